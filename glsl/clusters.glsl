@@ -0,0 +1,56 @@
+// Clustered lights, binned into view frustum clusters by lib/cluster.h:
+// CLUSTER_X * CLUSTER_Y screen tiles times exponential depth slices
+
+uniform samplerBuffer cluster_lights;   // CLUSTER_LIGHT_TEXELS per light
+uniform usamplerBuffer cluster_grid;    // Per cluster: first index, count
+uniform usamplerBuffer cluster_indices; // Light indices, cluster by cluster
+uniform ivec3 cluster_size;
+uniform vec2 cluster_tile;  // Tile size in pixels
+uniform vec4 cluster_depth; // near, far, slice scale, slice bias
+
+// View depth of a depth buffer value, for the projection the clusters use
+float cluster_linear_depth(float window_z) {
+    float near = cluster_depth.x;
+    float far = cluster_depth.y;
+    float ndc = window_z * 2.0 - 1.0;
+    return 2.0 * near * far / (far + near - ndc * (far - near));
+}
+
+// Range of cluster_indices holding the lights that reach the pixel at
+// `frag_coord` with depth buffer value `window_z`
+uvec2 cluster_span(vec2 frag_coord, float window_z) {
+    float depth = cluster_linear_depth(window_z);
+    int slice = int(log(depth) * cluster_depth.z + cluster_depth.w);
+    ivec2 tile = ivec2(frag_coord / cluster_tile);
+    ivec3 cell = clamp(ivec3(tile, slice), ivec3(0), cluster_size - 1);
+    int cluster = (cell.z * cluster_size.y + cell.y) * cluster_size.x + cell.x;
+    return texelFetch(cluster_grid, cluster).xy;
+}
+
+// Every clustered light is a spot light, point lights come with a cone
+// that covers every direction. `range` is the fade out distance, or 0, and
+// `shadow` the light's shadow atlas slot plus one, or 0.
+SpotLight cluster_light(uint i, out float range, out int shadow) {
+    int base = int(texelFetch(cluster_indices, int(i)).r) * 6;
+    vec4 position = texelFetch(cluster_lights, base);
+    vec4 direction = texelFetch(cluster_lights, base + 1);
+    vec4 ambient = texelFetch(cluster_lights, base + 2);
+    vec4 diffuse = texelFetch(cluster_lights, base + 3);
+    vec4 specular = texelFetch(cluster_lights, base + 4);
+    vec4 cone = texelFetch(cluster_lights, base + 5);
+
+    SpotLight light;
+    light.position = position.xyz;
+    light.direction = direction.xyz;
+    light.cutoff = direction.w;
+    light.outer_cutoff = cone.x;
+    light.ambient = ambient.xyz;
+    light.diffuse = diffuse.xyz;
+    light.specular = specular.xyz;
+    light.constant = ambient.w;
+    light.linear = diffuse.w;
+    light.quadratic = specular.w;
+    range = position.w;
+    shadow = int(cone.y);
+    return light;
+}
@@ -1,5 +1,8 @@
 #version 330 core
 
+// Must match depth_vs.glsl bit for bit for the depth pre-pass
+invariant gl_Position;
+
 layout(location = 0) in vec3 aPos;
 layout(location = 1) in vec3 aNormal;
 layout(location = 2) in vec2 aTexCoords;
@@ -0,0 +1,42 @@
+#version 330 core
+
+// Lighting pass of the deferred path, runs once per pixel however many
+// surfaces were drawn over it
+
+out vec4 FragColor;
+
+#include "gbuffer.glsl"
+#include "scene_lights.glsl"
+
+uniform sampler2D gbuffer_albedo;
+uniform sampler2D gbuffer_specular;
+uniform sampler2D gbuffer_normal;
+uniform sampler2D gbuffer_depth;
+
+uniform mat4 inverse_view_projection;
+uniform vec3 viewPos;
+
+void main() {
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    float window_z = texelFetch(gbuffer_depth, texel, 0).r;
+    // Nothing was drawn here, keep the clear color
+    if (window_z == 1.0)
+        discard;
+
+    vec4 specular = texelFetch(gbuffer_specular, texel, 0);
+    Surface surface;
+    surface.diffuse = texelFetch(gbuffer_albedo, texel, 0).rgb;
+    surface.specular = specular.rgb;
+    surface.shininess = specular.a * GBUFFER_MAX_SHININESS;
+    vec3 normal = oct_decode(texelFetch(gbuffer_normal, texel, 0).rg);
+
+    // World position from the depth buffer, no position target needed
+    vec2 uv = gl_FragCoord.xy / vec2(textureSize(gbuffer_depth, 0));
+    vec4 ndc = vec4(vec3(uv, window_z) * 2.0 - 1.0, 1.0);
+    vec4 world = inverse_view_projection * ndc;
+    vec3 frag_pos = world.xyz / world.w;
+
+    vec3 view_dir = normalize(viewPos - frag_pos);
+    vec3 result = scene_lighting(surface, normal, frag_pos, view_dir, window_z);
+    FragColor = vec4(result, 1.0);
+}
@@ -0,0 +1,5 @@
+#version 330 core
+
+// Depth pre-pass, color writes are masked off so there's nothing to output
+void main() {
+}
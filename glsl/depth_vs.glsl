@@ -0,0 +1,16 @@
+#version 330 core
+
+// Depth pre-pass, positions only. gl_Position is invariant here and in
+// cube_vs, so the shading pass lands on exactly the same depths and
+// GL_EQUAL passes.
+invariant gl_Position;
+
+layout(location = 0) in vec3 aPos;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+void main() {
+    gl_Position = projection * view * model * vec4(aPos, 1.0f);
+}
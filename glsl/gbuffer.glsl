@@ -0,0 +1,27 @@
+// G-buffer encoding, written by gbuffer_fs and read by deferred_fs. Layout
+// is in lib/gbuffer.h.
+
+// Shininess is stored as a fraction of this in an 8 bit channel, whole
+// values up to it come back exactly
+#define GBUFFER_MAX_SHININESS 255.0
+
+// Signs that are never 0, so both halves of the octahedron fold the same way
+vec2 sign_not_zero(vec2 v) {
+    return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+// Octahedral normal encoding: the unit sphere is projected onto an
+// octahedron and unfolded into a square, two channels in [0, 1]
+vec2 oct_encode(vec3 n) {
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 e = n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * sign_not_zero(n.xy);
+    return e * 0.5 + 0.5;
+}
+
+vec3 oct_decode(vec2 e) {
+    e = e * 2.0 - 1.0;
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = clamp(-n.z, 0.0, 1.0);
+    n.xy -= t * sign_not_zero(n.xy);
+    return normalize(n);
+}
@@ -0,0 +1,21 @@
+#version 330 core
+
+// Geometry pass of the deferred path, stores what the lighting pass needs
+layout(location = 0) out vec4 gbuffer_albedo;
+layout(location = 1) out vec4 gbuffer_specular;
+layout(location = 2) out vec2 gbuffer_normal;
+
+#include "material.glsl"
+#include "gbuffer.glsl"
+
+in vec3 FragPos;
+in vec3 Normal;
+in vec2 TexCoords;
+
+void main() {
+    Surface surface = sample_surface(TexCoords);
+    gbuffer_albedo = vec4(surface.diffuse, 1.0);
+    gbuffer_specular =
+        vec4(surface.specular, surface.shininess / GBUFFER_MAX_SHININESS);
+    gbuffer_normal = oct_encode(normalize(Normal));
+}
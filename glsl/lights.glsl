@@ -0,0 +1,145 @@
+// Light types and the math shared by every lit shader
+
+// Material maps sampled once per fragment and shared by every light
+struct Surface {
+    vec3 diffuse;
+    vec3 specular;
+    float shininess;
+};
+
+// Lights scaled below this can't move an 8 bit channel, skip them
+#define LIGHT_MIN_CONTRIBUTION (0.5 / 255.0)
+
+// Directional Light
+struct DirLight {
+    vec3 direction;
+
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+};
+
+// Point Light
+struct PointLight {
+    vec3 position;
+
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+
+    float constant;
+    float linear;
+    float quadratic;
+};
+
+// Spotlight
+struct SpotLight {
+    vec3 position;
+    vec3 direction;
+    float cutoff;
+    float outer_cutoff;
+
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+
+    float constant;
+    float linear;
+    float quadratic;
+};
+
+float light_diffuse(vec3 normal, vec3 light_dir) {
+    return max(dot(normal, light_dir), 0.0);
+}
+
+float light_specular(vec3 normal, vec3 light_dir, vec3 view_dir, float shininess) {
+    vec3 reflect_dir = reflect(-light_dir, normal);
+    return pow(max(dot(view_dir, reflect_dir), 0.0), shininess);
+}
+
+float light_attenuation(float constant, float linear, float quadratic, float distance) {
+    return 1.0 / (constant + linear * distance + quadratic * (distance * distance));
+}
+
+// Fades a light to nothing at `range`, no change when range is 0
+float light_window(float distance, float range) {
+    if (range <= 0.0)
+        return 1.0;
+    float x = distance / range;
+    float fade = clamp(1.0 - x * x * x * x, 0.0, 1.0);
+    return fade * fade;
+}
+
+// Upper bound of what a light adds to a channel, maps are at most 1
+float light_peak(vec3 ambient, vec3 diffuse, vec3 specular, float scale) {
+    vec3 sum = ambient + diffuse + specular;
+    return max(max(sum.r, sum.g), sum.b) * scale;
+}
+
+float spot_intensity(SpotLight light, vec3 light_dir) {
+    float theta = dot(light_dir, normalize(-light.direction));
+    float epsilon = light.cutoff - light.outer_cutoff;
+    return clamp((theta - light.outer_cutoff) / epsilon, 0.0, 1.0);
+}
+
+// `shadow` scales the direct part, 0 for fully shadowed
+vec3 calc_dir_light(DirLight light, Surface surface, vec3 normal, vec3 view_dir,
+                    float shadow) {
+    vec3 light_dir = normalize(-light.direction);
+
+    float diff = light_diffuse(normal, light_dir);
+    float spec = light_specular(normal, light_dir, view_dir, surface.shininess);
+
+    // Results
+    vec3 ambient = light.ambient * surface.diffuse;
+    vec3 diffuse = light.diffuse * diff * surface.diffuse;
+    vec3 specular = light.specular * spec * surface.specular;
+
+    return ambient + (diffuse + specular) * shadow;
+}
+
+vec3 calc_point_light(PointLight light, Surface surface, vec3 normal,
+                      vec3 frag_pos, vec3 view_dir, float shadow) {
+    vec3 to_light = light.position - frag_pos;
+    float distance = length(to_light);
+    float attenuation = light_attenuation(light.constant, light.linear, light.quadratic, distance);
+    if (light_peak(light.ambient, light.diffuse, light.specular, attenuation) <
+        LIGHT_MIN_CONTRIBUTION)
+        return vec3(0.0);
+
+    vec3 light_dir = to_light / distance;
+
+    float diff = light_diffuse(normal, light_dir);
+    float spec = light_specular(normal, light_dir, view_dir, surface.shininess);
+
+    // Results
+    vec3 ambient = light.ambient * surface.diffuse;
+    vec3 diffuse = light.diffuse * diff * surface.diffuse;
+    vec3 specular = light.specular * spec * surface.specular;
+
+    return (ambient + (diffuse + specular) * shadow) * attenuation;
+}
+
+vec3 calc_spot_light(SpotLight light, Surface surface, vec3 normal,
+                     vec3 frag_pos, vec3 view_dir, float shadow) {
+    vec3 to_light = light.position - frag_pos;
+    float distance = length(to_light);
+    vec3 light_dir = to_light / distance;
+
+    // Everything is scaled by the cone, outside it there is nothing to add
+    float intensity = spot_intensity(light, light_dir);
+    float attenuation = light_attenuation(light.constant, light.linear, light.quadratic, distance);
+    if (light_peak(light.ambient, light.diffuse, light.specular, attenuation * intensity) <
+        LIGHT_MIN_CONTRIBUTION)
+        return vec3(0.0);
+
+    float diff = light_diffuse(normal, light_dir);
+    float spec = light_specular(normal, light_dir, view_dir, surface.shininess);
+
+    // Results
+    vec3 ambient = light.ambient * surface.diffuse;
+    vec3 diffuse = light.diffuse * diff * surface.diffuse;
+    vec3 specular = light.specular * spec * surface.specular;
+
+    return (ambient + (diffuse + specular) * shadow) * attenuation * intensity;
+}
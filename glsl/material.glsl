@@ -0,0 +1,38 @@
+// Cube materials, read by the forward and the G-buffer passes
+
+#include "lights.glsl"
+
+// Maps live in the layers of a texture array, rects remap the mesh UVs into
+// the packed region of each map (xy: scale, zw: offset). UVs are clamped half
+// a texel inside the rect, filtering never reaches past the map's border.
+struct Material {
+    sampler2DArray maps;
+    int diffuse;
+    int specular;
+    vec4 diffuse_rect;
+    vec4 specular_rect;
+    float shininess;
+};
+
+uniform Material material;
+
+vec3 sample_map(int layer, vec4 rect, vec2 uv) {
+    vec2 half_texel = 0.5 / vec2(textureSize(material.maps, 0).xy);
+    uv = clamp(uv * rect.xy + rect.zw, rect.zw + half_texel,
+               rect.zw + rect.xy - half_texel);
+    return texture(material.maps, vec3(uv, float(layer))).rgb;
+}
+
+// One fetch per map for the whole fragment
+// Permutations: NO_SPECULAR_MAP
+Surface sample_surface(vec2 uv) {
+    Surface surface;
+    surface.diffuse = sample_map(material.diffuse, material.diffuse_rect, uv);
+#ifdef NO_SPECULAR_MAP
+    surface.specular = vec3(0.0);
+#else
+    surface.specular = sample_map(material.specular, material.specular_rect, uv);
+#endif
+    surface.shininess = material.shininess;
+    return surface;
+}
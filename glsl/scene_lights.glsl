@@ -0,0 +1,58 @@
+// The scene's lights and their sum, shared by forward and deferred shading
+
+#include "lights.glsl"
+
+// Permutations: NR_POINT_LIGHTS, CLUSTERED (point and spot lights come from
+// the cluster buffers instead of point_lights), SHADOWS (dir_light casts
+// cascaded shadows, spot_light and clustered lights atlas shadows)
+#ifdef CLUSTERED
+#include "clusters.glsl"
+#else
+#ifndef NR_POINT_LIGHTS
+#define NR_POINT_LIGHTS 4
+#endif
+uniform PointLight point_lights[NR_POINT_LIGHTS];
+#endif
+#ifdef SHADOWS
+#include "shadows.glsl"
+#endif
+uniform DirLight dir_light;
+uniform SpotLight spot_light;
+
+// `window_z` is the fragment's depth buffer value, clusters are found by it
+vec3 scene_lighting(Surface surface, vec3 normal, vec3 frag_pos, vec3 view_dir,
+                    float window_z) {
+    // phase 1: directional lighting
+#ifdef SHADOWS
+    float shadow = dir_shadow(frag_pos, normal);
+#else
+    float shadow = 1.0;
+#endif
+    vec3 result = calc_dir_light(dir_light, surface, normal, view_dir, shadow);
+    // phase 2: point lights
+#ifdef CLUSTERED
+    uvec2 span = cluster_span(gl_FragCoord.xy, window_z);
+    for (uint i = span.x; i < span.x + span.y; i++) {
+        float range;
+        int shadow_slot;
+        SpotLight light = cluster_light(i, range, shadow_slot);
+#ifdef SHADOWS
+        // Point lights are packed with a cutoff below -1
+        shadow = light_shadow(shadow_slot, light.cutoff < -1.0,
+                              light.position, frag_pos, normal);
+#endif
+        result += calc_spot_light(light, surface, normal, frag_pos, view_dir, shadow) *
+                  light_window(distance(light.position, frag_pos), range);
+    }
+#else
+    for (int i = 0; i < NR_POINT_LIGHTS; i++)
+        result += calc_point_light(point_lights[i], surface, normal, frag_pos, view_dir, 1.0);
+#endif
+    // phase 3: spot light
+#ifdef SHADOWS
+    shadow = light_shadow(spot_light_shadow, false, spot_light.position,
+                          frag_pos, normal);
+#endif
+    result += calc_spot_light(spot_light, surface, normal, frag_pos, view_dir, shadow);
+    return result;
+}
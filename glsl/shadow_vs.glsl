@@ -0,0 +1,11 @@
+#version 330 core
+
+// Shadow casters, instanced. Each instance is one caster in one cascade.
+layout(location = 0) in vec3 aPos;
+layout(location = 3) in mat4 instance_model;
+
+uniform mat4 light_view_projection;
+
+void main() {
+    gl_Position = light_view_projection * instance_model * vec4(aPos, 1.0f);
+}
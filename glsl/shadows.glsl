@@ -0,0 +1,75 @@
+// Shadows, filled by lib/shadow.h
+
+// Cascaded shadow maps of dir_light
+
+// Must match SHADOW_MAX_CASCADES in lib/shadow.h
+#define SHADOW_MAX_CASCADES 4
+
+uniform sampler2DArrayShadow shadow_map;
+uniform mat4 shadow_matrices[SHADOW_MAX_CASCADES]; // World to [0, 1]
+uniform float shadow_texel[SHADOW_MAX_CASCADES];   // World size of a texel
+uniform int shadow_cascade_count;
+
+// 0 in shadow, 1 lit. The first cascade holding the point is the sharpest.
+float dir_shadow(vec3 frag_pos, vec3 normal) {
+    for (int i = 0; i < shadow_cascade_count; i++) {
+        // Pushed off the surface by a couple of texels against acne
+        vec3 offset = normal * (shadow_texel[i] * 2.0);
+        vec4 p = shadow_matrices[i] * vec4(frag_pos + offset, 1.0);
+        if (all(greaterThan(p.xyz, vec3(0.0))) && all(lessThan(p.xyz, vec3(1.0))))
+            return texture(shadow_map, vec4(p.xy, float(i), p.z));
+    }
+    return 1.0;
+}
+
+// Point and spot light shadows from the atlas of lib/shadow.h. Each light
+// slot has SHADOW_ATLAS_FACES tiles of SHADOW_ATLAS_TILE_TEXELS texels:
+// a world to [0, 1] tile space matrix, then the tile's corner and size in
+// the atlas and the world size of a texel one unit from the light.
+#define SHADOW_ATLAS_FACES 6
+#define SHADOW_ATLAS_TILE_TEXELS 5
+
+uniform sampler2DShadow shadow_atlas;
+uniform samplerBuffer shadow_atlas_tiles;
+uniform int spot_light_shadow; // Atlas slot plus one, 0 for none
+
+// 0 in shadow, 1 lit. `shadow` is the light's atlas slot plus one, 0 for an
+// unshadowed light. Point lights pick the cube face facing the point.
+float light_shadow(int shadow, bool point, vec3 light_pos, vec3 frag_pos,
+                   vec3 normal) {
+    if (shadow == 0)
+        return 1.0;
+    vec3 to_frag = frag_pos - light_pos;
+    int face = 0;
+    if (point) {
+        vec3 a = abs(to_frag);
+        if (a.x >= a.y && a.x >= a.z)
+            face = to_frag.x < 0.0 ? 1 : 0;
+        else if (a.y >= a.z)
+            face = to_frag.y < 0.0 ? 3 : 2;
+        else
+            face = to_frag.z < 0.0 ? 5 : 4;
+    }
+    int base = ((shadow - 1) * SHADOW_ATLAS_FACES + face) * SHADOW_ATLAS_TILE_TEXELS;
+    vec4 rect = texelFetch(shadow_atlas_tiles, base + 4);
+    if (rect.z <= 0.0)
+        return 1.0;
+    mat4 tile = mat4(texelFetch(shadow_atlas_tiles, base),
+                     texelFetch(shadow_atlas_tiles, base + 1),
+                     texelFetch(shadow_atlas_tiles, base + 2),
+                     texelFetch(shadow_atlas_tiles, base + 3));
+
+    // Texels grow with the distance, and so does the offset against acne
+    vec3 offset = normal * (rect.w * length(to_frag) * 2.0);
+    vec4 p = tile * vec4(frag_pos + offset, 1.0);
+    if (p.w <= 0.0)
+        return 1.0;
+    p.xyz /= p.w;
+    if (p.z >= 1.0)
+        return 1.0;
+    // Filtering mustn't reach into the neighbouring tiles
+    float half_texel = 0.5 / float(textureSize(shadow_atlas, 0).x);
+    vec2 uv = clamp(rect.xy + p.xy * rect.z, rect.xy + half_texel,
+                    rect.xy + rect.z - half_texel);
+    return texture(shadow_atlas, vec3(uv, p.z));
+}
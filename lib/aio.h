@@ -0,0 +1,627 @@
+#ifndef AIO_H_
+#define AIO_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "str.h"
+
+// Asynchronous File Reads
+//
+// Loads many whole files at once. Every file is split into AIO_CHUNK sized
+// reads and all of them are queued before waiting on any, so the disk sees a
+// deep queue instead of one blocking read at a time. With io_uring the whole
+// batch goes to the kernel in a single io_uring_enter; without it (old
+// kernels, seccomp sandboxes) a small thread pool issues pread calls.
+//
+// Completion callbacks run on the reaper/worker threads, never on the
+// submitting thread (files that fail to open or are empty aside, and reads
+// the ring rejected after a failed io_uring_enter, which complete during
+// submit).
+#define AIO_CHUNK (1024 * 1024)
+
+enum {
+  AIO_NO_URING = 1 << 0, // Force the thread pool backend
+};
+
+typedef struct aio_read aio_read;
+typedef void (*aio_callback)(aio_read *read, void *user);
+
+struct aio_read {
+  const char *path;
+  aio_callback done; // Optional
+  void *user;
+
+  // Results, valid once the read completed
+  string data; // Null terminated
+  int error;   // 0 or an errno value
+
+  // Internal
+  int fd;
+  atomic_int pending;
+};
+
+typedef struct aio_chunk aio_chunk;
+struct aio_chunk {
+  aio_read *read;
+  struct iovec iov;
+  int64_t offset;
+  aio_chunk *next; // Thread pool queue link
+};
+
+typedef struct {
+  bool uring;
+
+  // io_uring rings
+  int ring_fd;
+  void *sq_ring;
+  void *cq_ring;
+  struct io_uring_sqe *sqes;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned cq_entries;
+  unsigned to_submit;
+  unsigned inflight; // Queued, in the kernel or awaiting resubmit
+  bool flushing;     // A thread is in io_uring_enter submitting
+  bool broken;       // io_uring_enter failed hard, new reads fail
+  pthread_t reaper;
+
+  // Thread pool fallback
+  pthread_t *workers;
+  int32_t thread_count;
+  aio_chunk *queue_head;
+  aio_chunk *queue_tail;
+  bool stopping; // Set by aio_free, for both backends
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // Work queued, ring space freed or flush finished
+  pthread_cond_t idle; // pending_reads dropped to zero
+  int32_t pending_reads;
+} aio;
+
+bool aio_init(aio *io, uint32_t entries, int32_t threads, int flags);
+void aio_free(aio *io);
+void aio_submit(aio *io, aio_read *reads, int32_t count, arena *a);
+void aio_wait(aio *io);
+
+#endif // AIO_H_
+
+// #define AIO_IMPLEMENTATION
+#if defined(AIO_IMPLEMENTATION) && !defined(AIO_IMPLEMENTED)
+#define AIO_IMPLEMENTED
+
+static int aio_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int aio_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                           unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+// Maps the rings of a new io_uring instance. Returns false (and leaves the
+// ring closed) when the kernel or the sandbox says no.
+static bool aio_uring_init(aio *io, unsigned entries) {
+  struct io_uring_params p = {0};
+  int fd = aio_uring_setup(entries, &p);
+  if (fd < 0) {
+    return false;
+  }
+
+  io->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  io->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (io->cq_ring_size > io->sq_ring_size) {
+      io->sq_ring_size = io->cq_ring_size;
+    }
+    io->cq_ring_size = io->sq_ring_size;
+  }
+
+  io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (io->sq_ring == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  io->cq_ring = io->sq_ring;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (io->cq_ring == MAP_FAILED) {
+      munmap(io->sq_ring, io->sq_ring_size);
+      close(fd);
+      return false;
+    }
+  }
+  io->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                  IORING_OFF_SQES);
+  if (io->sqes == MAP_FAILED) {
+    if (io->cq_ring != io->sq_ring) {
+      munmap(io->cq_ring, io->cq_ring_size);
+    }
+    munmap(io->sq_ring, io->sq_ring_size);
+    close(fd);
+    return false;
+  }
+
+  char *sq = io->sq_ring;
+  io->sq_head = (unsigned *)(sq + p.sq_off.head);
+  io->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  io->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  io->sq_array = (unsigned *)(sq + p.sq_off.array);
+  io->sq_entries = p.sq_entries;
+
+  char *cq = io->cq_ring;
+  io->cq_head = (unsigned *)(cq + p.cq_off.head);
+  io->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  io->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  io->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  io->cq_entries = p.cq_entries;
+
+  io->ring_fd = fd;
+  return true;
+}
+
+static void aio_read_finish(aio *io, aio_read *read) {
+  if (read->fd >= 0) {
+    close(read->fd);
+    read->fd = -1;
+  }
+  if (read->error) {
+    read->data.len = 0;
+  }
+  if (read->done) {
+    read->done(read, read->user);
+  }
+
+  pthread_mutex_lock(&io->lock);
+  if (--io->pending_reads == 0) {
+    pthread_cond_broadcast(&io->idle);
+  }
+  pthread_mutex_unlock(&io->lock);
+}
+
+static void aio_chunk_done(aio *io, aio_chunk *chunk) {
+  if (atomic_fetch_sub(&chunk->read->pending, 1) == 1) {
+    aio_read_finish(io, chunk->read);
+  }
+}
+
+// Takes every SQE the kernel hasn't consumed back out of the ring and fails
+// its read with `error`. Later pushes fail straight away. Caller holds the
+// lock and is the flusher, so the kernel's SQ head can't move under it; the
+// lock is dropped while the reads finish.
+static void aio_uring_fail(aio *io, int error) {
+  unsigned head = atomic_load_explicit((_Atomic unsigned *)io->sq_head,
+                                       memory_order_acquire);
+  unsigned tail = *io->sq_tail;
+  aio_chunk *failed = NULL;
+  for (; head != tail; head++) {
+    unsigned index = io->sq_array[head & *io->sq_mask];
+    aio_chunk *chunk = (aio_chunk *)(uintptr_t)io->sqes[index].user_data;
+    chunk->next = failed;
+    failed = chunk;
+    io->inflight--;
+  }
+  atomic_store_explicit((_Atomic unsigned *)io->sq_tail, head,
+                        memory_order_release);
+  io->to_submit = 0;
+  io->broken = true;
+  pthread_cond_broadcast(&io->wake);
+
+  pthread_mutex_unlock(&io->lock);
+  while (failed) {
+    aio_chunk *next = failed->next;
+    failed->read->error = error;
+    aio_chunk_done(io, failed);
+    failed = next;
+  }
+  pthread_mutex_lock(&io->lock);
+}
+
+// Hands queued SQEs to the kernel. Caller holds the lock; it's dropped around
+// io_uring_enter so the reaper keeps draining completions meanwhile, and one
+// thread flushes at a time (the others leave their SQEs to it). Returns false
+// if SQEs are still queued: another thread is flushing them, or the kernel
+// turned them away for now (EAGAIN, or EBUSY with completions to reap) and
+// the reaper retries. Any other error fails every queued read.
+static bool aio_uring_flush(aio *io) {
+  if (io->flushing) {
+    return false;
+  }
+  io->flushing = true;
+  while (io->to_submit) {
+    unsigned count = io->to_submit;
+    pthread_mutex_unlock(&io->lock);
+    int n = aio_uring_enter(io->ring_fd, count, 0, 0);
+    int error = n < 0 ? errno : 0;
+    pthread_mutex_lock(&io->lock);
+    if (n > 0) {
+      io->to_submit -= n;
+    } else if (error == EINTR) {
+      continue;
+    } else if (n == 0 || error == EAGAIN || error == EBUSY) {
+      break;
+    } else {
+      aio_uring_fail(io, error);
+    }
+  }
+  io->flushing = false;
+  pthread_cond_broadcast(&io->wake);
+  return !io->to_submit;
+}
+
+static bool aio_uring_sq_full(aio *io) {
+  unsigned head = atomic_load_explicit((_Atomic unsigned *)io->sq_head,
+                                       memory_order_acquire);
+  return *io->sq_tail - head == io->sq_entries;
+}
+
+// Writes one read of `chunk` into the next SQE. The SQ has room and the
+// chunk is already counted in `inflight`. Caller holds the lock.
+static void aio_uring_queue(aio *io, aio_chunk *chunk) {
+  unsigned tail = *io->sq_tail;
+  unsigned index = tail & *io->sq_mask;
+  struct io_uring_sqe *sqe = &io->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  // READV rather than READ keeps this working on 5.1+ kernels
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = chunk->read->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&chunk->iov;
+  sqe->len = 1;
+  sqe->off = chunk->offset;
+  sqe->user_data = (uint64_t)(uintptr_t)chunk;
+
+  io->sq_array[index] = index;
+  atomic_store_explicit((_Atomic unsigned *)io->sq_tail, tail + 1,
+                        memory_order_release);
+  io->to_submit++;
+}
+
+// Fails a chunk the ring can't take any more. Caller holds the lock, it's
+// dropped while the read finishes.
+static void aio_uring_reject(aio *io, aio_chunk *chunk) {
+  chunk->read->error = EIO;
+  pthread_mutex_unlock(&io->lock);
+  aio_chunk_done(io, chunk);
+  pthread_mutex_lock(&io->lock);
+}
+
+// Queues a new read. Blocks while the number in flight would overflow the
+// completion ring or the SQ is full. Caller holds the lock.
+static void aio_uring_push(aio *io, aio_chunk *chunk) {
+  while (!io->broken &&
+         (io->inflight >= io->cq_entries || aio_uring_sq_full(io))) {
+    aio_uring_flush(io);
+    // Rechecked under the lock, a completion during the flush isn't missed
+    if (!io->broken &&
+        (io->inflight >= io->cq_entries || aio_uring_sq_full(io))) {
+      pthread_cond_wait(&io->wake, &io->lock);
+    }
+  }
+  if (io->broken) {
+    aio_uring_reject(io, chunk);
+    return;
+  }
+  io->inflight++;
+  aio_uring_queue(io, chunk);
+}
+
+// Completion thread for the io_uring backend. Short reads and EAGAIN are
+// resubmitted for the remainder, keeping their slot in `inflight`. Each CQE
+// is released to the kernel before the lock is taken for it, so a full
+// completion ring never waits on the reaper. The reaper never blocks on the
+// SQ either: resubmits that find it full wait in `retry` for the next pass.
+// Sleeps on `wake` while the kernel holds nothing and exits once `stopping`
+// is set.
+static void *aio_reaper(void *arg) {
+  aio *io = arg;
+  aio_chunk *retry = NULL;
+  unsigned retries = 0;
+  pthread_mutex_lock(&io->lock);
+  for (;;) {
+    while (retry && (io->broken || !aio_uring_sq_full(io))) {
+      aio_chunk *chunk = retry;
+      retry = chunk->next;
+      retries--;
+      if (io->broken) {
+        io->inflight--;
+        aio_uring_reject(io, chunk);
+      } else {
+        aio_uring_queue(io, chunk);
+      }
+    }
+    if (io->to_submit) {
+      aio_uring_flush(io);
+    }
+
+    unsigned queued = io->to_submit + retries;
+    if (io->inflight == queued) {
+      // Nothing in the kernel to wait for
+      if (!queued && io->stopping) {
+        break;
+      }
+      if (!queued || io->flushing) {
+        pthread_cond_wait(&io->wake, &io->lock);
+      } else {
+        // The kernel turned the SQEs away with nothing in flight, back off
+        pthread_mutex_unlock(&io->lock);
+        nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+        pthread_mutex_lock(&io->lock);
+      }
+      continue;
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    aio_uring_enter(io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+    unsigned head = *io->cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *)io->cq_tail,
+                                         memory_order_acquire);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+      aio_chunk *chunk = (aio_chunk *)(uintptr_t)cqe->user_data;
+      int res = cqe->res;
+      atomic_store_explicit((_Atomic unsigned *)io->cq_head, head + 1,
+                            memory_order_release);
+
+      if (res == -EAGAIN || res == -EINTR ||
+          (res > 0 && (size_t)res < chunk->iov.iov_len)) {
+        if (res > 0) {
+          chunk->iov.iov_base = (char *)chunk->iov.iov_base + res;
+          chunk->iov.iov_len -= res;
+          chunk->offset += res;
+        }
+        pthread_mutex_lock(&io->lock);
+        if (io->broken) {
+          io->inflight--;
+          aio_uring_reject(io, chunk);
+        } else if (aio_uring_sq_full(io)) {
+          chunk->next = retry;
+          retry = chunk;
+          retries++;
+        } else {
+          aio_uring_queue(io, chunk);
+        }
+        pthread_mutex_unlock(&io->lock);
+        continue;
+      }
+
+      pthread_mutex_lock(&io->lock);
+      io->inflight--;
+      pthread_cond_broadcast(&io->wake);
+      pthread_mutex_unlock(&io->lock);
+
+      if (res <= 0) {
+        // A read of 0 means the file shrank under us
+        chunk->read->error = res < 0 ? -res : EIO;
+      }
+      aio_chunk_done(io, chunk);
+    }
+    pthread_mutex_lock(&io->lock);
+  }
+  pthread_mutex_unlock(&io->lock);
+  return NULL;
+}
+
+// Worker for the thread pool backend
+static void *aio_worker(void *arg) {
+  aio *io = arg;
+  for (;;) {
+    pthread_mutex_lock(&io->lock);
+    while (!io->queue_head && !io->stopping) {
+      pthread_cond_wait(&io->wake, &io->lock);
+    }
+    aio_chunk *chunk = io->queue_head;
+    if (!chunk) {
+      pthread_mutex_unlock(&io->lock);
+      return NULL;
+    }
+    io->queue_head = chunk->next;
+    if (!io->queue_head) {
+      io->queue_tail = NULL;
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    char *dst = chunk->iov.iov_base;
+    size_t len = chunk->iov.iov_len;
+    int64_t offset = chunk->offset;
+    while (len) {
+      ssize_t n = pread(chunk->read->fd, dst, len, offset);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        chunk->read->error = n < 0 ? errno : EIO;
+        break;
+      }
+      dst += n;
+      len -= n;
+      offset += n;
+    }
+    aio_chunk_done(io, chunk);
+  }
+}
+
+// Sets up the backend in place (threads keep a pointer to `io`). `entries`
+// sizes the submission ring, `threads` the fallback pool.
+bool aio_init(aio *io, uint32_t entries, int32_t threads, int flags) {
+  *io = (aio){0};
+  pthread_mutex_init(&io->lock, NULL);
+  pthread_cond_init(&io->wake, NULL);
+  pthread_cond_init(&io->idle, NULL);
+
+  if (!(flags & AIO_NO_URING) && aio_uring_init(io, entries)) {
+    if (!pthread_create(&io->reaper, NULL, aio_reaper, io)) {
+      io->uring = true;
+      return true;
+    }
+    // Couldn't start the reaper, tear the ring down and use the pool
+    munmap(io->sqes, io->sq_entries * sizeof(struct io_uring_sqe));
+    if (io->cq_ring != io->sq_ring) {
+      munmap(io->cq_ring, io->cq_ring_size);
+    }
+    munmap(io->sq_ring, io->sq_ring_size);
+    close(io->ring_fd);
+  }
+
+  io->thread_count = threads > 0 ? threads : 1;
+  io->workers = calloc(io->thread_count, sizeof(pthread_t));
+  if (!io->workers) {
+    return false;
+  }
+  for (int32_t i = 0; i < io->thread_count; i++) {
+    if (pthread_create(&io->workers[i], NULL, aio_worker, io)) {
+      io->thread_count = i;
+      return i > 0;
+    }
+  }
+  return true;
+}
+
+// Waits for outstanding reads, then stops the threads and releases the ring
+void aio_free(aio *io) {
+  aio_wait(io);
+
+  if (io->uring) {
+    pthread_mutex_lock(&io->lock);
+    io->stopping = true;
+    pthread_cond_broadcast(&io->wake);
+    pthread_mutex_unlock(&io->lock);
+    pthread_join(io->reaper, NULL);
+
+    munmap(io->sqes, io->sq_entries * sizeof(struct io_uring_sqe));
+    if (io->cq_ring != io->sq_ring) {
+      munmap(io->cq_ring, io->cq_ring_size);
+    }
+    munmap(io->sq_ring, io->sq_ring_size);
+    close(io->ring_fd);
+  } else {
+    pthread_mutex_lock(&io->lock);
+    io->stopping = true;
+    pthread_cond_broadcast(&io->wake);
+    pthread_mutex_unlock(&io->lock);
+    for (int32_t i = 0; i < io->thread_count; i++) {
+      pthread_join(io->workers[i], NULL);
+    }
+    free(io->workers);
+  }
+
+  pthread_mutex_destroy(&io->lock);
+  pthread_cond_destroy(&io->wake);
+  pthread_cond_destroy(&io->idle);
+}
+
+// Opens every file, allocates its buffer from `a` and queues all of the
+// chunk reads. Returns without waiting; `reads`, the buffers and the arena
+// must stay alive until aio_wait returns (or every callback has run).
+void aio_submit(aio *io, aio_read *reads, int32_t count, arena *a) {
+  pthread_mutex_lock(&io->lock);
+  io->pending_reads += count;
+  pthread_mutex_unlock(&io->lock);
+
+  for (int32_t i = 0; i < count; i++) {
+    aio_read *read = &reads[i];
+    read->data = (string){0};
+    read->error = 0;
+
+    struct stat st;
+    read->fd = open(read->path, O_RDONLY | O_CLOEXEC);
+    if (read->fd < 0 || fstat(read->fd, &st)) {
+      read->error = errno;
+      aio_read_finish(io, read);
+      continue;
+    }
+    // Streams have no size to split into chunks, use read_file for those
+    if (!S_ISREG(st.st_mode)) {
+      read->error = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+      aio_read_finish(io, read);
+      continue;
+    }
+
+    ptrdiff_t size = st.st_size;
+    read->data.data = make_nozero(a, uint8_t, size + 1);
+    read->data.data[size] = '\0';
+    read->data.len = size;
+
+    // Whole file read-ahead, the chunks below will walk it in order
+    posix_fadvise(read->fd, 0, size, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(read->fd, 0, size, POSIX_FADV_WILLNEED);
+
+    int32_t chunks = (int32_t)((size + AIO_CHUNK - 1) / AIO_CHUNK);
+    if (!chunks) {
+      aio_read_finish(io, read);
+      continue;
+    }
+    atomic_store(&read->pending, chunks);
+
+    aio_chunk *list = make(a, aio_chunk, chunks);
+    for (int32_t c = 0; c < chunks; c++) {
+      int64_t offset = (int64_t)c * AIO_CHUNK;
+      ptrdiff_t len = size - offset < AIO_CHUNK ? size - offset : AIO_CHUNK;
+      list[c] = (aio_chunk){
+          .read = read,
+          .iov = {read->data.data + offset, len},
+          .offset = offset,
+      };
+    }
+
+    pthread_mutex_lock(&io->lock);
+    for (int32_t c = 0; c < chunks; c++) {
+      if (io->uring) {
+        aio_uring_push(io, &list[c]);
+      } else if (io->queue_tail) {
+        io->queue_tail->next = &list[c];
+        io->queue_tail = &list[c];
+      } else {
+        io->queue_head = io->queue_tail = &list[c];
+      }
+    }
+    if (!io->uring) {
+      pthread_cond_broadcast(&io->wake);
+    }
+    pthread_mutex_unlock(&io->lock);
+  }
+
+  // One io_uring_enter for everything still queued
+  if (io->uring) {
+    pthread_mutex_lock(&io->lock);
+    aio_uring_flush(io);
+    pthread_mutex_unlock(&io->lock);
+  }
+}
+
+// Blocks until every submitted read has completed
+void aio_wait(aio *io) {
+  pthread_mutex_lock(&io->lock);
+  while (io->pending_reads > 0) {
+    pthread_cond_wait(&io->idle, &io->lock);
+  }
+  pthread_mutex_unlock(&io->lock);
+}
+
+#endif // AIO_IMPLEMENTATION
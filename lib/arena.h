@@ -1,60 +1,231 @@
 #ifndef ARENA_H_
 #define ARENA_H_
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <pthread.h>
 #include <string.h>
+#include <sys/mman.h>
 
 // Arena Allocator
 //
 #define make(a, t, n) (t *)alloc(a, sizeof(t), _Alignof(t), n)
 // #define make(a, t, n) (t *)alloc(a, (n) * sizeof(t), _Alignof(t), n)
+// For buffers that are fully overwritten right away (file contents, staging)
+#define make_nozero(a, t, n) (t *)alloc_nozero(a, sizeof(t), _Alignof(t), n)
+
+// Growth modes. A fixed arena aborts when full. A virtual arena reserves a
+// large address range up front and commits pages as it fills, so it grows in
+// place and untouched capacity costs no RSS. A chained arena links extra
+// malloc'd blocks instead. Neither growth mode ever moves an allocation.
+enum {
+  ARENA_FIXED = 0,
+  ARENA_VIRTUAL = 1 << 0,
+  ARENA_CHAINED = 1 << 1,
+};
+
+// Allocation flags. NOZERO skips the memset, HUGEPAGE asks the kernel to back
+// the block with transparent huge pages (only worth it for multi-MB blocks).
+// SOFTFAIL returns NULL when the arena is out of room instead of aborting,
+// for sizes that come from untrusted input.
+enum {
+  ARENA_NOZERO = 1 << 0,
+  ARENA_HUGEPAGE = 1 << 1,
+  ARENA_SOFTFAIL = 1 << 2,
+};
+
+// Granularity of commits in a virtual arena
+#define ARENA_COMMIT_SIZE (64 * 1024)
+// Bulk blocks are cache line aligned, which also covers AVX-512 loads
+#define ARENA_BULK_ALIGN 64
+#define ARENA_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+typedef struct arena_block arena_block;
+struct arena_block {
+  arena_block *prev;
+  char *end;
+};
 
 typedef struct {
   char *beg;
   char *end;
   char *current;
+
+  char *limit;        // End of the reserved range (ARENA_VIRTUAL)
+  arena_block *block; // Header of the current block (ARENA_CHAINED)
+  ptrdiff_t block_size;
+  int flags;
 } arena;
 
-void arena_init(arena *a, ptrdiff_t size);
-void *arena_alloc(arena *a, ptrdiff_t size, ptrdiff_t align, ptrdiff_t count);
+// Savepoint, everything allocated after begin is released by end
+typedef struct {
+  arena *a;
+  char *current;
+  arena_block *block;
+} arena_temp;
+
+// Two arenas used on alternate frames. Allocations made during a frame are
+// still valid through the next one, then the arena is reset and reused.
+typedef struct {
+  arena arenas[2];
+  uint64_t frame;
+} frame_arena;
+
+// Per thread scratch arenas, lazily reserved and released when the thread
+// exits
+#define ARENA_SCRATCH_COUNT 2
+#define ARENA_SCRATCH_RESERVE ((ptrdiff_t)1 << 30)
+
+arena new_arena(ptrdiff_t cap);
+arena new_arena_virtual(ptrdiff_t reserve);
+arena new_arena_chained(ptrdiff_t block_size);
+void *alloc(arena *a, ptrdiff_t size, ptrdiff_t align, ptrdiff_t count);
+void *alloc_nozero(arena *a, ptrdiff_t size, ptrdiff_t align, ptrdiff_t count);
+void *alloc_ex(arena *a, ptrdiff_t size, ptrdiff_t align, ptrdiff_t count,
+               int flags);
+void *alloc_bulk(arena *a, ptrdiff_t bytes, int flags);
+bool arena_extend(arena *a, void *end, ptrdiff_t bytes);
 void arena_reset(arena *a);
 void arena_free(arena *a);
 
+arena_temp arena_temp_begin(arena *a);
+void arena_temp_end(arena_temp temp);
+arena_temp arena_scratch_begin(arena **conflicts, int32_t count);
+#define arena_scratch_end(temp) arena_temp_end(temp)
+void arena_scratch_release(void);
+
+frame_arena new_frame_arena(ptrdiff_t reserve);
+arena *frame_arena_begin(frame_arena *f);
+arena *frame_arena_previous(frame_arena *f);
+void frame_arena_free(frame_arena *f);
+
 #endif // ARENA_H_
 
 // #define ARENA_IMPLEMENTATION
-#ifdef ARENA_IMPLEMENTATION
+// Several lib/ headers request the implementation, only emit it once
+#if defined(ARENA_IMPLEMENTATION) && !defined(ARENA_IMPLEMENTED)
+#define ARENA_IMPLEMENTED
 
-__attribute__((malloc, alloc_size(2), alloc_align(3))) void *
-alloc(arena *a, ptrdiff_t size, ptrdiff_t align, ptrdiff_t count) {
+// Makes room for `count` objects after the current pointer, either by
+// committing more of the reserved range or by chaining a new block. Returns
+// false for fixed arenas and when the system is out of memory.
+static bool arena_grow(arena *a, ptrdiff_t size, ptrdiff_t align,
+                       ptrdiff_t count) {
+  if (count > (PTRDIFF_MAX - align) / size) {
+    return false;
+  }
+  ptrdiff_t bytes = count * size;
+
+  if (a->flags & ARENA_VIRTUAL) {
+    ptrdiff_t padding =
+        (align - ((uintptr_t)a->current & (align - 1))) & (align - 1);
+    if (bytes > a->limit - a->current - padding) {
+      return false;
+    }
+
+    char *need = a->current + padding + bytes;
+    ptrdiff_t commit = (need - a->beg + ARENA_COMMIT_SIZE - 1) &
+                       ~(ptrdiff_t)(ARENA_COMMIT_SIZE - 1);
+    char *new_end = a->beg + commit < a->limit ? a->beg + commit : a->limit;
+    if (mprotect(a->end, new_end - a->end, PROT_READ | PROT_WRITE)) {
+      return false;
+    }
+    a->end = new_end;
+    return true;
+  }
+
+  if (a->flags & ARENA_CHAINED) {
+    // Oversized requests get a block of their own
+    ptrdiff_t cap = bytes + align > a->block_size ? bytes + align
+                                                   : a->block_size;
+    arena_block *block = malloc(sizeof(arena_block) + cap);
+    if (!block) {
+      return false;
+    }
+    block->prev = a->block;
+    block->end = (char *)(block + 1) + cap;
+
+    a->block = block;
+    a->beg = a->current = (char *)(block + 1);
+    a->end = block->end;
+    return true;
+  }
+
+  return false;
+}
+
+__attribute__((malloc, alloc_size(2, 4), alloc_align(3))) void *
+alloc_ex(arena *a, ptrdiff_t size, ptrdiff_t align, ptrdiff_t count,
+         int flags) {
 
   ptrdiff_t padding =
       (align - ((uintptr_t)a->current & (align - 1))) & (align - 1);
   ptrdiff_t available = a->end - a->current - padding;
 
   if (available < 0 || count > available / size) {
-    // Política de memoria insuficiente
-    fprintf(stderr,
-            "ERROR: Not enough available memory on this arena for allocating "
-            "%td bits\n",
-            count);
-    abort();
+    if (!arena_grow(a, size, align, count)) {
+      if (flags & ARENA_SOFTFAIL) {
+        return NULL;
+      }
+      // Política de memoria insuficiente
+      fprintf(stderr,
+              "ERROR: Not enough available memory on this arena for "
+              "allocating %td bits\n",
+              count);
+      abort();
+    }
+    padding = (align - ((uintptr_t)a->current & (align - 1))) & (align - 1);
   }
 
   void *p = a->current + padding;
   a->current += padding + count * size;
-  return memset(p, 0, count * size);
+  return flags & ARENA_NOZERO ? p : memset(p, 0, count * size);
+}
+
+__attribute__((malloc, alloc_size(2, 4), alloc_align(3))) void *
+alloc(arena *a, ptrdiff_t size, ptrdiff_t align, ptrdiff_t count) {
+  return alloc_ex(a, size, align, count, 0);
+}
+
+__attribute__((malloc, alloc_size(2, 4), alloc_align(3))) void *
+alloc_nozero(arena *a, ptrdiff_t size, ptrdiff_t align, ptrdiff_t count) {
+  return alloc_ex(a, size, align, count, ARENA_NOZERO);
+}
+
+// Large SIMD friendly block, ARENA_BULK_ALIGN aligned. With ARENA_HUGEPAGE
+// the block is aligned to a huge page and the whole pages inside it are
+// hinted with MADV_HUGEPAGE, so TLB misses don't dominate streaming passes.
+__attribute__((malloc, alloc_size(2))) void *alloc_bulk(arena *a,
+                                                        ptrdiff_t bytes,
+                                                        int flags) {
+  ptrdiff_t align = ARENA_BULK_ALIGN;
+  if (flags & ARENA_HUGEPAGE && bytes >= ARENA_HUGEPAGE_SIZE) {
+    align = ARENA_HUGEPAGE_SIZE;
+  }
+  char *p = alloc_ex(a, 1, align, bytes, flags);
+
+#ifdef MADV_HUGEPAGE
+  if (align == ARENA_HUGEPAGE_SIZE) {
+    uintptr_t page_beg = ((uintptr_t)p + 4095) & ~(uintptr_t)4095;
+    uintptr_t page_end = ((uintptr_t)p + bytes) & ~(uintptr_t)4095;
+    if (page_end > page_beg) {
+      madvise((void *)page_beg, page_end - page_beg, MADV_HUGEPAGE);
+    }
+  }
+#endif
+
+  return p;
 }
 
 // For debug alloc
 // #define alloc(a, size, align, count) alloc_debug(a, size, align, count,
 // __FILE__, __LINE__)
 
-__attribute__((malloc, alloc_size(2), alloc_align(3))) void *
+__attribute__((malloc, alloc_size(2, 4), alloc_align(3))) void *
 alloc_debug(arena *a, ptrdiff_t size, ptrdiff_t align, ptrdiff_t count,
             const char *file, int line) {
 
@@ -63,12 +234,15 @@ alloc_debug(arena *a, ptrdiff_t size, ptrdiff_t align, ptrdiff_t count,
   ptrdiff_t available = a->end - a->current - padding;
 
   if (available < 0 || count > available / size) {
-    // Política de memoria insuficiente
-    fprintf(stderr,
-            "ERROR: Not enough available memory on this arena for allocating "
-            "%td bits\nFile: %s:%d\n",
-            count, file, line);
-    abort();
+    if (!arena_grow(a, size, align, count)) {
+      // Política de memoria insuficiente
+      fprintf(stderr,
+              "ERROR: Not enough available memory on this arena for "
+              "allocating %td bits\nFile: %s:%d\n",
+              count, file, line);
+      abort();
+    }
+    padding = (align - ((uintptr_t)a->current & (align - 1))) & (align - 1);
   }
 
   void *p = a->current + padding;
@@ -76,6 +250,23 @@ alloc_debug(arena *a, ptrdiff_t size, ptrdiff_t align, ptrdiff_t count,
   return memset(p, 0, count * size);
 }
 
+// Grows the allocation that ends at `end` by `bytes` without moving it. Only
+// works for the last allocation of the arena, and only within the current
+// block (or the reserved range of a virtual arena). The new bytes are zeroed.
+bool arena_extend(arena *a, void *end, ptrdiff_t bytes) {
+  if ((char *)end != a->current) {
+    return false;
+  }
+  if (bytes > a->end - a->current) {
+    if (!(a->flags & ARENA_VIRTUAL) || !arena_grow(a, 1, 1, bytes)) {
+      return false;
+    }
+  }
+  memset(a->current, 0, bytes);
+  a->current += bytes;
+  return true;
+}
+
 arena new_arena(ptrdiff_t cap) {
   arena a = {0};
   a.beg = (char *)malloc(cap);
@@ -84,11 +275,174 @@ arena new_arena(ptrdiff_t cap) {
   return a;
 }
 
+// Reserves `reserve` bytes of address space without backing them. Pages are
+// committed on demand as the arena fills. Falls back to a chained arena when
+// the reservation fails (e.g. under a restrictive RLIMIT_AS).
+arena new_arena_virtual(ptrdiff_t reserve) {
+  arena a = {0};
+  void *p = mmap(NULL, reserve, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    return new_arena_chained(ARENA_COMMIT_SIZE * 16);
+  }
+
+  a.beg = a.end = a.current = (char *)p;
+  a.limit = a.beg + reserve;
+  a.flags = ARENA_VIRTUAL;
+  return a;
+}
+
+// Starts empty and mallocs `block_size` blocks as needed. Earlier blocks are
+// kept until reset or free, so pointers into them stay valid.
+arena new_arena_chained(ptrdiff_t block_size) {
+  arena a = {0};
+  a.block_size = block_size;
+  a.flags = ARENA_CHAINED;
+  if (!arena_grow(&a, 1, 1, 0)) {
+    a.block_size = 0;
+  }
+  return a;
+}
+
 void arena_free(arena *a) {
-  free(a->beg);
-  a->beg = a->end = NULL;
+  if (a->flags & ARENA_VIRTUAL) {
+    munmap(a->beg, a->limit - a->beg);
+  } else if (a->flags & ARENA_CHAINED) {
+    while (a->block) {
+      arena_block *prev = a->block->prev;
+      free(a->block);
+      a->block = prev;
+    }
+  } else {
+    free(a->beg);
+  }
+  a->beg = a->end = a->current = a->limit = NULL;
+}
+
+// Chained arenas give every block but the first back to the system; virtual
+// arenas keep their committed pages for the next round.
+void arena_reset(arena *a) {
+  if (a->flags & ARENA_CHAINED) {
+    while (a->block && a->block->prev) {
+      arena_block *prev = a->block->prev;
+      free(a->block);
+      a->block = prev;
+    }
+    if (a->block) {
+      a->beg = (char *)(a->block + 1);
+      a->end = a->block->end;
+    }
+  }
+  a->current = a->beg;
+}
+
+// Savepoints
+// ------------------------------------------------------------------------
+
+arena_temp arena_temp_begin(arena *a) {
+  return (arena_temp){.a = a, .current = a->current, .block = a->block};
+}
+
+// Rolls the arena back to the savepoint. Blocks chained since then are
+// freed; committed pages of a virtual arena are kept.
+void arena_temp_end(arena_temp temp) {
+  arena *a = temp.a;
+  if (a->flags & ARENA_CHAINED) {
+    while (a->block != temp.block) {
+      arena_block *prev = a->block->prev;
+      free(a->block);
+      a->block = prev;
+    }
+    if (a->block) {
+      a->beg = (char *)(a->block + 1);
+      a->end = a->block->end;
+    }
+  }
+  a->current = temp.current;
+}
+
+// Scratch Arenas
+// ------------------------------------------------------------------------
+
+static _Thread_local arena arena_scratch_pool[ARENA_SCRATCH_COUNT];
+static pthread_key_t arena_scratch_key;
+static pthread_once_t arena_scratch_once = PTHREAD_ONCE_INIT;
+
+// Destructor of arena_scratch_key, gets the exiting thread's pool
+static void arena_scratch_free(void *pool) {
+  arena *scratch = pool;
+  for (int32_t i = 0; i < ARENA_SCRATCH_COUNT; i++) {
+    if (scratch[i].beg) {
+      arena_free(&scratch[i]);
+    }
+  }
+}
+
+static void arena_scratch_key_init(void) {
+  pthread_key_create(&arena_scratch_key, arena_scratch_free);
+}
+
+// Returns a savepoint on a thread local scratch arena that is not one of
+// `conflicts`. Pass the arenas the caller is allocating its results from, so
+// temporaries never land on top of (and get freed with) the results.
+arena_temp arena_scratch_begin(arena **conflicts, int32_t count) {
+  for (int32_t i = 0; i < ARENA_SCRATCH_COUNT; i++) {
+    arena *scratch = &arena_scratch_pool[i];
+
+    bool taken = false;
+    for (int32_t j = 0; j < count; j++) {
+      taken |= conflicts[j] == scratch;
+    }
+    if (taken) {
+      continue;
+    }
+
+    if (!scratch->beg) {
+      // Key destructors only run for threads that exit through pthread,
+      // the main thread calls arena_scratch_release itself
+      pthread_once(&arena_scratch_once, arena_scratch_key_init);
+      pthread_setspecific(arena_scratch_key, arena_scratch_pool);
+      *scratch = new_arena_virtual(ARENA_SCRATCH_RESERVE);
+    }
+    return arena_temp_begin(scratch);
+  }
+
+  fprintf(stderr, "ERROR: All %d scratch arenas are in use\n",
+          ARENA_SCRATCH_COUNT);
+  abort();
 }
 
-void arena_reset(arena *a) { a->current = a->beg; }
+// Gives this thread's scratch arenas back to the system. None of them may be
+// in use; the next arena_scratch_begin reserves them again.
+void arena_scratch_release(void) { arena_scratch_free(arena_scratch_pool); }
+
+// Frame Arenas
+// ------------------------------------------------------------------------
+
+frame_arena new_frame_arena(ptrdiff_t reserve) {
+  frame_arena f = {0};
+  f.arenas[0] = new_arena_virtual(reserve);
+  f.arenas[1] = new_arena_virtual(reserve);
+  return f;
+}
+
+// Starts a frame: flips to the other arena and resets it. Everything
+// allocated two frames ago is gone, last frame's data is still readable
+// through frame_arena_previous.
+arena *frame_arena_begin(frame_arena *f) {
+  f->frame++;
+  arena *a = &f->arenas[f->frame & 1];
+  arena_reset(a);
+  return a;
+}
+
+arena *frame_arena_previous(frame_arena *f) {
+  return &f->arenas[(f->frame + 1) & 1];
+}
+
+void frame_arena_free(frame_arena *f) {
+  arena_free(&f->arenas[0]);
+  arena_free(&f->arenas[1]);
+}
 
 #endif // ARENA_IMPLEMENTATION
@@ -13,23 +13,90 @@
   ((s)->len >= (s)->cap   ? grow(s, sizeof(*(s)->data), arena),                \
    (s)->data + (s)->len++ : (s)->data + (s)->len++)
 
-static void grow(void *slice, ptrdiff_t size, arena *a) {
-  struct {
-    void *data;
-    ptrdiff_t len;
-    ptrdiff_t cap;
-  } replica;
+// Makes sure the slice has room for `n` elements without changing its length
+#define reserve(s, n, arena) reserve_slice(s, sizeof(*(s)->data), n, arena)
+// Sets the length, new elements are zeroed
+#define resize(s, n, arena) resize_slice(s, sizeof(*(s)->data), n, arena)
+#define pop(s) ((s)->data[--(s)->len])
+// Opens a zeroed slot at `i`, shifting the tail up. Returns a pointer to it.
+// `i` is evaluated once.
+#define insert(s, i, arena)                                                    \
+  ((__typeof__((s)->data))insert_slice(s, sizeof(*(s)->data), i, arena))
+// O(1) unordered removal, the last element takes the place of `i`
+#define remove_swap(s, i) ((s)->data[i] = (s)->data[--(s)->len])
+
+typedef struct {
+  void *data;
+  ptrdiff_t len;
+  ptrdiff_t cap;
+} slice_header;
+
+// Grows the slice to `cap` elements. When the slice is the last allocation
+// in the arena it is extended in place, otherwise it is copied to a new block
+// (and the old one is left behind in the arena).
+static void grow_to(void *slice, ptrdiff_t size, ptrdiff_t cap, arena *a) {
+  slice_header replica;
   memcpy(&replica, slice, sizeof(replica));
 
-  replica.cap = replica.cap ? replica.cap : 1;
+  char *end = (char *)replica.data + size * replica.cap;
+  if (replica.data && arena_extend(a, end, size * (cap - replica.cap))) {
+    replica.cap = cap;
+    memcpy(slice, &replica, sizeof(replica));
+    return;
+  }
+
   ptrdiff_t align = 16;
-  void *data = alloc(a, 2 * size, align, replica.cap);
-  replica.cap *= 2;
+  void *data = alloc(a, size, align, cap);
   if (replica.len) {
     memcpy(data, replica.data, size * replica.len);
   }
   replica.data = data;
+  replica.cap = cap;
+
+  memcpy(slice, &replica, sizeof(replica));
+}
+
+static void grow(void *slice, ptrdiff_t size, arena *a) {
+  slice_header replica;
+  memcpy(&replica, slice, sizeof(replica));
+  grow_to(slice, size, replica.cap ? 2 * replica.cap : 2, a);
+}
 
+static void reserve_slice(void *slice, ptrdiff_t size, ptrdiff_t n,
+                          arena *a) {
+  slice_header replica;
+  memcpy(&replica, slice, sizeof(replica));
+  if (n > replica.cap) {
+    // Keep growth geometric so repeated reserves stay amortized
+    grow_to(slice, size, n > 2 * replica.cap ? n : 2 * replica.cap, a);
+  }
+}
+
+static void resize_slice(void *slice, ptrdiff_t size, ptrdiff_t n,
+                         arena *a) {
+  reserve_slice(slice, size, n, a);
+
+  slice_header replica;
+  memcpy(&replica, slice, sizeof(replica));
+  if (n > replica.len) {
+    memset((char *)replica.data + size * replica.len, 0,
+           size * (n - replica.len));
+  }
+  replica.len = n;
   memcpy(slice, &replica, sizeof(replica));
 }
 
+static void *insert_slice(void *slice, ptrdiff_t size, ptrdiff_t i,
+                          arena *a) {
+  slice_header replica;
+  memcpy(&replica, slice, sizeof(replica));
+  reserve_slice(slice, size, replica.len + 1, a);
+
+  memcpy(&replica, slice, sizeof(replica));
+  char *at = (char *)replica.data + size * i;
+  memmove(at + size, at, size * (replica.len - i));
+  memset(at, 0, size);
+  replica.len++;
+  memcpy(slice, &replica, sizeof(replica));
+  return at;
+}
@@ -51,7 +51,8 @@ static void update_camera_vectors(Camera *camera);
 #endif // CAMERA_H
 
 // #define CAMERA_IMPLEMENTATION
-#ifdef CAMERA_IMPLEMENTATION
+#if defined(CAMERA_IMPLEMENTATION) && !defined(CAMERA_IMPLEMENTED)
+#define CAMERA_IMPLEMENTED
 
 // Creates a camera with specified initial parameters and returns it.
 Camera new_camera(vec3s position, vec3s up, float yaw, float pitch) {
@@ -0,0 +1,519 @@
+#ifndef CLUSTER_H_
+#define CLUSTER_H_
+
+#include <GL/glew.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "../include/cglm/struct/frustum.h"
+#include "../include/cglm/struct/mat4.h"
+#include "../include/cglm/types-struct.h"
+#include "arena.h"
+#define JOBS_IMPLEMENTATION
+#include "jobs.h"
+#include "shader.h"
+
+// Clustered Forward Lighting
+//
+// The view frustum is cut into CLUSTER_X * CLUSTER_Y screen tiles and
+// CLUSTER_Z depth slices, exponentially spaced so clusters stay roughly
+// cube shaped. Every frame the lights' bounding spheres are binned into the
+// clusters they touch on the CPU, and the lists go to the GPU as texture
+// buffers; a fragment looks up its cluster and only shades the lights in it.
+//
+// Binning is slice major. Each slice first keeps the lights whose depth range
+// overlaps it (four at a time with SSE2), then marks which tile columns and
+// rows each survivor spans as bitmasks. A cluster's candidates are its
+// column mask AND its row mask, confirmed with an exact sphere / box test.
+// Slices are split between the worker threads, each writing its own run of
+// the index list.
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_COUNT (CLUSTER_X * CLUSTER_Y * CLUSTER_Z)
+
+// Light indices are 16 bit, and a cluster never holds more than this many
+#define CLUSTER_MAX_LIGHTS 65535
+#define CLUSTER_MAX_PER_CLUSTER 256
+#define CLUSTER_MAX_THREADS 16
+
+// Must match LIGHT_MIN_CONTRIBUTION in glsl/lights.glsl, lights reach as far
+// as the shader would shade them
+#define CLUSTER_MIN_CONTRIBUTION (0.5f / 255.0f)
+
+// Texels per light in the cluster_lights buffer
+#define CLUSTER_LIGHT_TEXELS 6
+
+// A point or spot light, world space. Point lights leave `direction` zero.
+// `range` 0 means the light reaches as far as its attenuation does,
+// otherwise the shader fades it out to nothing at `range`.
+typedef struct {
+  vec3s position;
+  vec3s direction;
+  float cutoff;       // Spot only, cosines like SpotLight in lights.glsl
+  float outer_cutoff;
+  vec3s ambient;
+  vec3s diffuse;
+  vec3s specular;
+  float constant;
+  float linear;
+  float quadratic;
+  float range;
+  int32_t shadow; // Shadow atlas slot plus one, 0 for none (lib/shadow.h)
+} ClusterLight;
+
+typedef struct ClusterGrid ClusterGrid;
+
+// A light overlapping the slice being binned, packed for the cluster tests.
+// `budget` is its squared radius minus the squared depth distance to the
+// slice, what's left for the x and y distances.
+typedef struct {
+  float x;
+  float y;
+  float budget;
+  int32_t light;
+} cluster_candidate;
+
+typedef struct {
+  int32_t first_slice; // Slices [first_slice, last_slice)
+  int32_t last_slice;
+
+  // Per frame scratch, carved from the frame arena before the threads start
+  int32_t *hits;
+  cluster_candidate *candidates;
+  uint64_t *masks;
+  uint16_t *indices;
+  int32_t index_count;
+  int32_t index_base; // Where this run starts in the uploaded list
+} cluster_worker;
+
+struct ClusterGrid {
+  // Lights, per cluster (first index, count), light indices
+  GLuint buffers[3];
+  GLuint textures[3];
+
+  // Per frame binning state, view space spheres as SoA
+  float *sphere_x;
+  float *sphere_y;
+  float *sphere_depth;
+  float *sphere_radius;
+  int32_t light_count;
+  int32_t mask_words;
+  float near;
+  float far;
+  float slice_scale; // slice = log(depth) * scale + bias
+  float slice_bias;
+  float slope_x[CLUSTER_X + 1]; // View x / depth at each tile edge
+  float slope_y[CLUSTER_Y + 1];
+  vec2s tile; // Tile size in pixels
+  uint32_t *spans;
+  int32_t index_count;
+
+  cluster_worker *workers;
+  int32_t thread_count; // Workers that bin, at most the pool's
+  job_pool *jobs;       // Not owned
+};
+
+bool cluster_grid_init(ClusterGrid *grid, job_pool *jobs);
+void cluster_grid_free(ClusterGrid *grid);
+void cluster_grid_update(ClusterGrid *grid, const ClusterLight *lights,
+                         int32_t count, mat4s view, mat4s projection,
+                         vec2s viewport, arena *frame);
+void cluster_grid_use(ClusterGrid *grid, Shader *shader, uint32_t unit);
+float cluster_light_radius(const ClusterLight *light);
+
+#endif // CLUSTER_H_
+
+// #define CLUSTER_IMPLEMENTATION
+#if defined(CLUSTER_IMPLEMENTATION) && !defined(CLUSTER_IMPLEMENTED)
+#define CLUSTER_IMPLEMENTED
+
+// Distance where the light's brightest channel drops below
+// CLUSTER_MIN_CONTRIBUTION, capped by its range
+float cluster_light_radius(const ClusterLight *light) {
+  vec3s sum = glms_vec3_add(glms_vec3_add(light->ambient, light->diffuse),
+                            light->specular);
+  float peak = glm_max(glm_max(sum.x, sum.y), sum.z);
+  // constant + linear d + quadratic d^2 = peak / threshold
+  float c = light->constant - peak / CLUSTER_MIN_CONTRIBUTION;
+  float radius = INFINITY;
+  if (c >= 0.0f) {
+    radius = 0.0f;
+  } else if (light->quadratic > 0.0f) {
+    float a = light->quadratic, b = light->linear;
+    radius = (-b + sqrtf(b * b - 4.0f * a * c)) / (2.0f * a);
+  } else if (light->linear > 0.0f) {
+    radius = -c / light->linear;
+  }
+  if (light->range > 0.0f && light->range < radius) {
+    radius = light->range;
+  }
+  return radius;
+}
+
+static void cluster_slice_bounds(ClusterGrid *g, int32_t z, float *d0,
+                                 float *d1) {
+  float ratio = g->far / g->near;
+  *d0 = g->near * powf(ratio, (float)z / CLUSTER_Z);
+  *d1 = g->near * powf(ratio, (float)(z + 1) / CLUSTER_Z);
+}
+
+// Indices of the spheres overlapping depths [d0, d1] go to `out`
+static int32_t cluster_slice_candidates(ClusterGrid *g, float d0, float d1,
+                                        int32_t *out) {
+  int32_t n = 0;
+  int32_t i = 0;
+#ifdef __SSE2__
+  __m128 near = _mm_set1_ps(d0);
+  __m128 far = _mm_set1_ps(d1);
+  for (; i + 4 <= g->light_count; i += 4) {
+    __m128 depth = _mm_loadu_ps(g->sphere_depth + i);
+    __m128 radius = _mm_loadu_ps(g->sphere_radius + i);
+    __m128 hit = _mm_and_ps(_mm_cmpgt_ps(_mm_add_ps(depth, radius), near),
+                            _mm_cmplt_ps(_mm_sub_ps(depth, radius), far));
+    for (int mask = _mm_movemask_ps(hit); mask; mask &= mask - 1) {
+      out[n++] = i + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; i < g->light_count; i++) {
+    float depth = g->sphere_depth[i], radius = g->sphere_radius[i];
+    if (depth + radius > d0 && depth - radius < d1) {
+      out[n++] = i;
+    }
+  }
+  return n;
+}
+
+// Box of one tile edge to the next over depths [d0, d1], along one axis
+static void cluster_tile_extent(const float *slope, int32_t tiles, float d0,
+                                float d1, float *lo, float *hi) {
+  for (int32_t t = 0; t < tiles; t++) {
+    lo[t] = glm_min(slope[t] * d0, slope[t] * d1);
+    hi[t] = glm_max(slope[t + 1] * d0, slope[t + 1] * d1);
+  }
+}
+
+// Sets bit `bit` in the mask of each tile the interval [a, b] overlaps
+static void cluster_mark(uint64_t *masks, int32_t words, const float *lo,
+                         const float *hi, int32_t tiles, float a, float b,
+                         int32_t bit) {
+  for (int32_t t = 0; t < tiles; t++) {
+    if (b >= lo[t] && a <= hi[t]) {
+      masks[t * words + bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+  }
+}
+
+static float cluster_axis_distance(float c, float lo, float hi) {
+  float d = c < lo ? lo - c : c > hi ? c - hi : 0.0f;
+  return d * d;
+}
+
+static void cluster_bin_slice(ClusterGrid *g, cluster_worker *w, int32_t z) {
+  float d0, d1;
+  cluster_slice_bounds(g, z, &d0, &d1);
+  int32_t count = cluster_slice_candidates(g, d0, d1, w->hits);
+  // Whole 128 bit pairs, so the masks are ANDed two words at a time
+  int32_t words = (count + 127) / 128 * 2;
+
+  float lo_x[CLUSTER_X], hi_x[CLUSTER_X], lo_y[CLUSTER_Y], hi_y[CLUSTER_Y];
+  cluster_tile_extent(g->slope_x, CLUSTER_X, d0, d1, lo_x, hi_x);
+  cluster_tile_extent(g->slope_y, CLUSTER_Y, d0, d1, lo_y, hi_y);
+
+  uint64_t *columns = w->masks;
+  uint64_t *rows = w->masks + CLUSTER_X * words;
+  memset(w->masks, 0, (CLUSTER_X + CLUSTER_Y) * words * sizeof(uint64_t));
+  for (int32_t j = 0; j < count; j++) {
+    int32_t i = w->hits[j];
+    float x = g->sphere_x[i], y = g->sphere_y[i], r = g->sphere_radius[i];
+    cluster_mark(columns, words, lo_x, hi_x, CLUSTER_X, x - r, x + r, j);
+    cluster_mark(rows, words, lo_y, hi_y, CLUSTER_Y, y - r, y + r, j);
+    w->candidates[j] = (cluster_candidate){
+        .x = x,
+        .y = y,
+        .budget = r * r - cluster_axis_distance(g->sphere_depth[i], d0, d1),
+        .light = i,
+    };
+  }
+
+  for (int32_t ty = 0; ty < CLUSTER_Y; ty++) {
+    for (int32_t tx = 0; tx < CLUSTER_X; tx++) {
+      int32_t cluster = (z * CLUSTER_Y + ty) * CLUSTER_X + tx;
+      int32_t first = w->index_count;
+      const uint64_t *column = columns + tx * words;
+      const uint64_t *row = rows + ty * words;
+
+      for (int32_t k = 0; k < words; k += 2) {
+        uint64_t both[2];
+#ifdef __SSE2__
+        _mm_storeu_si128(
+            (__m128i *)both,
+            _mm_and_si128(_mm_loadu_si128((const __m128i *)(column + k)),
+                          _mm_loadu_si128((const __m128i *)(row + k))));
+#else
+        both[0] = column[k] & row[k];
+        both[1] = column[k + 1] & row[k + 1];
+#endif
+        // Written unconditionally and kept on a hit, no branch to miss
+        for (int32_t half = 0; half < 2; half++) {
+          for (uint64_t bits = both[half]; bits; bits &= bits - 1) {
+            const cluster_candidate *c =
+                &w->candidates[(k + half) * 64 + __builtin_ctzll(bits)];
+            float d2 = cluster_axis_distance(c->x, lo_x[tx], hi_x[tx]) +
+                       cluster_axis_distance(c->y, lo_y[ty], hi_y[ty]);
+            w->indices[w->index_count] = (uint16_t)c->light;
+            w->index_count += d2 <= c->budget;
+          }
+        }
+      }
+      if (w->index_count - first > CLUSTER_MAX_PER_CLUSTER) {
+        w->index_count = first + CLUSTER_MAX_PER_CLUSTER;
+      }
+
+      g->spans[cluster * 2] = first;
+      g->spans[cluster * 2 + 1] = w->index_count - first;
+    }
+  }
+}
+
+static void cluster_bin(ClusterGrid *g, cluster_worker *w) {
+  w->index_count = 0;
+  for (int32_t z = w->first_slice; z < w->last_slice; z++) {
+    cluster_bin_slice(g, w, z);
+  }
+}
+
+static void cluster_bin_job(void *user, int32_t worker) {
+  ClusterGrid *g = user;
+  if (worker < g->thread_count) {
+    cluster_bin(g, &g->workers[worker]);
+  }
+}
+
+// Creates the GL buffers and splits the slices between the workers of
+// `jobs`, the thread that calls cluster_grid_update bins its share too. The
+// pool is shared, not owned, and must outlive the grid.
+bool cluster_grid_init(ClusterGrid *grid, job_pool *jobs) {
+  *grid = (ClusterGrid){0};
+  grid->jobs = jobs;
+  int32_t threads = jobs->thread_count;
+  if (threads > CLUSTER_MAX_THREADS) {
+    threads = CLUSTER_MAX_THREADS;
+  }
+  if (threads > CLUSTER_Z) {
+    threads = CLUSTER_Z;
+  }
+
+  glGenBuffers(3, grid->buffers);
+  glGenTextures(3, grid->textures);
+  const GLenum formats[3] = {GL_RGBA32F, GL_RG32UI, GL_R16UI};
+  for (int i = 0; i < 3; i++) {
+    glBindBuffer(GL_TEXTURE_BUFFER, grid->buffers[i]);
+    glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+    glBindTexture(GL_TEXTURE_BUFFER, grid->textures[i]);
+    glTexBuffer(GL_TEXTURE_BUFFER, formats[i], grid->buffers[i]);
+  }
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+  grid->workers = calloc(threads, sizeof(cluster_worker));
+  if (!grid->workers) {
+    cluster_grid_free(grid);
+    return false;
+  }
+  grid->thread_count = threads;
+
+  // Nearby slices hold more, smaller clusters; an even split is close enough
+  for (int32_t i = 0; i < grid->thread_count; i++) {
+    cluster_worker *w = &grid->workers[i];
+    w->first_slice = CLUSTER_Z * i / grid->thread_count;
+    w->last_slice = CLUSTER_Z * (i + 1) / grid->thread_count;
+  }
+  return true;
+}
+
+void cluster_grid_free(ClusterGrid *grid) {
+  free(grid->workers);
+  glDeleteTextures(3, grid->textures);
+  glDeleteBuffers(3, grid->buffers);
+  *grid = (ClusterGrid){0};
+}
+
+// Frustum slopes and depth slicing from the projection, any perspective
+// projection works since every cluster edge is a ray through the eye
+static void cluster_grid_frustum(ClusterGrid *g, mat4s projection) {
+  vec4s corners[8];
+  glms_frustum_corners(glms_mat4_inv(projection), corners);
+  g->near = -corners[GLM_LBN].z;
+  g->far = -corners[GLM_LBF].z;
+
+  float left = corners[GLM_LBF].x / g->far;
+  float right = corners[GLM_RBF].x / g->far;
+  float bottom = corners[GLM_LBF].y / g->far;
+  float top = corners[GLM_LTF].y / g->far;
+  for (int32_t i = 0; i <= CLUSTER_X; i++) {
+    g->slope_x[i] = left + (right - left) * i / CLUSTER_X;
+  }
+  for (int32_t i = 0; i <= CLUSTER_Y; i++) {
+    g->slope_y[i] = bottom + (top - bottom) * i / CLUSTER_Y;
+  }
+
+  float log_ratio = logf(g->far / g->near);
+  g->slice_scale = CLUSTER_Z / log_ratio;
+  g->slice_bias = -CLUSTER_Z * logf(g->near) / log_ratio;
+}
+
+// Bounding sphere of the light's lit volume, a cone's is tighter than the
+// full sphere when it is narrow
+static vec4s cluster_light_sphere(const ClusterLight *light) {
+  float radius = cluster_light_radius(light);
+  float cos_angle = light->outer_cutoff;
+  bool spot = glms_vec3_norm2(light->direction) > 0.0f && cos_angle > 0.0f &&
+              isfinite(radius);
+  if (!spot) {
+    return glms_vec4(light->position, radius);
+  }
+
+  vec3s direction = glms_vec3_normalize(light->direction);
+  float sin_angle = sqrtf(1.0f - cos_angle * cos_angle);
+  if (cos_angle < GLM_SQRT1_2f) {
+    // Wide: the disc at the end of the cone
+    return glms_vec4(glms_vec3_muladds(direction, radius * cos_angle,
+                                       light->position),
+                     radius * sin_angle);
+  }
+  // Narrow: the sphere through the apex and the rim
+  float r = radius / (2.0f * cos_angle);
+  return glms_vec4(glms_vec3_muladds(direction, r, light->position), r);
+}
+
+static void cluster_pack_light(const ClusterLight *l, float radius,
+                               float *out) {
+  // Point lights get a cone that covers every direction
+  bool spot = glms_vec3_norm2(l->direction) > 0.0f;
+  vec3s direction = spot ? l->direction : (vec3s){{0.0f, -1.0f, 0.0f}};
+  float cutoff = spot ? l->cutoff : -2.0f;
+  float outer = spot ? l->outer_cutoff : -3.0f;
+  float range = l->range > 0.0f ? radius : 0.0f;
+  const float texels[CLUSTER_LIGHT_TEXELS][4] = {
+      {l->position.x, l->position.y, l->position.z, range},
+      {direction.x, direction.y, direction.z, cutoff},
+      {l->ambient.x, l->ambient.y, l->ambient.z, l->constant},
+      {l->diffuse.x, l->diffuse.y, l->diffuse.z, l->linear},
+      {l->specular.x, l->specular.y, l->specular.z, l->quadratic},
+      {outer, (float)l->shadow, 0.0f, 0.0f},
+  };
+  memcpy(out, texels, sizeof(texels));
+}
+
+// Bins `lights` for this frame's camera and uploads the cluster lists.
+// Scratch memory comes from `frame`, which must outlive the call only.
+void cluster_grid_update(ClusterGrid *grid, const ClusterLight *lights,
+                         int32_t count, mat4s view, mat4s projection,
+                         vec2s viewport, arena *frame) {
+  ClusterGrid *g = grid;
+  if (count > CLUSTER_MAX_LIGHTS) {
+    count = CLUSTER_MAX_LIGHTS;
+  }
+  cluster_grid_frustum(g, projection);
+  g->tile = (vec2s){{viewport.x / CLUSTER_X, viewport.y / CLUSTER_Y}};
+
+  // View space spheres, depth is positive in front of the camera
+  float *packed = make_nozero(frame, float, count * CLUSTER_LIGHT_TEXELS * 4);
+  g->sphere_x = make_nozero(frame, float, count);
+  g->sphere_y = make_nozero(frame, float, count);
+  g->sphere_depth = make_nozero(frame, float, count);
+  g->sphere_radius = make_nozero(frame, float, count);
+  g->light_count = count;
+  for (int32_t i = 0; i < count; i++) {
+    vec4s sphere = cluster_light_sphere(&lights[i]);
+    vec4s center = glms_mat4_mulv(view, glms_vec4(glms_vec3(sphere), 1.0f));
+    g->sphere_x[i] = center.x;
+    g->sphere_y[i] = center.y;
+    g->sphere_depth[i] = -center.z;
+    g->sphere_radius[i] = sphere.w;
+    cluster_pack_light(&lights[i], cluster_light_radius(&lights[i]),
+                       packed + i * CLUSTER_LIGHT_TEXELS * 4);
+  }
+
+  g->mask_words = (count + 127) / 128 * 2;
+  g->spans = make_nozero(frame, uint32_t, CLUSTER_COUNT * 2);
+  int32_t per_cluster =
+      count < CLUSTER_MAX_PER_CLUSTER ? count : CLUSTER_MAX_PER_CLUSTER;
+  for (int32_t i = 0; i < g->thread_count; i++) {
+    cluster_worker *w = &g->workers[i];
+    int32_t clusters =
+        (w->last_slice - w->first_slice) * CLUSTER_X * CLUSTER_Y;
+    w->hits = make_nozero(frame, int32_t, count);
+    w->candidates = make_nozero(frame, cluster_candidate, count);
+    w->masks =
+        make_nozero(frame, uint64_t, (CLUSTER_X + CLUSTER_Y) * g->mask_words);
+    // A cluster may run past its cap before being cut back
+    w->indices = make_nozero(frame, uint16_t, clusters * per_cluster + count);
+  }
+
+  // Every worker bins its slices, this thread included
+  job_pool_run(g->jobs, cluster_bin_job, g);
+
+  // Runs were indexed from zero per worker, shift them into one list
+  g->index_count = 0;
+  for (int32_t i = 0; i < g->thread_count; i++) {
+    cluster_worker *w = &g->workers[i];
+    w->index_base = g->index_count;
+    g->index_count += w->index_count;
+    int32_t first = w->first_slice * CLUSTER_X * CLUSTER_Y;
+    int32_t last = w->last_slice * CLUSTER_X * CLUSTER_Y;
+    for (int32_t c = first; c < last && w->index_base; c++) {
+      g->spans[c * 2] += w->index_base;
+    }
+  }
+
+  // Fresh storage every frame, the driver can keep the old one in flight
+  glBindBuffer(GL_TEXTURE_BUFFER, g->buffers[0]);
+  glBufferData(GL_TEXTURE_BUFFER,
+               (count ? count : 1) * CLUSTER_LIGHT_TEXELS * 4 * sizeof(float),
+               count ? packed : NULL, GL_STREAM_DRAW);
+  glBindBuffer(GL_TEXTURE_BUFFER, g->buffers[1]);
+  glBufferData(GL_TEXTURE_BUFFER, CLUSTER_COUNT * 2 * sizeof(uint32_t),
+               g->spans, GL_STREAM_DRAW);
+  glBindBuffer(GL_TEXTURE_BUFFER, g->buffers[2]);
+  glBufferData(GL_TEXTURE_BUFFER,
+               (g->index_count ? g->index_count : 1) * sizeof(uint16_t), NULL,
+               GL_STREAM_DRAW);
+  for (int32_t i = 0; i < g->thread_count; i++) {
+    cluster_worker *w = &g->workers[i];
+    if (w->index_count) {
+      glBufferSubData(GL_TEXTURE_BUFFER, w->index_base * sizeof(uint16_t),
+                      w->index_count * sizeof(uint16_t), w->indices);
+    }
+  }
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+// Binds the cluster buffers to texture units `unit` to `unit + 2` and points
+// the shader's cluster uniforms (glsl/clusters.glsl) at them
+void cluster_grid_use(ClusterGrid *grid, Shader *shader, uint32_t unit) {
+  for (uint32_t i = 0; i < 3; i++) {
+    glActiveTexture(GL_TEXTURE0 + unit + i);
+    glBindTexture(GL_TEXTURE_BUFFER, grid->textures[i]);
+  }
+  shader_set_int(shader, "cluster_lights", unit);
+  shader_set_int(shader, "cluster_grid", unit + 1);
+  shader_set_int(shader, "cluster_indices", unit + 2);
+  glUniform3i(shader_uniform_location(shader, "cluster_size"), CLUSTER_X,
+              CLUSTER_Y, CLUSTER_Z);
+  shader_set_vec2(shader, "cluster_tile", grid->tile);
+  shader_set_vec4f(shader, "cluster_depth", grid->near, grid->far,
+                   grid->slice_scale, grid->slice_bias);
+}
+
+#endif // CLUSTER_IMPLEMENTATION
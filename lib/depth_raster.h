@@ -0,0 +1,382 @@
+#ifndef DEPTH_RASTER_H_
+#define DEPTH_RASTER_H_
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "../include/cglm/struct/mat4.h"
+#include "../include/cglm/types-struct.h"
+#include "arena.h"
+#define JOBS_IMPLEMENTATION
+#include "jobs.h"
+
+// Software Occlusion Culling
+//
+// A small depth buffer rendered on the CPU, so objects can be culled before
+// they're submitted, with no GPU round trip. Each frame the chosen
+// occluders' triangles are set up once, then rasterized by bands of tile
+// rows on the worker threads, four pixels at a time with SSE2. Every
+// DEPTH_RASTER_TILE square tile also keeps its farthest depth, so a box
+// test first checks whole tiles and only looks at pixels in tiles where the
+// box could show.
+//
+// Depths are window space, [0, 1] with 1 the far plane. Triangles crossing
+// the near plane are left out, which can only make fewer things occluded.
+#define DEPTH_RASTER_TILE 8
+#define DEPTH_RASTER_MAX_TRIANGLES 16384
+#define DEPTH_RASTER_MAX_THREADS 16
+
+// Screen space triangle, ready to rasterize
+typedef struct {
+  float edge[3][3]; // A, B, C of A x + B y + C, inside where all are >= 0
+  float depth[3];   // Depth plane, same form
+  int32_t x0, y0, x1, y1; // Pixel bounds, [x0, x1) x [y0, y1)
+} depth_raster_triangle;
+
+typedef struct DepthRaster DepthRaster;
+
+typedef struct {
+  int32_t first_row; // Pixel rows [first_row, last_row), whole tiles
+  int32_t last_row;
+} depth_raster_worker;
+
+struct DepthRaster {
+  int32_t width; // Multiples of DEPTH_RASTER_TILE
+  int32_t height;
+  int32_t tiles_x;
+  int32_t tiles_y;
+  float *depth;    // width * height
+  float *tile_max; // Farthest depth per tile
+
+  // Per frame
+  mat4s view_projection;
+  depth_raster_triangle *triangles;
+  int32_t triangle_count;
+  int32_t tested;
+  int32_t culled;
+
+  depth_raster_worker *workers;
+  int32_t thread_count; // Bands, at most the pool's workers
+  job_pool *jobs;       // Not owned
+};
+
+bool depth_raster_init(DepthRaster *raster, int32_t width, int32_t height,
+                       job_pool *jobs);
+void depth_raster_free(DepthRaster *raster);
+void depth_raster_begin(DepthRaster *raster, mat4s view_projection,
+                        arena *frame);
+void depth_raster_add_occluder(DepthRaster *raster, const float *positions,
+                               int32_t stride, int32_t vertex_count,
+                               mat4s model);
+void depth_raster_render(DepthRaster *raster);
+bool depth_raster_test_box(DepthRaster *raster, vec3s box[2]);
+void depth_raster_report(DepthRaster *raster, FILE *stream);
+
+#endif // DEPTH_RASTER_H_
+
+// #define DEPTH_RASTER_IMPLEMENTATION
+#if defined(DEPTH_RASTER_IMPLEMENTATION) && !defined(DEPTH_RASTER_IMPLEMENTED)
+#define DEPTH_RASTER_IMPLEMENTED
+
+// Fills the rows of `t` inside [first_row, last_row), keeping the nearest
+// depth
+static void depth_raster_triangle_rows(DepthRaster *r,
+                                       const depth_raster_triangle *t,
+                                       int32_t first_row, int32_t last_row) {
+  int32_t y0 = t->y0 > first_row ? t->y0 : first_row;
+  int32_t y1 = t->y1 < last_row ? t->y1 : last_row;
+  // Whole groups of four, the buffer width is a multiple of them
+  int32_t x0 = t->x0 & ~3;
+  int32_t x1 = t->x1;
+  const float(*e)[3] = t->edge;
+  const float *z = t->depth;
+
+  for (int32_t y = y0; y < y1; y++) {
+    float py = y + 0.5f;
+    float *row = r->depth + (ptrdiff_t)y * r->width;
+    int32_t x = x0;
+#ifdef __SSE2__
+    __m128 px = _mm_add_ps(_mm_set1_ps(x + 0.5f), _mm_setr_ps(0, 1, 2, 3));
+    __m128 a0 = _mm_set1_ps(e[0][0]), a1 = _mm_set1_ps(e[1][0]);
+    __m128 a2 = _mm_set1_ps(e[2][0]), az = _mm_set1_ps(z[0]);
+    __m128 c0 = _mm_set1_ps(e[0][1] * py + e[0][2]);
+    __m128 c1 = _mm_set1_ps(e[1][1] * py + e[1][2]);
+    __m128 c2 = _mm_set1_ps(e[2][1] * py + e[2][2]);
+    __m128 cz = _mm_set1_ps(z[1] * py + z[2]);
+    __m128 zero = _mm_setzero_ps();
+    __m128 four = _mm_set1_ps(4.0f);
+    for (; x < x1; x += 4, px = _mm_add_ps(px, four)) {
+      __m128 inside = _mm_and_ps(
+          _mm_and_ps(_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a0, px), c0), zero),
+                     _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a1, px), c1), zero)),
+          _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a2, px), c2), zero));
+      if (!_mm_movemask_ps(inside)) {
+        continue;
+      }
+      __m128 depth = _mm_load_ps(row + x);
+      __m128 nearer = _mm_min_ps(depth, _mm_add_ps(_mm_mul_ps(az, px), cz));
+      _mm_store_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer),
+                                      _mm_andnot_ps(inside, depth)));
+    }
+#endif
+    for (; x < x1; x++) {
+      float pxs = x + 0.5f;
+      if (e[0][0] * pxs + e[0][1] * py + e[0][2] >= 0.0f &&
+          e[1][0] * pxs + e[1][1] * py + e[1][2] >= 0.0f &&
+          e[2][0] * pxs + e[2][1] * py + e[2][2] >= 0.0f) {
+        float d = z[0] * pxs + z[1] * py + z[2];
+        row[x] = d < row[x] ? d : row[x];
+      }
+    }
+  }
+}
+
+// Clears a band, draws every triangle into it, then sums up its tiles
+static void depth_raster_band(DepthRaster *r, depth_raster_worker *w) {
+  for (ptrdiff_t i = (ptrdiff_t)w->first_row * r->width;
+       i < (ptrdiff_t)w->last_row * r->width; i++) {
+    r->depth[i] = 1.0f;
+  }
+  for (int32_t i = 0; i < r->triangle_count; i++) {
+    depth_raster_triangle_rows(r, &r->triangles[i], w->first_row,
+                               w->last_row);
+  }
+
+  for (int32_t ty = w->first_row / DEPTH_RASTER_TILE;
+       ty < w->last_row / DEPTH_RASTER_TILE; ty++) {
+    for (int32_t tx = 0; tx < r->tiles_x; tx++) {
+      float farthest = 0.0f;
+      for (int32_t y = 0; y < DEPTH_RASTER_TILE; y++) {
+        const float *row = r->depth +
+                           (ptrdiff_t)(ty * DEPTH_RASTER_TILE + y) * r->width +
+                           tx * DEPTH_RASTER_TILE;
+        for (int32_t x = 0; x < DEPTH_RASTER_TILE; x++) {
+          farthest = row[x] > farthest ? row[x] : farthest;
+        }
+      }
+      r->tile_max[ty * r->tiles_x + tx] = farthest;
+    }
+  }
+}
+
+static void depth_raster_band_job(void *user, int32_t worker) {
+  DepthRaster *r = user;
+  if (worker < r->thread_count) {
+    depth_raster_band(r, &r->workers[worker]);
+  }
+}
+
+// Allocates a width x height buffer (rounded up to whole tiles) and splits
+// it into one band of tile rows per worker of `jobs`, the thread calling
+// depth_raster_render draws its band too. The pool is shared, not owned,
+// and must outlive the raster.
+bool depth_raster_init(DepthRaster *raster, int32_t width, int32_t height,
+                       job_pool *jobs) {
+  DepthRaster *r = raster;
+  *r = (DepthRaster){0};
+  r->jobs = jobs;
+  r->tiles_x = (width + DEPTH_RASTER_TILE - 1) / DEPTH_RASTER_TILE;
+  r->tiles_y = (height + DEPTH_RASTER_TILE - 1) / DEPTH_RASTER_TILE;
+  r->width = r->tiles_x * DEPTH_RASTER_TILE;
+  r->height = r->tiles_y * DEPTH_RASTER_TILE;
+  int32_t threads = jobs->thread_count;
+  if (threads > DEPTH_RASTER_MAX_THREADS) {
+    threads = DEPTH_RASTER_MAX_THREADS;
+  }
+  if (threads > r->tiles_y) {
+    threads = r->tiles_y;
+  }
+
+  // 16 byte aligned rows for the SSE loads
+  r->depth = aligned_alloc(16, (size_t)r->width * r->height * sizeof(float));
+  r->tile_max = calloc(r->tiles_x * r->tiles_y, sizeof(float));
+  r->workers = calloc(threads, sizeof(depth_raster_worker));
+  if (!r->depth || !r->tile_max || !r->workers) {
+    depth_raster_free(r);
+    return false;
+  }
+  r->thread_count = threads;
+
+  for (int32_t i = 0; i < r->thread_count; i++) {
+    depth_raster_worker *w = &r->workers[i];
+    w->first_row = r->tiles_y * i / r->thread_count * DEPTH_RASTER_TILE;
+    w->last_row = r->tiles_y * (i + 1) / r->thread_count * DEPTH_RASTER_TILE;
+  }
+  return true;
+}
+
+void depth_raster_free(DepthRaster *raster) {
+  DepthRaster *r = raster;
+  free(r->workers);
+  free(r->depth);
+  free(r->tile_max);
+  *r = (DepthRaster){0};
+}
+
+// Starts a frame, triangle storage comes from `frame`
+void depth_raster_begin(DepthRaster *raster, mat4s view_projection,
+                        arena *frame) {
+  raster->view_projection = view_projection;
+  raster->triangles =
+      make_nozero(frame, depth_raster_triangle, DEPTH_RASTER_MAX_TRIANGLES);
+  raster->triangle_count = 0;
+  raster->tested = 0;
+  raster->culled = 0;
+}
+
+// Window space position, w <= 0 for points at or behind the eye
+static vec4s depth_raster_project(DepthRaster *r, mat4s mvp, vec3s p) {
+  vec4s clip = glms_mat4_mulv(mvp, glms_vec4(p, 1.0f));
+  if (clip.w <= 1e-5f) {
+    return (vec4s){{0.0f, 0.0f, 0.0f, 0.0f}};
+  }
+  float inv_w = 1.0f / clip.w;
+  return (vec4s){{(clip.x * inv_w * 0.5f + 0.5f) * r->width,
+                  (clip.y * inv_w * 0.5f + 0.5f) * r->height,
+                  clip.z * inv_w * 0.5f + 0.5f, clip.w}};
+}
+
+// Edge a -> b, positive on its left
+static void depth_raster_edge(vec4s a, vec4s b, float *edge) {
+  edge[0] = a.y - b.y;
+  edge[1] = b.x - a.x;
+  edge[2] = -(edge[0] * a.x + edge[1] * a.y);
+}
+
+// Adds a triangle list as an occluder. `positions` holds `vertex_count`
+// model space vertices, `stride` floats apart. Both windings are drawn.
+void depth_raster_add_occluder(DepthRaster *raster, const float *positions,
+                               int32_t stride, int32_t vertex_count,
+                               mat4s model) {
+  DepthRaster *r = raster;
+  mat4s mvp = glms_mat4_mul(r->view_projection, model);
+  for (int32_t v = 0; v + 3 <= vertex_count; v += 3) {
+    if (r->triangle_count == DEPTH_RASTER_MAX_TRIANGLES) {
+      return;
+    }
+    vec4s p[3];
+    bool behind = false;
+    for (int32_t k = 0; k < 3; k++) {
+      const float *src = positions + (ptrdiff_t)(v + k) * stride;
+      p[k] = depth_raster_project(r, mvp, (vec3s){{src[0], src[1], src[2]}});
+      behind |= p[k].w <= 0.0f || p[k].z < 0.0f;
+    }
+    if (behind) {
+      continue;
+    }
+
+    float area = (p[1].x - p[0].x) * (p[2].y - p[0].y) -
+                 (p[1].y - p[0].y) * (p[2].x - p[0].x);
+    if (fabsf(area) < 1e-6f) {
+      continue;
+    }
+    if (area < 0.0f) {
+      vec4s swap = p[1];
+      p[1] = p[2];
+      p[2] = swap;
+      area = -area;
+    }
+
+    depth_raster_triangle *t = &r->triangles[r->triangle_count];
+    float min_x = glm_min(p[0].x, glm_min(p[1].x, p[2].x));
+    float max_x = glm_max(p[0].x, glm_max(p[1].x, p[2].x));
+    float min_y = glm_min(p[0].y, glm_min(p[1].y, p[2].y));
+    float max_y = glm_max(p[0].y, glm_max(p[1].y, p[2].y));
+    t->x0 = (int32_t)glm_clamp(floorf(min_x), 0.0f, r->width);
+    t->x1 = (int32_t)glm_clamp(ceilf(max_x), 0.0f, r->width);
+    t->y0 = (int32_t)glm_clamp(floorf(min_y), 0.0f, r->height);
+    t->y1 = (int32_t)glm_clamp(ceilf(max_y), 0.0f, r->height);
+    if (t->x0 >= t->x1 || t->y0 >= t->y1) {
+      continue;
+    }
+
+    // Edge i is opposite vertex i, so edge / area is that vertex's weight
+    depth_raster_edge(p[1], p[2], t->edge[0]);
+    depth_raster_edge(p[2], p[0], t->edge[1]);
+    depth_raster_edge(p[0], p[1], t->edge[2]);
+    float dz1 = (p[1].z - p[0].z) / area, dz2 = (p[2].z - p[0].z) / area;
+    for (int32_t c = 0; c < 3; c++) {
+      t->depth[c] = dz1 * t->edge[1][c] + dz2 * t->edge[2][c];
+    }
+    t->depth[2] += p[0].z;
+    r->triangle_count++;
+  }
+}
+
+// Draws the occluders added since depth_raster_begin
+void depth_raster_render(DepthRaster *raster) {
+  job_pool_run(raster->jobs, depth_raster_band_job, raster);
+}
+
+// False when the world space box is off screen or behind the occluders.
+// Boxes reaching behind the eye always count as visible.
+bool depth_raster_test_box(DepthRaster *raster, vec3s box[2]) {
+  DepthRaster *r = raster;
+  r->tested++;
+  float min_x = INFINITY, max_x = -INFINITY;
+  float min_y = INFINITY, max_y = -INFINITY;
+  float nearest = INFINITY;
+  for (int32_t i = 0; i < 8; i++) {
+    vec3s corner = {
+        {box[i & 1].x, box[(i >> 1) & 1].y, box[(i >> 2) & 1].z}};
+    vec4s p = depth_raster_project(r, r->view_projection, corner);
+    if (p.w <= 0.0f || p.z < 0.0f) {
+      return true;
+    }
+    min_x = glm_min(min_x, p.x);
+    max_x = glm_max(max_x, p.x);
+    min_y = glm_min(min_y, p.y);
+    max_y = glm_max(max_y, p.y);
+    nearest = glm_min(nearest, p.z);
+  }
+
+  int32_t x0 = (int32_t)glm_clamp(floorf(min_x), 0.0f, r->width);
+  int32_t x1 = (int32_t)glm_clamp(ceilf(max_x), 0.0f, r->width);
+  int32_t y0 = (int32_t)glm_clamp(floorf(min_y), 0.0f, r->height);
+  int32_t y1 = (int32_t)glm_clamp(ceilf(max_y), 0.0f, r->height);
+  if (x0 >= x1 || y0 >= y1 || nearest > 1.0f) {
+    r->culled++;
+    return false;
+  }
+
+  // Tiles whose farthest depth is in front of the box hide it entirely
+  for (int32_t ty = y0 / DEPTH_RASTER_TILE; ty * DEPTH_RASTER_TILE < y1;
+       ty++) {
+    for (int32_t tx = x0 / DEPTH_RASTER_TILE; tx * DEPTH_RASTER_TILE < x1;
+         tx++) {
+      if (r->tile_max[ty * r->tiles_x + tx] < nearest) {
+        continue;
+      }
+      int32_t px0 = glm_max(x0, tx * DEPTH_RASTER_TILE);
+      int32_t px1 = glm_min(x1, (tx + 1) * DEPTH_RASTER_TILE);
+      int32_t py0 = glm_max(y0, ty * DEPTH_RASTER_TILE);
+      int32_t py1 = glm_min(y1, (ty + 1) * DEPTH_RASTER_TILE);
+      for (int32_t y = py0; y < py1; y++) {
+        const float *row = r->depth + (ptrdiff_t)y * r->width;
+        for (int32_t x = px0; x < px1; x++) {
+          if (row[x] >= nearest) {
+            return true;
+          }
+        }
+      }
+    }
+  }
+  r->culled++;
+  return false;
+}
+
+void depth_raster_report(DepthRaster *raster, FILE *stream) {
+  fprintf(stream,
+          "Software occlusion: %d occluder triangles, %d of %d boxes culled\n",
+          raster->triangle_count, raster->culled, raster->tested);
+}
+
+#endif // DEPTH_RASTER_IMPLEMENTATION
@@ -1,53 +1,323 @@
+#ifndef FILE_H_
+#define FILE_H_
+
 #define ARENA_IMPLEMENTATION
 #include "arena.h"
 
 #include "str.h"
+#define LZ_IMPLEMENTATION
+#include "lz.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <wchar.h>
 
-static string read_file(const char *filename, arena *a) {
-  FILE *file = fopen(filename, "rb");
-  if (!file) {
-    string empty_str = {0}; // Return an empty string if file cannot be opened
-    fprintf(stderr, "Error: No se pudo abrir el archivo %s\n", filename);
-    return empty_str;
+// File Access
+//
+// read_file copies a whole file into arena memory (null terminated).
+// map_file maps it instead and returns a `string` view straight into the page
+// cache, so big assets load with no copy; views are NOT null terminated.
+// Files that can't be mapped (pipes, /proc, character devices) fall back to
+// reading into the arena, so callers don't need to care which one they got.
+// read_asset (and read_file, which goes through it) also finds assets shipped
+// lz compressed: when "name" isn't there but "name.lz" is, that frame comes
+// back decompressed. Compression is chosen by the file name alone, a loose
+// file is never sniffed for the lz magic.
+//
+// An asset source can be mounted with file_mount (pack_mount mounts a pack):
+// read_asset asks it first and only reads loose files for what it lacks.
+
+typedef enum {
+  FILE_OK = 0,
+  FILE_NOT_FOUND,
+  FILE_ACCESS_DENIED,
+  FILE_IS_DIRECTORY,
+  FILE_READ_FAILED,
+  FILE_MAP_FAILED,
+} file_error;
+
+enum {
+  FILE_MAP_POPULATE = 1 << 0,  // Prefault every page up front
+  FILE_MAP_SEQUENTIAL = 1 << 1, // Aggressive read-ahead, early page drop
+  FILE_MAP_RANDOM = 1 << 2,     // No read-ahead, for sparse lookups
+};
+
+typedef struct {
+  string data;
+  ptrdiff_t mapped; // Length of the mapping, 0 when data lives in an arena
+} file_map;
+
+// Copies `filename` into `a` (null terminated) and returns true, or returns
+// false when the source doesn't have it
+typedef bool (*file_source)(void *source, const char *filename, arena *a,
+                            string *out);
+
+static file_source file_mounted;
+static void *file_mounted_source;
+
+static inline file_error map_file(const char *filename, int flags, file_map *map,
+                           arena *fallback);
+static inline void unmap_file(file_map *map);
+static inline file_error read_file_into(const char *filename, arena *a,
+                                 string *out);
+static inline string read_file(const char *filename, arena *a);
+static inline file_error read_asset(const char *filename, arena *a,
+                                    string *out);
+static inline file_error read_loose_asset(const char *filename, arena *a,
+                                          string *out);
+static inline void file_mount(file_source read, void *source);
+static inline bool read_mounted(const char *filename, arena *a, string *out);
+static inline const char *file_error_string(file_error error);
+
+static file_error file_error_from_errno(int error) {
+  switch (error) {
+  case ENOENT:
+  case ENOTDIR:
+    return FILE_NOT_FOUND;
+  case EACCES:
+  case EPERM:
+    return FILE_ACCESS_DENIED;
+  case EISDIR:
+    return FILE_IS_DIRECTORY;
+  default:
+    return FILE_READ_FAILED;
+  }
+}
+
+static inline const char *file_error_string(file_error error) {
+  switch (error) {
+  case FILE_OK:
+    return "ok";
+  case FILE_NOT_FOUND:
+    return "file not found";
+  case FILE_ACCESS_DENIED:
+    return "access denied";
+  case FILE_IS_DIRECTORY:
+    return "is a directory";
+  case FILE_READ_FAILED:
+    return "read failed";
+  case FILE_MAP_FAILED:
+    return "mmap failed";
+  }
+  return "unknown error";
+}
+
+// Reads everything left in `fd` into the arena, for files whose size isn't
+// known up front. Chunks are appended in place while the buffer is the
+// arena's last allocation. The buffer always has a spare byte at the end,
+// which gets the null terminator.
+static file_error read_stream(int fd, arena *a, string *out) {
+  ptrdiff_t cap = 64 * 1024;
+  ptrdiff_t len = 0;
+  uint8_t *data = make_nozero(a, uint8_t, cap);
+
+  for (;;) {
+    if (len == cap) {
+      if (!arena_extend(a, data + cap, cap)) {
+        uint8_t *copy = make_nozero(a, uint8_t, cap * 2);
+        memcpy(copy, data, len);
+        data = copy;
+      }
+      cap *= 2;
+    }
+
+    ssize_t n = read(fd, data + len, cap - len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return FILE_READ_FAILED;
+    }
+    if (n == 0) {
+      break;
+    }
+    len += n;
+  }
+
+  data[len] = '\0';
+  *out = (string){data, len};
+  return FILE_OK;
+}
+
+// Maps `filename` read-only. On success `map->data` views the file contents
+// until unmap_file. Files without a usable size are read into `fallback`.
+static inline file_error map_file(const char *filename, int flags, file_map *map,
+                           arena *fallback) {
+  *map = (file_map){0};
+
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return file_error_from_errno(errno);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return FILE_READ_FAILED;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    close(fd);
+    return FILE_IS_DIRECTORY;
+  }
+  // procfs and sysfs files claim a size of 0, read those too
+  if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+    file_error error = read_stream(fd, fallback, &map->data);
+    close(fd);
+    return error;
+  }
+
+  int mmap_flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+  if (flags & FILE_MAP_POPULATE) {
+    mmap_flags |= MAP_POPULATE;
+  }
+#endif
+  void *p = mmap(NULL, st.st_size, PROT_READ, mmap_flags, fd, 0);
+  // The mapping keeps its own reference to the file
+  close(fd);
+  if (p == MAP_FAILED) {
+    return FILE_MAP_FAILED;
+  }
+
+  if (flags & FILE_MAP_SEQUENTIAL) {
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+  } else if (flags & FILE_MAP_RANDOM) {
+    madvise(p, st.st_size, MADV_RANDOM);
+  }
+
+  map->data = (string){p, st.st_size};
+  map->mapped = st.st_size;
+  return FILE_OK;
+}
+
+static inline void unmap_file(file_map *map) {
+  if (map->mapped) {
+    munmap(map->data.data, map->mapped);
+  }
+  *map = (file_map){0};
+}
+
+// Copies the whole file into the arena, null terminated.
+static inline file_error read_file_into(const char *filename, arena *a,
+                                 string *out) {
+  *out = (string){0};
+
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return file_error_from_errno(errno);
   }
 
-  fseek(file, 0, SEEK_END); // Seek to the end of the file
-  long file_size =
-      ftell(file); // Get the current position, which represents the file size
-  fseek(file, 0, SEEK_SET); // Seek back to the beginning of the file
+  struct stat st;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return FILE_READ_FAILED;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    close(fd);
+    return FILE_IS_DIRECTORY;
+  }
+  if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+    file_error error = read_stream(fd, a, out);
+    close(fd);
+    return error;
+  }
 
-  // Allocate memory in the arena for the file contents
+  // Skip zeroing, read overwrites every byte
   uint8_t *file_contents =
-      make(a, uint8_t, file_size + 1); // Plus 1 for null terminator
-  if (!file_contents) {
-    fclose(file); // Close the file if memory allocation fails
-    fprintf(
-        stderr,
-        "Error: No se pudo asignar memoria para el contenido del archivo %s\n",
-        filename);
-    string empty_str = {0};
-    return empty_str;
-  }
-
-  // Read the file contents into memory
-  size_t bytes_read = fread(file_contents, 1, file_size, file);
-  if (bytes_read != (size_t)file_size) {
-    fclose(file); // Close the file if read fails
-    fprintf(stderr, "Error: No se pudo leer correctamente el archivo %s\n",
-            filename);
-    string empty_str = {0};
-    return empty_str;
-  }
-  file_contents[file_size] = '\0'; // Null-terminate the string
-
-  fclose(file); // Close the file after reading
-
-  // Create and return the str structure containing the file contents
-  string file_str = {.data = file_contents, .len = file_size};
+      make_nozero(a, uint8_t, st.st_size + 1); // Plus 1 for null terminator
+
+  ptrdiff_t len = 0;
+  while (len < st.st_size) {
+    ssize_t n = read(fd, file_contents + len, st.st_size - len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      close(fd);
+      return FILE_READ_FAILED;
+    }
+    len += n;
+  }
+  file_contents[len] = '\0'; // Null-terminate the string
+
+  close(fd);
+
+  *out = (string){.data = file_contents, .len = len};
+  return FILE_OK;
+}
+
+static inline string read_file(const char *filename, arena *a) {
+  string file_str;
+  file_error error = read_asset(filename, a, &file_str);
+  if (error != FILE_OK) {
+    fprintf(stderr, "ERROR: Could not read file %s: %s\n", filename,
+            file_error_string(error));
+  }
   return file_str;
 }
+
+// Mounts `source`, NULL unmounts. Not thread safe, mount before loading.
+static inline void file_mount(file_source read, void *source) {
+  file_mounted = read;
+  file_mounted_source = source;
+}
+
+static inline bool read_mounted(const char *filename, arena *a, string *out) {
+  *out = (string){0};
+  return file_mounted && file_mounted(file_mounted_source, filename, a, out);
+}
+
+// Like read_file_into, but tries the mounted source first, and a missing file
+// falls back to its lz compressed copy
+static inline file_error read_asset(const char *filename, arena *a,
+                                    string *out) {
+  if (read_mounted(filename, a, out)) {
+    return FILE_OK;
+  }
+  return read_loose_asset(filename, a, out);
+}
+
+// read_asset without the mounted source. `filename` comes back as is; only
+// when it's missing is `filename`.lz tried. Either file is mapped rather than
+// read, only the copy (or the decompressed frame) lands in `a`.
+static inline file_error read_loose_asset(const char *filename, arena *a,
+                                          string *out) {
+  *out = (string){0};
+  file_map map;
+  file_error error = map_file(filename, FILE_MAP_SEQUENTIAL, &map, a);
+  if (error == FILE_NOT_FOUND) {
+    char lz_name[512];
+    int len = snprintf(lz_name, sizeof(lz_name), "%s.lz", filename);
+    if (len < 0 || len >= (int)sizeof(lz_name) ||
+        map_file(lz_name, FILE_MAP_SEQUENTIAL, &map, a) != FILE_OK) {
+      return FILE_NOT_FOUND;
+    }
+    error = lz_decompress_frame(map.data, a, out) ? FILE_OK
+                                                   : FILE_READ_FAILED;
+    unmap_file(&map);
+    return error;
+  }
+  if (error != FILE_OK) {
+    return error;
+  }
+
+  if (!map.mapped) {
+    // Already read into the arena (and null terminated) by the fallback
+    *out = map.data;
+  } else {
+    uint8_t *data = make_nozero(a, uint8_t, map.data.len + 1);
+    memcpy(data, map.data.data, map.data.len);
+    data[map.data.len] = '\0';
+    *out = (string){data, map.data.len};
+  }
+  unmap_file(&map);
+  return error;
+}
+
+#endif // FILE_H_
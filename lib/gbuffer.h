@@ -0,0 +1,138 @@
+#ifndef GBUFFER_H_
+#define GBUFFER_H_
+
+#include <GL/glew.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "shader.h"
+
+// G-Buffer
+//
+// Render targets of the deferred path. The geometry pass stores only what
+// the lighting pass can't rebuild, 16 bytes a pixel:
+//
+//   0  albedo    RGBA8             diffuse map
+//   1  specular  RGBA8             specular map, shininess / 255 in alpha
+//   2  normal    RG16              octahedral encoded (glsl/gbuffer.glsl)
+//      depth     DEPTH24_STENCIL8  world position is rebuilt from it
+//
+// The depth format matches the usual default framebuffer, so it can be
+// blitted there for forward passes drawn on top.
+enum {
+  GBUFFER_ALBEDO,
+  GBUFFER_SPECULAR,
+  GBUFFER_NORMAL,
+  GBUFFER_DEPTH,
+  GBUFFER_TARGETS,
+};
+
+typedef struct {
+  GLuint FBO;
+  GLuint textures[GBUFFER_TARGETS];
+  int32_t width;
+  int32_t height;
+} GBuffer;
+
+GBuffer new_gbuffer(int32_t width, int32_t height);
+void gbuffer_bind(GBuffer *gbuffer);
+void gbuffer_use(GBuffer *gbuffer, Shader *shader, uint32_t unit);
+void gbuffer_blit_depth(GBuffer *gbuffer, GLuint target);
+void gbuffer_free(GBuffer *gbuffer);
+
+#endif // GBUFFER_H_
+
+// #define GBUFFER_IMPLEMENTATION
+#if defined(GBUFFER_IMPLEMENTATION) && !defined(GBUFFER_IMPLEMENTED)
+#define GBUFFER_IMPLEMENTED
+
+// Creates the targets and the framebuffer. Returns FBO 0 when the driver
+// can't render to the combination.
+GBuffer new_gbuffer(int32_t width, int32_t height) {
+  GBuffer gbuffer = {.width = width, .height = height};
+  const struct {
+    GLint internal;
+    GLenum format;
+    GLenum type;
+    GLenum attachment;
+  } targets[GBUFFER_TARGETS] = {
+      [GBUFFER_ALBEDO] = {GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE,
+                          GL_COLOR_ATTACHMENT0},
+      [GBUFFER_SPECULAR] = {GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE,
+                            GL_COLOR_ATTACHMENT1},
+      [GBUFFER_NORMAL] = {GL_RG16, GL_RG, GL_UNSIGNED_SHORT,
+                          GL_COLOR_ATTACHMENT2},
+      [GBUFFER_DEPTH] = {GL_DEPTH24_STENCIL8, GL_DEPTH_STENCIL,
+                         GL_UNSIGNED_INT_24_8, GL_DEPTH_STENCIL_ATTACHMENT},
+  };
+
+  glGenFramebuffers(1, &gbuffer.FBO);
+  glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.FBO);
+  glGenTextures(GBUFFER_TARGETS, gbuffer.textures);
+  for (int i = 0; i < GBUFFER_TARGETS; i++) {
+    glBindTexture(GL_TEXTURE_2D, gbuffer.textures[i]);
+    glTexImage2D(GL_TEXTURE_2D, 0, targets[i].internal, width, height, 0,
+                 targets[i].format, targets[i].type, NULL);
+    // Read with texelFetch, one texel per pixel
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, targets[i].attachment,
+                           GL_TEXTURE_2D, gbuffer.textures[i], 0);
+  }
+  const GLenum draw_buffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1,
+                                 GL_COLOR_ATTACHMENT2};
+  glDrawBuffers(3, draw_buffers);
+
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  if (status != GL_FRAMEBUFFER_COMPLETE) {
+    fprintf(stderr, "ERROR: G-buffer framebuffer incomplete (0x%x)\n",
+            status);
+    gbuffer_free(&gbuffer);
+  }
+  return gbuffer;
+}
+
+// Makes the G-buffer the render target of the geometry pass
+void gbuffer_bind(GBuffer *gbuffer) {
+  glBindFramebuffer(GL_FRAMEBUFFER, gbuffer->FBO);
+}
+
+// Binds the targets to texture units `unit` to `unit + 3` for reading and
+// points the shader's gbuffer_* samplers (glsl/deferred_fs.glsl) at them
+void gbuffer_use(GBuffer *gbuffer, Shader *shader, uint32_t unit) {
+  const char *names[GBUFFER_TARGETS] = {
+      [GBUFFER_ALBEDO] = "gbuffer_albedo",
+      [GBUFFER_SPECULAR] = "gbuffer_specular",
+      [GBUFFER_NORMAL] = "gbuffer_normal",
+      [GBUFFER_DEPTH] = "gbuffer_depth",
+  };
+  for (uint32_t i = 0; i < GBUFFER_TARGETS; i++) {
+    glActiveTexture(GL_TEXTURE0 + unit + i);
+    glBindTexture(GL_TEXTURE_2D, gbuffer->textures[i]);
+    shader_set_int(shader, names[i], unit + i);
+  }
+}
+
+// Copies the geometry pass depth into `target` (0 for the window), so
+// forward passes drawn afterwards are hidden by the deferred surfaces
+void gbuffer_blit_depth(GBuffer *gbuffer, GLuint target) {
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, gbuffer->FBO);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
+  glBlitFramebuffer(0, 0, gbuffer->width, gbuffer->height, 0, 0,
+                    gbuffer->width, gbuffer->height, GL_DEPTH_BUFFER_BIT,
+                    GL_NEAREST);
+  glBindFramebuffer(GL_FRAMEBUFFER, target);
+}
+
+void gbuffer_free(GBuffer *gbuffer) {
+  glDeleteFramebuffers(1, &gbuffer->FBO);
+  glDeleteTextures(GBUFFER_TARGETS, gbuffer->textures);
+  *gbuffer = (GBuffer){0};
+}
+
+#endif // GBUFFER_IMPLEMENTATION
@@ -0,0 +1,399 @@
+#ifndef HASHMAP_H_
+#define HASHMAP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "arena.h"
+#include "str.h"
+
+// Hash Map
+//
+// Open addressing in the Swiss table style: one control byte per slot holds
+// 7 bits of the hash (or EMPTY/DELETED), and probing walks groups of 16
+// control bytes, compared in one SSE2 instruction, before any key is
+// touched. Keys and values are plain bytes of a fixed size; with
+// HASHMAP_STRING_KEYS the key is a `string` compared by contents, and its
+// bytes are copied into the arena on insert. A map with no value is a set.
+//
+// Each key is stored next to its value, so a hit costs a control byte and
+// one entry. Lookups of string, 4 byte and 8 byte keys run a probe loop
+// compiled for that key kind. Storage comes from the arena. Growing
+// rehashes into new arrays and leaves the old ones in the arena, so size
+// `cap` for the expected count.
+#define HASHMAP_GROUP 16
+
+enum {
+  HASHMAP_STRING_KEYS = 1 << 0,
+};
+
+typedef struct {
+  arena *a;
+  int8_t *ctrl;
+  uint8_t *entries; // Key, padded to 8 bytes, then value
+  ptrdiff_t key_size;
+  ptrdiff_t value_size;
+  ptrdiff_t value_offset;
+  ptrdiff_t stride;
+  ptrdiff_t cap; // Power of two, at least one group
+  ptrdiff_t len;
+  ptrdiff_t tombstones;
+  int flags;
+} hashmap;
+
+#define new_hashset(a, key_size, cap) new_hashmap(a, key_size, 0, cap)
+#define new_hashset_string(a, cap) new_hashmap_string(a, 0, cap)
+#define hashset_add(m, key) hashmap_put(m, key)
+#define hashset_has(m, key) (hashmap_get(m, key) != NULL)
+#define hashset_remove(m, key) hashmap_remove(m, key)
+
+hashmap new_hashmap(arena *a, ptrdiff_t key_size, ptrdiff_t value_size,
+                    ptrdiff_t cap);
+hashmap new_hashmap_string(arena *a, ptrdiff_t value_size, ptrdiff_t cap);
+void *hashmap_get(hashmap *m, const void *key);
+void *hashmap_put(hashmap *m, const void *key);
+bool hashmap_remove(hashmap *m, const void *key);
+void hashmap_clear(hashmap *m);
+// Iteration: for (i = hashmap_next(m, 0); i >= 0; i = hashmap_next(m, i + 1))
+ptrdiff_t hashmap_next(hashmap *m, ptrdiff_t i);
+void *hashmap_key(hashmap *m, ptrdiff_t i);
+void *hashmap_value(hashmap *m, ptrdiff_t i);
+
+uint64_t hash_bytes(const void *data, ptrdiff_t len);
+
+#endif // HASHMAP_H_
+
+// #define HASHMAP_IMPLEMENTATION
+#if defined(HASHMAP_IMPLEMENTATION) && !defined(HASHMAP_IMPLEMENTED)
+#define HASHMAP_IMPLEMENTED
+
+#define HASHMAP_EMPTY ((int8_t)-128)
+#define HASHMAP_DELETED ((int8_t)-2)
+
+// Multiply-xorshift over 8 byte words, strong enough for the 7 bit tags
+inline uint64_t hash_bytes(const void *data, ptrdiff_t len) {
+  const uint8_t *p = data;
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ (uint64_t)len;
+
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t k;
+    memcpy(&k, p, 8);
+    h = (h ^ k) * 0xff51afd7ed558ccdull;
+    h ^= h >> 32;
+  }
+  uint64_t tail = 0;
+  for (ptrdiff_t i = 0; i < len; i++) {
+    tail |= (uint64_t)p[i] << (i * 8);
+  }
+  h = (h ^ tail) * 0xff51afd7ed558ccdull;
+
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+static void hashmap_alloc(hashmap *m, ptrdiff_t cap) {
+  m->cap = cap;
+  // 16 byte aligned so every group loads with one aligned SSE2 load
+  m->ctrl = alloc_nozero(m->a, 1, HASHMAP_GROUP, cap);
+  memset(m->ctrl, HASHMAP_EMPTY, cap);
+  m->entries = alloc_nozero(m->a, m->stride, 16, cap);
+}
+
+hashmap new_hashmap(arena *a, ptrdiff_t key_size, ptrdiff_t value_size,
+                    ptrdiff_t cap) {
+  hashmap m = {.a = a, .key_size = key_size, .value_size = value_size};
+  m.value_offset = (key_size + 7) & ~(ptrdiff_t)7;
+  m.stride = (m.value_offset + value_size + 7) & ~(ptrdiff_t)7;
+
+  // Room for `cap` entries under the 7/8 load factor
+  ptrdiff_t slots = HASHMAP_GROUP;
+  while (slots - slots / 8 < cap) {
+    slots *= 2;
+  }
+  hashmap_alloc(&m, slots);
+  return m;
+}
+
+hashmap new_hashmap_string(arena *a, ptrdiff_t value_size, ptrdiff_t cap) {
+  hashmap m = new_hashmap(a, sizeof(string), value_size, cap);
+  m.flags = HASHMAP_STRING_KEYS;
+  return m;
+}
+
+// Key kind: HASHMAP_STRING_KEY (0) for string keys, otherwise the key size.
+// The _kind helpers are always inlined, so a constant kind folds the hash
+// and compare into straight-line code.
+#define HASHMAP_STRING_KEY 0
+
+static inline ptrdiff_t hashmap_kind(hashmap *m) {
+  return m->flags & HASHMAP_STRING_KEYS ? HASHMAP_STRING_KEY : m->key_size;
+}
+
+__attribute__((always_inline)) static inline uint64_t
+hashmap_hash_kind(const void *key, ptrdiff_t kind) {
+  if (kind == HASHMAP_STRING_KEY) {
+    const string *s = key;
+    return hash_bytes(s->data, s->len);
+  }
+  return hash_bytes(key, kind);
+}
+
+// Compares without calling memcmp, which would make the probe loop save its
+// state around the call for every candidate. Names and paths are short, so
+// the last word overlaps the ones before it instead of ending in a byte
+// loop.
+static inline uint64_t hashmap_load64(const uint8_t *p) {
+  uint64_t x;
+  memcpy(&x, p, 8);
+  return x;
+}
+
+static inline uint32_t hashmap_load32(const uint8_t *p) {
+  uint32_t x;
+  memcpy(&x, p, 4);
+  return x;
+}
+
+static inline bool hashmap_bytes_equal(const uint8_t *a, const uint8_t *b,
+                                       ptrdiff_t len) {
+  if (len >= 8) {
+    for (ptrdiff_t i = 0; i < len - 8; i += 8) {
+      if (hashmap_load64(a + i) != hashmap_load64(b + i)) {
+        return false;
+      }
+    }
+    return hashmap_load64(a + len - 8) == hashmap_load64(b + len - 8);
+  }
+  if (len >= 4) {
+    return hashmap_load32(a) == hashmap_load32(b) &&
+           hashmap_load32(a + len - 4) == hashmap_load32(b + len - 4);
+  }
+  for (ptrdiff_t i = 0; i < len; i++) {
+    if (a[i] != b[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+__attribute__((always_inline)) static inline bool
+hashmap_equal_kind(const void *stored, const void *key, ptrdiff_t kind) {
+  if (kind == HASHMAP_STRING_KEY) {
+    const string *a = stored, *b = key;
+    return a->len == b->len && hashmap_bytes_equal(a->data, b->data, a->len);
+  }
+  return !memcmp(stored, key, kind);
+}
+
+static uint64_t hashmap_hash(hashmap *m, const void *key) {
+  return hashmap_hash_kind(key, hashmap_kind(m));
+}
+
+// Bitmask of the slots in the group at `ctrl` whose byte equals `tag`
+static inline uint32_t hashmap_match(const int8_t *ctrl, int8_t tag) {
+#ifdef __SSE2__
+  __m128i group = _mm_load_si128((const __m128i *)ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < HASHMAP_GROUP; i++) {
+    mask |= (uint32_t)(ctrl[i] == tag) << i;
+  }
+  return mask;
+#endif
+}
+
+// Bitmask of the EMPTY or DELETED slots, both have the sign bit set
+static uint32_t hashmap_match_free(const int8_t *ctrl) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < HASHMAP_GROUP; i++) {
+    mask |= (uint32_t)(ctrl[i] < 0) << i;
+  }
+  return mask;
+#endif
+}
+
+// Slot holding `key`, or -1. Groups are visited in triangular order, which
+// covers every group of a power of two table.
+__attribute__((always_inline)) static inline ptrdiff_t
+hashmap_find_kind(hashmap *m, const void *key, uint64_t hash, ptrdiff_t kind) {
+  size_t groups = (size_t)m->cap / HASHMAP_GROUP;
+  size_t g = (hash >> 7) & (groups - 1);
+  int8_t tag = hash & 0x7f;
+
+  for (size_t step = 1; step <= groups; step++) {
+    const int8_t *ctrl = m->ctrl + g * HASHMAP_GROUP;
+
+    for (uint32_t mask = hashmap_match(ctrl, tag); mask; mask &= mask - 1) {
+      ptrdiff_t i = g * HASHMAP_GROUP + __builtin_ctz(mask);
+      if (hashmap_equal_kind(m->entries + i * m->stride, key, kind)) {
+        return i;
+      }
+    }
+    // An EMPTY slot ends the probe sequence
+    if (hashmap_match(ctrl, HASHMAP_EMPTY)) {
+      return -1;
+    }
+    g = (g + step) & (groups - 1);
+  }
+  return -1;
+}
+
+static ptrdiff_t hashmap_find(hashmap *m, const void *key, uint64_t hash) {
+  return hashmap_find_kind(m, key, hash, hashmap_kind(m));
+}
+
+static ptrdiff_t hashmap_find_free(hashmap *m, uint64_t hash) {
+  ptrdiff_t groups = m->cap / HASHMAP_GROUP;
+  ptrdiff_t g = (hash >> 7) & (groups - 1);
+
+  for (ptrdiff_t step = 1;; step++) {
+    uint32_t mask = hashmap_match_free(m->ctrl + g * HASHMAP_GROUP);
+    if (mask) {
+      return g * HASHMAP_GROUP + __builtin_ctz(mask);
+    }
+    g = (g + step) & (groups - 1);
+  }
+}
+
+// Rebuilds the table at `cap` slots, dropping tombstones. String keys keep
+// pointing at their arena copies.
+static void hashmap_rehash(hashmap *m, ptrdiff_t cap) {
+  hashmap old = *m;
+  hashmap_alloc(m, cap);
+  m->tombstones = 0;
+
+  for (ptrdiff_t i = 0; i < old.cap; i++) {
+    if (old.ctrl[i] < 0) {
+      continue;
+    }
+    const void *entry = old.entries + i * m->stride;
+    uint64_t hash = hashmap_hash(m, entry);
+    ptrdiff_t j = hashmap_find_free(m, hash);
+
+    m->ctrl[j] = hash & 0x7f;
+    memcpy(m->entries + j * m->stride, entry, m->stride);
+  }
+}
+
+static void *hashmap_slot_value(hashmap *m, ptrdiff_t i) {
+  return m->entries + i * m->stride + (m->value_size ? m->value_offset : 0);
+}
+
+// Lookups for the common key kinds. Kept out of line, inlined into
+// hashmap_get they share its registers and every call pays for saving them.
+#define HASHMAP_GET_KIND(name, kind)                                           \
+  __attribute__((noinline)) static void *name(hashmap *m, const void *key) {   \
+    ptrdiff_t i = hashmap_find_kind(m, key, hashmap_hash_kind(key, kind),      \
+                                    kind);                                     \
+    return i < 0 ? NULL : hashmap_slot_value(m, i);                            \
+  }
+HASHMAP_GET_KIND(hashmap_get_string, HASHMAP_STRING_KEY)
+HASHMAP_GET_KIND(hashmap_get_4, 4)
+HASHMAP_GET_KIND(hashmap_get_8, 8)
+#undef HASHMAP_GET_KIND
+
+// Returns the value stored for `key` (for sets, the stored key) or NULL
+void *hashmap_get(hashmap *m, const void *key) {
+  switch (hashmap_kind(m)) {
+  case HASHMAP_STRING_KEY:
+    return hashmap_get_string(m, key);
+  case 4:
+    return hashmap_get_4(m, key);
+  case 8:
+    return hashmap_get_8(m, key);
+  }
+  ptrdiff_t i = hashmap_find(m, key, hashmap_hash(m, key));
+  return i < 0 ? NULL : hashmap_slot_value(m, i);
+}
+
+// Returns the value slot for `key`, inserting a zeroed one if it is new
+void *hashmap_put(hashmap *m, const void *key) {
+  uint64_t hash = hashmap_hash(m, key);
+  ptrdiff_t i = hashmap_find(m, key, hash);
+  if (i >= 0) {
+    return hashmap_slot_value(m, i);
+  }
+
+  if (m->len + m->tombstones + 1 > m->cap - m->cap / 8) {
+    // Mostly tombstones: clean up in place, otherwise double
+    hashmap_rehash(m, m->len + 1 > m->cap / 2 ? m->cap * 2 : m->cap);
+  }
+
+  i = hashmap_find_free(m, hash);
+  if (m->ctrl[i] == HASHMAP_DELETED) {
+    m->tombstones--;
+  }
+  m->ctrl[i] = hash & 0x7f;
+  m->len++;
+
+  void *stored = m->entries + i * m->stride;
+  if (m->flags & HASHMAP_STRING_KEYS) {
+    const string *s = key;
+    string copy = {make_nozero(m->a, uint8_t, s->len), s->len};
+    memcpy(copy.data, s->data, s->len);
+    memcpy(stored, &copy, sizeof(copy));
+  } else {
+    memcpy(stored, key, m->key_size);
+  }
+
+  if (m->value_size) {
+    memset((uint8_t *)stored + m->value_offset, 0, m->value_size);
+  }
+  return hashmap_slot_value(m, i);
+}
+
+bool hashmap_remove(hashmap *m, const void *key) {
+  ptrdiff_t i = hashmap_find(m, key, hashmap_hash(m, key));
+  if (i < 0) {
+    return false;
+  }
+
+  // A group that never filled up ends every probe through it, so its slots
+  // can go straight back to EMPTY
+  ptrdiff_t group = i & ~(ptrdiff_t)(HASHMAP_GROUP - 1);
+  if (hashmap_match(m->ctrl + group, HASHMAP_EMPTY)) {
+    m->ctrl[i] = HASHMAP_EMPTY;
+  } else {
+    m->ctrl[i] = HASHMAP_DELETED;
+    m->tombstones++;
+  }
+  m->len--;
+  return true;
+}
+
+void hashmap_clear(hashmap *m) {
+  memset(m->ctrl, HASHMAP_EMPTY, m->cap);
+  m->len = 0;
+  m->tombstones = 0;
+}
+
+ptrdiff_t hashmap_next(hashmap *m, ptrdiff_t i) {
+  for (; i < m->cap; i++) {
+    if (m->ctrl[i] >= 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void *hashmap_key(hashmap *m, ptrdiff_t i) {
+  return m->entries + i * m->stride;
+}
+
+void *hashmap_value(hashmap *m, ptrdiff_t i) {
+  return m->value_size ? m->entries + i * m->stride + m->value_offset : NULL;
+}
+
+#endif // HASHMAP_IMPLEMENTATION
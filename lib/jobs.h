@@ -0,0 +1,150 @@
+#ifndef JOBS_H_
+#define JOBS_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Fork-Join Jobs
+//
+// A fixed set of threads that sleep until job_pool_run hands them a job,
+// run it once each and go back to sleep. The thread calling job_pool_run
+// takes part as worker 0 and returns once every worker is done, so each
+// call is one parallel step of a frame. Workers are told their index and
+// pick their own share of the work by it.
+//
+// One pool serves every system that fans work out: the owner passes it to
+// them, and a job split into fewer shares than there are workers leaves
+// the extra indices idle.
+typedef void (*job_fn)(void *user, int32_t worker);
+
+typedef struct job_pool job_pool;
+
+typedef struct {
+  job_pool *pool;
+  pthread_t thread;
+  int32_t index;
+} job_worker;
+
+struct job_pool {
+  job_worker *workers;
+  int32_t thread_count; // Workers, the thread calling job_pool_run included
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // A new job was handed out
+  pthread_cond_t done; // Every worker finished it
+  job_fn fn;
+  void *user;
+  uint64_t generation;
+  int32_t running;
+  bool stopping;
+};
+
+bool job_pool_init(job_pool *pool, int32_t threads);
+void job_pool_run(job_pool *pool, job_fn fn, void *user);
+void job_pool_free(job_pool *pool);
+
+#endif // JOBS_H_
+
+// #define JOBS_IMPLEMENTATION
+#if defined(JOBS_IMPLEMENTATION) && !defined(JOBS_IMPLEMENTED)
+#define JOBS_IMPLEMENTED
+
+static void *job_thread(void *arg) {
+  job_worker *w = arg;
+  job_pool *p = w->pool;
+  uint64_t seen = 0;
+  for (;;) {
+    pthread_mutex_lock(&p->lock);
+    while (p->generation == seen && !p->stopping) {
+      pthread_cond_wait(&p->wake, &p->lock);
+    }
+    if (p->stopping) {
+      pthread_mutex_unlock(&p->lock);
+      return NULL;
+    }
+    seen = p->generation;
+    pthread_mutex_unlock(&p->lock);
+
+    p->fn(p->user, w->index);
+
+    pthread_mutex_lock(&p->lock);
+    if (--p->running == 0) {
+      pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+// Starts `threads - 1` threads, the thread calling job_pool_run makes up the
+// rest. If the system runs out of threads the pool has fewer workers, see
+// thread_count. False only when allocation fails. The pool must stay put
+// while the workers run.
+bool job_pool_init(job_pool *pool, int32_t threads) {
+  *pool = (job_pool){0};
+  if (threads < 1) {
+    threads = 1;
+  }
+  pool->workers = calloc(threads, sizeof(job_worker));
+  if (!pool->workers) {
+    return false;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  pool->thread_count = 1;
+  for (int32_t i = 0; i < threads; i++) {
+    job_worker *w = &pool->workers[i];
+    w->pool = pool;
+    w->index = i;
+    if (i > 0) {
+      if (pthread_create(&w->thread, NULL, job_thread, w)) {
+        break;
+      }
+      pool->thread_count++;
+    }
+  }
+  return true;
+}
+
+// Runs fn(user, i) once for every worker index i, 0 on this thread, and
+// returns when all of them are done
+void job_pool_run(job_pool *pool, job_fn fn, void *user) {
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->user = user;
+  pool->running = pool->thread_count - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  fn(user, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->running) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void job_pool_free(job_pool *pool) {
+  if (!pool->workers) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (int32_t i = 1; i < pool->thread_count; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->done);
+  free(pool->workers);
+  *pool = (job_pool){0};
+}
+
+#endif // JOBS_IMPLEMENTATION
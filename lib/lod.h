@@ -0,0 +1,152 @@
+#ifndef LOD_H_
+#define LOD_H_
+
+#include <GL/glew.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/cglm/struct/mat4.h"
+#include "../include/cglm/struct/vec3.h"
+#include "../include/cglm/types-struct.h"
+#include "arena.h"
+#include "camera.h"
+#define LOD_BUILD_IMPLEMENTATION
+#include "lod_build.h"
+
+// Level of Detail
+//
+// Meshes are simplified once, when they're loaded, by lod_build (see
+// lod_build.h). Their welded vertices and every level's indices are then
+// uploaded to one vertex and one index buffer.
+//
+// Objects get the coarsest level whose error projects to at most
+// LOD_MAX_PIXEL_ERROR pixels. They only move to a coarser level once its
+// error is LOD_HYSTERESIS below that, so objects at the boundary don't pop
+// back and forth.
+#define LOD_MAX_PIXEL_ERROR 1.0f
+#define LOD_HYSTERESIS 0.25f
+
+typedef struct {
+  GLuint VBO; // The welded vertices, attributes as given
+  GLuint EBO; // Every level's indices, one after the other
+  int32_t vertex_count;
+  lod_level levels[LOD_MAX_LEVELS];
+  int32_t level_count;
+} LodMesh;
+
+bool lod_mesh_init(LodMesh *mesh, const float *vertices, int32_t count,
+                   int32_t stride_floats, int32_t normal_offset);
+void lod_mesh_free(LodMesh *mesh);
+float lod_screen_scale(const Camera *camera, float viewport_height);
+int32_t lod_select(const LodMesh *mesh, int32_t current, mat4s model,
+                   vec3s bounds[2], vec3s eye, float screen_scale);
+void lod_mesh_draw(const LodMesh *mesh, int32_t level);
+void lod_report(const LodMesh *mesh, const int32_t *levels, int32_t count,
+                FILE *stream);
+
+#endif // LOD_H_
+
+// #define LOD_IMPLEMENTATION
+#if defined(LOD_IMPLEMENTATION) && !defined(LOD_IMPLEMENTED)
+#define LOD_IMPLEMENTED
+
+// Simplifies the mesh with lod_build and uploads it. The arguments are
+// lod_build's.
+bool lod_mesh_init(LodMesh *mesh, const float *vertices, int32_t count,
+                   int32_t stride_floats, int32_t normal_offset) {
+  *mesh = (LodMesh){0};
+  arena_temp scratch = arena_scratch_begin(NULL, 0);
+  lod_levels built;
+  if (!lod_build(&built, vertices, count, stride_floats, normal_offset,
+                 scratch.a)) {
+    arena_temp_end(scratch);
+    return false;
+  }
+  memcpy(mesh->levels, built.levels, sizeof(mesh->levels));
+  mesh->level_count = built.level_count;
+  mesh->vertex_count = built.vertex_count;
+
+  glGenBuffers(1, &mesh->VBO);
+  glBindBuffer(GL_ARRAY_BUFFER, mesh->VBO);
+  glBufferData(GL_ARRAY_BUFFER,
+               (size_t)built.vertex_count * stride_floats * sizeof(float),
+               built.vertices, GL_STATIC_DRAW);
+  // Uploaded through the array target, binding it as the element buffer
+  // would attach it to whatever VAO is bound
+  glGenBuffers(1, &mesh->EBO);
+  glBindBuffer(GL_ARRAY_BUFFER, mesh->EBO);
+  glBufferData(GL_ARRAY_BUFFER, built.index_count * sizeof(uint32_t),
+               built.indices, GL_STATIC_DRAW);
+  arena_temp_end(scratch);
+  return true;
+}
+
+void lod_mesh_free(LodMesh *mesh) {
+  glDeleteBuffers(1, &mesh->VBO);
+  glDeleteBuffers(1, &mesh->EBO);
+  *mesh = (LodMesh){0};
+}
+
+// Pixels per unit of object space error one unit in front of the camera
+float lod_screen_scale(const Camera *camera, float viewport_height) {
+  return viewport_height / (2.0f * tanf(glm_rad(camera->Fov) * 0.5f));
+}
+
+// Level to draw an object with this frame, `current` being the one it was
+// drawn with last. `bounds` is its world space box, errors are measured
+// from its nearest point.
+int32_t lod_select(const LodMesh *mesh, int32_t current, mat4s model,
+                   vec3s bounds[2], vec3s eye, float screen_scale) {
+  vec3s nearest;
+  for (int i = 0; i < 3; i++) {
+    nearest.raw[i] =
+        glm_clamp(eye.raw[i], bounds[0].raw[i], bounds[1].raw[i]);
+  }
+  float distance = glms_vec3_distance(eye, nearest);
+  // Errors grow with the model's largest scale
+  float scale = glm_max(glm_max(glms_vec3_norm(glms_vec3(model.col[0])),
+                                glms_vec3_norm(glms_vec3(model.col[1]))),
+                        glms_vec3_norm(glms_vec3(model.col[2])));
+  float pixels_per_error = scale * screen_scale / glm_max(distance, 1e-6f);
+
+  for (int32_t i = mesh->level_count - 1; i > 0; i--) {
+    float limit = LOD_MAX_PIXEL_ERROR;
+    if (i > current) {
+      limit *= 1.0f - LOD_HYSTERESIS;
+    }
+    if (mesh->levels[i].error * pixels_per_error <= limit) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+// The mesh's buffers must be bound, through the caller's VAO
+void lod_mesh_draw(const LodMesh *mesh, int32_t level) {
+  const lod_level *l = &mesh->levels[level];
+  glDrawElements(GL_TRIANGLES, l->index_count, GL_UNSIGNED_INT,
+                 (void *)(l->first_index * sizeof(uint32_t)));
+}
+
+// How many of `count` objects use each level, and the triangles they cost
+// against all of them at level 0
+void lod_report(const LodMesh *mesh, const int32_t *levels, int32_t count,
+                FILE *stream) {
+  int32_t per_level[LOD_MAX_LEVELS] = {0};
+  int64_t triangles = 0;
+  for (int32_t i = 0; i < count; i++) {
+    per_level[levels[i]]++;
+    triangles += mesh->levels[levels[i]].index_count / 3;
+  }
+  fprintf(stream, "LOD: objects per level");
+  for (int32_t l = 0; l < mesh->level_count; l++) {
+    fprintf(stream, "%s%d", l ? "/" : " ", per_level[l]);
+  }
+  fprintf(stream, ", %lld of %lld triangles\n", (long long)triangles,
+          (long long)mesh->levels[0].index_count / 3 * count);
+}
+
+#endif // LOD_IMPLEMENTATION
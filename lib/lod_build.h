@@ -0,0 +1,504 @@
+#ifndef LOD_BUILD_H_
+#define LOD_BUILD_H_
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/cglm/struct/vec3.h"
+#include "../include/cglm/types-struct.h"
+#include "arena.h"
+
+// Mesh Simplification
+//
+// Builds a mesh's levels of detail on the CPU, with no GL involved.
+// lod_build simplifies it into up to LOD_MAX_LEVELS levels with quadric
+// error metrics (Garland & Heckbert):
+// - Every vertex carries the sum of its triangles' plane quadrics.
+// - The cheapest edge collapses go first.
+// - Each level aims for half the previous one's triangles.
+// - A collapse keeps one of the edge's end points. It is skipped when it
+//   would flip a triangle or pinch the surface.
+//
+// Vertices are welded by position before simplifying, so hard edges and UV
+// seams move together. A simplified corner takes the original vertex at
+// its position whose normal is closest to its triangle's. That keeps hard
+// edged faces flat and with their own UVs. Levels are only index lists,
+// and every level draws from the same welded vertices.
+//
+// A level's error is the largest quadric error of its collapses. It
+// estimates how far the surface moved, in object space.
+#define LOD_MAX_LEVELS 6
+// Simplifying stops once a level keeps more than this share of the
+// previous level's triangles, or its error passes this share of the mesh's
+// bounding radius
+#define LOD_MIN_REDUCTION 0.85f
+#define LOD_MAX_RELATIVE_ERROR 0.25f
+// Cosine of the most a collapse may turn a neighbouring triangle
+#define LOD_MAX_TURN 0.25f
+// Open edges weigh this much more than faces, so holes keep their outline
+#define LOD_BORDER_WEIGHT 10.0
+
+typedef struct {
+  int32_t first_index;
+  int32_t index_count;
+  float error; // Object space distance
+} lod_level;
+
+typedef struct {
+  float *vertices; // Welded, attributes as given
+  int32_t vertex_count;
+  uint32_t *indices; // Every level's indices, one after the other
+  int32_t index_count;
+  lod_level levels[LOD_MAX_LEVELS];
+  int32_t level_count;
+} lod_levels;
+
+bool lod_build(lod_levels *out, const float *vertices, int32_t count,
+               int32_t stride_floats, int32_t normal_offset, arena *a);
+
+#endif // LOD_BUILD_H_
+
+// #define LOD_BUILD_IMPLEMENTATION
+#if defined(LOD_BUILD_IMPLEMENTATION) && !defined(LOD_BUILD_IMPLEMENTED)
+#define LOD_BUILD_IMPLEMENTED
+
+// Symmetric 4x4 plane quadric, upper triangle, and the area it was
+// weighted by so errors come out as distances
+typedef struct {
+  double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+  double weight;
+} lod_quadric;
+
+typedef struct {
+  int32_t from; // Collapses onto `to`
+  int32_t to;
+  float error;
+} lod_collapse;
+
+// A vertex to weld, compared by its `floats` attributes, then by its index
+// so the order is the same on every run
+typedef struct {
+  const float *key;
+  int32_t floats;
+  int32_t index;
+} lod_vertex_ref;
+
+static int lod_compare_vertices(const void *pa, const void *pb) {
+  const lod_vertex_ref *a = pa, *b = pb;
+  for (int32_t i = 0; i < a->floats; i++) {
+    if (a->key[i] != b->key[i]) {
+      return a->key[i] < b->key[i] ? -1 : 1;
+    }
+  }
+  return (a->index > b->index) - (a->index < b->index);
+}
+
+static int lod_compare_edges(const void *pa, const void *pb) {
+  const lod_collapse *a = pa, *b = pb;
+  if (a->from != b->from) {
+    return a->from < b->from ? -1 : 1;
+  }
+  return (a->to > b->to) - (a->to < b->to);
+}
+
+static int lod_compare_collapses(const void *pa, const void *pb) {
+  float a = ((const lod_collapse *)pa)->error;
+  float b = ((const lod_collapse *)pb)->error;
+  return (a > b) - (a < b);
+}
+
+static void lod_quadric_add_plane(lod_quadric *q, vec3s n, float d,
+                                  double weight) {
+  q->a2 += weight * n.x * n.x;
+  q->ab += weight * n.x * n.y;
+  q->ac += weight * n.x * n.z;
+  q->ad += weight * n.x * d;
+  q->b2 += weight * n.y * n.y;
+  q->bc += weight * n.y * n.z;
+  q->bd += weight * n.y * d;
+  q->c2 += weight * n.z * n.z;
+  q->cd += weight * n.z * d;
+  q->d2 += weight * d * d;
+  q->weight += weight;
+}
+
+static void lod_quadric_merge(lod_quadric *q, const lod_quadric *other) {
+  double *dst = (double *)q;
+  const double *src = (const double *)other;
+  for (size_t i = 0; i < sizeof(lod_quadric) / sizeof(double); i++) {
+    dst[i] += src[i];
+  }
+}
+
+// Weighted mean of the squared distances to the planes, as a distance
+static float lod_quadric_error(const lod_quadric *a, const lod_quadric *b,
+                               vec3s p) {
+  lod_quadric q = *a;
+  lod_quadric_merge(&q, b);
+  double x = p.x, y = p.y, z = p.z;
+  double e = q.a2 * x * x + 2 * q.ab * x * y + 2 * q.ac * x * z +
+             2 * q.ad * x + q.b2 * y * y + 2 * q.bc * y * z + 2 * q.bd * y +
+             q.c2 * z * z + 2 * q.cd * z + q.d2;
+  return q.weight > 0.0 ? (float)sqrt(fmax(e, 0.0) / q.weight) : 0.0f;
+}
+
+typedef struct {
+  vec3s *positions;
+  int32_t position_count;
+  lod_quadric *quadrics;
+  vec3s *facing; // Area weighted normal of what each position stands for
+  int32_t *triangles; // Position id triples, -1 once collapsed away
+  int32_t triangle_count;
+  int32_t live;
+  // Per pass: the triangles around each position
+  int32_t *adjacency_offsets;
+  int32_t *adjacency;
+  bool *locked;
+} lod_simplifier;
+
+static vec3s lod_triangle_normal(const lod_simplifier *s, int32_t a,
+                                 int32_t b, int32_t c) {
+  vec3s pa = s->positions[a];
+  return glms_vec3_cross(glms_vec3_sub(s->positions[b], pa),
+                         glms_vec3_sub(s->positions[c], pa));
+}
+
+static void lod_build_adjacency(lod_simplifier *s) {
+  int32_t *offsets = s->adjacency_offsets;
+  memset(offsets, 0, (s->position_count + 1) * sizeof(int32_t));
+  for (int32_t t = 0; t < s->triangle_count; t++) {
+    const int32_t *tri = s->triangles + t * 3;
+    for (int c = 0; c < 3 && tri[0] >= 0; c++) {
+      offsets[tri[c]]++;
+    }
+  }
+  // Ends of each position's run, counted back down to its start below
+  int32_t total = 0;
+  for (int32_t p = 0; p < s->position_count; p++) {
+    total += offsets[p];
+    offsets[p] = total;
+  }
+  offsets[s->position_count] = total;
+  for (int32_t t = 0; t < s->triangle_count; t++) {
+    const int32_t *tri = s->triangles + t * 3;
+    for (int c = 0; c < 3 && tri[0] >= 0; c++) {
+      s->adjacency[--offsets[tri[c]]] = t;
+    }
+  }
+}
+
+static bool lod_triangle_has(const int32_t *t, int32_t p) {
+  return t[0] == p || t[1] == p || t[2] == p;
+}
+
+// Moving `from` onto `to` must not turn a triangle over, and the two may
+// only share the neighbours across the triangles on their edge, otherwise
+// the surface gets pinched. Turns add up over many collapses, so a moved
+// triangle must also still face the way its corners' surface does.
+static bool lod_collapse_allowed(lod_simplifier *s, int32_t from,
+                                 int32_t to) {
+  int32_t shared_triangles = 0;
+  for (int32_t i = s->adjacency_offsets[from];
+       i < s->adjacency_offsets[from + 1]; i++) {
+    int32_t *t = s->triangles + s->adjacency[i] * 3;
+    if (lod_triangle_has(t, to)) {
+      shared_triangles++;
+      continue;
+    }
+    vec3s before = lod_triangle_normal(s, t[0], t[1], t[2]);
+    int32_t moved[3] = {t[0], t[1], t[2]};
+    for (int c = 0; c < 3; c++) {
+      moved[c] = moved[c] == from ? to : moved[c];
+    }
+    // Turning a triangle this far is as bad as flipping it
+    vec3s after = lod_triangle_normal(s, moved[0], moved[1], moved[2]);
+    if (glms_vec3_dot(before, after) <=
+        LOD_MAX_TURN * glms_vec3_norm(before) * glms_vec3_norm(after)) {
+      return false;
+    }
+    for (int c = 0; c < 3; c++) {
+      vec3s facing = s->facing[moved[c]];
+      if (moved[c] == to) {
+        facing = glms_vec3_add(facing, s->facing[from]);
+      }
+      if (glms_vec3_dot(facing, after) <=
+          LOD_MAX_TURN * glms_vec3_norm(facing) * glms_vec3_norm(after)) {
+        return false;
+      }
+    }
+  }
+
+  int32_t shared_neighbours = 0;
+  for (int32_t i = s->adjacency_offsets[from];
+       i < s->adjacency_offsets[from + 1]; i++) {
+    int32_t *t = s->triangles + s->adjacency[i] * 3;
+    for (int c = 0; c < 3; c++) {
+      int32_t n = t[c];
+      if (n == from || n == to) {
+        continue;
+      }
+      // Count each neighbour once, at its first triangle around `from`
+      bool seen = false;
+      for (int32_t j = s->adjacency_offsets[from]; j < i && !seen; j++) {
+        seen = lod_triangle_has(s->triangles + s->adjacency[j] * 3, n);
+      }
+      bool around_to = false;
+      for (int32_t j = s->adjacency_offsets[to];
+           j < s->adjacency_offsets[to + 1] && !around_to; j++) {
+        around_to = lod_triangle_has(s->triangles + s->adjacency[j] * 3, n);
+      }
+      shared_neighbours += !seen && around_to;
+    }
+  }
+  return shared_neighbours <= shared_triangles;
+}
+
+static void lod_apply_collapse(lod_simplifier *s, int32_t from, int32_t to) {
+  for (int32_t i = s->adjacency_offsets[from];
+       i < s->adjacency_offsets[from + 1]; i++) {
+    int32_t *t = s->triangles + s->adjacency[i] * 3;
+    // Every corner's triangle list is stale now, wait for the next pass
+    for (int c = 0; c < 3; c++) {
+      s->locked[t[c]] = true;
+    }
+    if (lod_triangle_has(t, to)) {
+      t[0] = t[1] = t[2] = -1;
+      s->live--;
+      continue;
+    }
+    for (int c = 0; c < 3; c++) {
+      t[c] = t[c] == from ? to : t[c];
+    }
+  }
+  lod_quadric_merge(&s->quadrics[to], &s->quadrics[from]);
+  s->facing[to] = glms_vec3_add(s->facing[to], s->facing[from]);
+}
+
+// Collapses edges, cheapest first, until at most `target` triangles are
+// left or nothing more can go. Returns the largest error of the collapses.
+static float lod_simplify(lod_simplifier *s, int32_t target, arena *scratch) {
+  float worst = 0.0f;
+  while (s->live > target) {
+    arena_temp pass = arena_temp_begin(scratch);
+    lod_build_adjacency(s);
+    memset(s->locked, 0, s->position_count * sizeof(bool));
+
+    // Every edge once, sorted by its end points to drop the repeats
+    lod_collapse *edges = make_nozero(scratch, lod_collapse, s->live * 3);
+    int32_t edge_count = 0;
+    for (int32_t t = 0; t < s->triangle_count; t++) {
+      const int32_t *tri = s->triangles + t * 3;
+      for (int c = 0; c < 3 && tri[0] >= 0; c++) {
+        int32_t a = tri[c], b = tri[(c + 1) % 3];
+        edges[edge_count++] = a < b ? (lod_collapse){a, b, 0.0f}
+                                    : (lod_collapse){b, a, 0.0f};
+      }
+    }
+    qsort(edges, edge_count, sizeof(lod_collapse), lod_compare_edges);
+    int32_t unique = 0;
+    for (int32_t e = 0; e < edge_count; e++) {
+      if (unique && edges[unique - 1].from == edges[e].from &&
+          edges[unique - 1].to == edges[e].to) {
+        continue;
+      }
+      // Whichever end point is cheaper to keep
+      int32_t a = edges[e].from, b = edges[e].to;
+      vec3s pa = s->positions[a], pb = s->positions[b];
+      float to_b = lod_quadric_error(&s->quadrics[a], &s->quadrics[b], pb);
+      float to_a = lod_quadric_error(&s->quadrics[a], &s->quadrics[b], pa);
+      edges[unique++] = to_b <= to_a ? (lod_collapse){a, b, to_b}
+                                     : (lod_collapse){b, a, to_a};
+    }
+    edge_count = unique;
+    qsort(edges, edge_count, sizeof(lod_collapse), lod_compare_collapses);
+
+    int32_t collapsed = 0;
+    for (int32_t e = 0; e < edge_count && s->live > target; e++) {
+      lod_collapse *c = &edges[e];
+      if (s->locked[c->from] || s->locked[c->to] ||
+          !lod_collapse_allowed(s, c->from, c->to)) {
+        continue;
+      }
+      lod_apply_collapse(s, c->from, c->to);
+      worst = glm_max(worst, c->error);
+      collapsed++;
+    }
+    arena_temp_end(pass);
+    if (!collapsed) {
+      break;
+    }
+  }
+  return worst;
+}
+
+// `vertices` is a triangle list of `count` vertices, `stride_floats` floats
+// each, position first. `normal_offset` is where the normal starts, or -1
+// when there is none. Identical vertices are merged. The welded vertices
+// and the index lists are allocated from `a`.
+bool lod_build(lod_levels *out, const float *vertices, int32_t count,
+               int32_t stride_floats, int32_t normal_offset, arena *a) {
+  *out = (lod_levels){0};
+  if (count < 3) {
+    return false;
+  }
+  arena_temp scratch = arena_scratch_begin(&a, 1);
+  arena *work = scratch.a;
+  int32_t stride = stride_floats;
+
+  // Sorting brings identical vertices, then same position ones, together
+  lod_vertex_ref *order = make_nozero(work, lod_vertex_ref, count);
+  for (int32_t i = 0; i < count; i++) {
+    order[i] = (lod_vertex_ref){vertices + i * stride, stride, i};
+  }
+  qsort(order, count, sizeof(lod_vertex_ref), lod_compare_vertices);
+
+  int32_t *vertex_of = make_nozero(work, int32_t, count); // Input to welded
+  int32_t *position_of = make_nozero(work, int32_t, count); // Welded to pos
+  float *welded = make_nozero(work, float, (size_t)count * stride);
+  vec3s *positions = make_nozero(work, vec3s, count);
+  int32_t vertex_count = 0, position_count = 0;
+  for (int32_t i = 0; i < count; i++) {
+    const float *v = order[i].key;
+    const float *last = welded + (vertex_count - 1) * stride;
+    if (!vertex_count || memcmp(v, last, stride * sizeof(float))) {
+      if (!vertex_count || memcmp(v, last, 3 * sizeof(float))) {
+        positions[position_count++] = (vec3s){{v[0], v[1], v[2]}};
+      }
+      memcpy(welded + vertex_count * stride, v, stride * sizeof(float));
+      position_of[vertex_count++] = position_count - 1;
+    }
+    vertex_of[order[i].index] = vertex_count - 1;
+  }
+
+  lod_simplifier s = {
+      .positions = positions,
+      .position_count = position_count,
+      .quadrics = make(work, lod_quadric, position_count),
+      .facing = make(work, vec3s, position_count),
+      .triangles = make_nozero(work, int32_t, count),
+      .adjacency_offsets = make(work, int32_t, position_count + 1),
+      .adjacency = make_nozero(work, int32_t, count),
+      .locked = make(work, bool, position_count),
+  };
+  // Level 0 is the input as it is
+  uint32_t *indices = make_nozero(work, uint32_t, count * LOD_MAX_LEVELS);
+  int32_t index_count = 0;
+  for (int32_t t = 0; t < count / 3; t++) {
+    int32_t *tri = s.triangles + s.triangle_count * 3;
+    for (int c = 0; c < 3; c++) {
+      indices[index_count + c] = vertex_of[t * 3 + c];
+      tri[c] = position_of[vertex_of[t * 3 + c]];
+    }
+    vec3s n = lod_triangle_normal(&s, tri[0], tri[1], tri[2]);
+    float area2 = glms_vec3_norm(n);
+    index_count += 3;
+    if (area2 <= 0.0f) {
+      continue; // Degenerate, drawn at level 0 only
+    }
+    n = glms_vec3_scale(n, 1.0f / area2);
+    float d = -glms_vec3_dot(n, positions[tri[0]]);
+    for (int c = 0; c < 3; c++) {
+      lod_quadric_add_plane(&s.quadrics[tri[c]], n, d, area2 * 0.5);
+      s.facing[tri[c]] = glms_vec3_add(s.facing[tri[c]],
+                                       glms_vec3_scale(n, area2));
+    }
+    s.triangle_count++;
+  }
+  s.live = s.triangle_count;
+  out->levels[0] = (lod_level){0, index_count, 0.0f};
+
+  // Open edges are used by one triangle, they get a plane through them
+  // standing on the triangle
+  lod_build_adjacency(&s);
+  for (int32_t t = 0; t < s.triangle_count; t++) {
+    int32_t *tri = s.triangles + t * 3;
+    vec3s n = glms_vec3_normalize(lod_triangle_normal(&s, tri[0], tri[1],
+                                                      tri[2]));
+    for (int c = 0; c < 3; c++) {
+      int32_t p = tri[c], q = tri[(c + 1) % 3];
+      int32_t users = 0;
+      for (int32_t i = s.adjacency_offsets[p]; i < s.adjacency_offsets[p + 1];
+           i++) {
+        users += lod_triangle_has(s.triangles + s.adjacency[i] * 3, q);
+      }
+      if (users != 1) {
+        continue;
+      }
+      vec3s edge = glms_vec3_sub(positions[q], positions[p]);
+      float length = glms_vec3_norm(edge);
+      vec3s side = glms_vec3_normalize(glms_vec3_cross(edge, n));
+      float d = -glms_vec3_dot(side, positions[p]);
+      double weight = LOD_BORDER_WEIGHT * length * length;
+      lod_quadric_add_plane(&s.quadrics[p], side, d, weight);
+      lod_quadric_add_plane(&s.quadrics[q], side, d, weight);
+    }
+  }
+
+  // Welded vertices by position, to pick each corner's attributes from
+  int32_t *first_vertex = make_nozero(work, int32_t, position_count + 1);
+  for (int32_t v = vertex_count - 1; v >= 0; v--) {
+    first_vertex[position_of[v]] = v;
+  }
+  first_vertex[position_count] = vertex_count;
+
+  vec3s box[2] = {positions[0], positions[0]};
+  for (int32_t p = 1; p < position_count; p++) {
+    box[0] = glms_vec3_minv(box[0], positions[p]);
+    box[1] = glms_vec3_maxv(box[1], positions[p]);
+  }
+  float max_error =
+      LOD_MAX_RELATIVE_ERROR * 0.5f * glms_vec3_distance(box[0], box[1]);
+
+  out->level_count = 1;
+  float error = 0.0f;
+  while (out->level_count < LOD_MAX_LEVELS) {
+    int32_t before = s.live;
+    error = glm_max(error, lod_simplify(&s, before / 2, work));
+    if (s.live > before * LOD_MIN_REDUCTION || !s.live ||
+        error > max_error) {
+      break;
+    }
+
+    lod_level *level = &out->levels[out->level_count++];
+    *level = (lod_level){.first_index = index_count, .error = error};
+    for (int32_t t = 0; t < s.triangle_count; t++) {
+      int32_t *tri = s.triangles + t * 3;
+      if (tri[0] < 0) {
+        continue;
+      }
+      vec3s n = lod_triangle_normal(&s, tri[0], tri[1], tri[2]);
+      for (int c = 0; c < 3; c++) {
+        int32_t best = first_vertex[tri[c]];
+        float best_dot = -INFINITY;
+        for (int32_t v = best;
+             normal_offset >= 0 && v < vertex_count &&
+             position_of[v] == tri[c];
+             v++) {
+          const float *normal = welded + v * stride + normal_offset;
+          float dot = n.x * normal[0] + n.y * normal[1] + n.z * normal[2];
+          if (dot > best_dot) {
+            best_dot = dot;
+            best = v;
+          }
+        }
+        indices[index_count++] = best;
+      }
+    }
+    level->index_count = index_count - level->first_index;
+  }
+
+  // Only what the caller keeps goes to `a`
+  out->vertex_count = vertex_count;
+  out->vertices = make_nozero(a, float, (size_t)vertex_count * stride);
+  memcpy(out->vertices, welded, (size_t)vertex_count * stride * sizeof(float));
+  out->index_count = index_count;
+  out->indices = make_nozero(a, uint32_t, index_count);
+  memcpy(out->indices, indices, index_count * sizeof(uint32_t));
+  arena_temp_end(scratch);
+  return true;
+}
+
+#endif // LOD_BUILD_IMPLEMENTATION
@@ -0,0 +1,424 @@
+#ifndef LZ_H_
+#define LZ_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+#include "str.h"
+
+// LZ Compression
+//
+// Byte oriented LZ77 in the LZ4 block format: greedy single probe hash
+// matching on the compress side, and a decoder that is mostly 16 byte
+// copies, which is what makes it decode at memory speeds. No entropy coding,
+// so the ratio is modest, but decoding is cheaper than reading the bytes it
+// saves.
+//
+// Frames split the data into independent LZ_BLOCK_SIZE blocks, so they can be
+// decoded incrementally (lz_stream) into a small reused buffer or fanned out
+// to threads. Incompressible blocks are stored raw.
+//
+//   lz_frame_header
+//   { uint32_t size | LZ_BLOCK_RAW; bytes[size] } per block
+#define LZ_MAGIC 0x315a4c43 // "CLZ1"
+#define LZ_BLOCK_SIZE (256 * 1024)
+#define LZ_BLOCK_RAW 0x80000000u
+
+typedef struct {
+  uint32_t magic;
+  uint32_t block_size;
+  uint64_t raw_size;
+} lz_frame_header;
+
+typedef struct {
+  const uint8_t *at;
+  const uint8_t *end;
+  uint64_t remaining; // Raw bytes still to decode
+  ptrdiff_t block_size;
+} lz_stream;
+
+ptrdiff_t lz_bound(ptrdiff_t len);
+ptrdiff_t lz_compress(const uint8_t *src, ptrdiff_t len, uint8_t *dst,
+                      ptrdiff_t cap);
+ptrdiff_t lz_decompress(const uint8_t *src, ptrdiff_t len, uint8_t *dst,
+                        ptrdiff_t cap);
+bool lz_is_frame(string data);
+string lz_compress_frame(string src, arena *a);
+bool lz_decompress_frame(string frame, arena *a, string *out);
+bool lz_stream_begin(lz_stream *s, string frame);
+ptrdiff_t lz_stream_next(lz_stream *s, uint8_t *dst, ptrdiff_t cap);
+
+#endif // LZ_H_
+
+// #define LZ_IMPLEMENTATION
+#if defined(LZ_IMPLEMENTATION) && !defined(LZ_IMPLEMENTED)
+#define LZ_IMPLEMENTED
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 // Blocks always end on at least this many literals
+#define LZ_MATCH_LIMIT 12  // No match starts closer than this to the end
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 65535
+// A match grows by at most 255 bytes per input byte, so no block decodes to
+// more than this many times its stored size
+#define LZ_MAX_EXPANSION 255
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t lz_read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Worst case size of lz_compress output, incompressible input grows a little
+ptrdiff_t lz_bound(ptrdiff_t len) { return len + len / 255 + 16; }
+
+static uint8_t *lz_put_length(uint8_t *op, ptrdiff_t len) {
+  for (; len >= 255; len -= 255) {
+    *op++ = 255;
+  }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+// Emits one sequence: literals, then a match (skipped when `match` is 0)
+static uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *literals,
+                                ptrdiff_t literal_len, ptrdiff_t offset,
+                                ptrdiff_t match) {
+  uint8_t *token = op++;
+  *token = (uint8_t)((literal_len >= 15 ? 15 : literal_len) << 4);
+  if (literal_len >= 15) {
+    op = lz_put_length(op, literal_len - 15);
+  }
+  memcpy(op, literals, literal_len);
+  op += literal_len;
+
+  if (match) {
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    match -= LZ_MIN_MATCH;
+    *token |= match >= 15 ? 15 : match;
+    if (match >= 15) {
+      op = lz_put_length(op, match - 15);
+    }
+  }
+  return op;
+}
+
+// Compresses one block. `cap` must be at least lz_bound(len). Returns the
+// compressed size, or -1 when it doesn't fit.
+ptrdiff_t lz_compress(const uint8_t *src, ptrdiff_t len, uint8_t *dst,
+                      ptrdiff_t cap) {
+  if (cap < lz_bound(len)) {
+    return -1;
+  }
+
+  uint32_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  uint8_t *op = dst;
+  ptrdiff_t anchor = 0;
+  ptrdiff_t ip = 0;
+  ptrdiff_t limit = len - LZ_MATCH_LIMIT;
+  ptrdiff_t match_end = len - LZ_LAST_LITERALS;
+
+  while (ip < limit) {
+    uint32_t seq = lz_read32(src + ip);
+    uint32_t h = lz_hash(seq);
+    ptrdiff_t ref = table[h];
+    table[h] = (uint32_t)ip;
+
+    if (ip - ref > LZ_MAX_OFFSET || ref >= ip ||
+        lz_read32(src + ref) != seq) {
+      // Step faster through data that isn't matching
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+
+    // Extend backwards into the pending literals
+    while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+      ip--;
+      ref--;
+    }
+
+    // Then forwards, a word at a time
+    ptrdiff_t n = LZ_MIN_MATCH;
+    while (ip + n + 8 <= match_end) {
+      uint64_t diff = lz_read64(src + ip + n) ^ lz_read64(src + ref + n);
+      if (diff) {
+        n += __builtin_ctzll(diff) >> 3;
+        goto matched;
+      }
+      n += 8;
+    }
+    while (ip + n < match_end && src[ip + n] == src[ref + n]) {
+      n++;
+    }
+  matched:
+
+    op = lz_put_sequence(op, src + anchor, ip - anchor, ip - ref, n);
+    ip += n;
+    anchor = ip;
+
+    // Seed the table inside the match, helps the next search
+    if (ip < limit) {
+      table[lz_hash(lz_read32(src + ip - 2))] = (uint32_t)(ip - 2);
+    }
+  }
+
+  op = lz_put_sequence(op, src + anchor, len - anchor, 0, 0);
+  return op - dst;
+}
+
+static inline ptrdiff_t lz_get_length(const uint8_t **ip, const uint8_t *end,
+                                      ptrdiff_t len) {
+  uint8_t b;
+  do {
+    if (*ip >= end) {
+      return -1;
+    }
+    b = *(*ip)++;
+    len += b;
+  } while (b == 255);
+  return len;
+}
+
+// Decompresses one block into `dst`. Returns the decompressed size, or -1
+// for corrupt input or too small a `cap`. Never reads or writes out of
+// bounds, the fast copies only run with room to spare.
+ptrdiff_t lz_decompress(const uint8_t *src, ptrdiff_t len, uint8_t *dst,
+                        ptrdiff_t cap) {
+  const uint8_t *ip = src;
+  const uint8_t *iend = src + len;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + cap;
+
+  for (;;) {
+    if (ip >= iend) {
+      return -1;
+    }
+    uint8_t token = *ip++;
+
+    ptrdiff_t literal_len = token >> 4;
+    if (literal_len == 15) {
+      literal_len = lz_get_length(&ip, iend, literal_len);
+      if (literal_len < 0) {
+        return -1;
+      }
+    }
+    if (literal_len > iend - ip || literal_len > oend - op) {
+      return -1;
+    }
+    if (literal_len <= 16 && iend - ip >= 16 && oend - op >= 16) {
+      memcpy(op, ip, 16);
+    } else {
+      memcpy(op, ip, literal_len);
+    }
+    op += literal_len;
+    ip += literal_len;
+
+    // The last sequence is literals only
+    if (ip == iend) {
+      break;
+    }
+
+    if (iend - ip < 2) {
+      return -1;
+    }
+    ptrdiff_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > op - dst) {
+      return -1;
+    }
+
+    ptrdiff_t match_len = token & 15;
+    if (match_len == 15) {
+      match_len = lz_get_length(&ip, iend, match_len);
+      if (match_len < 0) {
+        return -1;
+      }
+    }
+    match_len += LZ_MIN_MATCH;
+    if (match_len > oend - op) {
+      return -1;
+    }
+
+    const uint8_t *match = op - offset;
+    uint8_t *copy_end = op + match_len;
+    if (offset >= 16 && oend - copy_end >= 16) {
+      // Chunks never overlap what they read, overshoot lands in the margin
+      do {
+        memcpy(op, match, 16);
+        op += 16;
+        match += 16;
+      } while (op < copy_end);
+    } else if (offset >= 8 && oend - copy_end >= 8) {
+      do {
+        memcpy(op, match, 8);
+        op += 8;
+        match += 8;
+      } while (op < copy_end);
+    } else {
+      // Short offsets repeat a pattern, copy bytewise so it propagates
+      while (op < copy_end) {
+        *op++ = *match++;
+      }
+    }
+    op = copy_end;
+  }
+
+  return op - dst;
+}
+
+bool lz_is_frame(string data) {
+  lz_frame_header header;
+  if (data.len < (ptrdiff_t)sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, data.data, sizeof(header));
+  return header.magic == LZ_MAGIC;
+}
+
+// Compresses `src` into a frame allocated from `a`
+string lz_compress_frame(string src, arena *a) {
+  ptrdiff_t blocks = (src.len + LZ_BLOCK_SIZE - 1) / LZ_BLOCK_SIZE;
+  ptrdiff_t cap = sizeof(lz_frame_header) +
+                  blocks * (sizeof(uint32_t) + lz_bound(LZ_BLOCK_SIZE));
+  uint8_t *frame = make_nozero(a, uint8_t, cap);
+
+  lz_frame_header header = {LZ_MAGIC, LZ_BLOCK_SIZE, src.len};
+  memcpy(frame, &header, sizeof(header));
+  uint8_t *op = frame + sizeof(header);
+
+  for (ptrdiff_t at = 0; at < src.len; at += LZ_BLOCK_SIZE) {
+    ptrdiff_t len = src.len - at < LZ_BLOCK_SIZE ? src.len - at : LZ_BLOCK_SIZE;
+    uint8_t *size = op;
+    op += sizeof(uint32_t);
+
+    uint32_t word;
+    ptrdiff_t n = lz_compress(src.data + at, len, op, lz_bound(len));
+    if (n < 0 || n >= len) {
+      memcpy(op, src.data + at, len);
+      n = len;
+      word = (uint32_t)len | LZ_BLOCK_RAW;
+    } else {
+      word = (uint32_t)n;
+    }
+    memcpy(size, &word, sizeof(word));
+    op += n;
+  }
+
+  // Give the unused tail of the worst case back to the arena
+  if ((char *)frame + cap == a->current) {
+    a->current = (char *)op;
+  }
+  return (string){frame, op - frame};
+}
+
+bool lz_stream_begin(lz_stream *s, string frame) {
+  *s = (lz_stream){0};
+  lz_frame_header header;
+  if (!lz_is_frame(frame)) {
+    return false;
+  }
+  memcpy(&header, frame.data, sizeof(header));
+  if (!header.block_size || header.block_size > LZ_BLOCK_RAW) {
+    return false;
+  }
+
+  // Each block takes a size word and at least one byte, and can't expand
+  // past LZ_MAX_EXPANSION, so a header claiming more than the frame can hold
+  // is rejected before anyone allocates for it
+  uint64_t payload = frame.len - sizeof(header);
+  uint64_t blocks = header.raw_size / header.block_size +
+                    (header.raw_size % header.block_size != 0);
+  if (blocks > payload / (sizeof(uint32_t) + 1) ||
+      header.raw_size / LZ_MAX_EXPANSION > payload) {
+    return false;
+  }
+  s->at = frame.data + sizeof(header);
+  s->end = frame.data + frame.len;
+  s->remaining = header.raw_size;
+  s->block_size = header.block_size;
+  return true;
+}
+
+// Decodes the next block into `dst`, which needs room for a whole block
+// (s->block_size). Returns its size, 0 at the end of the frame or -1 on
+// corrupt input.
+ptrdiff_t lz_stream_next(lz_stream *s, uint8_t *dst, ptrdiff_t cap) {
+  if (!s->remaining) {
+    return 0;
+  }
+  uint32_t word;
+  if (s->end - s->at < (ptrdiff_t)sizeof(word)) {
+    return -1;
+  }
+  memcpy(&word, s->at, sizeof(word));
+  s->at += sizeof(word);
+
+  ptrdiff_t size = word & ~LZ_BLOCK_RAW;
+  ptrdiff_t expect =
+      s->remaining < (uint64_t)s->block_size ? (ptrdiff_t)s->remaining
+                                             : s->block_size;
+  if (size > s->end - s->at || expect > cap) {
+    return -1;
+  }
+
+  ptrdiff_t n;
+  if (word & LZ_BLOCK_RAW) {
+    n = size == expect ? size : -1;
+    if (n > 0) {
+      memcpy(dst, s->at, n);
+    }
+  } else {
+    n = lz_decompress(s->at, size, dst, expect);
+  }
+  if (n != expect) {
+    return -1;
+  }
+  s->at += size;
+  s->remaining -= n;
+  return n;
+}
+
+// Decompresses a whole frame into `a`, null terminated like read_file.
+// Returns false on a corrupt frame, or when `a` has no room for it.
+bool lz_decompress_frame(string frame, arena *a, string *out) {
+  *out = (string){0};
+  lz_stream s;
+  if (!lz_stream_begin(&s, frame) ||
+      s.remaining > (uint64_t)PTRDIFF_MAX - 1) {
+    return false;
+  }
+
+  ptrdiff_t len = s.remaining;
+  uint8_t *data = alloc_ex(a, 1, 1, len + 1, ARENA_NOZERO | ARENA_SOFTFAIL);
+  if (!data) {
+    return false;
+  }
+  for (ptrdiff_t at = 0; at < len;) {
+    ptrdiff_t n = lz_stream_next(&s, data + at, len - at);
+    if (n <= 0) {
+      return false;
+    }
+    at += n;
+  }
+  data[len] = '\0';
+  *out = (string){data, len};
+  return true;
+}
+
+#endif // LZ_IMPLEMENTATION
@@ -0,0 +1,204 @@
+#ifndef OCCLUSION_H_
+#define OCCLUSION_H_
+
+#include <GL/glew.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../include/cglm/struct/affine.h"
+#include "../include/cglm/struct/box.h"
+#include "../include/cglm/types-struct.h"
+#include "shader.h"
+
+// Occlusion Culling
+//
+// Hardware occlusion queries with temporal coherence, in the spirit of
+// coherent hierarchical culling. After the scene is drawn, objects get their
+// world space bounding box rasterized against its depth inside a
+// GL_ANY_SAMPLES_PASSED query. Results are picked up on a later frame once
+// the GPU has them, never waited for, and decide whether the object is drawn
+// from then on.
+//
+// Objects last seen occluded are tested every frame so they come back as
+// soon as they show. Visible ones usually stay visible, so they're only
+// retested every OCCLUSION_VISIBLE_INTERVAL frames, staggered across
+// objects. An object never tested, or with a test still in flight, keeps
+// its last state, visible to begin with.
+#define OCCLUSION_VISIBLE_INTERVAL 4
+
+// Boxes closer to the eye than this are visible without a query, the near
+// plane would clip their front faces and the test could miss them
+#define OCCLUSION_EYE_MARGIN 0.5f
+
+typedef struct {
+  GLuint query;
+  bool visible;
+  bool pending; // A query was issued and its result isn't read yet
+} occlusion_object;
+
+typedef struct {
+  occlusion_object *objects;
+  int32_t capacity;
+  int64_t frame;
+  // Unit box drawn for the tests
+  GLuint VAO;
+  GLuint VBO;
+  GLuint EBO;
+  // This frame
+  int32_t queries_issued;
+  int32_t objects_skipped;
+} OcclusionCuller;
+
+bool occlusion_init(OcclusionCuller *culler, int32_t capacity);
+void occlusion_free(OcclusionCuller *culler);
+void occlusion_begin_frame(OcclusionCuller *culler);
+bool occlusion_visible(OcclusionCuller *culler, int32_t object);
+void occlusion_test_begin(OcclusionCuller *culler, Shader *shader);
+void occlusion_test(OcclusionCuller *culler, Shader *shader, int32_t object,
+                    vec3s box[2], vec3s eye);
+void occlusion_test_end(OcclusionCuller *culler);
+void occlusion_report(OcclusionCuller *culler, FILE *stream);
+
+#endif // OCCLUSION_H_
+
+// #define OCCLUSION_IMPLEMENTATION
+#if defined(OCCLUSION_IMPLEMENTATION) && !defined(OCCLUSION_IMPLEMENTED)
+#define OCCLUSION_IMPLEMENTED
+
+// Objects are the caller's indices, 0 to capacity - 1
+bool occlusion_init(OcclusionCuller *culler, int32_t capacity) {
+  *culler = (OcclusionCuller){.capacity = capacity};
+  culler->objects = calloc(capacity, sizeof(occlusion_object));
+  if (!culler->objects) {
+    return false;
+  }
+  for (int32_t i = 0; i < capacity; i++) {
+    glGenQueries(1, &culler->objects[i].query);
+    culler->objects[i].visible = true;
+  }
+
+  // [0, 1] cube, scaled onto each box
+  const float corners[] = {
+      0, 0, 0, 1, 0, 0, 0, 1, 0, 1, 1, 0, //
+      0, 0, 1, 1, 0, 1, 0, 1, 1, 1, 1, 1, //
+  };
+  const uint8_t indices[] = {
+      0, 2, 1, 1, 2, 3, 4, 5, 6, 5, 7, 6, // -z, +z
+      0, 1, 4, 1, 5, 4, 2, 6, 3, 3, 6, 7, // -y, +y
+      0, 4, 2, 2, 4, 6, 1, 3, 5, 3, 7, 5, // -x, +x
+  };
+  glGenVertexArrays(1, &culler->VAO);
+  glBindVertexArray(culler->VAO);
+  glGenBuffers(1, &culler->VBO);
+  glBindBuffer(GL_ARRAY_BUFFER, culler->VBO);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+  glGenBuffers(1, &culler->EBO);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, culler->EBO);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices,
+               GL_STATIC_DRAW);
+  glVertexAttribPointer(0, 3, GL_FLOAT, false, 3 * sizeof(float), NULL);
+  glEnableVertexAttribArray(0);
+  glBindVertexArray(0);
+  return true;
+}
+
+void occlusion_free(OcclusionCuller *culler) {
+  if (culler->objects) {
+    for (int32_t i = 0; i < culler->capacity; i++) {
+      glDeleteQueries(1, &culler->objects[i].query);
+    }
+    free(culler->objects);
+  }
+  glDeleteVertexArrays(1, &culler->VAO);
+  glDeleteBuffers(1, &culler->VBO);
+  glDeleteBuffers(1, &culler->EBO);
+  *culler = (OcclusionCuller){0};
+}
+
+// Picks up the results that have arrived since the last frame, without
+// waiting for the rest
+void occlusion_begin_frame(OcclusionCuller *culler) {
+  culler->frame++;
+  culler->queries_issued = 0;
+  culler->objects_skipped = 0;
+  for (int32_t i = 0; i < culler->capacity; i++) {
+    occlusion_object *o = &culler->objects[i];
+    if (!o->pending) {
+      continue;
+    }
+    GLuint available = 0;
+    glGetQueryObjectuiv(o->query, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available) {
+      GLuint passed = 0;
+      glGetQueryObjectuiv(o->query, GL_QUERY_RESULT, &passed);
+      o->visible = passed;
+      o->pending = false;
+    }
+  }
+}
+
+// Whether to draw the object this frame. Call once per object per frame,
+// skipped objects are counted.
+bool occlusion_visible(OcclusionCuller *culler, int32_t object) {
+  bool visible = culler->objects[object].visible;
+  culler->objects_skipped += !visible;
+  return visible;
+}
+
+// Tests draw into the bound framebuffer against the scene's depth, writing
+// nothing. `shader` is a position only shader with model, view and
+// projection uniforms, the caller sets view and projection.
+void occlusion_test_begin(OcclusionCuller *culler, Shader *shader) {
+  shader_use(shader);
+  glBindVertexArray(culler->VAO);
+  glColorMask(false, false, false, false);
+  glDepthMask(false);
+  // Boxes of axis aligned objects lie exactly on their faces
+  glDepthFunc(GL_LEQUAL);
+}
+
+// Queues a test of the object's world space box if one is due
+void occlusion_test(OcclusionCuller *culler, Shader *shader, int32_t object,
+                    vec3s box[2], vec3s eye) {
+  occlusion_object *o = &culler->objects[object];
+  if (o->pending) {
+    return;
+  }
+  if (o->visible && (culler->frame + object) % OCCLUSION_VISIBLE_INTERVAL) {
+    return;
+  }
+
+  vec3s margin = glms_vec3_broadcast(OCCLUSION_EYE_MARGIN);
+  vec3s near_box[2] = {glms_vec3_sub(box[0], margin),
+                       glms_vec3_add(box[1], margin)};
+  if (glms_aabb_point(near_box, eye)) {
+    o->visible = true;
+    return;
+  }
+
+  mat4s model = glms_translate(glms_mat4_identity(), box[0]);
+  model = glms_scale(model, glms_vec3_sub(box[1], box[0]));
+  shader_set_mat4(shader, "model", model);
+  glBeginQuery(GL_ANY_SAMPLES_PASSED, o->query);
+  glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_BYTE, NULL);
+  glEndQuery(GL_ANY_SAMPLES_PASSED);
+  o->pending = true;
+  culler->queries_issued++;
+}
+
+void occlusion_test_end(OcclusionCuller *culler) {
+  (void)culler;
+  glDepthFunc(GL_LESS);
+  glDepthMask(true);
+  glColorMask(true, true, true, true);
+}
+
+void occlusion_report(OcclusionCuller *culler, FILE *stream) {
+  fprintf(stream, "Occlusion: %d queries issued, %d of %d objects skipped\n",
+          culler->queries_issued, culler->objects_skipped,
+          culler->capacity);
+}
+
+#endif // OCCLUSION_IMPLEMENTATION
@@ -0,0 +1,381 @@
+#ifndef PACK_H_
+#define PACK_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "file.h"
+#include "str.h"
+
+// Asset Packs
+//
+// One file holding every asset, so a deployment opens and maps a single file
+// instead of hundreds, and assets that are used together sit next to each
+// other on disk. Layout (little endian, all offsets from the file start):
+//
+//   pack_header
+//   blobs        each PACK_ALIGN aligned, in path order
+//   pack_entry[] sorted by path hash
+//   names        the paths the entries point into, for collision checks
+//
+// The reader maps the pack and finds an asset with a binary search over the
+// index, no parsing or allocation at open. Uncompressed blobs are returned
+// as views straight into the mapping, lz compressed ones are lz frames and
+// get decompressed into the caller's arena.
+//
+// pack_mount makes read_asset (and so every shader and texture load) read
+// from the pack, anything not in it still comes from loose files.
+#define PACK_MAGIC 0x4b415043 // "CPAK"
+#define PACK_VERSION 1
+#define PACK_ALIGN 64
+
+enum {
+  PACK_COMPRESSION_NONE = 0,
+  PACK_COMPRESSION_LZ = 1,
+};
+
+enum {
+  PACK_VERIFY = 1 << 0,   // Check blob checksums on read (pack_read) / write them
+  PACK_COMPRESS = 1 << 1, // pack_write: lz compress blobs where it pays off
+};
+
+// Compressed blobs are kept only when they save at least 1/this of the size
+#define PACK_COMPRESS_MIN_SAVING 16
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;
+  uint32_t flags;
+  uint64_t index_offset;
+  uint64_t names_offset;
+  uint64_t names_size;
+} pack_header;
+
+typedef struct {
+  uint64_t hash;
+  uint64_t offset;
+  uint64_t size;     // Stored bytes
+  uint64_t raw_size; // Bytes after decompression
+  uint32_t name_offset;
+  uint32_t name_len;
+  uint32_t checksum; // CRC-32 of the stored bytes, 0 when not written
+  uint32_t compression;
+} pack_entry;
+
+typedef struct {
+  file_map file;
+  const pack_header *header;
+  const pack_entry *entries;
+  const char *names;
+} pack;
+
+file_error pack_open(pack *p, const char *path, arena *fallback);
+void pack_close(pack *p);
+const pack_entry *pack_find(pack *p, string path);
+bool pack_read(pack *p, const pack_entry *entry, int flags, arena *a,
+               string *out);
+bool pack_read_path(pack *p, const char *path, int flags, arena *a,
+                    string *out);
+void pack_mount(pack *p);
+bool pack_write(const char *out_path, const char **paths, int32_t count,
+                int flags, arena *scratch);
+uint64_t pack_hash_path(string path);
+uint32_t pack_crc32(const uint8_t *data, ptrdiff_t len);
+
+#endif // PACK_H_
+
+// #define PACK_IMPLEMENTATION
+#if defined(PACK_IMPLEMENTATION) && !defined(PACK_IMPLEMENTED)
+#define PACK_IMPLEMENTED
+
+// Paths are stored without a leading "./" so both spellings resolve
+static string pack_normalize(string path) {
+  while (path.len >= 2 && path.data[0] == '.' && path.data[1] == '/') {
+    path.data += 2;
+    path.len -= 2;
+  }
+  return path;
+}
+
+// FNV-1a, 64 bit so collisions in one pack are practically nonexistent
+uint64_t pack_hash_path(string path) {
+  path = pack_normalize(path);
+  uint64_t hash = 0xcbf29ce484222325;
+  for (ptrdiff_t i = 0; i < path.len; i++) {
+    hash ^= path.data[i];
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+static uint32_t pack_crc32_table[256];
+static pthread_once_t pack_crc32_once = PTHREAD_ONCE_INIT;
+
+static void pack_crc32_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    }
+    pack_crc32_table[i] = c;
+  }
+}
+
+// CRC-32 (IEEE), one table lookup per byte. Safe to call from any thread,
+// the first call builds the table.
+uint32_t pack_crc32(const uint8_t *data, ptrdiff_t len) {
+  pthread_once(&pack_crc32_once, pack_crc32_init);
+  uint32_t crc = 0xffffffff;
+  for (ptrdiff_t i = 0; i < len; i++) {
+    crc = pack_crc32_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc ^ 0xffffffff;
+}
+
+// Maps the pack and checks that the header and index fit in the file
+file_error pack_open(pack *p, const char *path, arena *fallback) {
+  *p = (pack){0};
+  file_error error = map_file(path, FILE_MAP_RANDOM, &p->file, fallback);
+  if (error != FILE_OK) {
+    return error;
+  }
+
+  uint64_t size = p->file.data.len;
+  const pack_header *h = (const pack_header *)p->file.data.data;
+  if (size < sizeof(*h) || h->magic != PACK_MAGIC ||
+      h->version != PACK_VERSION || h->index_offset > size ||
+      h->count > (size - h->index_offset) / sizeof(pack_entry) ||
+      h->names_offset > size || h->names_size > size - h->names_offset) {
+    fprintf(stderr, "ERROR: %s is not a valid pack\n", path);
+    unmap_file(&p->file);
+    return FILE_READ_FAILED;
+  }
+
+  p->header = h;
+  p->entries = (const pack_entry *)(p->file.data.data + h->index_offset);
+  p->names = (const char *)p->file.data.data + h->names_offset;
+  return FILE_OK;
+}
+
+void pack_close(pack *p) {
+  unmap_file(&p->file);
+  *p = (pack){0};
+}
+
+// Binary search for the hash, then compare names across any run of equal
+// hashes. Returns NULL when the path isn't in the pack.
+const pack_entry *pack_find(pack *p, string path) {
+  if (!p->header) {
+    return NULL;
+  }
+  path = pack_normalize(path);
+  uint64_t hash = pack_hash_path(path);
+
+  ptrdiff_t lo = 0, hi = p->header->count;
+  while (lo < hi) {
+    ptrdiff_t mid = lo + (hi - lo) / 2;
+    if (p->entries[mid].hash < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  for (; lo < p->header->count && p->entries[lo].hash == hash; lo++) {
+    const pack_entry *e = &p->entries[lo];
+    if (e->name_len == path.len &&
+        (uint64_t)e->name_offset + e->name_len <= p->header->names_size &&
+        !memcmp(p->names + e->name_offset, path.data, path.len)) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+// Returns the asset's bytes. Uncompressed blobs are a view into the mapping
+// (valid until pack_close) and `a` is untouched; compressed ones are
+// decompressed into `a`, null terminated. With PACK_VERIFY the blob's
+// checksum is checked first.
+bool pack_read(pack *p, const pack_entry *entry, int flags, arena *a,
+               string *out) {
+  *out = (string){0};
+  uint64_t size = p->file.data.len;
+  if (entry->offset > size || entry->size > size - entry->offset) {
+    return false;
+  }
+  uint8_t *blob = p->file.data.data + entry->offset;
+
+  if ((flags & PACK_VERIFY) && (p->header->flags & PACK_VERIFY) &&
+      pack_crc32(blob, entry->size) != entry->checksum) {
+    fprintf(stderr, "ERROR: Pack blob %.*s is corrupt\n", entry->name_len,
+            p->names + entry->name_offset);
+    return false;
+  }
+
+  switch (entry->compression) {
+  case PACK_COMPRESSION_NONE:
+    *out = (string){blob, entry->size};
+    return true;
+  case PACK_COMPRESSION_LZ:
+    return lz_decompress_frame((string){blob, entry->size}, a, out) &&
+           (uint64_t)out->len == entry->raw_size;
+  }
+  return false;
+}
+
+bool pack_read_path(pack *p, const char *path, int flags, arena *a,
+                    string *out) {
+  const pack_entry *entry =
+      pack_find(p, (string){(uint8_t *)path, (ptrdiff_t)strlen(path)});
+  if (!entry) {
+    *out = (string){0};
+    return false;
+  }
+  return pack_read(p, entry, flags, a, out);
+}
+
+// file_source for pack_mount. Views into the mapping are copied, read_asset
+// hands out null terminated arena memory.
+static bool pack_source_read(void *source, const char *filename, arena *a,
+                             string *out) {
+  const pack_entry *entry = pack_find(
+      source, (string){(uint8_t *)filename, (ptrdiff_t)strlen(filename)});
+  if (!entry || !pack_read(source, entry, PACK_VERIFY, a, out)) {
+    return false;
+  }
+  if (entry->compression == PACK_COMPRESSION_NONE) {
+    uint8_t *copy = make_nozero(a, uint8_t, out->len + 1);
+    memcpy(copy, out->data, out->len);
+    copy[out->len] = '\0';
+    out->data = copy;
+  }
+  return true;
+}
+
+// Serves read_asset from `p` until pack_mount(NULL). Keep `p` open until then.
+void pack_mount(pack *p) {
+  file_mount(p ? pack_source_read : NULL, p);
+}
+
+static int pack_entry_by_hash(const void *a, const void *b) {
+  const pack_entry *ea = a;
+  const pack_entry *eb = b;
+  return ea->hash < eb->hash ? -1 : ea->hash > eb->hash;
+}
+
+static bool pack_pad(FILE *f, uint64_t *offset) {
+  static const uint8_t zero[PACK_ALIGN];
+  uint64_t pad = -*offset & (PACK_ALIGN - 1);
+  *offset += pad;
+  return fwrite(zero, 1, pad, f) == pad;
+}
+
+// Writes `paths` into a new pack at `out_path`. Blobs are written in the
+// given order, so pass paths sorted (or in load order) to keep related
+// assets together. With PACK_VERIFY every blob gets a checksum, with
+// PACK_COMPRESS blobs that shrink enough are stored as lz frames.
+bool pack_write(const char *out_path, const char **paths, int32_t count,
+                int flags, arena *scratch) {
+  FILE *f = fopen(out_path, "wb");
+  if (!f) {
+    fprintf(stderr, "ERROR: Could not create pack %s\n", out_path);
+    return false;
+  }
+
+  pack_header header = {
+      .magic = PACK_MAGIC,
+      .version = PACK_VERSION,
+      .count = count,
+      .flags = flags & PACK_VERIFY,
+  };
+  pack_entry *entries = make(scratch, pack_entry, count);
+  uint64_t names_size = 0;
+
+  // Header is rewritten once the offsets are known
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+  uint64_t offset = sizeof(header);
+
+  for (int32_t i = 0; i < count && ok; i++) {
+    arena_temp temp = arena_temp_begin(scratch);
+    string data;
+    file_error error = read_file_into(paths[i], scratch, &data);
+    if (error != FILE_OK) {
+      fprintf(stderr, "ERROR: Could not read file %s: %s\n", paths[i],
+              file_error_string(error));
+      ok = false;
+      arena_temp_end(temp);
+      break;
+    }
+
+    ptrdiff_t raw_size = data.len;
+    uint32_t compression = PACK_COMPRESSION_NONE;
+    if (flags & PACK_COMPRESS) {
+      string packed = lz_compress_frame(data, scratch);
+      if (packed.len < data.len - data.len / PACK_COMPRESS_MIN_SAVING) {
+        data = packed;
+        compression = PACK_COMPRESSION_LZ;
+      }
+    }
+
+    string name =
+        pack_normalize((string){(uint8_t *)paths[i], strlen(paths[i])});
+    ok = pack_pad(f, &offset);
+    entries[i] = (pack_entry){
+        .hash = pack_hash_path(name),
+        .offset = offset,
+        .size = data.len,
+        .raw_size = raw_size,
+        .name_offset = names_size,
+        .name_len = name.len,
+        .checksum = flags & PACK_VERIFY ? pack_crc32(data.data, data.len) : 0,
+        .compression = compression,
+    };
+    ok = ok && fwrite(data.data, 1, data.len, f) == (size_t)data.len;
+    offset += data.len;
+    names_size += name.len;
+    arena_temp_end(temp);
+  }
+
+  if (ok) {
+    qsort(entries, count, sizeof(*entries), pack_entry_by_hash);
+    for (int32_t i = 1; i < count; i++) {
+      if (entries[i].hash == entries[i - 1].hash &&
+          entries[i].name_len == entries[i - 1].name_len) {
+        // Same hash and length is almost surely the same path twice
+        fprintf(stderr, "WARNING: Duplicate path in pack %s\n", out_path);
+      }
+    }
+
+    ok = pack_pad(f, &offset);
+    header.index_offset = offset;
+    ok = ok && fwrite(entries, sizeof(*entries), count, f) == (size_t)count;
+    offset += sizeof(*entries) * count;
+
+    // Names go in file order, matching the offsets handed out above
+    header.names_offset = offset;
+    header.names_size = names_size;
+    for (int32_t i = 0; i < count && ok; i++) {
+      string name =
+          pack_normalize((string){(uint8_t *)paths[i], strlen(paths[i])});
+      ok = fwrite(name.data, 1, name.len, f) == (size_t)name.len;
+    }
+
+    ok = ok && !fseek(f, 0, SEEK_SET) &&
+         fwrite(&header, sizeof(header), 1, f) == 1;
+  }
+
+  ok = !fclose(f) && ok;
+  if (!ok) {
+    fprintf(stderr, "ERROR: Could not write pack %s\n", out_path);
+    remove(out_path);
+  }
+  return ok;
+}
+
+#endif // PACK_IMPLEMENTATION
@@ -0,0 +1,83 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+
+// Pool Allocator
+//
+// Fixed size objects with O(1) alloc and release. Free objects are threaded
+// into an intrusive free list, fresh ones are carved out of the backing arena
+// `chunk` objects at a time. Memory goes back to the pool, never to the
+// arena, so churn doesn't grow the arena past the peak object count.
+#define pool_make(p, t) (t *)pool_alloc(p)
+
+typedef struct pool_node pool_node;
+struct pool_node {
+  pool_node *next;
+};
+
+typedef struct {
+  arena *a;
+  pool_node *free;
+  ptrdiff_t size;
+  ptrdiff_t align;
+  ptrdiff_t chunk;
+  ptrdiff_t live;
+} pool;
+
+pool new_pool(arena *a, ptrdiff_t size, ptrdiff_t align, ptrdiff_t chunk);
+void *pool_alloc(pool *p);
+void pool_release(pool *p, void *ptr);
+
+#endif // POOL_H_
+
+// #define POOL_IMPLEMENTATION
+#ifdef POOL_IMPLEMENTATION
+
+// Objects of `size` bytes, carved `chunk` at a time (64 when not positive)
+pool new_pool(arena *a, ptrdiff_t size, ptrdiff_t align, ptrdiff_t chunk) {
+  chunk = chunk > 0 ? chunk : 64;
+  if (align < (ptrdiff_t)_Alignof(pool_node)) {
+    align = _Alignof(pool_node);
+  }
+  if (size < (ptrdiff_t)sizeof(pool_node)) {
+    size = sizeof(pool_node);
+  }
+  // Round up so every slot in a chunk stays aligned
+  size = (size + align - 1) & ~(align - 1);
+
+  return (pool){.a = a, .size = size, .align = align, .chunk = chunk};
+}
+
+// Returns a zeroed object
+void *pool_alloc(pool *p) {
+  if (!p->free) {
+    char *block = alloc_nozero(p->a, p->size, p->align, p->chunk);
+    for (ptrdiff_t i = p->chunk - 1; i >= 0; i--) {
+      pool_node *node = (pool_node *)(block + i * p->size);
+      node->next = p->free;
+      p->free = node;
+    }
+  }
+
+  pool_node *node = p->free;
+  p->free = node->next;
+  p->live++;
+  return memset(node, 0, p->size);
+}
+
+void pool_release(pool *p, void *ptr) {
+  if (!ptr) {
+    return;
+  }
+  pool_node *node = ptr;
+  node->next = p->free;
+  p->free = node;
+  p->live--;
+}
+
+#endif // POOL_IMPLEMENTATION
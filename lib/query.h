@@ -0,0 +1,85 @@
+#ifndef QUERY_H_
+#define QUERY_H_
+
+#include <GL/glew.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// GPU Counters
+//
+// A query object per frame in flight, read back QUERY_FRAMES frames after
+// it was issued. By then the GPU has long finished it, so instrumentation
+// never stalls the pipeline waiting for a result.
+#define QUERY_FRAMES 3
+
+typedef struct {
+  GLenum target; // GL_SAMPLES_PASSED, GL_TIME_ELAPSED, ...
+  GLuint queries[QUERY_FRAMES];
+  int64_t issued; // Queries begun so far
+  int64_t read;   // Of those, results read back
+  uint64_t value; // Latest result, valid once `read` is non zero
+} GpuCounter;
+
+GpuCounter new_gpu_counter(GLenum target);
+void gpu_counter_begin(GpuCounter *counter);
+void gpu_counter_end(GpuCounter *counter);
+bool gpu_counter_poll(GpuCounter *counter);
+void gpu_counter_free(GpuCounter *counter);
+
+#endif // QUERY_H_
+
+// #define QUERY_IMPLEMENTATION
+#if defined(QUERY_IMPLEMENTATION) && !defined(QUERY_IMPLEMENTED)
+#define QUERY_IMPLEMENTED
+
+GpuCounter new_gpu_counter(GLenum target) {
+  GpuCounter counter = {.target = target};
+  glGenQueries(QUERY_FRAMES, counter.queries);
+  return counter;
+}
+
+static void gpu_counter_read(GpuCounter *counter) {
+  GLuint64 value;
+  glGetQueryObjectui64v(counter->queries[counter->read % QUERY_FRAMES],
+                        GL_QUERY_RESULT, &value);
+  counter->value = value;
+  counter->read++;
+}
+
+// Starts counting. If every query is still in flight the oldest result is
+// waited for, which only happens when the GPU is QUERY_FRAMES frames behind.
+void gpu_counter_begin(GpuCounter *counter) {
+  if (counter->issued - counter->read == QUERY_FRAMES) {
+    gpu_counter_read(counter);
+  }
+  glBeginQuery(counter->target,
+               counter->queries[counter->issued % QUERY_FRAMES]);
+  counter->issued++;
+}
+
+void gpu_counter_end(GpuCounter *counter) { glEndQuery(counter->target); }
+
+// Reads back every finished query without waiting. Returns true when
+// `value` changed.
+bool gpu_counter_poll(GpuCounter *counter) {
+  bool updated = false;
+  while (counter->read < counter->issued) {
+    GLuint available = 0;
+    glGetQueryObjectuiv(counter->queries[counter->read % QUERY_FRAMES],
+                        GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+      break;
+    }
+    gpu_counter_read(counter);
+    updated = true;
+  }
+  return updated;
+}
+
+void gpu_counter_free(GpuCounter *counter) {
+  glDeleteQueries(QUERY_FRAMES, counter->queries);
+  *counter = (GpuCounter){0};
+}
+
+#endif // QUERY_IMPLEMENTATION
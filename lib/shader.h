@@ -2,20 +2,139 @@
 #define SHADER_H
 
 #include <GL/glew.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "../include/cglm/types-struct.h"
 #include "file.h"
+#define HASHMAP_IMPLEMENTATION
+#include "hashmap.h"
 
 typedef struct {
   GLuint ID;
+  hashmap uniforms; // Uniform name -> location cache
+  const char *vertex_path;
+  const char *fragment_path;
+  string defines; // Injected "#define" lines, kept for reloads
 } Shader;
 
+// Preprocessor
+//
+// Sources may `#include "file.glsl"` relative to the including file. Each
+// file is pasted in at most once per shader, so shared headers need no
+// guards, and file contents are cached across shaders. Defines passed to
+// new_shader_defines ("NAME" or "NAME VALUE") go right after `#version`.
+// `#line` directives keep compile errors pointing at the right line; the
+// source number in an error is the include order, 0 being the shader file.
+// Conditionals aren't evaluated: an include inside an #ifdef'd-out block is
+// still pasted there (the compiler drops it) and counts as included, so a
+// file needed outside the block must not be included inside it first.
+#define SHADER_INCLUDE_DEPTH 16
+
+// Permutations
+//
+// Specialized builds of one shader pair, one per define set, compiled the
+// first time they're asked for and cached after that. Pass the defines in a
+// consistent order, the set is looked up by its rendered text. A set longer
+// than SHADER_DEFINES_MAX once rendered fails to build.
+#define SHADER_DEFINES_MAX 1024
+
+// Program Binary Cache
+//
+// Linked programs are saved with glGetProgramBinary and loaded back with
+// glProgramBinary on the next launch, skipping GLSL compilation entirely.
+// Entries are keyed by a hash of both sources (which include any injected
+// defines) and the GL vendor, renderer and version, so a driver update or a
+// different GPU just misses. A binary the driver rejects falls back to
+// compiling from source and is overwritten.
+#ifndef SHADER_CACHE_DIR
+#define SHADER_CACHE_DIR ".cache/shaders"
+#endif
+#define SHADER_CACHE_MAGIC 0x48435350 // "PSCH"
+
+// Shader Hot Reload
+//
+// A background thread waits on inotify for writes to the sources of watched
+// shaders and reads the new sources into a staging buffer. The render thread
+// only compiles and links, in shader_watcher_poll, and swaps the program in
+// when linking succeeds; on errors the old program stays in use. Uniform
+// values belong to the program, so anything set once at startup has to be
+// set again after a reload.
+#define SHADER_WATCH_MAX 32
+#define SHADER_WATCH_SETTLE_MS 50 // Editors save in several writes
+
+typedef struct {
+  Shader *shader;
+  int vertex_wd;
+  int fragment_wd;
+  const char *vertex_name;   // Base names, what inotify reports
+  const char *fragment_name;
+  // Staged by the watch thread, taken by shader_watcher_poll
+  arena staging;
+  string vertex_code;
+  string fragment_code;
+  bool ready;
+} ShaderWatch;
+
+typedef struct {
+  int fd;      // inotify
+  int wake[2]; // Pipe that stops the thread
+  pthread_t thread;
+  pthread_mutex_t lock;
+  ShaderWatch watches[SHADER_WATCH_MAX];
+  int32_t count;
+  atomic_bool pending;
+  atomic_bool includes_changed; // Some other .glsl changed, reload all
+  bool running;
+} ShaderWatcher;
+
+typedef struct {
+  const char *vertex_path;
+  const char *fragment_path;
+  hashmap variants;       // Rendered defines -> Shader *
+  ShaderWatcher *watcher; // Optional, new variants get watched
+} ShaderVariants;
+
+// Batched Compilation
+//
+// Compiling one program at a time and checking it straight away makes the
+// driver finish each program before the next one is even submitted. A batch
+// submits every compile and link first and only looks at the results
+// afterwards. With KHR_parallel_shader_compile the driver compiles on its
+// own threads and GL_COMPLETION_STATUS_KHR says which programs are done
+// without blocking; without it the status queries are simply deferred to
+// shader_batch_finish. Queued shaders have ID 0 until they finish and must
+// stay at the same address until then.
+#define SHADER_BATCH_MAX 64
+
+typedef struct {
+  Shader *shader;
+  GLuint program;
+  GLuint vertex;
+  GLuint fragment;
+  uint64_t key;
+  bool cache;
+} ShaderPending;
+
+typedef struct {
+  ShaderPending pending[SHADER_BATCH_MAX];
+  int32_t count;
+} ShaderBatch;
+
 Shader new_shader(const char *vertex_path, const char *fragment_path);
+Shader new_shader_defines(const char *vertex_path, const char *fragment_path,
+                          const char **defines, int32_t count);
 void shader_free(Shader *shader);
 void shader_use(Shader *shader);
+GLint shader_uniform_location(Shader *shader, const char *name);
 // Primitives
 void shader_set_bool(Shader *shader, const char *name, bool value);
 void shader_set_int(Shader *shader, const char *name, int value);
@@ -34,113 +153,801 @@ void shader_set_mat2(Shader *shader, const char *name, const mat2s mat);
 void shader_set_mat3(Shader *shader, const char *name, const mat3s mat);
 void shader_set_mat4(Shader *shader, const char *name, const mat4s mat);
 
+// Permutations
+ShaderVariants new_shader_variants(const char *vertex_path,
+                                   const char *fragment_path,
+                                   ShaderWatcher *watcher);
+Shader *shader_variant(ShaderVariants *v, const char **defines,
+                       int32_t count);
+void shader_variants_free(ShaderVariants *v);
+void shader_include_cache_clear(void);
+
+// Batched compilation
+void shader_batch_add(ShaderBatch *b, Shader *shader, const char *vertex_path,
+                      const char *fragment_path, const char **defines,
+                      int32_t count);
+Shader *shader_variant_queue(ShaderVariants *v, const char **defines,
+                             int32_t count, ShaderBatch *b);
+int32_t shader_batch_poll(ShaderBatch *b);
+void shader_batch_finish(ShaderBatch *b);
+
+// Hot reload
+bool shader_reload(Shader *shader);
+bool shader_watcher_init(ShaderWatcher *w);
+bool shader_watch(ShaderWatcher *w, Shader *shader);
+int32_t shader_watcher_poll(ShaderWatcher *w);
+void shader_watcher_free(ShaderWatcher *w);
+
 // Helper
-void check_shader_compilation(GLuint shader, const char *shader_type,
+bool check_shader_compilation(GLuint shader, const char *shader_type,
                               const char *filename);
-void check_program_linking(GLuint programID);
+bool check_program_linking(GLuint programID);
 #endif // SHADER_H
 
 // #define SHADER_IMPLEMENTATION
-#ifdef SHADER_IMPLEMENTATION
-inline Shader new_shader(const char *vertex_path, const char *fragment_path) {
-  Shader shader = {0};
+#if defined(SHADER_IMPLEMENTATION) && !defined(SHADER_IMPLEMENTED)
+#define SHADER_IMPLEMENTED
+
+// Backs every shader's uniform cache and paths, shaders are few and long
+// lived
+static arena shader_arena;
+
+// Set once hot reload picks up an edit. From then on sources and includes
+// come from the loose files, a mounted pack still holds the old ones.
+static atomic_bool shader_edited;
+
+static string shader_read(const char *path, arena *a) {
+  string contents;
+  file_error error = atomic_load(&shader_edited)
+                         ? read_loose_asset(path, a, &contents)
+                         : read_asset(path, a, &contents);
+  if (error != FILE_OK) {
+    fprintf(stderr, "ERROR: Could not read file %s: %s\n", path,
+            file_error_string(error));
+  }
+  return contents;
+}
+
+typedef struct {
+  uint32_t magic;
+  uint32_t format; // Driver's binary format enum
+  uint64_t key;
+  uint64_t length;
+} shader_cache_header;
 
+// Program binaries need the extension and at least one binary format
+static bool shader_cache_enabled(void) {
+  static int enabled = -1;
+  if (enabled < 0) {
+    GLint formats = 0;
+    if (GLEW_ARB_get_program_binary) {
+      glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    }
+    enabled = formats > 0;
+  }
+  return enabled;
+}
+
+static uint64_t shader_cache_key(string vertex_code, string fragment_code) {
+  const char *driver[] = {
+      (const char *)glGetString(GL_VENDOR),
+      (const char *)glGetString(GL_RENDERER),
+      (const char *)glGetString(GL_VERSION),
+  };
+
+  uint64_t key = hash_bytes(vertex_code.data, vertex_code.len);
+  key = key * 0x100000001b3 ^ hash_bytes(fragment_code.data, fragment_code.len);
+  for (int i = 0; i < 3; i++) {
+    const char *s = driver[i] ? driver[i] : "";
+    key = key * 0x100000001b3 ^ hash_bytes(s, strlen(s));
+  }
+  return key;
+}
+
+static void shader_cache_path(char *path, ptrdiff_t len, uint64_t key) {
+  snprintf(path, len, "%s/%016llx.bin", SHADER_CACHE_DIR,
+           (unsigned long long)key);
+}
+
+// Creates the program from a cached binary, 0 on a miss or when the driver
+// rejects what was stored
+static GLuint shader_cache_load(uint64_t key) {
+  char path[512];
+  shader_cache_path(path, sizeof(path), key);
+
+  arena scratch = new_arena_virtual(1024 * 1024 * 64);
+  string data;
+  GLuint program = 0;
+  if (read_file_into(path, &scratch, &data) == FILE_OK &&
+      data.len >= (ptrdiff_t)sizeof(shader_cache_header)) {
+    shader_cache_header header;
+    memcpy(&header, data.data, sizeof(header));
+    if (header.magic == SHADER_CACHE_MAGIC && header.key == key &&
+        header.length == data.len - sizeof(header)) {
+      program = glCreateProgram();
+      glProgramBinary(program, header.format, data.data + sizeof(header),
+                      (GLsizei)header.length);
+      GLint success = 0;
+      glGetProgramiv(program, GL_LINK_STATUS, &success);
+      if (!success) {
+        glDeleteProgram(program);
+        program = 0;
+      }
+    }
+  }
+  arena_free(&scratch);
+  return program;
+}
+
+// Creates SHADER_CACHE_DIR and any missing parents, like mkdir -p. Failures
+// show up when the entry can't be written.
+static void shader_cache_mkdir(void) {
+  char dir[512];
+  int len = snprintf(dir, sizeof(dir), "%s", SHADER_CACHE_DIR);
+  if (len <= 0 || len >= (int)sizeof(dir)) {
+    return;
+  }
+  for (char *at = dir + 1; *at; at++) {
+    if (*at == '/') {
+      *at = '\0';
+      mkdir(dir, 0755);
+      *at = '/';
+    }
+  }
+  mkdir(dir, 0755);
+}
+
+// Writes the linked program's binary. Goes through a temporary file and a
+// rename so a crash never leaves a torn entry behind.
+static void shader_cache_store(GLuint program, uint64_t key) {
+  GLint length = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0) {
+    return;
+  }
+
+  arena scratch = new_arena_virtual(1024 * 1024 * 64);
+  uint8_t *binary = make_nozero(&scratch, uint8_t, length);
+  GLenum format = 0;
+  glGetProgramBinary(program, length, &length, &format, binary);
+
+  shader_cache_mkdir();
+
+  char path[512], temp[520];
+  shader_cache_path(path, sizeof(path), key);
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+
+  shader_cache_header header = {SHADER_CACHE_MAGIC, format, key, length};
+  FILE *f = fopen(temp, "wb");
+  if (f) {
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(binary, 1, length, f) == (size_t)length;
+    ok = !fclose(f) && ok;
+    if (!ok || rename(temp, path)) {
+      remove(temp);
+    }
+  }
+  arena_free(&scratch);
+}
+
+// Submits both stages and the link without asking for any status, so the
+// driver is free to work on it in the background. Programs built before
+// come from the binary cache instead, finished and with no stages.
+static ShaderPending shader_build_begin(string vertex_code,
+                                         string fragment_code) {
+  ShaderPending p = {.cache = shader_cache_enabled()};
+  if (p.cache) {
+    p.key = shader_cache_key(vertex_code, fragment_code);
+    p.program = shader_cache_load(p.key);
+    if (p.program) {
+      return p;
+    }
+  }
+
+  p.vertex = glCreateShader(GL_VERTEX_SHADER);
+  glShaderSource(p.vertex, 1, (const char *const *)&vertex_code.data, NULL);
+  glCompileShader(p.vertex);
+
+  p.fragment = glCreateShader(GL_FRAGMENT_SHADER);
+  glShaderSource(p.fragment, 1, (const char *const *)&fragment_code.data,
+                 NULL);
+  glCompileShader(p.fragment);
+
+  p.program = glCreateProgram();
+  glAttachShader(p.program, p.vertex);
+  glAttachShader(p.program, p.fragment);
+  if (p.cache) {
+    glProgramParameteri(p.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                        GL_TRUE);
+  }
+  glLinkProgram(p.program);
+  return p;
+}
+
+// Checks the logs (this waits for the driver if it isn't done yet) and
+// stores the binary. Returns the program, or 0 with the errors printed.
+static GLuint shader_build_end(ShaderPending *p, const char *vertex_path,
+                               const char *fragment_path) {
+  if (!p->vertex) {
+    return p->program;
+  }
+
+  bool ok = check_shader_compilation(p->vertex, "Vertex", vertex_path);
+  ok = check_shader_compilation(p->fragment, "Fragment", fragment_path) && ok;
+  ok = ok && check_program_linking(p->program);
+
+  glDeleteShader(p->vertex);
+  glDeleteShader(p->fragment);
+  if (!ok) {
+    glDeleteProgram(p->program);
+    return 0;
+  }
+  if (p->cache) {
+    shader_cache_store(p->program, p->key);
+  }
+  return p->program;
+}
+
+static void shader_arena_init(void) {
+  if (!shader_arena.beg) {
+    shader_arena = new_arena_virtual(1024 * 1024 * 64);
+  }
+}
+
+static const char *shader_copy_path(const char *path) {
+  ptrdiff_t len = strlen(path) + 1;
+  return memcpy(make_nozero(&shader_arena, char, len), path, len);
+}
+
+// Preprocessor ------------------------------------------------------------
+
+// Include path -> contents, shared by every shader
+static hashmap shader_includes;
+
+typedef struct {
+  arena *a;
+  uint8_t *data;
+  ptrdiff_t len;
+  ptrdiff_t cap;
+  const char *seen[SHADER_INCLUDE_DEPTH * 4];
+  int32_t seen_count;
+  int32_t files;
+} shader_source;
+
+static void shader_append(shader_source *b, const void *data, ptrdiff_t len) {
+  if (b->len + len + 1 > b->cap) {
+    ptrdiff_t cap = b->cap ? b->cap : 4096;
+    while (b->len + len + 1 > cap) {
+      cap *= 2;
+    }
+    if (!b->data || !arena_extend(b->a, b->data + b->cap, cap - b->cap)) {
+      uint8_t *data = make_nozero(b->a, uint8_t, cap);
+      if (b->len) {
+        memcpy(data, b->data, b->len);
+      }
+      b->data = data;
+    }
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+  b->data[b->len] = '\0';
+}
+
+static void shader_appendf(shader_source *b, const char *format, int a,
+                           int c) {
+  char line[64];
+  int len = snprintf(line, sizeof(line), format, a, c);
+  shader_append(b, line, len);
+}
+
+static string shader_include_load(const char *path) {
+  if (!shader_includes.a) {
+    shader_includes = new_hashmap_string(&shader_arena, sizeof(string), 16);
+  }
+  string key = {(uint8_t *)path, strlen(path)};
+  string *cached = hashmap_get(&shader_includes, &key);
+  if (cached) {
+    return *cached;
+  }
+
+  string contents = shader_read(path, &shader_arena);
+  if (!contents.data) {
+    return (string){0};
+  }
+  *(string *)hashmap_put(&shader_includes, &key) = contents;
+  return contents;
+}
+
+static bool shader_line_starts(string line, const char *directive) {
+  ptrdiff_t len = strlen(directive);
+  return line.len >= len && !memcmp(line.data, directive, len);
+}
+
+// Number of the `#version` line, 0 when there isn't one. Only comments and
+// blank lines may come before it.
+static int shader_version_line(string source) {
+  bool comment = false;
+  int line_number = 1;
+  for (ptrdiff_t i = 0; i < source.len; i++) {
+    uint8_t c = source.data[i];
+    if (c == '\n') {
+      line_number++;
+    } else if (comment) {
+      if (c == '*' && i + 1 < source.len && source.data[i + 1] == '/') {
+        comment = false;
+        i++;
+      }
+    } else if (c == '/' && i + 1 < source.len && source.data[i + 1] == '*') {
+      comment = true;
+      i++;
+    } else if (c == '/' && i + 1 < source.len && source.data[i + 1] == '/') {
+      while (i + 1 < source.len && source.data[i + 1] != '\n') {
+        i++;
+      }
+    } else if (c != ' ' && c != '\t' && c != '\r') {
+      string rest = {source.data + i, source.len - i};
+      return shader_line_starts(rest, "#version") ? line_number : 0;
+    }
+  }
+  return 0;
+}
+
+// Pastes `source` (from `path`) into `b`, expanding includes recursively
+static void shader_expand(shader_source *b, const char *path, string source,
+                          string defines, int depth) {
+  int file = b->files++;
+  int line_number = 0;
+  bool root = depth == 0;
+  bool injected = !root;
+  // Defines go after the #version line, or before the first line
+  int version_line = root ? shader_version_line(source) : 0;
+
+  for (ptrdiff_t at = 0; at < source.len;) {
+    ptrdiff_t end = at;
+    while (end < source.len && source.data[end] != '\n') {
+      end++;
+    }
+    string line = {source.data + at, end - at};
+    at = end + 1;
+    line_number++;
+
+    if (!injected && line_number > version_line) {
+      injected = true;
+      shader_append(b, defines.data, defines.len);
+      shader_appendf(b, "#line %d %d\n", line_number, file);
+    }
+
+    string directive = line;
+    while (directive.len && (*directive.data == ' ' || *directive.data == '\t')) {
+      directive.data++;
+      directive.len--;
+    }
+
+    if (!shader_line_starts(directive, "#include")) {
+      shader_append(b, line.data, line.len);
+      shader_append(b, "\n", 1);
+      continue;
+    }
+
+    // #include "name", relative to this file
+    uint8_t *open = memchr(directive.data, '"', directive.len);
+    uint8_t *close =
+        open ? memchr(open + 1, '"', directive.data + directive.len - open - 1)
+             : NULL;
+    if (!close || depth + 1 >= SHADER_INCLUDE_DEPTH) {
+      fprintf(stderr, "ERROR: %s:%d: bad or too deeply nested #include\n",
+              path, line_number);
+      shader_append(b, "\n", 1);
+      continue;
+    }
+
+    const char *slash = strrchr(path, '/');
+    ptrdiff_t dir_len = slash ? slash - path + 1 : 0;
+    ptrdiff_t name_len = close - open - 1;
+    char *include = make_nozero(b->a, char, dir_len + name_len + 1);
+    memcpy(include, path, dir_len);
+    memcpy(include + dir_len, open + 1, name_len);
+    include[dir_len + name_len] = '\0';
+
+    bool seen = false;
+    for (int32_t i = 0; i < b->seen_count && !seen; i++) {
+      seen = !strcmp(b->seen[i], include);
+    }
+    string contents = seen ? (string){0} : shader_include_load(include);
+    if (seen || !contents.data ||
+        b->seen_count == (int32_t)(sizeof(b->seen) / sizeof(*b->seen))) {
+      shader_append(b, "\n", 1);
+      continue;
+    }
+    b->seen[b->seen_count++] = include;
+
+    shader_appendf(b, "#line %d %d\n", 1, b->files);
+    shader_expand(b, include, contents, (string){0}, depth + 1);
+    shader_appendf(b, "#line %d %d\n", line_number + 1, file);
+  }
+}
+
+static string shader_preprocess(const char *path, string source,
+                                string defines, arena *a) {
+  shader_source b = {.a = a};
+  shader_append(&b, "", 0);
+  shader_expand(&b, path, source, defines, 0);
+  return (string){b.data, b.len};
+}
+
+// Renders {"NAME", "NAME VALUE", "NAME=VALUE"} as #define lines into `out`.
+// Returns the length, or -1 when it doesn't fit.
+static ptrdiff_t shader_render_defines(const char **defines, int32_t count,
+                                       char *out, ptrdiff_t cap) {
+  ptrdiff_t len = 0;
+  for (int32_t i = 0; i < count; i++) {
+    int n = snprintf(out + len, cap - len, "#define %s\n", defines[i]);
+    if (n < 0 || n >= cap - len) {
+      return -1;
+    }
+    char *equals = memchr(out + len, '=', n);
+    if (equals) {
+      *equals = ' ';
+    }
+    len += n;
+  }
+  return len;
+}
+
+// Preprocesses both stages with the shader's defines and submits them. The
+// program is 0 when the defines didn't fit.
+static ShaderPending shader_compile_begin(Shader *shader, string vertex_code,
+                                           string fragment_code) {
+  if (!shader->defines.data) {
+    return (ShaderPending){.shader = shader};
+  }
+  arena sArena = new_arena_virtual(1024 * 1024 * 64);
+  string vertex = shader_preprocess(shader->vertex_path, vertex_code,
+                                    shader->defines, &sArena);
+  string fragment = shader_preprocess(shader->fragment_path, fragment_code,
+                                      shader->defines, &sArena);
+  // GL copies the sources, the buffers can go right away
+  ShaderPending p = shader_build_begin(vertex, fragment);
+  arena_free(&sArena);
+  p.shader = shader;
+  return p;
+}
+
+static GLuint shader_compile(Shader *shader, string vertex_code,
+                             string fragment_code) {
+  ShaderPending p = shader_compile_begin(shader, vertex_code, fragment_code);
+  return shader_build_end(&p, shader->vertex_path, shader->fragment_path);
+}
+
+// Reads the sources and submits them. The program is 0 when a file is
+// missing.
+static ShaderPending shader_load_begin(Shader *shader) {
   // 1. Retrieve the vertex/fragment source code from filePath
-  arena sArena = new_arena(1024 * 8);
+  arena sArena = new_arena_virtual(1024 * 1024 * 64);
 
-  string vertex_code = read_file(vertex_path, &sArena);
-  string fragment_code = read_file(fragment_path, &sArena);
+  string vertex_code = shader_read(shader->vertex_path, &sArena);
+  string fragment_code = shader_read(shader->fragment_path, &sArena);
 
-  // return shader;
-  GLuint vertex, fragment;
+  // 2. Expand includes and defines, compile and link
+  ShaderPending p = {.shader = shader};
+  if (vertex_code.data && fragment_code.data) {
+    p = shader_compile_begin(shader, vertex_code, fragment_code);
+  }
+  arena_free(&sArena);
+  return p;
+}
 
-  vertex = glCreateShader(GL_VERTEX_SHADER);
-  glShaderSource(vertex, 1, (const char *const *)&vertex_code.data, NULL);
-  glCompileShader(vertex);
+// Everything but the program
+static Shader shader_init(const char *vertex_path, const char *fragment_path,
+                          const char **defines, int32_t count) {
+  Shader shader = {0};
+  shader_arena_init();
 
-  check_shader_compilation(vertex, "Vertex", vertex_path);
+  char rendered[SHADER_DEFINES_MAX];
+  ptrdiff_t len = shader_render_defines(defines, count, rendered,
+                                        sizeof(rendered));
+  if (len < 0) {
+    // Left NULL, building without them would be a different shader
+    fprintf(stderr, "ERROR: Too many defines for %s / %s\n", vertex_path,
+            fragment_path);
+  } else {
+    uint8_t *copy = make_nozero(&shader_arena, uint8_t, len + 1);
+    memcpy(copy, rendered, len);
+    shader.defines = (string){copy, len};
+  }
+  shader.vertex_path = shader_copy_path(vertex_path);
+  shader.fragment_path = shader_copy_path(fragment_path);
+  shader.uniforms = new_hashmap_string(&shader_arena, sizeof(GLint), 32);
+  return shader;
+}
 
-  fragment = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(fragment, 1, (const char *const *)&fragment_code.data, NULL);
-  glCompileShader(fragment);
+inline Shader new_shader_defines(const char *vertex_path,
+                                 const char *fragment_path,
+                                 const char **defines, int32_t count) {
+  Shader shader = shader_init(vertex_path, fragment_path, defines, count);
+  ShaderPending p = shader_load_begin(&shader);
+  shader.ID = shader_build_end(&p, vertex_path, fragment_path);
+  return shader;
+}
 
-  check_shader_compilation(fragment, "Fragment", fragment_path);
+inline Shader new_shader(const char *vertex_path, const char *fragment_path) {
+  return new_shader_defines(vertex_path, fragment_path, NULL, 0);
+}
 
-  shader.ID = glCreateProgram();
-  glAttachShader(shader.ID, vertex);
-  glAttachShader(shader.ID, fragment);
-  glLinkProgram(shader.ID);
+// Swaps in a freshly built program, or keeps the current one when the new
+// sources don't build. Cached uniform locations belong to the old program
+// and are dropped.
+static bool shader_swap(Shader *shader, string vertex_code,
+                        string fragment_code) {
+  GLuint program = shader_compile(shader, vertex_code, fragment_code);
+  if (!program) {
+    fprintf(stderr, "ERROR: Keeping the previous %s / %s program\n",
+            shader->vertex_path, shader->fragment_path);
+    return false;
+  }
 
-  check_program_linking(shader.ID);
+  // Keep the binding if the old program was in use
+  GLint current = 0;
+  glGetIntegerv(GL_CURRENT_PROGRAM, &current);
+  if ((GLuint)current == shader->ID && current) {
+    glUseProgram(program);
+  }
+  glDeleteProgram(shader->ID);
+  shader->ID = program;
+  hashmap_clear(&shader->uniforms);
+  return true;
+}
 
-  glDeleteShader(vertex);
-  glDeleteShader(fragment);
+// Rebuilds the shader from its source files
+inline bool shader_reload(Shader *shader) {
+  arena sArena = new_arena_virtual(1024 * 1024 * 64);
+  string vertex_code = shader_read(shader->vertex_path, &sArena);
+  string fragment_code = shader_read(shader->fragment_path, &sArena);
+  bool ok = vertex_code.data && fragment_code.data &&
+            shader_swap(shader, vertex_code, fragment_code);
   arena_free(&sArena);
+  return ok;
+}
+
+// Drops cached include files, the next build reads them again. The old
+// contents stay in the shader arena, this is for edits during development.
+inline void shader_include_cache_clear(void) {
+  if (shader_includes.a) {
+    hashmap_clear(&shader_includes);
+  }
+}
 
+// Permutations ------------------------------------------------------------
+
+inline ShaderVariants new_shader_variants(const char *vertex_path,
+                                          const char *fragment_path,
+                                          ShaderWatcher *watcher) {
+  shader_arena_init();
+  return (ShaderVariants){
+      .vertex_path = shader_copy_path(vertex_path),
+      .fragment_path = shader_copy_path(fragment_path),
+      .variants = new_hashmap_string(&shader_arena, sizeof(Shader *), 8),
+      .watcher = watcher,
+  };
+}
+
+// Returns the variant built with `defines`, compiling it on first use. A
+// variant that fails to build is cached too (with ID 0), so a broken one
+// isn't recompiled every frame; hot reload can still fix it. Returns NULL
+// when the defines don't fit SHADER_DEFINES_MAX.
+inline Shader *shader_variant(ShaderVariants *v, const char **defines,
+                              int32_t count) {
+  char rendered[SHADER_DEFINES_MAX];
+  ptrdiff_t len = shader_render_defines(defines, count, rendered,
+                                        sizeof(rendered));
+  if (len < 0) {
+    fprintf(stderr, "ERROR: Too many defines for a %s / %s variant\n",
+            v->vertex_path, v->fragment_path);
+    return NULL;
+  }
+  string key = {(uint8_t *)rendered, len};
+  Shader **cached = hashmap_get(&v->variants, &key);
+  if (cached) {
+    return *cached;
+  }
+
+  // Shaders are handed out by pointer, keep them out of the table itself
+  Shader *shader = make(&shader_arena, Shader, 1);
+  *shader =
+      new_shader_defines(v->vertex_path, v->fragment_path, defines, count);
+  *(Shader **)hashmap_put(&v->variants, &key) = shader;
+  if (v->watcher) {
+    shader_watch(v->watcher, shader);
+  }
+  return shader;
+}
+
+// Batched compilation ------------------------------------------------------
+
+// Lets the driver use as many compiler threads as it likes
+static bool shader_parallel_enabled(void) {
+  static int enabled = -1;
+  if (enabled < 0) {
+    enabled = GLEW_KHR_parallel_shader_compile != 0;
+    if (enabled) {
+      glMaxShaderCompilerThreadsKHR(0xffffffff);
+    }
+  }
+  return enabled;
+}
+
+static void shader_batch_push(ShaderBatch *b, ShaderPending p) {
+  shader_parallel_enabled();
+  if (!p.vertex) {
+    // Binary cache hit or missing file, nothing left to wait for
+    p.shader->ID = p.program;
+    return;
+  }
+  if (b->count == SHADER_BATCH_MAX) {
+    shader_batch_finish(b);
+  }
+  b->pending[b->count++] = p;
+}
+
+// Initializes `shader` and queues its compile
+inline void shader_batch_add(ShaderBatch *b, Shader *shader,
+                             const char *vertex_path,
+                             const char *fragment_path, const char **defines,
+                             int32_t count) {
+  shader_parallel_enabled();
+  *shader = shader_init(vertex_path, fragment_path, defines, count);
+  shader_batch_push(b, shader_load_begin(shader));
+}
+
+// Like shader_variant, but a new variant is queued on `b` instead of being
+// compiled on the spot. Nothing is queued when it returns NULL.
+inline Shader *shader_variant_queue(ShaderVariants *v, const char **defines,
+                                    int32_t count, ShaderBatch *b) {
+  char rendered[SHADER_DEFINES_MAX];
+  ptrdiff_t len = shader_render_defines(defines, count, rendered,
+                                        sizeof(rendered));
+  if (len < 0) {
+    fprintf(stderr, "ERROR: Too many defines for a %s / %s variant\n",
+            v->vertex_path, v->fragment_path);
+    return NULL;
+  }
+  string key = {(uint8_t *)rendered, len};
+  Shader **cached = hashmap_get(&v->variants, &key);
+  if (cached) {
+    return *cached;
+  }
+
+  Shader *shader = make(&shader_arena, Shader, 1);
+  shader_batch_add(b, shader, v->vertex_path, v->fragment_path, defines,
+                   count);
+  *(Shader **)hashmap_put(&v->variants, &key) = shader;
+  if (v->watcher) {
+    shader_watch(v->watcher, shader);
+  }
   return shader;
 }
 
+// Finishes the programs the driver is done with, without waiting on the
+// rest. Returns how many are still compiling. Without the extension nothing
+// is known to be done until shader_batch_finish.
+inline int32_t shader_batch_poll(ShaderBatch *b) {
+  if (!shader_parallel_enabled()) {
+    return b->count;
+  }
+  for (int32_t i = 0; i < b->count;) {
+    ShaderPending *p = &b->pending[i];
+    GLint done = GL_FALSE;
+    glGetProgramiv(p->program, GL_COMPLETION_STATUS_KHR, &done);
+    if (!done) {
+      i++;
+      continue;
+    }
+    p->shader->ID =
+        shader_build_end(p, p->shader->vertex_path, p->shader->fragment_path);
+    *p = b->pending[--b->count];
+  }
+  return b->count;
+}
+
+// Waits for and checks everything still queued
+inline void shader_batch_finish(ShaderBatch *b) {
+  if (shader_parallel_enabled()) {
+    // Programs are finished in completion order, not submission order
+    while (shader_batch_poll(b)) {
+      sched_yield();
+    }
+    return;
+  }
+  for (int32_t i = 0; i < b->count; i++) {
+    ShaderPending *p = &b->pending[i];
+    p->shader->ID =
+        shader_build_end(p, p->shader->vertex_path, p->shader->fragment_path);
+  }
+  b->count = 0;
+}
+
+inline void shader_variants_free(ShaderVariants *v) {
+  for (ptrdiff_t i = hashmap_next(&v->variants, 0); i >= 0;
+       i = hashmap_next(&v->variants, i + 1)) {
+    shader_free(*(Shader **)hashmap_value(&v->variants, i));
+  }
+  hashmap_clear(&v->variants);
+}
+
 inline void shader_use(Shader *shader) { glUseProgram(shader->ID); }
 
 inline void shader_free(Shader *shader) { glDeleteProgram(shader->ID); }
 
+// Looks the location up once per name, later calls are a hash map probe
+// instead of a driver call
+inline GLint shader_uniform_location(Shader *shader, const char *name) {
+  string key = {(uint8_t *)name, strlen(name)};
+  GLint *location = hashmap_get(&shader->uniforms, &key);
+  if (!location) {
+    location = hashmap_put(&shader->uniforms, &key);
+    *location = glGetUniformLocation(shader->ID, name);
+  }
+  return *location;
+}
+
 inline void shader_set_bool(Shader *shader, const char *name, bool value) {
-  glUniform1i(glGetUniformLocation(shader->ID, name), (int)value);
+  glUniform1i(shader_uniform_location(shader, name), (int)value);
 }
 
 inline void shader_set_int(Shader *shader, const char *name, int value) {
-  glUniform1i(glGetUniformLocation(shader->ID, name), value);
+  glUniform1i(shader_uniform_location(shader, name), value);
 }
 
 inline void shader_set_float(Shader *shader, const char *name, float value) {
-  glUniform1f(glGetUniformLocation(shader->ID, name), value);
+  glUniform1f(shader_uniform_location(shader, name), value);
 }
 // ------------------------------------------------------------------------
 inline void shader_set_vec2(Shader *shader, const char *name,
                             const vec2s value) {
-  glUniform2fv(glGetUniformLocation(shader->ID, name), 1, value.raw);
+  glUniform2fv(shader_uniform_location(shader, name), 1, value.raw);
 }
 
 inline void shader_set_vec2f(Shader *shader, const char *name, float x,
                              float y) {
-  glUniform2f(glGetUniformLocation(shader->ID, name), x, y);
+  glUniform2f(shader_uniform_location(shader, name), x, y);
 }
 // ------------------------------------------------------------------------
 inline void shader_set_vec3(Shader *shader, const char *name,
                             const vec3s value) {
-  glUniform3fv(glGetUniformLocation(shader->ID, name), 1, value.raw);
+  glUniform3fv(shader_uniform_location(shader, name), 1, value.raw);
 }
 inline void shader_set_vec3f(Shader *shader, const char *name, float x, float y,
                              float z) {
-  glUniform3f(glGetUniformLocation(shader->ID, name), x, y, z);
+  glUniform3f(shader_uniform_location(shader, name), x, y, z);
 }
 // ------------------------------------------------------------------------
 inline void shader_set_vec4(Shader *shader, const char *name,
                             const vec4s value) {
-  glUniform4fv(glGetUniformLocation(shader->ID, name), 1, value.raw);
+  glUniform4fv(shader_uniform_location(shader, name), 1, value.raw);
 }
 inline void shader_set_vec4f(Shader *shader, const char *name, float x, float y,
                              float z, float w) {
-  glUniform4f(glGetUniformLocation(shader->ID, name), x, y, z, w);
+  glUniform4f(shader_uniform_location(shader, name), x, y, z, w);
 }
 // ------------------------------------------------------------------------
 inline void shader_set_mat2(Shader *shader, const char *name, const mat2s mat) {
-  glUniformMatrix2fv(glGetUniformLocation(shader->ID, name), 1, GL_FALSE,
+  glUniformMatrix2fv(shader_uniform_location(shader, name), 1, GL_FALSE,
                      *mat.raw);
 }
 // ------------------------------------------------------------------------
 inline void shader_set_mat3(Shader *shader, const char *name, const mat3s mat) {
-  glUniformMatrix3fv(glGetUniformLocation(shader->ID, name), 1, GL_FALSE,
+  glUniformMatrix3fv(shader_uniform_location(shader, name), 1, GL_FALSE,
                      *mat.raw);
 }
 // ------------------------------------------------------------------------
 inline void shader_set_mat4(Shader *shader, const char *name, const mat4s mat) {
-  glUniformMatrix4fv(glGetUniformLocation(shader->ID, name), 1, GL_FALSE,
+  glUniformMatrix4fv(shader_uniform_location(shader, name), 1, GL_FALSE,
                      *mat.raw);
 }
 
 // Helpers
-inline void check_shader_compilation(GLuint shader, const char *shader_type,
+inline bool check_shader_compilation(GLuint shader, const char *shader_type,
                                      const char *filename) {
   int success;
   char infoLog[512];
@@ -151,9 +958,10 @@ inline void check_shader_compilation(GLuint shader, const char *shader_type,
             "ERROR: %s shader compilation failed\nFile: %s\nDetails:\n%s\n",
             shader_type, filename, infoLog);
   }
+  return success;
 }
 
-inline void check_program_linking(GLuint programID) {
+inline bool check_program_linking(GLuint programID) {
   int success;
   char infoLog[512];
   glGetProgramiv(programID, GL_LINK_STATUS, &success);
@@ -161,6 +969,217 @@ inline void check_program_linking(GLuint programID) {
     glGetProgramInfoLog(programID, 512, NULL, infoLog);
     fprintf(stderr, "ERROR: Shader program linking failed %s\n", infoLog);
   }
+  return success;
+}
+
+// Hot reload --------------------------------------------------------------
+
+static const char *shader_base_name(const char *path) {
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+// Watches the directory rather than the file, editors that save by writing
+// a new file and renaming it over the old one would drop a file watch.
+static int shader_watch_dir(ShaderWatcher *w, const char *path) {
+  char dir[4096] = ".";
+  const char *slash = strrchr(path, '/');
+  if (slash) {
+    // Keep the slash itself for files directly under /
+    ptrdiff_t len = slash == path ? 1 : slash - path;
+    if (len >= (ptrdiff_t)sizeof(dir)) {
+      return -1;
+    }
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+  }
+  return inotify_add_watch(w->fd, dir,
+                           IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+}
+
+// Reads the sources of a changed shader off the render thread
+static void shader_watch_stage(ShaderWatcher *w, ShaderWatch *watch) {
+  atomic_store(&shader_edited, true);
+  arena staging = new_arena_virtual(1024 * 1024 * 64);
+  string vertex_code = shader_read(watch->shader->vertex_path, &staging);
+  string fragment_code = shader_read(watch->shader->fragment_path, &staging);
+  if (!vertex_code.data || !fragment_code.data) {
+    arena_free(&staging);
+    return;
+  }
+
+  pthread_mutex_lock(&w->lock);
+  if (watch->ready) {
+    arena_free(&watch->staging);
+  }
+  watch->staging = staging;
+  watch->vertex_code = vertex_code;
+  watch->fragment_code = fragment_code;
+  watch->ready = true;
+  atomic_store(&w->pending, true);
+  pthread_mutex_unlock(&w->lock);
+}
+
+static void *shader_watch_thread(void *arg) {
+  ShaderWatcher *w = arg;
+  _Alignas(struct inotify_event) char buffer[4096];
+  bool changed[SHADER_WATCH_MAX] = {0};
+
+  for (;;) {
+    struct pollfd fds[2] = {{w->fd, POLLIN, 0}, {w->wake[0], POLLIN, 0}};
+    bool settling = false;
+    for (int32_t i = 0; i < SHADER_WATCH_MAX; i++) {
+      settling |= changed[i];
+    }
+    int ready = poll(fds, 2, settling ? SHADER_WATCH_SETTLE_MS : -1);
+    if (ready < 0) {
+      continue;
+    }
+    if (fds[1].revents) {
+      return NULL;
+    }
+
+    // Quiet for a moment after a change, the save is done
+    if (!ready) {
+      pthread_mutex_lock(&w->lock);
+      int32_t count = w->count;
+      pthread_mutex_unlock(&w->lock);
+      for (int32_t i = 0; i < count; i++) {
+        if (changed[i]) {
+          shader_watch_stage(w, &w->watches[i]);
+          changed[i] = false;
+        }
+      }
+      continue;
+    }
+
+    ssize_t len = read(w->fd, buffer, sizeof(buffer));
+    for (char *at = buffer; len > 0 && at < buffer + len;) {
+      struct inotify_event *event = (struct inotify_event *)at;
+      at += sizeof(*event) + event->len;
+      if (!event->len) {
+        continue;
+      }
+
+      pthread_mutex_lock(&w->lock);
+      bool source = false;
+      for (int32_t i = 0; i < w->count; i++) {
+        ShaderWatch *watch = &w->watches[i];
+        if ((event->wd == watch->vertex_wd &&
+             !strcmp(event->name, watch->vertex_name)) ||
+            (event->wd == watch->fragment_wd &&
+             !strcmp(event->name, watch->fragment_name))) {
+          changed[i] = source = true;
+        }
+      }
+      // Any other .glsl next to the sources may be an include, rebuild all
+      ptrdiff_t name_len = strlen(event->name);
+      if (!source && name_len > 5 &&
+          !strcmp(event->name + name_len - 5, ".glsl")) {
+        for (int32_t i = 0; i < w->count; i++) {
+          changed[i] = true;
+        }
+        atomic_store(&w->includes_changed, true);
+      }
+      pthread_mutex_unlock(&w->lock);
+    }
+  }
+}
+
+// Starts the watch thread. Returns false when inotify isn't available, the
+// watcher then does nothing.
+inline bool shader_watcher_init(ShaderWatcher *w) {
+  *w = (ShaderWatcher){.fd = -1, .wake = {-1, -1}};
+  pthread_mutex_init(&w->lock, NULL);
+
+  w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (w->fd < 0) {
+    fprintf(stderr, "ERROR: Shader hot reload unavailable, no inotify\n");
+    return false;
+  }
+  if (pipe(w->wake) ||
+      pthread_create(&w->thread, NULL, shader_watch_thread, w)) {
+    fprintf(stderr, "ERROR: Could not start the shader watch thread\n");
+    close(w->fd);
+    w->fd = -1;
+    return false;
+  }
+  w->running = true;
+  return true;
+}
+
+// Reloads `shader` whenever one of its sources changes. The shader must stay
+// at the same address while watched.
+inline bool shader_watch(ShaderWatcher *w, Shader *shader) {
+  if (!w->running || w->count == SHADER_WATCH_MAX) {
+    return false;
+  }
+  ShaderWatch watch = {
+      .shader = shader,
+      .vertex_wd = shader_watch_dir(w, shader->vertex_path),
+      .fragment_wd = shader_watch_dir(w, shader->fragment_path),
+      .vertex_name = shader_base_name(shader->vertex_path),
+      .fragment_name = shader_base_name(shader->fragment_path),
+  };
+  if (watch.vertex_wd < 0 || watch.fragment_wd < 0) {
+    return false;
+  }
+
+  pthread_mutex_lock(&w->lock);
+  w->watches[w->count++] = watch;
+  pthread_mutex_unlock(&w->lock);
+  return true;
+}
+
+// Call once a frame on the thread that owns the GL context. Builds whatever
+// the watch thread staged and returns how many shaders were swapped.
+inline int32_t shader_watcher_poll(ShaderWatcher *w) {
+  if (!atomic_exchange(&w->pending, false)) {
+    return 0;
+  }
+  if (atomic_exchange(&w->includes_changed, false)) {
+    shader_include_cache_clear();
+  }
+
+  int32_t reloaded = 0;
+  for (int32_t i = 0; i < w->count; i++) {
+    ShaderWatch *watch = &w->watches[i];
+
+    pthread_mutex_lock(&w->lock);
+    bool ready = watch->ready;
+    arena staging = watch->staging;
+    string vertex_code = watch->vertex_code;
+    string fragment_code = watch->fragment_code;
+    watch->ready = false;
+    pthread_mutex_unlock(&w->lock);
+
+    if (ready) {
+      if (shader_swap(watch->shader, vertex_code, fragment_code)) {
+        printf("Reloaded %s / %s\n", watch->shader->vertex_path,
+               watch->shader->fragment_path);
+        reloaded++;
+      }
+      arena_free(&staging);
+    }
+  }
+  return reloaded;
+}
+
+inline void shader_watcher_free(ShaderWatcher *w) {
+  if (w->running) {
+    (void)!write(w->wake[1], "", 1);
+    pthread_join(w->thread, NULL);
+    close(w->wake[0]);
+    close(w->wake[1]);
+    close(w->fd);
+  }
+  for (int32_t i = 0; i < w->count; i++) {
+    if (w->watches[i].ready) {
+      arena_free(&w->watches[i].staging);
+    }
+  }
+  pthread_mutex_destroy(&w->lock);
+  *w = (ShaderWatcher){.fd = -1};
 }
 
 #endif // SHADER_IMPLEMENTATION
@@ -0,0 +1,837 @@
+#ifndef SHADOW_H_
+#define SHADOW_H_
+
+#include <GL/glew.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/cglm/struct/affine.h"
+#include "../include/cglm/struct/box.h"
+#include "../include/cglm/struct/cam.h"
+#include "../include/cglm/struct/frustum.h"
+#include "../include/cglm/struct/mat4.h"
+#include "../include/cglm/types-struct.h"
+#include "arena.h"
+#include "shader.h"
+
+// Cascaded Shadow Maps
+//
+// The directional light's shadows come from a depth texture array, one
+// layer per cascade. The view frustum, up to `max_distance`, is split with
+// the practical scheme (a blend of uniform and logarithmic splits), and each
+// cascade covers one split:
+//
+// - Its extent is the bounding sphere of the split's corners, so it doesn't
+//   change size as the camera turns, and its center is snapped to whole
+//   texels in light space so moving doesn't make the edges shimmer.
+// - Its depth range is the split's box in light space, pulled towards the
+//   light just far enough to take in the casters that survive culling.
+//
+// Casters are culled per cascade against its light space box, and each
+// cascade's survivors are drawn in one instanced draw. Matching shader side
+// in glsl/shadows.glsl.
+#define SHADOW_MAX_CASCADES 4
+// Uniform vs logarithmic splits, 0 is all uniform
+#define SHADOW_SPLIT_LAMBDA 0.6f
+#define SHADOW_MAX_DISTANCE 50.0f
+
+// Something that casts a shadow, its mesh is the one given at init
+typedef struct {
+  mat4s model;
+  vec3s bounds[2]; // World space box
+} ShadowCaster;
+
+typedef struct {
+  int32_t count;
+  int32_t resolution;
+  float split_lambda;
+  float max_distance;
+
+  GLuint FBO;
+  GLuint texture; // DEPTH_COMPONENT24 array, compare mode on
+  GLuint VAO;     // The caster mesh plus per instance model matrices
+  GLuint instances;
+  int32_t vertex_count;
+
+  // Per frame
+  mat4s view_projection[SHADOW_MAX_CASCADES]; // World to light clip space
+  float splits[SHADOW_MAX_CASCADES + 1];      // View depths
+  float texel[SHADOW_MAX_CASCADES];           // World size of a texel
+  int32_t first[SHADOW_MAX_CASCADES];         // Instance runs
+  int32_t drawn[SHADOW_MAX_CASCADES];
+} ShadowCascades;
+
+bool shadow_cascades_init(ShadowCascades *shadows, int32_t count,
+                          int32_t resolution, GLuint mesh, GLsizei stride,
+                          int32_t vertex_count);
+void shadow_cascades_free(ShadowCascades *shadows);
+void shadow_cascades_render(ShadowCascades *shadows, Shader *shader,
+                            mat4s view, mat4s projection, vec3s direction,
+                            const ShadowCaster *casters, int32_t count,
+                            arena *frame);
+void shadow_cascades_use(ShadowCascades *shadows, Shader *shader,
+                         uint32_t unit);
+
+// Shadow Atlas
+//
+// Point and spot light shadows share one depth texture, cut into square
+// tiles by a buddy allocator: a tile is a power of two multiple of
+// SHADOW_ATLAS_MIN_TILE, aligned to its size. A spot light takes one tile
+// and a point light six, one per cube face, so no cube maps are needed.
+// Tile sizes follow how much of the screen the light's range covers,
+// up to the atlas' `max_tile`. A light that would grow but doesn't fit
+// keeps the tiles it has.
+//
+// Tiles are cached. A light's tiles are only drawn again when the light
+// moves, changes, gets new tiles, or a caster that moved was or is within
+// its range, so the cost follows what changed rather than the number of
+// lights. Matching shader side in glsl/shadows.glsl.
+#define SHADOW_ATLAS_MAX_LIGHTS 8
+#define SHADOW_ATLAS_MIN_TILE 64
+#define SHADOW_ATLAS_NEAR 0.05f
+// Texels per tile in the shadow_atlas_tiles buffer, and tiles per light
+#define SHADOW_ATLAS_TILE_TEXELS 5
+#define SHADOW_ATLAS_FACES 6
+// Spot tiles cover the cone up to this field of view, in degrees
+#define SHADOW_ATLAS_MAX_SPOT_FOV 120.0f
+
+// A shadowed point or spot light, world space. Point lights leave
+// `direction` zero.
+typedef struct {
+  vec3s position;
+  vec3s direction;
+  float outer_cutoff; // Spot only, cosine of the cone's half angle
+  float range;        // Far plane, nothing further away casts
+} ShadowLight;
+
+typedef struct {
+  ShadowLight light;
+  int32_t tile_count; // SHADOW_ATLAS_FACES, 1 for a spot light, 0 for none
+  int32_t size;       // Tile size in cells
+  int32_t x[SHADOW_ATLAS_FACES]; // Tile origins in cells
+  int32_t y[SHADOW_ATLAS_FACES];
+  mat4s view_projection[SHADOW_ATLAS_FACES];
+  bool cached; // The tiles hold this light's current shadows
+} shadow_atlas_light;
+
+typedef struct {
+  int32_t resolution;
+  int32_t max_tile;
+  int32_t cells; // Per side, SHADOW_ATLAS_MIN_TILE texels each
+  uint8_t *used;
+
+  GLuint FBO;
+  GLuint texture; // DEPTH_COMPONENT24, compare mode on
+  GLuint VAO;     // The caster mesh plus per instance model matrices
+  GLuint instances;
+  int32_t vertex_count;
+  GLuint tile_buffer; // Tile matrices and rects, see glsl/shadows.glsl
+  GLuint tile_texture;
+
+  shadow_atlas_light lights[SHADOW_ATLAS_MAX_LIGHTS];
+  int32_t light_count;
+  // Last frame's casters, to find the ones that moved
+  ShadowCaster *casters;
+  int32_t caster_count;
+  int32_t caster_capacity;
+
+  // This frame
+  int32_t tiles_drawn;
+  int32_t tiles_cached;
+} ShadowAtlas;
+
+bool shadow_atlas_init(ShadowAtlas *atlas, int32_t resolution,
+                       int32_t max_tile, GLuint mesh, GLsizei stride,
+                       int32_t vertex_count);
+void shadow_atlas_free(ShadowAtlas *atlas);
+void shadow_atlas_render(ShadowAtlas *atlas, Shader *shader,
+                         const ShadowLight *lights, int32_t count,
+                         mat4s view, mat4s projection,
+                         const ShadowCaster *casters, int32_t caster_count,
+                         arena *frame);
+void shadow_atlas_use(ShadowAtlas *atlas, Shader *shader, uint32_t unit);
+void shadow_atlas_report(ShadowAtlas *atlas, FILE *stream);
+
+#endif // SHADOW_H_
+
+// #define SHADOW_IMPLEMENTATION
+#if defined(SHADOW_IMPLEMENTATION) && !defined(SHADOW_IMPLEMENTED)
+#define SHADOW_IMPLEMENTED
+
+// Locations 3 to 6 hold the instance's model matrix, see shadow_vs.glsl
+static void shadow_caster_vao(GLuint mesh, GLsizei stride, GLuint *VAO,
+                              GLuint *instances) {
+  glGenVertexArrays(1, VAO);
+  glBindVertexArray(*VAO);
+  glBindBuffer(GL_ARRAY_BUFFER, mesh);
+  glVertexAttribPointer(0, 3, GL_FLOAT, false, stride, NULL);
+  glEnableVertexAttribArray(0);
+  glGenBuffers(1, instances);
+  glBindBuffer(GL_ARRAY_BUFFER, *instances);
+  for (int i = 0; i < 4; i++) {
+    glEnableVertexAttribArray(3 + i);
+    glVertexAttribDivisor(3 + i, 1);
+  }
+  glBindVertexArray(0);
+}
+
+// Draws instances [first, first + count) of the uploaded model matrices.
+// GL 3.3 has no base instance, the run is picked with the offsets.
+static void shadow_draw_instances(int32_t first, int32_t count,
+                                  int32_t vertex_count) {
+  for (int c = 0; c < 4; c++) {
+    glVertexAttribPointer(
+        3 + c, 4, GL_FLOAT, false, sizeof(mat4s),
+        (void *)((first * sizeof(mat4s)) + c * sizeof(vec4s)));
+  }
+  glDrawArraysInstanced(GL_TRIANGLES, 0, vertex_count, count);
+}
+
+// `mesh` is the casters' vertex buffer, positions are the first three
+// floats of each `stride` byte vertex. Returns false when the driver can't
+// render to the depth array.
+bool shadow_cascades_init(ShadowCascades *shadows, int32_t count,
+                          int32_t resolution, GLuint mesh, GLsizei stride,
+                          int32_t vertex_count) {
+  ShadowCascades *s = shadows;
+  *s = (ShadowCascades){
+      .count = count < 1                     ? 1
+               : count > SHADOW_MAX_CASCADES ? SHADOW_MAX_CASCADES
+                                             : count,
+      .resolution = resolution,
+      .split_lambda = SHADOW_SPLIT_LAMBDA,
+      .max_distance = SHADOW_MAX_DISTANCE,
+      .vertex_count = vertex_count,
+  };
+
+  glGenTextures(1, &s->texture);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, s->texture);
+  glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, resolution,
+               resolution, s->count, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT,
+               NULL);
+  // Linear filtering with compare mode gives 2x2 PCF for free
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE,
+                  GL_COMPARE_REF_TO_TEXTURE);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+  glGenFramebuffers(1, &s->FBO);
+  glBindFramebuffer(GL_FRAMEBUFFER, s->FBO);
+  glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, s->texture,
+                            0, 0);
+  glDrawBuffer(GL_NONE);
+  glReadBuffer(GL_NONE);
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  shadow_caster_vao(mesh, stride, &s->VAO, &s->instances);
+
+  if (status != GL_FRAMEBUFFER_COMPLETE) {
+    fprintf(stderr, "ERROR: Shadow map framebuffer incomplete (0x%x)\n",
+            status);
+    shadow_cascades_free(s);
+    return false;
+  }
+  return true;
+}
+
+void shadow_cascades_free(ShadowCascades *shadows) {
+  glDeleteFramebuffers(1, &shadows->FBO);
+  glDeleteTextures(1, &shadows->texture);
+  glDeleteVertexArrays(1, &shadows->VAO);
+  glDeleteBuffers(1, &shadows->instances);
+  *shadows = (ShadowCascades){0};
+}
+
+// Light clip space to [0, 1] texture space
+static mat4s shadow_texture_space(mat4s view_projection) {
+  mat4s bias = glms_translate(glms_mat4_identity(),
+                              (vec3s){{0.5f, 0.5f, 0.5f}});
+  bias = glms_scale(bias, (vec3s){{0.5f, 0.5f, 0.5f}});
+  return glms_mat4_mul(bias, view_projection);
+}
+
+// Light view looking down `direction` from the origin. It never moves with
+// the camera, which is what keeps the snapped cascades still.
+static mat4s shadow_light_view(vec3s direction) {
+  direction = glms_vec3_normalize(direction);
+  vec3s up = fabsf(direction.y) > 0.99f ? (vec3s){{1.0f, 0.0f, 0.0f}}
+                                        : (vec3s){{0.0f, 1.0f, 0.0f}};
+  return glms_look(glms_vec3_zero(), direction, up);
+}
+
+// Fits cascade `i` around view depths splits[i] to splits[i + 1] and copies
+// the casters it needs to `instances`. Returns how many were kept.
+static int32_t shadow_fit_cascade(ShadowCascades *s, int32_t i,
+                                  vec4s corners[8], float near, float far,
+                                  mat4s inv_view, mat4s light_view,
+                                  const ShadowCaster *casters, int32_t count,
+                                  mat4s *instances) {
+  // Bounding sphere in view space, where it doesn't move with the camera
+  // The struct glms_frustum_corners_at writes 8 corners, not 4
+  vec4s split[8];
+  glm_frustum_corners_at((vec4 *)corners, s->splits[i] - near, far - near,
+                         (vec4 *)split);
+  glm_frustum_corners_at((vec4 *)corners, s->splits[i + 1] - near,
+                         far - near, (vec4 *)(split + 4));
+  vec4s center = glms_frustum_center(split);
+  float radius = 0.0f;
+  for (int32_t c = 0; c < 8; c++) {
+    radius = glm_max(radius, glms_vec3_distance(glms_vec3(split[c]),
+                                                glms_vec3(center)));
+    split[c] = glms_mat4_mulv(inv_view, split[c]);
+  }
+  // Rounded up so float noise can't change the texel size frame to frame
+  radius = ceilf(radius * 16.0f) / 16.0f;
+  float texel = 2.0f * radius / s->resolution;
+  s->texel[i] = texel;
+  center = glms_mat4_mulv(inv_view, center);
+
+  vec4s light_center = glms_mat4_mulv(light_view, center);
+  float x = floorf(light_center.x / texel) * texel;
+  float y = floorf(light_center.y / texel) * texel;
+
+  // The light looks down -z, receivers span box[0].z (far) to box[1].z
+  vec3s box[2];
+  glms_frustum_box(split, light_view, box);
+  float nearest = box[1].z;
+  int32_t kept = 0;
+  for (int32_t c = 0; c < count; c++) {
+    vec3s light_box[2];
+    glms_aabb_transform((vec3s *)casters[c].bounds, light_view, light_box);
+    if (light_box[1].x < x - radius || light_box[0].x > x + radius ||
+        light_box[1].y < y - radius || light_box[0].y > y + radius ||
+        light_box[1].z < box[0].z) {
+      continue;
+    }
+    nearest = glm_max(nearest, light_box[1].z);
+    instances[kept++] = casters[c].model;
+  }
+
+  mat4s projection = glms_ortho(x - radius, x + radius, y - radius,
+                                y + radius, -nearest, -box[0].z);
+  s->view_projection[i] = glms_mat4_mul(projection, light_view);
+  return kept;
+}
+
+// Fits the cascades to this frame's view and draws `casters` into them.
+// `shader` is glsl/shadow_vs.glsl. Leaves the default framebuffer bound and
+// the viewport as it was.
+void shadow_cascades_render(ShadowCascades *shadows, Shader *shader,
+                            mat4s view, mat4s projection, vec3s direction,
+                            const ShadowCaster *casters, int32_t count,
+                            arena *frame) {
+  ShadowCascades *s = shadows;
+  vec4s corners[8];
+  glms_frustum_corners(glms_mat4_inv(projection), corners);
+  float near = -corners[GLM_LBN].z;
+  float far = -corners[GLM_LBF].z;
+  float end = glm_min(far, s->max_distance);
+
+  // Practical split scheme
+  for (int32_t i = 0; i <= s->count; i++) {
+    float t = (float)i / s->count;
+    float log_split = near * powf(end / near, t);
+    float uniform_split = near + (end - near) * t;
+    s->splits[i] = glm_lerp(uniform_split, log_split, s->split_lambda);
+  }
+
+  mat4s inv_view = glms_mat4_inv(view);
+  mat4s light_view = shadow_light_view(direction);
+  mat4s *instances = make_nozero(frame, mat4s, count * s->count + 1);
+  int32_t total = 0;
+  for (int32_t i = 0; i < s->count; i++) {
+    s->first[i] = total;
+    s->drawn[i] = shadow_fit_cascade(s, i, corners, near, far, inv_view,
+                                     light_view, casters, count,
+                                     instances + total);
+    total += s->drawn[i];
+  }
+
+  // Every cascade's matrices in one upload
+  glBindBuffer(GL_ARRAY_BUFFER, s->instances);
+  glBufferData(GL_ARRAY_BUFFER, total * sizeof(mat4s), instances,
+               GL_STREAM_DRAW);
+
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  glBindFramebuffer(GL_FRAMEBUFFER, s->FBO);
+  glViewport(0, 0, s->resolution, s->resolution);
+  // Slope scaled bias against acne on surfaces at grazing angles
+  glEnable(GL_POLYGON_OFFSET_FILL);
+  glPolygonOffset(1.5f, 2.0f);
+  shader_use(shader);
+  glBindVertexArray(s->VAO);
+  for (int32_t i = 0; i < s->count; i++) {
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, s->texture,
+                              0, i);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    if (!s->drawn[i]) {
+      continue;
+    }
+    shader_set_mat4(shader, "light_view_projection", s->view_projection[i]);
+    shadow_draw_instances(s->first[i], s->drawn[i], s->vertex_count);
+  }
+  glDisable(GL_POLYGON_OFFSET_FILL);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+}
+
+// Binds the depth array to `unit` and sets the shadow_* uniforms of
+// glsl/shadows.glsl, `shader` must be in use
+void shadow_cascades_use(ShadowCascades *shadows, Shader *shader,
+                         uint32_t unit) {
+  ShadowCascades *s = shadows;
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, s->texture);
+  shader_set_int(shader, "shadow_map", unit);
+  shader_set_int(shader, "shadow_cascade_count", s->count);
+
+  char name[32];
+  for (int32_t i = 0; i < s->count; i++) {
+    snprintf(name, sizeof(name), "shadow_matrices[%d]", i);
+    shader_set_mat4(shader, name,
+                    shadow_texture_space(s->view_projection[i]));
+    snprintf(name, sizeof(name), "shadow_texel[%d]", i);
+    shader_set_float(shader, name, s->texel[i]);
+  }
+}
+
+// `resolution` is the atlas' side in texels and `max_tile` the largest
+// tile, both powers of two of at least SHADOW_ATLAS_MIN_TILE. The caster
+// mesh is given as for shadow_cascades_init.
+bool shadow_atlas_init(ShadowAtlas *atlas, int32_t resolution,
+                       int32_t max_tile, GLuint mesh, GLsizei stride,
+                       int32_t vertex_count) {
+  ShadowAtlas *a = atlas;
+  *a = (ShadowAtlas){
+      .resolution = resolution,
+      .max_tile = max_tile < resolution ? max_tile : resolution,
+      .cells = resolution / SHADOW_ATLAS_MIN_TILE,
+      .vertex_count = vertex_count,
+  };
+  a->used = calloc(a->cells * a->cells, 1);
+  if (!a->used) {
+    return false;
+  }
+
+  glGenTextures(1, &a->texture);
+  glBindTexture(GL_TEXTURE_2D, a->texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, resolution,
+               resolution, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE,
+                  GL_COMPARE_REF_TO_TEXTURE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glGenFramebuffers(1, &a->FBO);
+  glBindFramebuffer(GL_FRAMEBUFFER, a->FBO);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D,
+                         a->texture, 0);
+  glDrawBuffer(GL_NONE);
+  glReadBuffer(GL_NONE);
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  shadow_caster_vao(mesh, stride, &a->VAO, &a->instances);
+
+  glGenBuffers(1, &a->tile_buffer);
+  glBindBuffer(GL_TEXTURE_BUFFER, a->tile_buffer);
+  glBufferData(GL_TEXTURE_BUFFER,
+               SHADOW_ATLAS_MAX_LIGHTS * SHADOW_ATLAS_FACES *
+                   SHADOW_ATLAS_TILE_TEXELS * sizeof(vec4s),
+               NULL, GL_DYNAMIC_DRAW);
+  glGenTextures(1, &a->tile_texture);
+  glBindTexture(GL_TEXTURE_BUFFER, a->tile_texture);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, a->tile_buffer);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+  if (status != GL_FRAMEBUFFER_COMPLETE) {
+    fprintf(stderr, "ERROR: Shadow atlas framebuffer incomplete (0x%x)\n",
+            status);
+    shadow_atlas_free(a);
+    return false;
+  }
+  return true;
+}
+
+void shadow_atlas_free(ShadowAtlas *atlas) {
+  free(atlas->used);
+  free(atlas->casters);
+  glDeleteFramebuffers(1, &atlas->FBO);
+  glDeleteTextures(1, &atlas->texture);
+  glDeleteVertexArrays(1, &atlas->VAO);
+  glDeleteBuffers(1, &atlas->instances);
+  glDeleteTextures(1, &atlas->tile_texture);
+  glDeleteBuffers(1, &atlas->tile_buffer);
+  *atlas = (ShadowAtlas){0};
+}
+
+static void shadow_atlas_mark(ShadowAtlas *a, int32_t x, int32_t y,
+                              int32_t size, uint8_t used) {
+  for (int32_t row = y; row < y + size; row++) {
+    memset(a->used + row * a->cells + x, used, size);
+  }
+}
+
+static bool shadow_atlas_block_free(ShadowAtlas *a, int32_t x, int32_t y,
+                                    int32_t size) {
+  for (int32_t row = y; row < y + size; row++) {
+    for (int32_t col = x; col < x + size; col++) {
+      if (a->used[row * a->cells + col]) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Takes the first free block of `size` cells aligned to its size
+static bool shadow_atlas_alloc(ShadowAtlas *a, int32_t size, int32_t *x,
+                               int32_t *y) {
+  for (int32_t ty = 0; ty + size <= a->cells; ty += size) {
+    for (int32_t tx = 0; tx + size <= a->cells; tx += size) {
+      if (shadow_atlas_block_free(a, tx, ty, size)) {
+        shadow_atlas_mark(a, tx, ty, size, 1);
+        *x = tx;
+        *y = ty;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static void shadow_atlas_release(ShadowAtlas *a, shadow_atlas_light *l) {
+  for (int32_t t = 0; t < l->tile_count; t++) {
+    shadow_atlas_mark(a, l->x[t], l->y[t], l->size, 0);
+  }
+  l->tile_count = 0;
+  l->cached = false;
+}
+
+// All of the light's tiles or none of them
+static bool shadow_atlas_alloc_light(ShadowAtlas *a, shadow_atlas_light *l,
+                                     int32_t tiles, int32_t size) {
+  for (int32_t t = 0; t < tiles; t++) {
+    if (!shadow_atlas_alloc(a, size, &l->x[t], &l->y[t])) {
+      for (int32_t u = 0; u < t; u++) {
+        shadow_atlas_mark(a, l->x[u], l->y[u], size, 0);
+      }
+      return false;
+    }
+  }
+  l->tile_count = tiles;
+  l->size = size;
+  l->cached = false;
+  return true;
+}
+
+static bool shadow_light_is_spot(const ShadowLight *light) {
+  return glms_vec3_norm2(light->direction) > 0.0f;
+}
+
+// Tile size in cells for the share of the screen the light's range covers
+static int32_t shadow_atlas_tile_size(ShadowAtlas *a,
+                                      const ShadowLight *light, mat4s view,
+                                      mat4s projection) {
+  float distance =
+      glms_vec3_norm(glms_mat4_mulv3(view, light->position, 1.0f));
+  float coverage = 1.0f;
+  if (distance > light->range) {
+    // Projected radius of the range's sphere over half the screen height
+    coverage = light->range * projection.m11 /
+               sqrtf(distance * distance - light->range * light->range);
+  }
+  float texels = glm_min(coverage, 1.0f) * a->max_tile;
+  int32_t size = 1;
+  while (size * SHADOW_ATLAS_MIN_TILE < texels &&
+         size * 2 * SHADOW_ATLAS_MIN_TILE <= a->max_tile) {
+    size *= 2;
+  }
+  return size;
+}
+
+// Keeps the light's tiles if they're still the right size, otherwise gets
+// new ones. Tiles only shrink once they're four times too big, so a light on
+// the edge between two sizes doesn't flip every frame, and a light that
+// can't grow keeps what it has.
+static void shadow_atlas_place(ShadowAtlas *a, shadow_atlas_light *l,
+                               int32_t tiles, int32_t size) {
+  if (l->tile_count && l->tile_count != tiles) {
+    shadow_atlas_release(a, l);
+  }
+  if (l->tile_count && size <= l->size && size * 2 >= l->size) {
+    return;
+  }
+  if (l->tile_count && size < l->size) {
+    shadow_atlas_release(a, l);
+  }
+  int32_t smallest = l->tile_count ? l->size * 2 : 1;
+  for (; size >= smallest; size /= 2) {
+    shadow_atlas_light placed = *l;
+    if (shadow_atlas_alloc_light(a, &placed, tiles, size)) {
+      shadow_atlas_release(a, l);
+      *l = placed;
+      return;
+    }
+  }
+}
+
+// Box / sphere overlap. cglm's glm_aabb_sphere measures from the wrong
+// corner when the center is below the box.
+static bool shadow_box_sphere(const vec3s box[2], vec3s center,
+                              float radius) {
+  float d2 = 0.0f;
+  for (int i = 0; i < 3; i++) {
+    float d = glm_max(glm_max(box[0].raw[i] - center.raw[i], 0.0f),
+                      center.raw[i] - box[1].raw[i]);
+    d2 += d * d;
+  }
+  return d2 <= radius * radius;
+}
+
+// Cube map face order, +x -x +y -y +z -z, with their usual up vectors
+static const vec3s shadow_face_directions[SHADOW_ATLAS_FACES] = {
+    {{1, 0, 0}}, {{-1, 0, 0}}, {{0, 1, 0}},
+    {{0, -1, 0}}, {{0, 0, 1}}, {{0, 0, -1}},
+};
+static const vec3s shadow_face_ups[SHADOW_ATLAS_FACES] = {
+    {{0, -1, 0}}, {{0, -1, 0}}, {{0, 0, 1}},
+    {{0, 0, -1}}, {{0, -1, 0}}, {{0, -1, 0}},
+};
+
+// Field of view of the light's tiles
+static float shadow_light_fov(const ShadowLight *light) {
+  if (!shadow_light_is_spot(light)) {
+    return GLM_PI_2f;
+  }
+  float fov = 2.0f * acosf(glm_clamp(light->outer_cutoff, 0.0f, 1.0f));
+  return glm_min(fov, glm_rad(SHADOW_ATLAS_MAX_SPOT_FOV));
+}
+
+static void shadow_atlas_fit_light(shadow_atlas_light *l) {
+  const ShadowLight *light = &l->light;
+  mat4s projection = glms_perspective(shadow_light_fov(light), 1.0f,
+                                      SHADOW_ATLAS_NEAR, light->range);
+  if (shadow_light_is_spot(light)) {
+    vec3s direction = glms_vec3_normalize(light->direction);
+    vec3s up = fabsf(direction.y) > 0.99f ? (vec3s){{1.0f, 0.0f, 0.0f}}
+                                          : (vec3s){{0.0f, 1.0f, 0.0f}};
+    l->view_projection[0] = glms_mat4_mul(
+        projection, glms_look(light->position, direction, up));
+    return;
+  }
+  for (int32_t f = 0; f < SHADOW_ATLAS_FACES; f++) {
+    mat4s view = glms_look(light->position, shadow_face_directions[f],
+                           shadow_face_ups[f]);
+    l->view_projection[f] = glms_mat4_mul(projection, view);
+  }
+}
+
+// Allocates tiles for `lights`, atlas slots 0 to count - 1, and redraws the
+// ones whose shadows changed. `shader` is glsl/shadow_vs.glsl. Leaves the
+// default framebuffer bound and the viewport as it was.
+void shadow_atlas_render(ShadowAtlas *atlas, Shader *shader,
+                         const ShadowLight *lights, int32_t count,
+                         mat4s view, mat4s projection,
+                         const ShadowCaster *casters, int32_t caster_count,
+                         arena *frame) {
+  ShadowAtlas *a = atlas;
+  if (count > SHADOW_ATLAS_MAX_LIGHTS) {
+    count = SHADOW_ATLAS_MAX_LIGHTS;
+  }
+  for (int32_t i = count; i < a->light_count; i++) {
+    shadow_atlas_release(a, &a->lights[i]);
+  }
+  a->light_count = count;
+
+  // Casters are matched with the last frame's by index
+  bool all_moved = caster_count != a->caster_count;
+  int32_t *moved = make_nozero(frame, int32_t, caster_count + 1);
+  int32_t moved_count = 0;
+  for (int32_t i = 0; i < caster_count && !all_moved; i++) {
+    if (memcmp(&casters[i].model, &a->casters[i].model, sizeof(mat4s))) {
+      moved[moved_count++] = i;
+    }
+  }
+
+  // Biggest tiles first, small ones would break up the free space
+  int32_t sizes[SHADOW_ATLAS_MAX_LIGHTS];
+  int32_t order[SHADOW_ATLAS_MAX_LIGHTS];
+  for (int32_t i = 0; i < count; i++) {
+    sizes[i] = shadow_atlas_tile_size(a, &lights[i], view, projection);
+    int32_t j = i;
+    for (; j > 0 && sizes[order[j - 1]] < sizes[i]; j--) {
+      order[j] = order[j - 1];
+    }
+    order[j] = i;
+  }
+
+  for (int32_t o = 0; o < count; o++) {
+    int32_t i = order[o];
+    shadow_atlas_light *l = &a->lights[i];
+    const ShadowLight *light = &lights[i];
+    if (memcmp(&l->light, light, sizeof(ShadowLight))) {
+      l->light = *light;
+      l->cached = false;
+    }
+    shadow_atlas_place(a, l, shadow_light_is_spot(light) ? 1
+                                                         : SHADOW_ATLAS_FACES,
+                       sizes[i]);
+    if (all_moved) {
+      l->cached = false;
+    }
+    for (int32_t m = 0; m < moved_count && l->cached; m++) {
+      const ShadowCaster *now = &casters[moved[m]];
+      const ShadowCaster *before = &a->casters[moved[m]];
+      if (shadow_box_sphere(now->bounds, light->position, light->range) ||
+          shadow_box_sphere(before->bounds, light->position, light->range)) {
+        l->cached = false;
+      }
+    }
+    if (l->tile_count) {
+      shadow_atlas_fit_light(l);
+    }
+  }
+
+  // Remember this frame's casters for the next
+  if (caster_count > a->caster_capacity) {
+    ShadowCaster *grown =
+        realloc(a->casters, caster_count * sizeof(ShadowCaster));
+    if (grown) {
+      a->casters = grown;
+      a->caster_capacity = caster_count;
+    }
+  }
+  a->caster_count = caster_count <= a->caster_capacity ? caster_count : -1;
+  if (a->caster_count > 0) {
+    memcpy(a->casters, casters, caster_count * sizeof(ShadowCaster));
+  }
+
+  // Every stale tile's casters, tile after tile, in one upload
+  enum { TILES = SHADOW_ATLAS_MAX_LIGHTS * SHADOW_ATLAS_FACES };
+  int32_t first[TILES];
+  int32_t drawn[TILES];
+  mat4s *instances = make_nozero(frame, mat4s, caster_count * TILES + 1);
+  int32_t total = 0;
+  a->tiles_drawn = 0;
+  a->tiles_cached = 0;
+  for (int32_t i = 0; i < count; i++) {
+    shadow_atlas_light *l = &a->lights[i];
+    if (l->cached) {
+      a->tiles_cached += l->tile_count;
+      continue;
+    }
+    for (int32_t t = 0; t < l->tile_count; t++) {
+      vec4s planes[6];
+      glms_frustum_planes(l->view_projection[t], planes);
+      int32_t tile = i * SHADOW_ATLAS_FACES + t;
+      first[tile] = total;
+      for (int32_t c = 0; c < caster_count; c++) {
+        if (glms_aabb_frustum((vec3s *)casters[c].bounds, planes)) {
+          instances[total++] = casters[c].model;
+        }
+      }
+      drawn[tile] = total - first[tile];
+    }
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, a->instances);
+  glBufferData(GL_ARRAY_BUFFER, total * sizeof(mat4s), instances,
+               GL_STREAM_DRAW);
+
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  glBindFramebuffer(GL_FRAMEBUFFER, a->FBO);
+  glEnable(GL_SCISSOR_TEST);
+  glEnable(GL_POLYGON_OFFSET_FILL);
+  glPolygonOffset(1.5f, 2.0f);
+  shader_use(shader);
+  glBindVertexArray(a->VAO);
+  for (int32_t i = 0; i < count; i++) {
+    shadow_atlas_light *l = &a->lights[i];
+    if (l->cached) {
+      continue;
+    }
+    int32_t side = l->size * SHADOW_ATLAS_MIN_TILE;
+    for (int32_t t = 0; t < l->tile_count; t++) {
+      int32_t tile = i * SHADOW_ATLAS_FACES + t;
+      int32_t x = l->x[t] * SHADOW_ATLAS_MIN_TILE;
+      int32_t y = l->y[t] * SHADOW_ATLAS_MIN_TILE;
+      glViewport(x, y, side, side);
+      glScissor(x, y, side, side);
+      glClear(GL_DEPTH_BUFFER_BIT);
+      if (drawn[tile]) {
+        shader_set_mat4(shader, "light_view_projection",
+                        l->view_projection[t]);
+        shadow_draw_instances(first[tile], drawn[tile], a->vertex_count);
+      }
+      a->tiles_drawn++;
+    }
+    l->cached = true;
+  }
+  glDisable(GL_POLYGON_OFFSET_FILL);
+  glDisable(GL_SCISSOR_TEST);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+  // Per tile: world to [0, 1] tile space, then the tile's corner and size
+  // in atlas texture space and the world size of a texel one unit from the
+  // light. Tiles of unshadowed slots have size 0.
+  vec4s texels[TILES * SHADOW_ATLAS_TILE_TEXELS] = {0};
+  for (int32_t i = 0; i < count; i++) {
+    shadow_atlas_light *l = &a->lights[i];
+    float size = (float)l->size / a->cells;
+    float texel = 2.0f * tanf(shadow_light_fov(&l->light) * 0.5f) /
+                  (l->size * SHADOW_ATLAS_MIN_TILE);
+    for (int32_t t = 0; t < l->tile_count; t++) {
+      vec4s *out =
+          &texels[(i * SHADOW_ATLAS_FACES + t) * SHADOW_ATLAS_TILE_TEXELS];
+      mat4s m = shadow_texture_space(l->view_projection[t]);
+      memcpy(out, &m, sizeof(m));
+      out[4] = (vec4s){{(float)l->x[t] / a->cells,
+                        (float)l->y[t] / a->cells, size, texel}};
+    }
+  }
+  glBindBuffer(GL_TEXTURE_BUFFER, a->tile_buffer);
+  glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(texels), texels);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+// Binds the atlas to `unit` and its tiles to `unit + 1` for the
+// shadow_atlas uniforms of glsl/shadows.glsl, `shader` must be in use.
+// Lights refer to their slot plus one, 0 being unshadowed.
+void shadow_atlas_use(ShadowAtlas *atlas, Shader *shader, uint32_t unit) {
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(GL_TEXTURE_2D, atlas->texture);
+  glActiveTexture(GL_TEXTURE0 + unit + 1);
+  glBindTexture(GL_TEXTURE_BUFFER, atlas->tile_texture);
+  shader_set_int(shader, "shadow_atlas", unit);
+  shader_set_int(shader, "shadow_atlas_tiles", unit + 1);
+}
+
+void shadow_atlas_report(ShadowAtlas *atlas, FILE *stream) {
+  int32_t used = 0;
+  for (int32_t i = 0; i < atlas->cells * atlas->cells; i++) {
+    used += atlas->used[i];
+  }
+  fprintf(stream,
+          "Shadow atlas: %d lights, %d tiles drawn, %d cached, %.0f%% full\n",
+          atlas->light_count, atlas->tiles_drawn, atlas->tiles_cached,
+          100.0 * used / (atlas->cells * atlas->cells));
+}
+
+#endif // SHADOW_IMPLEMENTATION
@@ -0,0 +1,172 @@
+#ifndef SLOTMAP_H_
+#define SLOTMAP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+
+// Generational Slot Map
+//
+// Stable handles to objects created and destroyed at runtime (meshes,
+// textures, lights, entities). A handle is a slot index plus the slot's
+// generation; removing an object bumps the generation, so old handles fail
+// to resolve instead of aliasing whatever reuses the slot. Objects are kept
+// densely packed (removal swaps the last one into the hole), so iterating
+// them is a linear walk over `data`.
+//
+// Storage comes from the arena. Growing copies every array and leaves the
+// old ones in the arena, so size `cap` for the expected peak count.
+#define new_slotmap_of(a, t, cap) new_slotmap(a, sizeof(t), _Alignof(t), cap)
+#define slotmap_data(m, t) ((t *)(m)->data)
+
+typedef struct {
+  uint32_t index;
+  uint32_t generation; // 0 is never a live generation, {0, 0} is invalid
+} handle;
+
+typedef struct {
+  uint32_t generation;
+  uint32_t dense; // Dense index when live, next free slot otherwise
+} slotmap_slot;
+
+typedef struct {
+  arena *a;
+  ptrdiff_t size;
+  ptrdiff_t align;
+
+  uint8_t *data;     // Dense objects
+  uint32_t *owners;  // Dense index -> slot
+  ptrdiff_t len;
+  ptrdiff_t cap;
+
+  slotmap_slot *slots;
+  ptrdiff_t slot_count;
+  uint32_t free_head;
+} slotmap;
+
+slotmap new_slotmap(arena *a, ptrdiff_t size, ptrdiff_t align,
+                    ptrdiff_t cap);
+handle slotmap_insert(slotmap *m, void **object);
+void *slotmap_get(slotmap *m, handle h);
+bool slotmap_remove(slotmap *m, handle h);
+handle slotmap_handle_at(slotmap *m, ptrdiff_t dense);
+
+#endif // SLOTMAP_H_
+
+// #define SLOTMAP_IMPLEMENTATION
+#ifdef SLOTMAP_IMPLEMENTATION
+
+#define SLOTMAP_NONE UINT32_MAX
+
+// Objects of `size` bytes aligned to `align`, room for `cap` before the
+// first growth
+slotmap new_slotmap(arena *a, ptrdiff_t size, ptrdiff_t align,
+                    ptrdiff_t cap) {
+  cap = cap > 0 ? cap : 16;
+  return (slotmap){
+      .a = a,
+      .size = size,
+      .align = align,
+      .data = alloc_nozero(a, size, align, cap),
+      .owners = make_nozero(a, uint32_t, cap),
+      .cap = cap,
+      .slots = make_nozero(a, slotmap_slot, cap),
+      .free_head = SLOTMAP_NONE,
+  };
+}
+
+// Doubles every array. Slots and dense storage always share a capacity
+// since there are never more slots than the peak object count. The old
+// arrays stay in the arena.
+static void slotmap_grow(slotmap *m) {
+  ptrdiff_t cap = m->cap * 2;
+
+  uint8_t *data = alloc_nozero(m->a, m->size, m->align, cap);
+  memcpy(data, m->data, m->len * m->size);
+  uint32_t *owners = make_nozero(m->a, uint32_t, cap);
+  memcpy(owners, m->owners, m->len * sizeof(uint32_t));
+  slotmap_slot *slots = make_nozero(m->a, slotmap_slot, cap);
+  memcpy(slots, m->slots, m->slot_count * sizeof(slotmap_slot));
+
+  m->data = data;
+  m->owners = owners;
+  m->slots = slots;
+  m->cap = cap;
+}
+
+// Adds a zeroed object, stores its address in `object` (valid until the
+// next insert or remove) and returns its handle.
+handle slotmap_insert(slotmap *m, void **object) {
+  if (m->len == m->cap) {
+    slotmap_grow(m);
+  }
+
+  uint32_t index;
+  if (m->free_head != SLOTMAP_NONE) {
+    index = m->free_head;
+    m->free_head = m->slots[index].dense;
+  } else {
+    index = m->slot_count++;
+    m->slots[index].generation = 0;
+  }
+
+  slotmap_slot *slot = &m->slots[index];
+  slot->generation = slot->generation + 1 ? slot->generation + 1 : 1;
+  slot->dense = m->len;
+  m->owners[m->len] = index;
+
+  void *p = memset(m->data + m->len * m->size, 0, m->size);
+  m->len++;
+  if (object) {
+    *object = p;
+  }
+  return (handle){index, slot->generation};
+}
+
+// Returns the object or NULL if the handle is stale
+void *slotmap_get(slotmap *m, handle h) {
+  if (h.index >= m->slot_count) {
+    return NULL;
+  }
+  slotmap_slot *slot = &m->slots[h.index];
+  // A free slot's `dense` is a free list link, the owner check rejects it
+  if (slot->generation != h.generation || slot->dense >= m->len ||
+      m->owners[slot->dense] != h.index) {
+    return NULL;
+  }
+  return m->data + slot->dense * m->size;
+}
+
+bool slotmap_remove(slotmap *m, handle h) {
+  if (!slotmap_get(m, h)) {
+    return false;
+  }
+
+  slotmap_slot *slot = &m->slots[h.index];
+  uint32_t dense = slot->dense;
+  uint32_t last = m->len - 1;
+
+  // Keep storage dense, the last object takes the hole
+  if (dense != last) {
+    memcpy(m->data + dense * m->size, m->data + last * m->size, m->size);
+    m->owners[dense] = m->owners[last];
+    m->slots[m->owners[dense]].dense = dense;
+  }
+  m->len--;
+
+  slot->generation++;
+  slot->dense = m->free_head;
+  m->free_head = h.index;
+  return true;
+}
+
+// Handle of the object at dense position `dense`, for use while iterating
+handle slotmap_handle_at(slotmap *m, ptrdiff_t dense) {
+  uint32_t index = m->owners[dense];
+  return (handle){index, m->slots[index].generation};
+}
+
+#endif // SLOTMAP_IMPLEMENTATION
@@ -9,4 +9,7 @@ typedef struct {
   ptrdiff_t len;
 } string;
 
+// String literal to `string`, without the null terminator
+#define S(s) ((string){(uint8_t *)(s), (ptrdiff_t)sizeof(s) - 1})
+
 #endif // STR_H_
@@ -0,0 +1,573 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <GL/glew.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef STBI_INCLUDE_STB_IMAGE_H
+#include "../include/stb_image.h"
+#endif
+#include "arena.h"
+#include "file.h"
+#include "texture_array.h"
+
+// Texture Cache
+//
+// Textures are keyed by their normalized path ("./a//b.png" and "a/b.png" are
+// the same file), so asking twice for the same file returns the same handle
+// and the image is decoded and uploaded once.
+// Handles are reference counted: a released texture stays resident in an LRU
+// list and is only deleted when the cache goes over its VRAM budget (or runs
+// out of slots), so a re-load shortly after a release is free.
+//
+// Texture arrays are cached the same way, keyed by their list of map paths.
+// A path listed twice is decoded once and both get the same region.
+
+typedef struct {
+  uint32_t index;
+  uint32_t generation; // 0 is never a live generation, {0, 0} is invalid
+} TextureHandle;
+
+typedef struct {
+  uint64_t hash;
+  char *key; // Normalized path, the hash is only a first filter
+  GLuint ID;
+  GLenum target;
+  int32_t width;
+  int32_t height;
+  int32_t channels;
+  int32_t layers;
+  TextureRegion *regions; // Where each path of an array landed
+  ptrdiff_t bytes;        // Estimated VRAM, mip chain included
+  int32_t refs;
+  uint32_t generation;
+  // Links in the LRU list of unreferenced textures. Free slots reuse
+  // `lru_next` as their free list link.
+  int32_t lru_prev;
+  int32_t lru_next;
+} Texture;
+
+typedef struct {
+  Texture *textures;
+  int32_t *table; // Open addressing, path -> texture index (-1 empty)
+  int32_t capacity;
+  int32_t table_cap;
+
+  int32_t free_head;
+  int32_t lru_head; // Most recently released
+  int32_t lru_tail; // Next eviction candidate
+
+  ptrdiff_t budget;
+  ptrdiff_t resident;
+  int32_t count;
+} TextureCache;
+
+TextureCache new_texture_cache(arena *a, int32_t capacity, ptrdiff_t budget);
+void texture_cache_free(TextureCache *cache);
+TextureHandle texture_cache_load(TextureCache *cache, const char *path);
+TextureHandle texture_cache_load_array(TextureCache *cache, const char **paths,
+                                       int32_t count, TextureRegion *regions,
+                                       aio *io, arena *scratch);
+void texture_cache_retain(TextureCache *cache, TextureHandle handle);
+void texture_cache_release(TextureCache *cache, TextureHandle handle);
+GLuint texture_cache_get(TextureCache *cache, TextureHandle handle);
+void texture_cache_bind(TextureCache *cache, TextureHandle handle,
+                        uint32_t unit);
+void texture_cache_set_budget(TextureCache *cache, ptrdiff_t budget);
+ptrdiff_t texture_cache_resident(TextureCache *cache);
+void texture_cache_report(TextureCache *cache, FILE *stream);
+
+// Helpers
+uint64_t hash_path(const char *path);
+char *normalize_path(const char *path);
+bool generate_texture(const char *path, Texture *texture);
+
+#endif // TEXTURE_H
+
+// #define TEXTURE_IMPLEMENTATION
+#ifdef TEXTURE_IMPLEMENTATION
+
+static void texture_cache_trim(TextureCache *cache, ptrdiff_t budget);
+
+// Creates a cache with room for `capacity` textures and a VRAM budget in
+// bytes. Storage comes from the arena, so it lives as long as the arena does.
+TextureCache new_texture_cache(arena *a, int32_t capacity, ptrdiff_t budget) {
+  TextureCache cache = {
+      .capacity = capacity,
+      .free_head = -1,
+      .lru_head = -1,
+      .lru_tail = -1,
+      .budget = budget,
+  };
+
+  // Keep the load factor at or below 50%
+  cache.table_cap = 1;
+  while (cache.table_cap < capacity * 2) {
+    cache.table_cap *= 2;
+  }
+
+  cache.textures = make(a, Texture, capacity);
+  cache.table = make(a, int32_t, cache.table_cap);
+  memset(cache.table, 0xff, cache.table_cap * sizeof(int32_t));
+
+  for (int32_t i = capacity - 1; i >= 0; i--) {
+    cache.textures[i].lru_next = cache.free_head;
+    cache.free_head = i;
+  }
+
+  return cache;
+}
+
+// Deletes every resident texture. Outstanding handles become stale.
+void texture_cache_free(TextureCache *cache) {
+  for (int32_t i = 0; i < cache->capacity; i++) {
+    if (cache->textures[i].ID) {
+      glDeleteTextures(1, &cache->textures[i].ID);
+      cache->textures[i].ID = 0;
+    }
+    free(cache->textures[i].key);
+    free(cache->textures[i].regions);
+    cache->textures[i].key = NULL;
+    cache->textures[i].regions = NULL;
+  }
+  cache->resident = 0;
+  cache->count = 0;
+}
+
+// ------------------------------------------------------------------------
+
+// Returns the slot holding `key`, or the empty slot it would go in
+static int32_t *texture_cache_find(TextureCache *cache, uint64_t hash,
+                                   const char *key) {
+  uint32_t mask = cache->table_cap - 1;
+  for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+    int32_t index = cache->table[i];
+    if (index < 0 || (cache->textures[index].hash == hash &&
+                      !strcmp(cache->textures[index].key, key))) {
+      return &cache->table[i];
+    }
+  }
+}
+
+// Linear probing removal with backward shift, so no tombstones pile up.
+static void texture_cache_unlink(TextureCache *cache, int32_t index) {
+  uint32_t mask = cache->table_cap - 1;
+  uint32_t hole = cache->textures[index].hash & mask;
+  while (cache->table[hole] != index) {
+    hole = (hole + 1) & mask;
+  }
+  cache->table[hole] = -1;
+
+  for (uint32_t i = (hole + 1) & mask; cache->table[i] >= 0;
+       i = (i + 1) & mask) {
+    uint32_t home = cache->textures[cache->table[i]].hash & mask;
+    // Move the entry back only if its home slot is not in (hole, i]
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      cache->table[hole] = cache->table[i];
+      cache->table[i] = -1;
+      hole = i;
+    }
+  }
+}
+
+static void texture_cache_lru_remove(TextureCache *cache, int32_t index) {
+  Texture *t = &cache->textures[index];
+  if (t->lru_prev >= 0) {
+    cache->textures[t->lru_prev].lru_next = t->lru_next;
+  } else {
+    cache->lru_head = t->lru_next;
+  }
+  if (t->lru_next >= 0) {
+    cache->textures[t->lru_next].lru_prev = t->lru_prev;
+  } else {
+    cache->lru_tail = t->lru_prev;
+  }
+  t->lru_prev = t->lru_next = -1;
+}
+
+static void texture_cache_lru_push(TextureCache *cache, int32_t index) {
+  Texture *t = &cache->textures[index];
+  t->lru_prev = -1;
+  t->lru_next = cache->lru_head;
+  if (cache->lru_head >= 0) {
+    cache->textures[cache->lru_head].lru_prev = index;
+  } else {
+    cache->lru_tail = index;
+  }
+  cache->lru_head = index;
+}
+
+static void texture_cache_evict(TextureCache *cache, int32_t index) {
+  Texture *t = &cache->textures[index];
+
+  texture_cache_lru_remove(cache, index);
+  texture_cache_unlink(cache, index);
+  glDeleteTextures(1, &t->ID);
+  free(t->key);
+  free(t->regions);
+
+  cache->resident -= t->bytes;
+  cache->count--;
+
+  uint32_t generation = t->generation;
+  *t = (Texture){0};
+  t->generation = generation;
+  t->lru_next = cache->free_head;
+  cache->free_head = index;
+}
+
+// Evicts unreferenced textures, least recently released first, until the
+// resident size fits in `budget`.
+static void texture_cache_trim(TextureCache *cache, ptrdiff_t budget) {
+  while (cache->resident > budget && cache->lru_tail >= 0) {
+    texture_cache_evict(cache, cache->lru_tail);
+  }
+}
+
+static Texture *texture_cache_lookup(TextureCache *cache,
+                                     TextureHandle handle) {
+  if (handle.index >= (uint32_t)cache->capacity) {
+    return NULL;
+  }
+  Texture *t = &cache->textures[handle.index];
+  if (!t->ID || t->generation != handle.generation) {
+    return NULL;
+  }
+  return t;
+}
+
+// ------------------------------------------------------------------------
+
+// Takes a reference to the texture stored under `key`. Returns -1 when it
+// isn't resident.
+static int32_t texture_cache_acquire(TextureCache *cache, uint64_t hash,
+                                     const char *key) {
+  int32_t index = *texture_cache_find(cache, hash, key);
+  if (index >= 0 && cache->textures[index].refs++ == 0) {
+    texture_cache_lru_remove(cache, index);
+  }
+  return index;
+}
+
+// Out of slots, recycle the least recently released texture
+static bool texture_cache_make_room(TextureCache *cache, const char *path) {
+  if (cache->free_head >= 0) {
+    return true;
+  }
+  if (cache->lru_tail < 0) {
+    fprintf(stderr,
+            "ERROR: Texture cache is full (%d textures referenced)\nFile: "
+            "%s\n",
+            cache->capacity, path);
+    return false;
+  }
+  texture_cache_evict(cache, cache->lru_tail);
+  return true;
+}
+
+// Moves a freshly uploaded texture into a free slot with one reference
+static TextureHandle texture_cache_insert(TextureCache *cache,
+                                          Texture loaded) {
+  int32_t index = cache->free_head;
+  Texture *t = &cache->textures[index];
+  cache->free_head = t->lru_next;
+
+  loaded.refs = 1;
+  loaded.generation = t->generation + 1 ? t->generation + 1 : 1;
+  loaded.lru_prev = loaded.lru_next = -1;
+  *t = loaded;
+
+  // The eviction that freed the slot may have moved entries in the table
+  *texture_cache_find(cache, t->hash, t->key) = index;
+
+  cache->resident += t->bytes;
+  cache->count++;
+  texture_cache_trim(cache, cache->budget);
+
+  if (cache->resident > cache->budget) {
+    fprintf(stderr,
+            "WARNING: Referenced textures exceed the VRAM budget (%td > %td "
+            "bytes)\n",
+            cache->resident, cache->budget);
+  }
+
+  return (TextureHandle){(uint32_t)index, t->generation};
+}
+
+// Returns a handle to the texture at `path`, loading it only if it is not
+// already resident. Every successful call must be paired with a release.
+TextureHandle texture_cache_load(TextureCache *cache, const char *path) {
+  char *key = normalize_path(path);
+  if (!key) {
+    return (TextureHandle){0};
+  }
+  uint64_t hash = hash_path(key);
+
+  int32_t index = texture_cache_acquire(cache, hash, key);
+  if (index >= 0) {
+    free(key);
+    return (TextureHandle){(uint32_t)index, cache->textures[index].generation};
+  }
+
+  Texture loaded = {.hash = hash, .key = key};
+  if (!texture_cache_make_room(cache, path) ||
+      !generate_texture(path, &loaded)) {
+    free(key);
+    return (TextureHandle){0};
+  }
+  return texture_cache_insert(cache, loaded);
+}
+
+// Returns a handle to a texture array of the maps at `paths` (see
+// new_texture_array) and fills in each map's region. The same list of paths
+// gives back the same array. `io` and `scratch` are only used on a miss.
+TextureHandle texture_cache_load_array(TextureCache *cache, const char **paths,
+                                       int32_t count, TextureRegion *regions,
+                                       aio *io, arena *scratch) {
+  arena_temp temp = arena_temp_begin(scratch);
+
+  // The key is every normalized path, one per line
+  char **keys = make(scratch, char *, count);
+  ptrdiff_t key_len = 0;
+  for (int32_t i = 0; i < count; i++) {
+    keys[i] = normalize_path(paths[i]);
+    key_len += keys[i] ? (ptrdiff_t)strlen(keys[i]) + 1 : 0;
+  }
+  char *key = malloc(key_len + 1);
+  TextureHandle handle = {0};
+  if (!key) {
+    goto done;
+  }
+  key[0] = '\0';
+  for (int32_t i = 0; i < count; i++) {
+    if (!keys[i]) {
+      free(key);
+      goto done;
+    }
+    strcat(strcat(key, keys[i]), "\n");
+  }
+  uint64_t hash = hash_path(key);
+
+  int32_t index = texture_cache_acquire(cache, hash, key);
+  if (index >= 0) {
+    free(key);
+    memcpy(regions, cache->textures[index].regions, count * sizeof(*regions));
+    handle =
+        (TextureHandle){(uint32_t)index, cache->textures[index].generation};
+    goto done;
+  }
+
+  // Each distinct path goes into the array once
+  const char **unique = make(scratch, const char *, count);
+  int32_t *slot = make(scratch, int32_t, count);
+  int32_t unique_count = 0;
+  for (int32_t i = 0; i < count; i++) {
+    slot[i] = unique_count;
+    for (int32_t j = 0; j < i; j++) {
+      if (!strcmp(keys[i], keys[j])) {
+        slot[i] = slot[j];
+        break;
+      }
+    }
+    if (slot[i] == unique_count) {
+      unique[unique_count++] = paths[i];
+    }
+  }
+
+  Texture loaded = {
+      .hash = hash,
+      .key = key,
+      .target = GL_TEXTURE_2D_ARRAY,
+      .channels = 4,
+      .regions = malloc(count * sizeof(TextureRegion)),
+  };
+  TextureRegion *unique_regions = make(scratch, TextureRegion, unique_count);
+  if (!loaded.regions || !texture_cache_make_room(cache, paths[0])) {
+    free(key);
+    free(loaded.regions);
+    goto done;
+  }
+  TextureArray array =
+      new_texture_array(unique, unique_count, unique_regions, io, scratch);
+  if (!array.ID) {
+    free(key);
+    free(loaded.regions);
+    goto done;
+  }
+  for (int32_t i = 0; i < count; i++) {
+    loaded.regions[i] = regions[i] = unique_regions[slot[i]];
+  }
+  loaded.ID = array.ID;
+  loaded.width = array.width;
+  loaded.height = array.height;
+  loaded.layers = array.layers;
+  loaded.bytes = (ptrdiff_t)array.width * array.height * 4 * array.layers *
+                 4 / 3;
+  handle = texture_cache_insert(cache, loaded);
+
+done:
+  for (int32_t i = 0; i < count; i++) {
+    free(keys[i]);
+  }
+  arena_temp_end(temp);
+  return handle;
+}
+
+void texture_cache_retain(TextureCache *cache, TextureHandle handle) {
+  Texture *t = texture_cache_lookup(cache, handle);
+  if (t && t->refs++ == 0) {
+    texture_cache_lru_remove(cache, handle.index);
+  }
+}
+
+// Drops a reference. The texture stays resident until the budget needs the
+// space back.
+void texture_cache_release(TextureCache *cache, TextureHandle handle) {
+  Texture *t = texture_cache_lookup(cache, handle);
+  if (!t || t->refs <= 0) {
+    return;
+  }
+  if (--t->refs == 0) {
+    texture_cache_lru_push(cache, handle.index);
+    texture_cache_trim(cache, cache->budget);
+  }
+}
+
+// Returns the GL texture name, or 0 if the handle is stale.
+GLuint texture_cache_get(TextureCache *cache, TextureHandle handle) {
+  Texture *t = texture_cache_lookup(cache, handle);
+  return t ? t->ID : 0;
+}
+
+void texture_cache_bind(TextureCache *cache, TextureHandle handle,
+                        uint32_t unit) {
+  Texture *t = texture_cache_lookup(cache, handle);
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(t ? t->target : GL_TEXTURE_2D, t ? t->ID : 0);
+}
+
+void texture_cache_set_budget(TextureCache *cache, ptrdiff_t budget) {
+  cache->budget = budget;
+  texture_cache_trim(cache, budget);
+}
+
+ptrdiff_t texture_cache_resident(TextureCache *cache) {
+  return cache->resident;
+}
+
+void texture_cache_report(TextureCache *cache, FILE *stream) {
+  int32_t unreferenced = 0;
+  for (int32_t i = cache->lru_head; i >= 0;
+       i = cache->textures[i].lru_next) {
+    unreferenced++;
+  }
+
+  fprintf(stream,
+          "Textures: %d resident (%d unreferenced), %.2f / %.2f MiB\n",
+          cache->count, unreferenced, cache->resident / (1024.0 * 1024.0),
+          cache->budget / (1024.0 * 1024.0));
+}
+
+// Helpers
+// ------------------------------------------------------------------------
+
+// 64-bit FNV-1a. Never returns 0 so a zeroed slot can't match a path.
+uint64_t hash_path(const char *path) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (const uint8_t *p = (const uint8_t *)path; *p; p++) {
+    hash ^= *p;
+    hash *= 0x100000001b3ull;
+  }
+  return hash ? hash : 1;
+}
+
+// Returns a malloc'd copy of `path` without "." segments and repeated
+// slashes. ".." is kept, resolving it would need the file system.
+char *normalize_path(const char *path) {
+  char *key = malloc(strlen(path) + 1);
+  if (!key) {
+    return NULL;
+  }
+  char *out = key;
+  for (const char *p = path; *p;) {
+    bool segment_start = p == path || p[-1] == '/';
+    if (segment_start && p[0] == '.' && (p[1] == '/' || !p[1])) {
+      p += p[1] ? 2 : 1;
+    } else if (p[0] == '/' && out > key && out[-1] == '/') {
+      p++;
+    } else {
+      *out++ = *p++;
+    }
+  }
+  *out = '\0';
+  return key;
+}
+
+// Decodes an image (from the mounted pack when it has it, see file_mount)
+// and uploads it with a full mip chain. Fills the GL name, size and VRAM
+// estimate of `texture`.
+bool generate_texture(const char *path, Texture *texture) {
+  stbi_set_flip_vertically_on_load(true);
+
+  int32_t width, height, nr_channels;
+  uint8_t *data = NULL;
+  arena_temp scratch = arena_scratch_begin(NULL, 0);
+  string file;
+  if (read_mounted(path, scratch.a, &file)) {
+    data = stbi_load_from_memory(file.data, (int)file.len, &width, &height,
+                                 &nr_channels, 0);
+  }
+  arena_scratch_end(scratch);
+  if (!data) {
+    data = stbi_load(path, &width, &height, &nr_channels, 0);
+  }
+  if (!data) {
+    fprintf(stderr, "ERROR: Failed to load texture at path: %s\n", path);
+    return false;
+  }
+
+  GLenum format = GL_RGBA;
+  if (nr_channels == 1)
+    format = GL_RED;
+  if (nr_channels == 2)
+    format = GL_RG;
+  if (nr_channels == 3)
+    format = GL_RGB;
+
+  GLuint ID;
+  glGenTextures(1, &ID);
+  glBindTexture(GL_TEXTURE_2D, ID);
+
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                  GL_LINEAR_MIPMAP_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+  // Rows of 1 and 3 channel images aren't 4 byte aligned
+  GLint alignment;
+  glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format,
+               GL_UNSIGNED_BYTE, data);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+  glGenerateMipmap(GL_TEXTURE_2D);
+
+  stbi_image_free(data);
+
+  texture->ID = ID;
+  texture->target = GL_TEXTURE_2D;
+  texture->width = width;
+  texture->height = height;
+  texture->channels = nr_channels;
+  // Base level plus a third for the mip chain
+  texture->bytes = (ptrdiff_t)width * height * nr_channels * 4 / 3;
+  return true;
+}
+
+#endif // TEXTURE_IMPLEMENTATION
@@ -0,0 +1,334 @@
+#ifndef TEXTURE_ARRAY_H
+#define TEXTURE_ARRAY_H
+
+#include <GL/glew.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef STBI_INCLUDE_STB_IMAGE_H
+#include "../include/stb_image.h"
+#endif
+#include "../include/cglm/types-struct.h"
+#include "aio.h"
+#include "arena.h"
+#include "file.h"
+
+// Texture Arrays
+//
+// Packs many material maps into the layers of one GL_TEXTURE_2D_ARRAY, so a
+// batch of differently textured objects needs a single bind and only passes
+// a layer index (and UV rect) per object. Maps of the layer size get a layer
+// of their own; smaller, odd sized maps are shelf packed together into shared
+// layers and get a UV rect to remap into their region.
+//
+// The array clamps to its edges. Packed maps sit in cells aligned to and
+// padded by TEXTURE_ARRAY_PADDING texels, with their edge texels repeated out
+// to the cell border. Arrays with shared layers stop their mip chain at
+// TEXTURE_ARRAY_MAX_LEVEL, so no mip texel mixes two cells and bilinear
+// filtering of a UV clamped half a texel inside a rect (see material.glsl)
+// stays in the map's own border.
+#define TEXTURE_ARRAY_MAX_LEVEL 4
+#define TEXTURE_ARRAY_PADDING (1 << TEXTURE_ARRAY_MAX_LEVEL)
+
+typedef struct {
+  int32_t layer;
+  vec4s rect; // xy: UV scale, zw: UV offset inside the layer
+} TextureRegion;
+
+typedef struct {
+  GLuint ID;
+  int32_t width;
+  int32_t height;
+  int32_t layers;
+} TextureArray;
+
+TextureArray new_texture_array(const char **paths, int32_t count,
+                               TextureRegion *regions, aio *io,
+                               arena *scratch);
+void texture_array_bind(TextureArray *array, uint32_t unit);
+void texture_array_free(TextureArray *array);
+
+#endif // TEXTURE_ARRAY_H
+
+// #define TEXTURE_ARRAY_IMPLEMENTATION
+#ifdef TEXTURE_ARRAY_IMPLEMENTATION
+
+typedef struct {
+  int32_t index;
+  int32_t width;
+  int32_t height;
+  // Cell in the layer, the map sits `border` texels in from its corner
+  int32_t x;
+  int32_t y;
+  int32_t cell_width;
+  int32_t cell_height;
+  int32_t border;
+  int32_t layer;
+  uint8_t *pixels; // Decoded up front when loading through aio
+} texture_array_rect;
+
+// Decoded on an aio worker, the upload happens later on the GL thread
+static void texture_array_decode(aio_read *read, void *user) {
+  texture_array_rect *r = user;
+  if (read->error) {
+    return;
+  }
+  int32_t channels;
+  r->pixels = stbi_load_from_memory(read->data.data, (int)read->data.len,
+                                    &r->width, &r->height, &channels, 4);
+}
+
+// Decodes the map from the mounted pack, if there is one and it has the map
+static void texture_array_decode_mounted(texture_array_rect *r,
+                                         const char *path, arena *scratch) {
+  arena_temp temp = arena_temp_begin(scratch);
+  string data;
+  if (read_mounted(path, scratch, &data)) {
+    int32_t channels;
+    r->pixels = stbi_load_from_memory(data.data, (int)data.len, &r->width,
+                                      &r->height, &channels, 4);
+  }
+  arena_temp_end(temp);
+}
+
+static int texture_array_by_height(const void *a, const void *b) {
+  const texture_array_rect *ra = a;
+  const texture_array_rect *rb = b;
+  if (ra->height != rb->height) {
+    return rb->height - ra->height;
+  }
+  return rb->width - ra->width;
+}
+
+static int32_t texture_array_align(int32_t n) {
+  return (n + TEXTURE_ARRAY_PADDING - 1) & ~(TEXTURE_ARRAY_PADDING - 1);
+}
+
+static void texture_array_free_pixels(texture_array_rect *rects,
+                                      int32_t count) {
+  for (int32_t i = 0; i < count; i++) {
+    stbi_image_free(rects[i].pixels);
+    rects[i].pixels = NULL;
+  }
+}
+
+// Copies the map into its cell and repeats the edge texels out to the cell
+// border
+static uint8_t *texture_array_fill_cell(const texture_array_rect *r,
+                                        const uint8_t *pixels,
+                                        arena *scratch) {
+  uint8_t *cell =
+      make_nozero(scratch, uint8_t, r->cell_width * r->cell_height * 4);
+  for (int32_t y = 0; y < r->cell_height; y++) {
+    int32_t sy = y - r->border;
+    sy = sy < 0 ? 0 : sy >= r->height ? r->height - 1 : sy;
+    for (int32_t x = 0; x < r->cell_width; x++) {
+      int32_t sx = x - r->border;
+      sx = sx < 0 ? 0 : sx >= r->width ? r->width - 1 : sx;
+      memcpy(cell + (y * r->cell_width + x) * 4,
+             pixels + (sy * r->width + sx) * 4, 4);
+    }
+  }
+  return cell;
+}
+
+// Builds an RGBA8 array from `paths` and writes where each one landed in
+// `regions`. The layer size is the largest image, an image wider or taller
+// than that layer is rejected. Temporary data comes from `scratch`. Returns
+// an array with ID 0 if any image fails to load or fit.
+//
+// Maps in a mounted pack (see file_mount) are decoded from it first. With
+// an `io` the other files are read in one batch and decoded in parallel on
+// the aio threads; without one each image is decoded in turn while
+// uploading.
+TextureArray new_texture_array(const char **paths, int32_t count,
+                               TextureRegion *regions, aio *io,
+                               arena *scratch) {
+  TextureArray array = {0};
+  texture_array_rect *rects = make(scratch, texture_array_rect, count);
+  for (int32_t i = 0; i < count; i++) {
+    rects[i].index = i;
+  }
+
+  stbi_set_flip_vertically_on_load(true);
+  for (int32_t i = 0; i < count; i++) {
+    texture_array_decode_mounted(&rects[i], paths[i], scratch);
+  }
+  if (io) {
+    aio_read *reads = make(scratch, aio_read, count);
+    int32_t read_count = 0;
+    for (int32_t i = 0; i < count; i++) {
+      if (!rects[i].pixels) {
+        reads[read_count++] = (aio_read){
+            .path = paths[i],
+            .done = texture_array_decode,
+            .user = &rects[i],
+        };
+      }
+    }
+    if (read_count) {
+      aio_submit(io, reads, read_count, scratch);
+      aio_wait(io);
+    }
+  }
+
+  // 1. Query sizes, without decoding unless the pack or aio already did
+  for (int32_t i = 0; i < count; i++) {
+    int32_t channels;
+    if (!rects[i].pixels &&
+        (io || !stbi_info(paths[i], &rects[i].width, &rects[i].height,
+                          &channels))) {
+      fprintf(stderr, "ERROR: Failed to load texture at path: %s\n",
+              paths[i]);
+      texture_array_free_pixels(rects, count);
+      return (TextureArray){0};
+    }
+    if (rects[i].width * rects[i].height > array.width * array.height) {
+      array.width = rects[i].width;
+      array.height = rects[i].height;
+    }
+  }
+
+  // 2. Maps of the layer size, or too big for a padded cell, take a layer
+  // each; the rest go on shelves
+  qsort(rects, count, sizeof(*rects), texture_array_by_height);
+
+  bool shared_layers = false;
+  int32_t shelf_layer = -1;
+  int32_t shelf_x = 0, shelf_y = 0, shelf_h = 0;
+  for (int32_t i = 0; i < count; i++) {
+    texture_array_rect *r = &rects[i];
+    if (r->width > array.width || r->height > array.height) {
+      fprintf(stderr,
+              "ERROR: Texture %s (%dx%d) does not fit a %dx%d array layer\n",
+              paths[r->index], r->width, r->height, array.width,
+              array.height);
+      texture_array_free_pixels(rects, count);
+      return (TextureArray){0};
+    }
+
+    int32_t w = texture_array_align(r->width + TEXTURE_ARRAY_PADDING);
+    int32_t h = texture_array_align(r->height + TEXTURE_ARRAY_PADDING);
+    bool full = r->width == array.width && r->height == array.height;
+    if (full || w > array.width || h > array.height) {
+      r->layer = array.layers++;
+      r->cell_width = array.width;
+      r->cell_height = array.height;
+      continue;
+    }
+
+    if (shelf_layer >= 0 && shelf_x + w > array.width) {
+      shelf_x = 0;
+      shelf_y += shelf_h;
+      shelf_h = 0;
+    }
+    if (shelf_layer < 0 || shelf_y + h > array.height) {
+      shelf_layer = array.layers++;
+      shelf_x = shelf_y = shelf_h = 0;
+    }
+    shared_layers = true;
+    r->layer = shelf_layer;
+    r->x = shelf_x;
+    r->y = shelf_y;
+    r->cell_width = w;
+    r->cell_height = h;
+    r->border = TEXTURE_ARRAY_PADDING / 2;
+    shelf_x += w;
+    shelf_h = h > shelf_h ? h : shelf_h;
+  }
+
+  // 3. Allocate every layer once, then upload into place
+  glGenTextures(1, &array.ID);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, array.ID);
+
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER,
+                  GL_LINEAR_MIPMAP_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  if (shared_layers) {
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL,
+                    TEXTURE_ARRAY_MAX_LEVEL);
+  }
+
+  glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, array.width, array.height,
+               array.layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+  // Shared layers start out black, the space between shelves is never read
+  if (shared_layers) {
+    uint8_t *zero = make(scratch, uint8_t, array.width * array.height * 4);
+    for (int32_t layer = 0; layer < array.layers; layer++) {
+      bool shared = false;
+      for (int32_t i = 0; i < count && !shared; i++) {
+        shared = rects[i].layer == layer && rects[i].border;
+      }
+      if (shared) {
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, array.width,
+                        array.height, 1, GL_RGBA, GL_UNSIGNED_BYTE, zero);
+      }
+    }
+  }
+
+  GLint alignment;
+  glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  for (int32_t i = 0; i < count; i++) {
+    texture_array_rect *r = &rects[i];
+
+    int32_t width, height, nr_channels;
+    uint8_t *data = r->pixels;
+    if (!data) {
+      data = stbi_load(paths[r->index], &width, &height, &nr_channels, 4);
+    }
+    if (!data || (!r->pixels && (width != r->width || height != r->height))) {
+      fprintf(stderr, "ERROR: Failed to load texture at path: %s\n",
+              paths[r->index]);
+      stbi_image_free(data);
+      texture_array_free_pixels(rects, count);
+      glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+      texture_array_free(&array);
+      return (TextureArray){0};
+    }
+    r->pixels = data;
+
+    arena_temp temp = arena_temp_begin(scratch);
+    const uint8_t *cell = data;
+    if (r->cell_width != r->width || r->cell_height != r->height) {
+      cell = texture_array_fill_cell(r, data, scratch);
+    }
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, r->x, r->y, r->layer,
+                    r->cell_width, r->cell_height, 1, GL_RGBA,
+                    GL_UNSIGNED_BYTE, cell);
+    arena_temp_end(temp);
+    stbi_image_free(data);
+    r->pixels = NULL;
+
+    regions[r->index] = (TextureRegion){
+        .layer = r->layer,
+        .rect = {{(float)r->width / array.width,
+                  (float)r->height / array.height,
+                  (float)(r->x + r->border) / array.width,
+                  (float)(r->y + r->border) / array.height}},
+    };
+  }
+  glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+
+  glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+
+  return array;
+}
+
+void texture_array_bind(TextureArray *array, uint32_t unit) {
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, array->ID);
+}
+
+void texture_array_free(TextureArray *array) {
+  glDeleteTextures(1, &array->ID);
+  array->ID = 0;
+}
+
+#endif // TEXTURE_ARRAY_IMPLEMENTATION
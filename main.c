@@ -17,12 +17,32 @@
 
 #define SHADER_IMPLEMENTATION
 #include "lib/shader.h"
+#define PACK_IMPLEMENTATION
+#include "lib/pack.h"
 #define CAMERA_IMPLEMENTATION
 #include "lib/camera.h"
+#define AIO_IMPLEMENTATION
+#define TEXTURE_ARRAY_IMPLEMENTATION
+#define TEXTURE_IMPLEMENTATION
+#include "lib/texture.h"
+#define CLUSTER_IMPLEMENTATION
+#include "lib/cluster.h"
+#define GBUFFER_IMPLEMENTATION
+#include "lib/gbuffer.h"
+#define QUERY_IMPLEMENTATION
+#include "lib/query.h"
+#define OCCLUSION_IMPLEMENTATION
+#include "lib/occlusion.h"
+#define DEPTH_RASTER_IMPLEMENTATION
+#include "lib/depth_raster.h"
+#define SHADOW_IMPLEMENTATION
+#include "lib/shadow.h"
+#define LOD_IMPLEMENTATION
+#include "lib/lod.h"
 
 void process_input(GLFWwindow *window);
+bool key_toggled(GLFWwindow *window, int key, bool *was_down);
 void framebuffer_size_callback(GLFWwindow *window, int width, int height);
-uint32_t generate_texture(const char *path);
 
 void mouse_callback(GLFWwindow *window, double x_pos, double y_pos);
 void scroll_callback(GLFWwindow *window, double x_pos, double y_pos);
@@ -43,6 +63,33 @@ float lastFrame = 0.0f;
 
 // Light
 vec3s light_pos = {{0.0f, 1.0f, 2.0f}};
+vec3s dir_light_direction = {{-0.2f, -1.0f, -0.3f}};
+// Toggled with L, a swarm of small lights on top of the scene's four
+bool light_swarm = false;
+enum { SWARM_LIGHTS = 1024 };
+
+// Toggled with G, lights the cubes from a G-buffer instead of while drawing
+bool deferred = false;
+// Toggled with P, lays down the cubes' depth first so only the visible
+// fragment of each pixel gets shaded
+bool depth_prepass = false;
+// Toggled with O, cubes hidden behind others are left out of the queue
+bool occlusion_culling = true;
+// Toggled with C, cubes behind others in a CPU rendered depth buffer are
+// never submitted
+bool software_culling = true;
+// Toggled with R, prints shading, culling, shadow, LOD and texture stats
+// once a second
+bool stats_report = false;
+
+// Per frame draw command, lives in the frame arena
+typedef struct {
+  mat4s model;
+  vec3s bounds[2]; // World space box, for occlusion tests
+  int32_t lod;
+  TextureRegion diffuse;
+  TextureRegion specular;
+} DrawCommand;
 
 int main(void) {
   if (!glfwInit()) {
@@ -77,8 +124,56 @@ int main(void) {
 
   glEnable(GL_DEPTH_TEST);
 
-  Shader cube_shader = new_shader("./glsl/cube_vs.glsl", "./glsl/cube_fs.glsl");
-  Shader lamp_shader = new_shader("./glsl/lamp_vs.glsl", "./glsl/lamp_fs.glsl");
+  // Shaders and textures come out of assets.pack (make pack) when there is
+  // one, loose files cover whatever it lacks. The arena only backs a pack
+  // that can't be mapped.
+  arena pack_arena = new_arena_virtual((ptrdiff_t)1 << 32);
+  pack assets;
+  if (pack_open(&assets, "assets.pack", &pack_arena) == FILE_OK) {
+    pack_mount(&assets);
+  }
+
+  // Edits to glsl/ show up without a restart
+  ShaderWatcher shader_watcher;
+  shader_watcher_init(&shader_watcher);
+
+  // Shaders compile in the background while the rest of the setup runs,
+  // the batch is finished right before they're first used
+  ShaderBatch shader_batch = {0};
+
+  // Point lights are binned into clusters, so the cube shader takes any
+  // number of them, and the directional light casts shadows
+  ShaderVariants cube_variants = new_shader_variants(
+      "./glsl/cube_vs.glsl", "./glsl/cube_fs.glsl", &shader_watcher);
+  const char *cube_defines[] = {"CLUSTERED", "SHADOWS"};
+  Shader *cube_shader =
+      shader_variant_queue(&cube_variants, cube_defines, 2, &shader_batch);
+  if (!cube_shader) {
+    glfwTerminate();
+    return -1;
+  }
+  Shader lamp_shader;
+  shader_batch_add(&shader_batch, &lamp_shader, "./glsl/lamp_vs.glsl",
+                   "./glsl/lamp_fs.glsl", NULL, 0);
+  shader_watch(&shader_watcher, &lamp_shader);
+  // Deferred path: the cubes go into the G-buffer, then one full-screen
+  // pass lights every pixel once
+  Shader gbuffer_shader;
+  shader_batch_add(&shader_batch, &gbuffer_shader, "./glsl/cube_vs.glsl",
+                   "./glsl/gbuffer_fs.glsl", NULL, 0);
+  shader_watch(&shader_watcher, &gbuffer_shader);
+  Shader deferred_shader;
+  shader_batch_add(&shader_batch, &deferred_shader, "./glsl/fullscreen_vs.glsl",
+                   "./glsl/deferred_fs.glsl", cube_defines, 2);
+  shader_watch(&shader_watcher, &deferred_shader);
+  Shader depth_shader;
+  shader_batch_add(&shader_batch, &depth_shader, "./glsl/depth_vs.glsl",
+                   "./glsl/depth_fs.glsl", NULL, 0);
+  shader_watch(&shader_watcher, &depth_shader);
+  Shader shadow_shader;
+  shader_batch_add(&shader_batch, &shadow_shader, "./glsl/shadow_vs.glsl",
+                   "./glsl/depth_fs.glsl", NULL, 0);
+  shader_watch(&shader_watcher, &shadow_shader);
 
   float vertices[] = {
       // positions          // normals           // texture coords
@@ -137,6 +232,8 @@ int main(void) {
       {{1.5f, 0.2f, -1.5f}},    //
       {{-1.3f, 1.0f, -1.5f}}    //
   };
+  // Level each cube was last drawn with
+  int32_t cube_lods[sizeof(cube_positions) / sizeof(*cube_positions)] = {0};
 
   vec3s point_light_positions[] = {
       {{0.7f, 0.2f, 2.0f}},    //
@@ -144,6 +241,51 @@ int main(void) {
       {{-4.0f, 2.0f, -12.0f}}, //
       {{0.0f, 0.0f, -3.0f}}    //
   };
+  enum { POINT_LIGHTS = sizeof(point_light_positions) /
+                        sizeof(*point_light_positions) };
+
+  // One occlusion query per cube
+  OcclusionCuller culler;
+  if (!occlusion_init(&culler,
+                      sizeof(cube_positions) / sizeof(*cube_positions))) {
+    fprintf(stderr, "ERROR: Failed to allocate the occlusion culler\n");
+    glfwTerminate();
+    return -1;
+  }
+
+  // Occluder bands and light binning run on this thread and three workers
+  job_pool jobs;
+  if (!job_pool_init(&jobs, 4)) {
+    fprintf(stderr, "ERROR: Failed to start the worker threads\n");
+    glfwTerminate();
+    return -1;
+  }
+  if (jobs.thread_count < 4) {
+    fprintf(stderr, "WARNING: Running jobs on %d threads\n",
+            jobs.thread_count);
+  }
+
+  // Occluders are rasterized at a quarter of the window's width and height
+  DepthRaster depth_raster;
+  if (!depth_raster_init(&depth_raster, SCR_WIDTH / 4, SCR_HEIGHT / 4,
+                         &jobs)) {
+    fprintf(stderr, "ERROR: Failed to allocate the occlusion depth buffer\n");
+    glfwTerminate();
+    return -1;
+  }
+
+  // Swarm lights are scattered around the cubes, each with its own color
+  static vec3s swarm_positions[SWARM_LIGHTS];
+  static vec3s swarm_colors[SWARM_LIGHTS];
+  srand(1);
+  for (int32_t i = 0; i < SWARM_LIGHTS; i++) {
+    swarm_positions[i] = (vec3s){{-6.0f + 12.0f * rand() / RAND_MAX,
+                                  -4.0f + 10.0f * rand() / RAND_MAX,
+                                  -16.0f + 18.0f * rand() / RAND_MAX}};
+    swarm_colors[i] = (vec3s){{0.2f + 0.8f * rand() / RAND_MAX,
+                               0.2f + 0.8f * rand() / RAND_MAX,
+                               0.2f + 0.8f * rand() / RAND_MAX}};
+  }
 
   // VBO
   uint32_t VBO;
@@ -152,11 +294,19 @@ int main(void) {
   glBindBuffer(GL_ARRAY_BUFFER, VBO);
   glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
 
-  // Cube
+  // Cube, simplified into its levels of detail
+  LodMesh cube_mesh;
+  if (!lod_mesh_init(&cube_mesh, vertices, 36, 8, 3)) {
+    fprintf(stderr, "ERROR: Failed to build the cube's levels of detail\n");
+    glfwTerminate();
+    return -1;
+  }
   uint32_t cube_VAO;
 
   glGenVertexArrays(1, &cube_VAO);
   glBindVertexArray(cube_VAO);
+  glBindBuffer(GL_ARRAY_BUFFER, cube_mesh.VBO);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cube_mesh.EBO);
 
   glVertexAttribPointer(0, 3, GL_FLOAT, false, 8 * sizeof(float), NULL);
   glEnableVertexAttribArray(0);
@@ -180,18 +330,82 @@ int main(void) {
   glVertexAttribPointer(0, 3, GL_FLOAT, false, 8 * sizeof(float), NULL);
   glEnableVertexAttribArray(0);
 
+  // Full-screen triangle, positions come from gl_VertexID
+  uint32_t fullscreen_VAO;
+  glGenVertexArrays(1, &fullscreen_VAO);
+
   glBindVertexArray(0);
 
+  GBuffer gbuffer = new_gbuffer(SCR_WIDTH, SCR_HEIGHT);
+  if (!gbuffer.FBO) {
+    glfwTerminate();
+    return -1;
+  }
+
+  // Four 2048 x 2048 cascades, casters are cubes
+  ShadowCascades shadows;
+  if (!shadow_cascades_init(&shadows, 4, 2048, VBO, 8 * sizeof(float), 36)) {
+    glfwTerminate();
+    return -1;
+  }
+  // Point and spot light shadows, tiles of up to 1024 x 1024
+  ShadowAtlas shadow_atlas;
+  if (!shadow_atlas_init(&shadow_atlas, 4096, 1024, VBO, 8 * sizeof(float),
+                         36)) {
+    glfwTerminate();
+    return -1;
+  }
+
   // Camera
   camera = new_camera_default((vec3s){{0.0f, 0.0f, 3.0f}});
 
   // Texture
-  uint32_t diffuseMap = generate_texture("./textures/container2.png");
-  uint32_t specularMap = generate_texture("./textures/container2_specular.png");
+  arena asset_arena = new_arena(1024 * 1024 * 4);
+  arena texture_arena = new_arena(1024 * 64);
+  TextureCache textures = new_texture_cache(&texture_arena, 256, 256l << 20);
+  // Asset files are read in batches, decoding runs on the I/O threads
+  aio io;
+  if (!aio_init(&io, 64, 4, 0)) {
+    fprintf(stderr, "ERROR: Failed to start the asset I/O threads\n");
+    glfwTerminate();
+    return -1;
+  }
 
-  shader_use(&cube_shader);
-  shader_set_int(&cube_shader, "material.diffuse", 0);
-  shader_set_int(&cube_shader, "material.specular", 1);
+  // Every cube material shares one array, one bind covers the whole batch
+  enum { DIFFUSE, SPECULAR, SPECULAR_COLORED, MAP_COUNT };
+  const char *map_paths[MAP_COUNT] = {
+      [DIFFUSE] = "./textures/container2.png",
+      [SPECULAR] = "./textures/container2_specular.png",
+      [SPECULAR_COLORED] = "./textures/container2_specular_colored.png",
+  };
+  TextureRegion maps[MAP_COUNT] = {0};
+  TextureHandle material_maps = texture_cache_load_array(
+      &textures, map_paths, MAP_COUNT, maps, &io, &asset_arena);
+  arena_reset(&asset_arena);
+  if (!texture_cache_get(&textures, material_maps)) {
+    glfwTerminate();
+    return -1;
+  }
+
+  ClusterGrid clusters;
+  if (!cluster_grid_init(&clusters, &jobs)) {
+    fprintf(stderr, "ERROR: Failed to allocate the light clusters\n");
+    glfwTerminate();
+    return -1;
+  }
+
+  shader_batch_finish(&shader_batch);
+  shader_use(cube_shader);
+  shader_set_int(cube_shader, "material.maps", 0);
+  shader_use(&gbuffer_shader);
+  shader_set_int(&gbuffer_shader, "material.maps", 0);
+
+  // Transient per frame allocations, reset every other frame
+  frame_arena frames = new_frame_arena(1024 * 1024 * 256);
+
+  // Fragments the cube shading pass ran for, for the stats report
+  GpuCounter shaded = new_gpu_counter(GL_SAMPLES_PASSED);
+  float last_report = 0.0f;
 
   // Main rendering loop
   while (!glfwWindowShouldClose(window)) {
@@ -199,17 +413,28 @@ int main(void) {
     deltaTime = currentFrame - lastFrame;
     lastFrame = currentFrame;
 
+    arena *frame = frame_arena_begin(&frames);
+
+    // Reloaded programs start with default uniforms, redo the one-time ones
+    if (shader_watcher_poll(&shader_watcher)) {
+      shader_use(cube_shader);
+      shader_set_int(cube_shader, "material.maps", 0);
+      shader_use(&gbuffer_shader);
+      shader_set_int(&gbuffer_shader, "material.maps", 0);
+    }
+
     // Render here
     process_input(window);
     glClearColor(0x1e / 255.0, 0x29 / 255.0, 0x3b / 255.0, 1.0);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // Active Shader
-    shader_use(&cube_shader);
-    shader_set_vec3(&cube_shader, "viewPos", camera.Position);
+    // Forward shades the cubes while drawing them, deferred draws them into
+    // the G-buffer and shades afterwards
+    Shader *geometry = deferred ? &gbuffer_shader : cube_shader;
+    Shader *lit = deferred ? &deferred_shader : cube_shader;
 
-    // Cube material
-    shader_set_float(&cube_shader, "material.shininess", 32.0f * 2);
+    shader_use(lit);
+    shader_set_vec3(lit, "viewPos", camera.Position);
 
     light_pos.x = sin(glfwGetTime()) * 2.0f;
     light_pos.z = cos(glfwGetTime()) * 1.0f;
@@ -219,115 +444,272 @@ int main(void) {
     // Light
 
     // directional light
-    shader_set_vec3(&cube_shader, "dir_light.direction",
-                    (vec3s){{-0.2f, -1.0f, -0.3f}});
-    shader_set_vec3(&cube_shader, "dir_light.ambient",
-                    (vec3s){{0.05f, 0.05f, 0.05f}});
-    shader_set_vec3(&cube_shader, "dir_light.diffuse",
-                    (vec3s){{0.4f, 0.4f, 0.4f}});
-    shader_set_vec3(&cube_shader, "dir_light.specular",
-                    (vec3s){{0.5f, 0.5f, 0.5f}});
-    // point light 1
-    shader_set_vec3(&cube_shader, "point_lights[0].position",
-                    point_light_positions[0]);
-    shader_set_vec3(&cube_shader, "point_lights[0].ambient",
-                    (vec3s){{0.05f, 0.05f, 0.05f}});
-    shader_set_vec3(&cube_shader, "point_lights[0].diffuse",
-                    (vec3s){{0.8f, 0.8f, 0.8f}});
-    shader_set_vec3(&cube_shader, "point_lights[0].specular",
-                    (vec3s){{1.0f, 1.0f, 1.0f}});
-    shader_set_float(&cube_shader, "point_lights[0].constant", 1.0f);
-    shader_set_float(&cube_shader, "point_lights[0].linear", 0.09f);
-    shader_set_float(&cube_shader, "point_lights[0].quadratic", 0.032f);
-    // point light 2
-    shader_set_vec3(&cube_shader, "point_lights[1].position",
-                    point_light_positions[1]);
-    shader_set_vec3(&cube_shader, "point_lights[1].ambient",
-                    (vec3s){{0.05f, 0.05f, 0.05f}});
-    shader_set_vec3(&cube_shader, "point_lights[1].diffuse",
-                    (vec3s){{0.8f, 0.8f, 0.8f}});
-    shader_set_vec3(&cube_shader, "point_lights[1].specular",
-                    (vec3s){{1.0f, 1.0f, 1.0f}});
-    shader_set_float(&cube_shader, "point_lights[1].constant", 1.0f);
-    shader_set_float(&cube_shader, "point_lights[1].linear", 0.09f);
-    shader_set_float(&cube_shader, "point_lights[1].quadratic", 0.032f);
-    // point light 3
-    shader_set_vec3(&cube_shader, "point_lights[2].position",
-                    point_light_positions[2]);
-    shader_set_vec3(&cube_shader, "point_lights[2].ambient",
-                    (vec3s){{0.05f, 0.05f, 0.05f}});
-    shader_set_vec3(&cube_shader, "point_lights[2].diffuse",
-                    (vec3s){{0.8f, 0.8f, 0.8f}});
-    shader_set_vec3(&cube_shader, "point_lights[2].specular",
-                    (vec3s){{1.0f, 1.0f, 1.0f}});
-    shader_set_float(&cube_shader, "point_lights[2].constant", 1.0f);
-    shader_set_float(&cube_shader, "point_lights[2].linear", 0.09f);
-    shader_set_float(&cube_shader, "point_lights[2].quadratic", 0.032f);
-    // point light 4
-    shader_set_vec3(&cube_shader, "point_lights[3].position",
-                    point_light_positions[3]);
-    shader_set_vec3(&cube_shader, "point_lights[3].ambient",
-                    (vec3s){{0.05f, 0.05f, 0.05f}});
-    shader_set_vec3(&cube_shader, "point_lights[3].diffuse",
-                    (vec3s){{0.8f, 0.8f, 0.8f}});
-    shader_set_vec3(&cube_shader, "point_lights[3].specular",
-                    (vec3s){{1.0f, 1.0f, 1.0f}});
-    shader_set_float(&cube_shader, "point_lights[3].constant", 1.0f);
-    shader_set_float(&cube_shader, "point_lights[3].linear", 0.09f);
-    shader_set_float(&cube_shader, "point_lights[3].quadratic", 0.032f);
+    shader_set_vec3(lit, "dir_light.direction", dir_light_direction);
+    shader_set_vec3(lit, "dir_light.ambient", (vec3s){{0.05f, 0.05f, 0.05f}});
+    shader_set_vec3(lit, "dir_light.diffuse", (vec3s){{0.4f, 0.4f, 0.4f}});
+    shader_set_vec3(lit, "dir_light.specular", (vec3s){{0.5f, 0.5f, 0.5f}});
     // spotLight
-    shader_set_vec3(&cube_shader, "spot_light.position", camera.Position);
-    shader_set_vec3(&cube_shader, "spot_light.direction", camera.Front);
-    shader_set_vec3(&cube_shader, "spot_light.ambient",
-                    (vec3s){{0.0f, 0.0f, 0.0f}});
-    shader_set_vec3(&cube_shader, "spot_light.diffuse",
-                    (vec3s){{1.0f, 1.0f, 1.0f}});
-    shader_set_vec3(&cube_shader, "spot_light.specular",
-                    (vec3s){{1.0f, 1.0f, 1.0f}});
-    shader_set_float(&cube_shader, "spot_light.constant", 1.0f);
-    shader_set_float(&cube_shader, "spot_light.linear", 0.09f);
-    shader_set_float(&cube_shader, "spot_light.quadratic", 0.032f);
-    shader_set_float(&cube_shader, "spot_light.cutOff", cos(glm_rad(12.5f)));
-    shader_set_float(&cube_shader, "spot_light.outerCutOff",
-                     cos(glm_rad(15.0f)));
+    ClusterLight spot = {
+        .position = camera.Position,
+        .direction = camera.Front,
+        .cutoff = cos(glm_rad(12.5f)),
+        .outer_cutoff = cos(glm_rad(15.0f)),
+        .diffuse = {{1.0f, 1.0f, 1.0f}},
+        .specular = {{1.0f, 1.0f, 1.0f}},
+        .constant = 1.0f,
+        .linear = 0.09f,
+        .quadratic = 0.032f,
+    };
+    shader_set_vec3(lit, "spot_light.position", spot.position);
+    shader_set_vec3(lit, "spot_light.direction", spot.direction);
+    shader_set_vec3(lit, "spot_light.ambient", spot.ambient);
+    shader_set_vec3(lit, "spot_light.diffuse", spot.diffuse);
+    shader_set_vec3(lit, "spot_light.specular", spot.specular);
+    shader_set_float(lit, "spot_light.constant", spot.constant);
+    shader_set_float(lit, "spot_light.linear", spot.linear);
+    shader_set_float(lit, "spot_light.quadratic", spot.quadratic);
+    shader_set_float(lit, "spot_light.cutoff", spot.cutoff);
+    shader_set_float(lit, "spot_light.outer_cutoff", spot.outer_cutoff);
+    shader_set_int(lit, "spot_light_shadow", POINT_LIGHTS + 1);
 
     ////////////////////
 
-    // Cube Texture
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, diffuseMap);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, specularMap);
-
     // Transformations
     mat4s projection = glms_mat4_identity();
     projection =
         glms_perspective(glm_rad(camera.Fov),
                          (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
-    shader_set_mat4(&cube_shader, "projection", projection);
-
     mat4s view = camera_get_view_matrix(&camera);
-    shader_set_mat4(&cube_shader, "view", view);
 
-    mat4s model = glms_mat4_identity();
-    shader_set_mat4(&cube_shader, "model", model);
+    // point lights, binned for this frame's view
+    int32_t light_count = POINT_LIGHTS + (light_swarm ? SWARM_LIGHTS : 0);
+    ClusterLight *lights = make(frame, ClusterLight, light_count);
+    // The four point lights take the first atlas slots, the spot light the
+    // next; their shadows reach as far as their light does
+    ShadowLight shadow_lights[POINT_LIGHTS + 1];
+    for (int32_t i = 0; i < POINT_LIGHTS; i++) {
+      lights[i] = (ClusterLight){
+          .position = point_light_positions[i],
+          .ambient = {{0.05f, 0.05f, 0.05f}},
+          .diffuse = {{0.8f, 0.8f, 0.8f}},
+          .specular = {{1.0f, 1.0f, 1.0f}},
+          .constant = 1.0f,
+          .linear = 0.09f,
+          .quadratic = 0.032f,
+          .shadow = i + 1,
+      };
+      shadow_lights[i] = (ShadowLight){
+          .position = lights[i].position,
+          .range = cluster_light_radius(&lights[i]),
+      };
+    }
+    shadow_lights[POINT_LIGHTS] = (ShadowLight){
+        .position = spot.position,
+        .direction = spot.direction,
+        .outer_cutoff = spot.outer_cutoff,
+        .range = cluster_light_radius(&spot),
+    };
+    for (int32_t i = POINT_LIGHTS; i < light_count; i++) {
+      int32_t s = i - POINT_LIGHTS;
+      vec3s position = swarm_positions[s];
+      position.y += sin(currentFrame + s) * 0.5f;
+      lights[i] = (ClusterLight){
+          .position = position,
+          .diffuse = swarm_colors[s],
+          .specular = swarm_colors[s],
+          .constant = 1.0f,
+          .linear = 0.35f,
+          .quadratic = 0.44f,
+          .range = 2.0f,
+      };
+    }
+    cluster_grid_update(&clusters, lights, light_count, view, projection,
+                        (vec2s){{SCR_WIDTH, SCR_HEIGHT}}, frame);
+    cluster_grid_use(&clusters, lit, 1);
+
+    // The lighting pass rebuilds world positions from the G-buffer depth
+    if (deferred) {
+      shader_set_mat4(lit, "inverse_view_projection",
+                      glms_mat4_inv(glms_mat4_mul(projection, view)));
+    }
 
-    glBindVertexArray(cube_VAO);
-    // glDrawArrays(GL_TRIANGLES, 0, 36);
+    // Build the render queue, then submit it
+    int32_t draw_count = sizeof(cube_positions) / sizeof(*cube_positions);
+    DrawCommand *draws = make_nozero(frame, DrawCommand, draw_count);
+    float lod_scale = lod_screen_scale(&camera, SCR_HEIGHT);
 
-    for (unsigned int i = 0; i < 10; i++) {
+    for (int32_t i = 0; i < draw_count; i++) {
       mat4s model = glms_mat4_identity();
       model = glms_translate(model, cube_positions[i]);
       float angle = 20.0f * i;
       model = glms_rotate(model, glm_rad(angle), (vec3s){{1.0f, 0.3f, 0.5f}});
-      shader_set_mat4(&cube_shader, "model", model);
 
-      glDrawArrays(GL_TRIANGLES, 0, 36);
+      // Alternate specular maps, only the layer changes between draws
+      draws[i] = (DrawCommand){
+          .model = model,
+          .diffuse = maps[DIFFUSE],
+          .specular = maps[i % 2 ? SPECULAR_COLORED : SPECULAR],
+      };
+      vec3s cube_box[2] = {{{-0.5f, -0.5f, -0.5f}}, {{0.5f, 0.5f, 0.5f}}};
+      glms_aabb_transform(cube_box, model, draws[i].bounds);
+      cube_lods[i] = lod_select(&cube_mesh, cube_lods[i], model,
+                                draws[i].bounds, camera.Position, lod_scale);
+      draws[i].lod = cube_lods[i];
+    }
+
+    // Every cube is an occluder too, at 12 triangles each
+    if (software_culling) {
+      depth_raster_begin(&depth_raster, glms_mat4_mul(projection, view),
+                         frame);
+      for (int32_t i = 0; i < draw_count; i++) {
+        depth_raster_add_occluder(&depth_raster, vertices, 8, 36,
+                                  draws[i].model);
+      }
+      depth_raster_render(&depth_raster);
+    }
+
+    // Cubes hidden in this frame's CPU depth buffer, or occluded when the
+    // GPU last tested them, stay out of the queue. The GPU tests after the
+    // cube pass bring them back once they show.
+    DrawCommand *visible = draws;
+    int32_t visible_count = draw_count;
+    if (software_culling || occlusion_culling) {
+      if (occlusion_culling) {
+        occlusion_begin_frame(&culler);
+      }
+      visible = make_nozero(frame, DrawCommand, draw_count);
+      visible_count = 0;
+      for (int32_t i = 0; i < draw_count; i++) {
+        if ((!software_culling ||
+             depth_raster_test_box(&depth_raster, draws[i].bounds)) &&
+            (!occlusion_culling || occlusion_visible(&culler, i))) {
+          visible[visible_count++] = draws[i];
+        }
+      }
+    }
+
+    // Every cube casts, culled or not, a hidden cube's shadow can still
+    // fall on a visible one
+    ShadowCaster *casters = make_nozero(frame, ShadowCaster, draw_count);
+    for (int32_t i = 0; i < draw_count; i++) {
+      casters[i] = (ShadowCaster){
+          .model = draws[i].model,
+          .bounds = {draws[i].bounds[0], draws[i].bounds[1]},
+      };
+    }
+    shadow_cascades_render(&shadows, &shadow_shader, view, projection,
+                           dir_light_direction, casters, draw_count, frame);
+    // Only lights whose shadows changed are drawn again
+    shadow_atlas_render(&shadow_atlas, &shadow_shader, shadow_lights,
+                        POINT_LIGHTS + 1, view, projection, casters,
+                        draw_count, frame);
+    shader_use(lit);
+    shadow_cascades_use(&shadows, lit, 8);
+    shadow_atlas_use(&shadow_atlas, lit, 9);
+
+    if (deferred) {
+      gbuffer_bind(&gbuffer);
+      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    // Depth only, then shade where the depth matches. Each pixel is shaded
+    // once however many cubes overlap it.
+    if (depth_prepass) {
+      shader_use(&depth_shader);
+      shader_set_mat4(&depth_shader, "projection", projection);
+      shader_set_mat4(&depth_shader, "view", view);
+      glColorMask(false, false, false, false);
+      glBindVertexArray(cube_VAO);
+      for (int32_t i = 0; i < visible_count; i++) {
+        shader_set_mat4(&depth_shader, "model", visible[i].model);
+        lod_mesh_draw(&cube_mesh, visible[i].lod);
+      }
+      glColorMask(true, true, true, true);
+      glDepthFunc(GL_EQUAL);
+      glDepthMask(false);
+    }
+
+    shader_use(geometry);
+    shader_set_mat4(geometry, "projection", projection);
+    shader_set_mat4(geometry, "view", view);
+
+    // Cube material
+    shader_set_float(geometry, "material.shininess", 32.0f * 2);
+
+    // Cube Texture
+    texture_cache_bind(&textures, material_maps, 0);
+
+    mat4s model = glms_mat4_identity();
+    shader_set_mat4(geometry, "model", model);
+
+    glBindVertexArray(cube_VAO);
+    // glDrawArrays(GL_TRIANGLES, 0, 36);
+
+    gpu_counter_begin(&shaded);
+    for (int32_t i = 0; i < visible_count; i++) {
+      DrawCommand *draw = &visible[i];
+      shader_set_mat4(geometry, "model", draw->model);
+      shader_set_int(geometry, "material.diffuse", draw->diffuse.layer);
+      shader_set_vec4(geometry, "material.diffuse_rect", draw->diffuse.rect);
+      shader_set_int(geometry, "material.specular", draw->specular.layer);
+      shader_set_vec4(geometry, "material.specular_rect", draw->specular.rect);
+
+      lod_mesh_draw(&cube_mesh, draw->lod);
+    }
+    gpu_counter_end(&shaded);
+
+    if (depth_prepass) {
+      glDepthFunc(GL_LESS);
+      glDepthMask(true);
+    }
+
+    // Every cube's box against the depth just drawn, read on a later frame
+    if (occlusion_culling) {
+      occlusion_test_begin(&culler, &depth_shader);
+      shader_set_mat4(&depth_shader, "projection", projection);
+      shader_set_mat4(&depth_shader, "view", view);
+      for (int32_t i = 0; i < draw_count; i++) {
+        occlusion_test(&culler, &depth_shader, i, draws[i].bounds,
+                       camera.Position);
+      }
+      occlusion_test_end(&culler);
+    }
+
+    gpu_counter_poll(&shaded);
+    if (stats_report && currentFrame - last_report >= 1.0f && shaded.read) {
+      printf("Cubes: %llu fragments shaded, %.2f per pixel (%s%s)\n",
+             (unsigned long long)shaded.value,
+             (double)shaded.value / (SCR_WIDTH * SCR_HEIGHT),
+             deferred ? "deferred" : "forward",
+             depth_prepass ? ", depth pre-pass" : "");
+      if (software_culling) {
+        depth_raster_report(&depth_raster, stdout);
+      }
+      if (occlusion_culling) {
+        occlusion_report(&culler, stdout);
+      }
+      shadow_atlas_report(&shadow_atlas, stdout);
+      lod_report(&cube_mesh, cube_lods, draw_count, stdout);
+      texture_cache_report(&textures, stdout);
+      last_report = currentFrame;
+    }
+
+    // Light the G-buffer into the window, then hand its depth over so the
+    // lamp is still hidden behind the cubes
+    if (deferred) {
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+      glDisable(GL_DEPTH_TEST);
+      shader_use(lit);
+      gbuffer_use(&gbuffer, lit, 4);
+      glBindVertexArray(fullscreen_VAO);
+      glDrawArrays(GL_TRIANGLES, 0, 3);
+      glEnable(GL_DEPTH_TEST);
+      gbuffer_blit_depth(&gbuffer, 0);
     }
 
     // Lamp
 
-    // shader_use(&lamp_shader);
+    shader_use(&lamp_shader);
     shader_set_mat4(&lamp_shader, "projection", projection);
     shader_set_mat4(&lamp_shader, "view", view);
 
@@ -347,9 +729,34 @@ int main(void) {
 
   glDeleteVertexArrays(1, &cube_VAO);
   glDeleteVertexArrays(1, &lamp_VAO);
+  glDeleteVertexArrays(1, &fullscreen_VAO);
   glDeleteBuffers(1, &VBO);
-  shader_free(&cube_shader);
+  lod_mesh_free(&cube_mesh);
+  shader_watcher_free(&shader_watcher);
+  shader_variants_free(&cube_variants);
   shader_free(&lamp_shader);
+  shader_free(&gbuffer_shader);
+  shader_free(&deferred_shader);
+  shader_free(&depth_shader);
+  shader_free(&shadow_shader);
+  shadow_cascades_free(&shadows);
+  shadow_atlas_free(&shadow_atlas);
+  gpu_counter_free(&shaded);
+  occlusion_free(&culler);
+  depth_raster_free(&depth_raster);
+  gbuffer_free(&gbuffer);
+  texture_cache_release(&textures, material_maps);
+  texture_cache_free(&textures);
+  arena_free(&texture_arena);
+  cluster_grid_free(&clusters);
+  job_pool_free(&jobs);
+  arena_free(&asset_arena);
+  aio_free(&io);
+  frame_arena_free(&frames);
+  pack_mount(NULL);
+  pack_close(&assets);
+  arena_free(&pack_arena);
+  arena_scratch_release();
   // Cleanup GLFW
   glfwTerminate();
 
@@ -369,6 +776,33 @@ void process_input(GLFWwindow *window) {
     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
   }
 
+  // Light swarm, deferred shading, the depth pre-pass, both kinds of
+  // occlusion culling and the stats report, each flips once per press
+  static bool swarm_key_down = false;
+  if (key_toggled(window, GLFW_KEY_L, &swarm_key_down)) {
+    light_swarm = !light_swarm;
+  }
+  static bool deferred_key_down = false;
+  if (key_toggled(window, GLFW_KEY_G, &deferred_key_down)) {
+    deferred = !deferred;
+  }
+  static bool prepass_key_down = false;
+  if (key_toggled(window, GLFW_KEY_P, &prepass_key_down)) {
+    depth_prepass = !depth_prepass;
+  }
+  static bool occlusion_key_down = false;
+  if (key_toggled(window, GLFW_KEY_O, &occlusion_key_down)) {
+    occlusion_culling = !occlusion_culling;
+  }
+  static bool software_key_down = false;
+  if (key_toggled(window, GLFW_KEY_C, &software_key_down)) {
+    software_culling = !software_culling;
+  }
+  static bool report_key_down = false;
+  if (key_toggled(window, GLFW_KEY_R, &report_key_down)) {
+    stats_report = !stats_report;
+  }
+
   // Movement
   if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
     camera_process_keyboard(&camera, FORWARD, deltaTime);
@@ -385,6 +819,14 @@ void process_input(GLFWwindow *window) {
   }
 }
 
+// True on the frame `key` goes down, `was_down` keeps the last state
+bool key_toggled(GLFWwindow *window, int key, bool *was_down) {
+  bool down = glfwGetKey(window, key) == GLFW_PRESS;
+  bool pressed = down && !*was_down;
+  *was_down = down;
+  return pressed;
+}
+
 void framebuffer_size_callback(GLFWwindow *window, int width, int height) {
   (void)window;
   (void)width;
@@ -392,44 +834,6 @@ void framebuffer_size_callback(GLFWwindow *window, int width, int height) {
   glViewport(0, 0, SCR_WIDTH, SCR_HEIGHT);
 }
 
-uint32_t generate_texture(const char *path) {
-  stbi_set_flip_vertically_on_load(true);
-
-  uint32_t texture;
-  glGenTextures(1, &texture);
-  glBindTexture(GL_TEXTURE_2D, texture);
-
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
-                  GL_LINEAR_MIPMAP_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-  int32_t width, height, nr_channels;
-  uint8_t *data = stbi_load(path, &width, &height, &nr_channels, 0);
-  if (!data) {
-    fprintf(stderr, "ERROR: Failed to load texture at path: %s\n", path);
-    stbi_image_free(data);
-    return 0;
-  }
-
-  GLenum format;
-  if (nr_channels == 1)
-    format = GL_RED;
-  if (nr_channels == 3)
-    format = GL_RGB;
-  if (nr_channels == 4)
-    format = GL_RGBA;
-
-  glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format,
-               GL_UNSIGNED_BYTE, data);
-  glGenerateMipmap(GL_TEXTURE_2D);
-
-  stbi_image_free(data);
-  return texture;
-}
-
 void mouse_callback(GLFWwindow *window, double x_pos, double y_pos) {
   (void)window;
 
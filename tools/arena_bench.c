@@ -0,0 +1,75 @@
+// Arena allocation benchmark
+//
+// Usage: arena_bench [rounds]
+//
+// Compares zeroing and non-zeroing allocation on a virtual arena: many small
+// allocations (alloc vs alloc_nozero), then large blocks (alloc vs
+// alloc_bulk, with and without ARENA_HUGEPAGE). Every block gets one byte
+// written so the compiler can't drop the allocation. Each test runs twice,
+// the first pass commits the arena's pages.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ARENA_IMPLEMENTATION
+#include "arena.h"
+
+#define SMALL_COUNT 1000000
+#define SMALL_SIZE 64
+#define BULK_SIZE ((ptrdiff_t)8 << 20)
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Millions of small allocations per second
+static double bench_small(arena *a, int flags, int rounds) {
+  double start = now();
+  for (int r = 0; r < rounds; r++) {
+    arena_reset(a);
+    for (int i = 0; i < SMALL_COUNT; i++) {
+      volatile char *p = alloc_ex(a, 1, 16, SMALL_SIZE, flags);
+      p[0] = 1;
+    }
+  }
+  return (double)rounds * SMALL_COUNT / (now() - start) / 1e6;
+}
+
+// Microseconds per large block
+static double bench_bulk(arena *a, bool bulk, int flags, int rounds) {
+  double start = now();
+  for (int r = 0; r < rounds; r++) {
+    arena_reset(a);
+    volatile char *p = bulk ? alloc_bulk(a, BULK_SIZE, flags)
+                            : alloc_ex(a, 1, 64, BULK_SIZE, flags);
+    p[BULK_SIZE - 1] = 1;
+  }
+  return (now() - start) / rounds * 1e6;
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 20;
+  if (rounds <= 0) {
+    fprintf(stderr, "Usage: %s [rounds]\n", argv[0]);
+    return 1;
+  }
+
+  arena a = new_arena_virtual((ptrdiff_t)1 << 34);
+  for (int pass = 0; pass < 2; pass++) {
+    printf("Pass %d\n", pass + 1);
+    printf("  %d B allocs: alloc %.1f M/s, alloc_nozero %.1f M/s\n",
+           SMALL_SIZE, bench_small(&a, 0, rounds),
+           bench_small(&a, ARENA_NOZERO, rounds));
+
+    double zeroed = bench_bulk(&a, false, 0, rounds * 10);
+    printf("  %td MiB blocks: alloc %.1f us (%.1f GB/s)\n", BULK_SIZE >> 20,
+           zeroed, BULK_SIZE / zeroed / 1e3);
+    printf("  %td MiB blocks: alloc_bulk nozero %.3f us, hugepage %.3f us\n",
+           BULK_SIZE >> 20, bench_bulk(&a, true, ARENA_NOZERO, rounds * 10),
+           bench_bulk(&a, true, ARENA_NOZERO | ARENA_HUGEPAGE, rounds * 10));
+  }
+  arena_free(&a);
+  return 0;
+}
@@ -0,0 +1,208 @@
+// Forward vs deferred shading benchmark
+//
+// Usage: deferred_bench
+//
+// Draws `overdraw` full-screen quads back to front at 800x600, so every
+// layer passes the depth test and gets shaded, once with the forward cube
+// shader and once through the G-buffer and the full-screen lighting pass.
+// Both use the clustered light lists, with main.c's four point lights plus
+// a swarm of small lights. Prints the best time per frame of each path and
+// how far apart their images are.
+#include "../include/cglm/struct/affine.h"
+#include "../include/cglm/struct/cam.h"
+
+#define SHADER_IMPLEMENTATION
+#include "shader.h"
+#define CLUSTER_IMPLEMENTATION
+#include "cluster.h"
+#define GBUFFER_IMPLEMENTATION
+#include "gbuffer.h"
+
+#include "gl_bench.h"
+
+#define WIDTH 800
+#define HEIGHT 600
+#define MAX_LIGHTS 1028
+#define ROUNDS 3
+#define FRAMES 5
+
+typedef struct {
+  GLuint target;
+  GLuint quad;
+  GLuint fullscreen;
+  GBuffer gbuffer;
+  Shader forward;
+  Shader geometry;
+  Shader lighting;
+  int32_t layers;
+} scene;
+
+static void draw_layers(scene *s, Shader *shader) {
+  glBindVertexArray(s->quad);
+  for (int32_t k = s->layers - 1; k >= 0; k--) {
+    mat4s model = glms_translate(glms_mat4_identity(),
+                                 (vec3s){{0.0f, 0.0f, -0.4f * k}});
+    model = glms_scale(model, (vec3s){{8.0f, 6.0f, 1.0f}});
+    shader_set_mat4(shader, "model", model);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+  }
+}
+
+static void frame_forward(scene *s) {
+  glBindFramebuffer(GL_FRAMEBUFFER, s->target);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  shader_use(&s->forward);
+  draw_layers(s, &s->forward);
+}
+
+// The same passes main.c runs with deferred shading on
+static void frame_deferred(scene *s) {
+  gbuffer_bind(&s->gbuffer);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  shader_use(&s->geometry);
+  draw_layers(s, &s->geometry);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, s->target);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glDisable(GL_DEPTH_TEST);
+  shader_use(&s->lighting);
+  gbuffer_use(&s->gbuffer, &s->lighting, 4);
+  glBindVertexArray(s->fullscreen);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+  glEnable(GL_DEPTH_TEST);
+  gbuffer_blit_depth(&s->gbuffer, s->target);
+}
+
+// Best seconds per frame, and the last frame read back into `image`
+static double run(scene *s, void (*frame)(scene *), uint8_t *image) {
+  frame(s);
+  glFinish();
+  double best = 1e9;
+  for (int32_t r = 0; r < ROUNDS; r++) {
+    double start = now();
+    for (int32_t i = 0; i < FRAMES; i++) {
+      frame(s);
+    }
+    glFinish();
+    double t = (now() - start) / FRAMES;
+    best = t < best ? t : best;
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, s->target);
+  glReadPixels(0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, image);
+  return best;
+}
+
+static float frand(void) { return (float)rand() / RAND_MAX; }
+
+int main(void) {
+  GLFWwindow *window = bench_window();
+  if (!window) {
+    return 1;
+  }
+
+  scene s = {0};
+  s.target = bench_target(WIDTH, HEIGHT);
+  s.quad = bench_quad();
+  glGenVertexArrays(1, &s.fullscreen);
+  GLuint maps = bench_maps();
+  glEnable(GL_DEPTH_TEST);
+  glClearColor(0.1f, 0.15f, 0.2f, 1.0f);
+
+  s.gbuffer = new_gbuffer(WIDTH, HEIGHT);
+  job_pool jobs;
+  ClusterGrid clusters;
+  const char *defines[] = {"CLUSTERED"};
+  s.forward = new_shader_defines("glsl/cube_vs.glsl", "glsl/cube_fs.glsl",
+                                 defines, 1);
+  s.geometry = new_shader("glsl/cube_vs.glsl", "glsl/gbuffer_fs.glsl");
+  s.lighting = new_shader_defines("glsl/fullscreen_vs.glsl",
+                                  "glsl/deferred_fs.glsl", defines, 1);
+  if (!s.gbuffer.FBO || !job_pool_init(&jobs, 1) ||
+      !cluster_grid_init(&clusters, &jobs) || !s.forward.ID ||
+      !s.geometry.ID || !s.lighting.ID) {
+    glfwTerminate();
+    return 1;
+  }
+
+  mat4s projection = glms_perspective(glm_rad(80.0f), (float)WIDTH / HEIGHT,
+                                      0.1f, 100.0f);
+  mat4s view = glms_lookat((vec3s){{0.0f, 0.0f, 3.0f}}, (vec3s){{0}},
+                           (vec3s){{0.0f, 1.0f, 0.0f}});
+  bench_material(&s.forward, view, projection);
+  bench_lights(&s.forward);
+  bench_material(&s.geometry, view, projection);
+  bench_lights(&s.lighting);
+  shader_set_mat4(&s.lighting, "inverse_view_projection",
+                  glms_mat4_inv(glms_mat4_mul(projection, view)));
+
+  // main.c's point lights, then small lights like its swarm
+  ClusterLight lights[MAX_LIGHTS];
+  for (int32_t i = 0; i < 4; i++) {
+    lights[i] = (ClusterLight){
+        .position = bench_point_positions[i],
+        .ambient = {{0.05f, 0.05f, 0.05f}},
+        .diffuse = {{0.8f, 0.8f, 0.8f}},
+        .specular = {{1.0f, 1.0f, 1.0f}},
+        .constant = 1.0f,
+        .linear = 0.09f,
+        .quadratic = 0.032f,
+    };
+  }
+  srand(1);
+  for (int32_t i = 4; i < MAX_LIGHTS; i++) {
+    vec3s color = {{0.2f + 0.8f * frand(), 0.2f + 0.8f * frand(),
+                    0.2f + 0.8f * frand()}};
+    lights[i] = (ClusterLight){
+        .position = {{-6.0f + 12.0f * frand(), -4.0f + 10.0f * frand(),
+                      -4.0f + 6.0f * frand()}},
+        .diffuse = color,
+        .specular = color,
+        .constant = 1.0f,
+        .linear = 0.35f,
+        .quadratic = 0.44f,
+        .range = 2.0f,
+    };
+  }
+
+  ptrdiff_t image_size = (ptrdiff_t)WIDTH * HEIGHT * 4;
+  uint8_t *forward_image = malloc(image_size);
+  uint8_t *deferred_image = malloc(image_size);
+  arena frame = new_arena_virtual((ptrdiff_t)1 << 30);
+  int32_t light_counts[] = {4, 260, MAX_LIGHTS};
+  int32_t overdraws[] = {1, 4, 8};
+
+  printf("lights  overdraw  forward ms  deferred ms  speedup  max diff\n");
+  for (int32_t c = 0; c < 3; c++) {
+    arena_reset(&frame);
+    cluster_grid_update(&clusters, lights, light_counts[c], view, projection,
+                        (vec2s){{WIDTH, HEIGHT}}, &frame);
+    shader_use(&s.forward);
+    cluster_grid_use(&clusters, &s.forward, 1);
+    shader_use(&s.lighting);
+    cluster_grid_use(&clusters, &s.lighting, 1);
+
+    for (int32_t o = 0; o < 3; o++) {
+      s.layers = overdraws[o];
+      double forward = run(&s, frame_forward, forward_image);
+      double deferred = run(&s, frame_deferred, deferred_image);
+      printf("%6d  %8d  %10.1f  %11.1f  %6.2fx  %3d/255\n", light_counts[c],
+             s.layers, forward * 1e3, deferred * 1e3, forward / deferred,
+             bench_max_diff(forward_image, deferred_image, image_size));
+      fflush(stdout);
+    }
+  }
+
+  arena_free(&frame);
+  free(forward_image);
+  free(deferred_image);
+  shader_free(&s.forward);
+  shader_free(&s.geometry);
+  shader_free(&s.lighting);
+  cluster_grid_free(&clusters);
+  job_pool_free(&jobs);
+  gbuffer_free(&s.gbuffer);
+  glDeleteTextures(1, &maps);
+  glfwDestroyWindow(window);
+  glfwTerminate();
+  return 0;
+}
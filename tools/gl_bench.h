@@ -0,0 +1,172 @@
+#ifndef GL_BENCH_H
+#define GL_BENCH_H
+
+#include <GL/glew.h>
+//
+#include <GLFW/glfw3.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../include/cglm/struct/mat4.h"
+#include "../include/cglm/types-struct.h"
+#include "shader.h"
+
+// Shared setup for the GL benchmarks: a hidden window for the context, an
+// offscreen target to draw into, a quad with the cube's vertex layout and
+// the lights main.c sets up. Run them with LIBGL_ALWAYS_SOFTWARE=1 to time
+// Mesa's llvmpipe rather than whatever GPU is around.
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// GL 3.3 core context on a window that's never shown. NULL on failure, with
+// GLFW already terminated.
+static GLFWwindow *bench_window(void) {
+  if (!glfwInit()) {
+    fprintf(stderr, "ERROR: Failed to initialize GLFW\n");
+    return NULL;
+  }
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+  glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+  GLFWwindow *window = glfwCreateWindow(64, 64, "bench", NULL, NULL);
+  if (!window) {
+    fprintf(stderr, "ERROR: Failed to create GLFW window\n");
+    glfwTerminate();
+    return NULL;
+  }
+  glfwMakeContextCurrent(window);
+  glewExperimental = true;
+  glewInit();
+  printf("%s\n", glGetString(GL_RENDERER));
+  return window;
+}
+
+// RGBA8 color and depth, left bound and set as the viewport
+static GLuint bench_target(int32_t width, int32_t height) {
+  GLuint fbo, buffers[2];
+  glGenFramebuffers(1, &fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glGenRenderbuffers(2, buffers);
+  glBindRenderbuffer(GL_RENDERBUFFER, buffers[0]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER, buffers[0]);
+  glBindRenderbuffer(GL_RENDERBUFFER, buffers[1]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+                            GL_RENDERBUFFER, buffers[1]);
+  glViewport(0, 0, width, height);
+  return fbo;
+}
+
+// Unit quad at z = 0 facing +z, laid out like the cube VBO (position,
+// normal, UV), drawn as 6 vertices
+static GLuint bench_quad(void) {
+  float vertices[] = {
+      -1, -1, 0, 0, 0, 1, 0, 0, //
+      1,  -1, 0, 0, 0, 1, 1, 0, //
+      1,  1,  0, 0, 0, 1, 1, 1, //
+      -1, -1, 0, 0, 0, 1, 0, 0, //
+      1,  1,  0, 0, 0, 1, 1, 1, //
+      -1, 1,  0, 0, 0, 1, 0, 1, //
+  };
+  GLuint vao, vbo;
+  glGenVertexArrays(1, &vao);
+  glBindVertexArray(vao);
+  glGenBuffers(1, &vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+  for (int i = 0; i < 3; i++) {
+    glEnableVertexAttribArray(i);
+  }
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void *)0);
+  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float),
+                        (void *)(3 * sizeof(float)));
+  glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float),
+                        (void *)(6 * sizeof(float)));
+  return vao;
+}
+
+// Two 512x512 layers of noise on texture unit 0, standing in for the
+// diffuse and specular maps. Noise keeps every fetch a real one.
+static GLuint bench_maps(void) {
+  int32_t size = 512 * 512 * 4 * 2;
+  uint8_t *pixels = malloc(size);
+  srand(1);
+  for (int32_t i = 0; i < size; i++) {
+    pixels[i] = 128 + rand() % 128;
+  }
+  GLuint maps;
+  glGenTextures(1, &maps);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, maps);
+  glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, 512, 512, 2, 0, GL_RGBA,
+               GL_UNSIGNED_BYTE, pixels);
+  glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER,
+                  GL_LINEAR_MIPMAP_LINEAR);
+  free(pixels);
+  return maps;
+}
+
+// Material uniforms of the cube and G-buffer shaders, maps from bench_maps
+static void bench_material(Shader *shader, mat4s view, mat4s projection) {
+  shader_use(shader);
+  shader_set_mat4(shader, "view", view);
+  shader_set_mat4(shader, "projection", projection);
+  shader_set_int(shader, "material.maps", 0);
+  shader_set_int(shader, "material.diffuse", 0);
+  shader_set_int(shader, "material.specular", 1);
+  shader_set_vec4f(shader, "material.diffuse_rect", 1, 1, 0, 0);
+  shader_set_vec4f(shader, "material.specular_rect", 1, 1, 0, 0);
+  shader_set_float(shader, "material.shininess", 64);
+}
+
+// main.c's directional light, and its spot light held by a camera at
+// (0, 0, 3) looking down -z
+static void bench_lights(Shader *shader) {
+  shader_use(shader);
+  shader_set_vec3f(shader, "viewPos", 0, 0, 3);
+  shader_set_vec3f(shader, "dir_light.direction", -0.2f, -1.0f, -0.3f);
+  shader_set_vec3f(shader, "dir_light.ambient", 0.05f, 0.05f, 0.05f);
+  shader_set_vec3f(shader, "dir_light.diffuse", 0.4f, 0.4f, 0.4f);
+  shader_set_vec3f(shader, "dir_light.specular", 0.5f, 0.5f, 0.5f);
+  shader_set_vec3f(shader, "spot_light.position", 0, 0, 3);
+  shader_set_vec3f(shader, "spot_light.direction", 0, 0, -1);
+  shader_set_vec3f(shader, "spot_light.ambient", 0, 0, 0);
+  shader_set_vec3f(shader, "spot_light.diffuse", 1, 1, 1);
+  shader_set_vec3f(shader, "spot_light.specular", 1, 1, 1);
+  shader_set_float(shader, "spot_light.constant", 1.0f);
+  shader_set_float(shader, "spot_light.linear", 0.09f);
+  shader_set_float(shader, "spot_light.quadratic", 0.032f);
+  shader_set_float(shader, "spot_light.cutoff", cosf(glm_rad(12.5f)));
+  shader_set_float(shader, "spot_light.outer_cutoff", cosf(glm_rad(15.0f)));
+}
+
+// main.c's four point lights
+static const vec3s bench_point_positions[] = {
+    {{0.7f, 0.2f, 2.0f}},
+    {{2.3f, -3.3f, -4.0f}},
+    {{-4.0f, 2.0f, -12.0f}},
+    {{0.0f, 0.0f, -3.0f}},
+};
+
+// Largest difference of any channel between two RGBA8 images
+static int32_t bench_max_diff(const uint8_t *a, const uint8_t *b,
+                              ptrdiff_t len) {
+  int32_t max = 0;
+  for (ptrdiff_t i = 0; i < len; i++) {
+    int32_t d = abs(a[i] - b[i]);
+    max = d > max ? d : max;
+  }
+  return max;
+}
+
+#endif // GL_BENCH_H
@@ -0,0 +1,238 @@
+// Hash map lookup benchmark
+//
+// Usage: hashmap_bench [lookups]
+//
+// Times random hits in three structures: lib/hashmap.h, a naive chained
+// table (one node per key, buckets of linked lists, same hash function) and
+// a linear scan of the key array. The linear scan only runs while N is
+// small enough to finish. First with N 8-byte keys, then with string keys
+// shaped like the uniform names shaders look up. Both tables are reached
+// through an out of line call, as a library lookup would be, and the
+// structures take turns so drift hits them alike. Times are the best of
+// ROUNDS, per lookup.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ARENA_IMPLEMENTATION
+#include "arena.h"
+#define HASHMAP_IMPLEMENTATION
+#include "hashmap.h"
+
+#define LINEAR_MAX_KEYS 5000
+#define ROUNDS 5
+
+typedef struct chain_node chain_node;
+struct chain_node {
+  uint64_t key;
+  int32_t value;
+  chain_node *next;
+};
+
+typedef struct string_node string_node;
+struct string_node {
+  string key;
+  int32_t value;
+  string_node *next;
+};
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Cheap LCG, picks which key each lookup asks for. The index comes from the
+// high bits: the low bits of an LCG repeat with a period of their range, so
+// `% n` would replay the same n lookups over and over for a power of two n
+// and let the branch predictor learn them.
+static uint32_t next_index(uint32_t *state, int32_t n) {
+  *state = *state * 1664525 + 1013904223;
+  return (uint32_t)(((uint64_t)*state * n) >> 32);
+}
+
+__attribute__((noinline)) static int32_t *
+chain_get(chain_node **buckets, int32_t bucket_count, uint64_t key) {
+  uint64_t b = hash_bytes(&key, sizeof(uint64_t)) & (bucket_count - 1);
+  for (chain_node *p = buckets[b]; p; p = p->next) {
+    if (p->key == key) {
+      return &p->value;
+    }
+  }
+  return NULL;
+}
+
+__attribute__((noinline)) static int32_t *
+string_chain_get(string_node **buckets, int32_t bucket_count, string key) {
+  uint64_t b = hash_bytes(key.data, key.len) & (bucket_count - 1);
+  for (string_node *p = buckets[b]; p; p = p->next) {
+    if (p->key.len == key.len && !memcmp(p->key.data, key.data, key.len)) {
+      return &p->value;
+    }
+  }
+  return NULL;
+}
+
+static int32_t power_of_two_above(int32_t n) {
+  int32_t p = 1;
+  while (p < n) {
+    p *= 2;
+  }
+  return p;
+}
+
+static void bench_integer_keys(arena *a, int32_t lookups) {
+  printf("8-byte keys\n");
+  for (int32_t n = 16; n <= 4000000; n *= 25) {
+    arena_temp temp = arena_temp_begin(a);
+    uint64_t *keys = make(a, uint64_t, n);
+    for (int32_t i = 0; i < n; i++) {
+      keys[i] = (uint64_t)i * 0x9e3779b97f4a7c15ull;
+    }
+
+    hashmap map = new_hashmap(a, sizeof(uint64_t), sizeof(int32_t), n);
+    for (int32_t i = 0; i < n; i++) {
+      *(int32_t *)hashmap_put(&map, &keys[i]) = i;
+    }
+
+    int32_t bucket_count = power_of_two_above(n);
+    chain_node **buckets = make(a, chain_node *, bucket_count);
+    chain_node *nodes = make(a, chain_node, n);
+    for (int32_t i = 0; i < n; i++) {
+      uint64_t b = hash_bytes(&keys[i], sizeof(uint64_t)) & (bucket_count - 1);
+      nodes[i] = (chain_node){keys[i], i, buckets[b]};
+      buckets[b] = &nodes[i];
+    }
+
+    volatile int64_t sum = 0;
+    uint32_t state = 1;
+    double swiss = 1e9, chained = 1e9, linear = 1e9;
+    // Fewer lookups for the big scans, they're slow enough to time
+    int32_t scans = n > 1000 ? lookups / 10 : lookups;
+    for (int32_t round = 0; round < ROUNDS; round++) {
+      double start = now();
+      for (int32_t j = 0; j < lookups; j++) {
+        uint64_t key = keys[next_index(&state, n)];
+        sum += *(int32_t *)hashmap_get(&map, &key);
+      }
+      double t = (now() - start) / lookups * 1e9;
+      swiss = t < swiss ? t : swiss;
+
+      start = now();
+      for (int32_t j = 0; j < lookups; j++) {
+        uint64_t key = keys[next_index(&state, n)];
+        sum += *chain_get(buckets, bucket_count, key);
+      }
+      t = (now() - start) / lookups * 1e9;
+      chained = t < chained ? t : chained;
+
+      if (n > LINEAR_MAX_KEYS) {
+        continue;
+      }
+      start = now();
+      for (int32_t j = 0; j < scans; j++) {
+        uint64_t key = keys[next_index(&state, n)];
+        for (int32_t i = 0; i < n; i++) {
+          if (keys[i] == key) {
+            sum += i;
+            break;
+          }
+        }
+      }
+      t = (now() - start) / scans * 1e9;
+      linear = t < linear ? t : linear;
+    }
+
+    printf("N=%7d  hashmap %6.1f ns  chained %6.1f ns", n, swiss, chained);
+    if (n <= LINEAR_MAX_KEYS) {
+      printf("  linear %8.1f ns", linear);
+    }
+    printf("\n");
+    arena_temp_end(temp);
+  }
+}
+
+static void bench_string_keys(arena *a, int32_t lookups) {
+  const char *names[] = {
+      "model",
+      "view",
+      "projection",
+      "view_pos",
+      "material.diffuse",
+      "material.specular",
+      "material.shininess",
+      "dir_light.direction",
+      "point_lights[%d].position",
+      "point_lights[%d].ambient",
+      "point_lights[%d].diffuse",
+      "point_lights[%d].specular",
+      "point_lights[%d].constant",
+      "point_lights[%d].linear",
+      "point_lights[%d].quadratic",
+      "shadow_maps[%d]",
+  };
+  int32_t name_count = sizeof(names) / sizeof(*names);
+
+  printf("Uniform name keys\n");
+  for (int32_t n = 8; n <= 512; n *= 4) {
+    arena_temp temp = arena_temp_begin(a);
+    string *keys = make(a, string, n);
+    for (int32_t i = 0; i < n; i++) {
+      char *name = make(a, char, 64);
+      int len = snprintf(name, 64, names[i % name_count], i / name_count);
+      keys[i] = (string){(uint8_t *)name, len};
+    }
+
+    hashmap map = new_hashmap_string(a, sizeof(int32_t), n);
+    for (int32_t i = 0; i < n; i++) {
+      *(int32_t *)hashmap_put(&map, &keys[i]) = i;
+    }
+
+    int32_t bucket_count = power_of_two_above(n);
+    string_node **buckets = make(a, string_node *, bucket_count);
+    string_node *nodes = make(a, string_node, n);
+    for (int32_t i = 0; i < n; i++) {
+      uint64_t b = hash_bytes(keys[i].data, keys[i].len) & (bucket_count - 1);
+      nodes[i] = (string_node){keys[i], i, buckets[b]};
+      buckets[b] = &nodes[i];
+    }
+
+    volatile int64_t sum = 0;
+    uint32_t state = 1;
+    double swiss = 1e9, chained = 1e9;
+    for (int32_t round = 0; round < ROUNDS; round++) {
+      double start = now();
+      for (int32_t j = 0; j < lookups; j++) {
+        string key = keys[next_index(&state, n)];
+        sum += *(int32_t *)hashmap_get(&map, &key);
+      }
+      double t = (now() - start) / lookups * 1e9;
+      swiss = t < swiss ? t : swiss;
+
+      start = now();
+      for (int32_t j = 0; j < lookups; j++) {
+        string key = keys[next_index(&state, n)];
+        sum += *string_chain_get(buckets, bucket_count, key);
+      }
+      t = (now() - start) / lookups * 1e9;
+      chained = t < chained ? t : chained;
+    }
+    printf("N=%7d  hashmap %6.1f ns  chained %6.1f ns\n", n, swiss, chained);
+    arena_temp_end(temp);
+  }
+}
+
+int main(int argc, char **argv) {
+  int32_t lookups = argc > 1 ? atoi(argv[1]) : 2000000;
+  if (lookups <= 0) {
+    fprintf(stderr, "Usage: %s [lookups]\n", argv[0]);
+    return 1;
+  }
+
+  arena a = new_arena_virtual((ptrdiff_t)1 << 33);
+  bench_integer_keys(&a, lookups);
+  bench_string_keys(&a, lookups);
+  arena_free(&a);
+  return 0;
+}
@@ -0,0 +1,677 @@
+// Library checks
+//
+// Usage: lib_check
+//
+// Exercises the lib/ containers that nothing in the renderer uses yet, so
+// they're at least compiled and run, and the CPU side pieces that can be
+// checked without a GL context. Prints every failed check and exits non
+// zero if there was one.
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define ARENA_IMPLEMENTATION
+#include "arena.h"
+#define POOL_IMPLEMENTATION
+#include "pool.h"
+#define SLOTMAP_IMPLEMENTATION
+#include "slotmap.h"
+#define HASHMAP_IMPLEMENTATION
+#include "hashmap.h"
+#define JOBS_IMPLEMENTATION
+#include "jobs.h"
+#define DEPTH_RASTER_IMPLEMENTATION
+#include "depth_raster.h"
+#define AIO_IMPLEMENTATION
+#include "aio.h"
+#include "file.h"
+#define LOD_BUILD_IMPLEMENTATION
+#include "lod_build.h"
+#include "../include/cglm/struct/affine.h"
+#include "../include/cglm/struct/cam.h"
+// Redefines sizeof, keep it last
+#include "array.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "FAILED: %s:%d: %s\n", __FILE__, __LINE__, #cond);       \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static void *scratch_thread(void *arg) {
+  arena_temp scratch = arena_scratch_begin(NULL, 0);
+  *(arena **)arg = scratch.a;
+  int32_t *values = make(scratch.a, int32_t, 1024);
+  values[1023] = 1;
+  arena_scratch_end(scratch);
+  return NULL;
+}
+
+static void check_arena(void) {
+  // A chained arena whose first block couldn't be allocated
+  arena chained = new_arena_chained(PTRDIFF_MAX / 2);
+  CHECK(!chained.block);
+  arena_temp temp = arena_temp_begin(&chained);
+  arena_temp_end(temp);
+  CHECK(!chained.block && !chained.current);
+  arena_free(&chained);
+
+  // Released scratch arenas are reserved again on the next begin
+  arena_temp scratch = arena_scratch_begin(NULL, 0);
+  arena *a = scratch.a;
+  CHECK(a->beg);
+  int32_t *values = make(a, int32_t, 1024);
+  values[1023] = 1;
+  arena_scratch_end(scratch);
+  arena_scratch_release();
+  CHECK(!a->beg);
+  scratch = arena_scratch_begin(NULL, 0);
+  CHECK(scratch.a == a && a->beg);
+  arena_scratch_end(scratch);
+  arena_scratch_release();
+
+  // Other threads get their own, freed when they exit
+  arena *other = NULL;
+  pthread_t thread;
+  CHECK(!pthread_create(&thread, NULL, scratch_thread, &other));
+  pthread_join(thread, NULL);
+  CHECK(other && other != a);
+}
+
+static void check_pool(arena *a) {
+  // A chunk of 0 falls back to the default instead of an empty carve
+  pool p = new_pool(a, 24, 32, 0);
+  CHECK(p.chunk > 0);
+  CHECK(p.size % 32 == 0);
+
+  void *objects[200];
+  for (int i = 0; i < 200; i++) {
+    objects[i] = pool_alloc(&p);
+    CHECK(((uintptr_t)objects[i] & 31) == 0);
+    CHECK(((uint8_t *)objects[i])[23] == 0);
+    memset(objects[i], 0xab, 24);
+  }
+  CHECK(p.live == 200);
+
+  // Released objects come back zeroed, without touching the arena
+  char *end = a->current;
+  for (int i = 0; i < 200; i++) {
+    pool_release(&p, objects[i]);
+  }
+  CHECK(p.live == 0);
+  for (int i = 0; i < 200; i++) {
+    uint8_t *o = pool_alloc(&p);
+    CHECK(o[0] == 0 && o[23] == 0);
+  }
+  CHECK(a->current == end);
+  pool_release(&p, NULL);
+  CHECK(p.live == 200);
+}
+
+static void check_slotmap(arena *a) {
+  slotmap m = new_slotmap_of(a, int32_t, 0);
+
+  handle handles[100];
+  for (int32_t i = 0; i < 100; i++) {
+    int32_t *value;
+    handles[i] = slotmap_insert(&m, (void **)&value);
+    CHECK(*value == 0);
+    *value = i;
+  }
+  CHECK(m.len == 100);
+  CHECK(!slotmap_get(&m, (handle){0}));
+
+  // Remove the even ones, the odd ones keep their values and handles
+  for (int32_t i = 0; i < 100; i += 2) {
+    CHECK(slotmap_remove(&m, handles[i]));
+    CHECK(!slotmap_remove(&m, handles[i]));
+  }
+  CHECK(m.len == 50);
+  for (int32_t i = 0; i < 100; i++) {
+    int32_t *value = slotmap_get(&m, handles[i]);
+    CHECK(i % 2 ? value && *value == i : !value);
+  }
+
+  // Dense storage holds exactly the live objects
+  int64_t sum = 0;
+  for (ptrdiff_t i = 0; i < m.len; i++) {
+    int32_t value = slotmap_data(&m, int32_t)[i];
+    sum += value;
+    CHECK(slotmap_get(&m, slotmap_handle_at(&m, i)) ==
+          &slotmap_data(&m, int32_t)[i]);
+  }
+  CHECK(sum == 2500);
+
+  // Reused slots get a new generation, the stale handle stays dead
+  handle reused = slotmap_insert(&m, NULL);
+  CHECK(reused.index == handles[98].index);
+  CHECK(reused.generation != handles[98].generation);
+  CHECK(!slotmap_get(&m, handles[98]));
+  CHECK(slotmap_get(&m, reused));
+
+  // Objects keep their alignment across growth
+  typedef struct {
+    _Alignas(64) float lanes[16];
+  } wide;
+  slotmap w = new_slotmap_of(a, wide, 1);
+  alloc(a, 1, 1, 1);
+  for (int32_t i = 0; i < 10; i++) {
+    wide *object;
+    slotmap_insert(&w, (void **)&object);
+    CHECK(((uintptr_t)object & 63) == 0);
+  }
+}
+
+static void check_hashmap(arena *a) {
+  // Grows from a single group, every value survives the rehashes
+  hashmap m = new_hashmap(a, sizeof(uint64_t), sizeof(int32_t), 1);
+  CHECK(m.cap == HASHMAP_GROUP);
+  for (uint64_t k = 0; k < 1000; k++) {
+    int32_t *value = hashmap_put(&m, &k);
+    CHECK(*value == 0);
+    *value = (int32_t)k + 1;
+  }
+  CHECK(m.len == 1000 && m.cap >= 1024);
+  for (uint64_t k = 0; k < 1000; k++) {
+    int32_t *value = hashmap_get(&m, &k);
+    CHECK(value && *value == (int32_t)k + 1);
+  }
+  uint64_t missing = 1000;
+  CHECK(!hashmap_get(&m, &missing));
+  CHECK(*(int32_t *)hashmap_put(&m, &(uint64_t){7}) == 8);
+  CHECK(m.len == 1000);
+
+  // Removing the odd keys leaves the even ones reachable, through the
+  // tombstones of groups that had filled up
+  for (uint64_t k = 1; k < 1000; k += 2) {
+    CHECK(hashmap_remove(&m, &k));
+    CHECK(!hashmap_remove(&m, &k));
+  }
+  CHECK(m.len == 500);
+  for (uint64_t k = 0; k < 1000; k++) {
+    int32_t *value = hashmap_get(&m, &k);
+    CHECK(k % 2 ? !value : value && *value == (int32_t)k + 1);
+  }
+  ptrdiff_t visited = 0;
+  for (ptrdiff_t i = hashmap_next(&m, 0); i >= 0; i = hashmap_next(&m, i + 1)) {
+    CHECK(*(uint64_t *)hashmap_key(&m, i) % 2 == 0);
+    visited++;
+  }
+  CHECK(visited == 500);
+
+  // A full table of tombstones is cleaned up in place rather than doubled
+  hashmap t = new_hashmap(a, sizeof(uint32_t), sizeof(uint32_t), 28);
+  ptrdiff_t cap = t.cap;
+  for (uint32_t round = 0; round < 50; round++) {
+    for (uint32_t k = 0; k < 20; k++) {
+      *(uint32_t *)hashmap_put(&t, &(uint32_t){round * 20 + k}) = k;
+    }
+    for (uint32_t k = 0; k < 20; k++) {
+      CHECK(hashmap_remove(&t, &(uint32_t){round * 20 + k}));
+    }
+  }
+  CHECK(t.len == 0 && t.cap == cap);
+  CHECK(t.len + t.tombstones <= t.cap - t.cap / 8);
+
+  // String keys are copied, the caller's buffer can change afterwards
+  hashmap names = new_hashmap_string(a, sizeof(int32_t), 4);
+  char buffer[32];
+  for (int32_t i = 0; i < 40; i++) {
+    int len = snprintf(buffer, sizeof(buffer), "point_lights[%d].position", i);
+    *(int32_t *)hashmap_put(&names, &(string){(uint8_t *)buffer, len}) = i;
+  }
+  memset(buffer, 0, sizeof(buffer));
+  for (int32_t i = 0; i < 40; i++) {
+    int len = snprintf(buffer, sizeof(buffer), "point_lights[%d].position", i);
+    int32_t *value = hashmap_get(&names, &(string){(uint8_t *)buffer, len});
+    CHECK(value && *value == i);
+  }
+  // Same bytes, different length
+  CHECK(!hashmap_get(&names, &(string){(uint8_t *)buffer, 5}));
+  hashmap_clear(&names);
+  CHECK(names.len == 0 && hashmap_next(&names, 0) < 0);
+  CHECK(!hashmap_get(&names, &(string){(uint8_t *)buffer, 5}));
+
+  // Sets hand back the stored key
+  hashmap set = new_hashset(a, 3, 0);
+  CHECK(hashset_add(&set, "abc") && hashset_has(&set, "abc"));
+  CHECK(!hashset_has(&set, "abd"));
+  CHECK(!memcmp(hashmap_get(&set, "abc"), "abc", 3));
+  CHECK(hashset_remove(&set, "abc") && !hashset_has(&set, "abc"));
+}
+
+typedef struct {
+  int32_t *data;
+  ptrdiff_t len;
+  ptrdiff_t cap;
+} int32_slice;
+
+static void check_array(arena *a) {
+  int32_slice s = {0};
+  for (int32_t i = 0; i < 100; i++) {
+    *push(&s, a) = i;
+  }
+  CHECK(s.len == 100 && s.cap >= 100);
+  CHECK(s.data[0] == 0 && s.data[99] == 99);
+
+  // The slice is the arena's last allocation, so it grows in place
+  int32_t *data = s.data;
+  reserve(&s, s.cap * 4, a);
+  CHECK(s.data == data);
+
+  // `i` is evaluated once, the new slot goes at 10 and i ends up at 11
+  ptrdiff_t i = 10;
+  int32_t *slot = insert(&s, i++, a);
+  CHECK(i == 11);
+  CHECK(slot == &s.data[10] && *slot == 0);
+  CHECK(s.len == 101 && s.data[9] == 9 && s.data[11] == 10);
+  *slot = -1;
+
+  CHECK(pop(&s) == 99);
+  remove_swap(&s, 0);
+  CHECK(s.len == 99 && s.data[0] == 98);
+
+  resize(&s, 120, a);
+  CHECK(s.len == 120 && s.data[119] == 0);
+  resize(&s, 5, a);
+  CHECK(s.len == 5 && s.data[4] == 4);
+
+  // Not the last allocation anymore, growth has to copy
+  alloc(a, 1, 1, 1);
+  int32_t *before = s.data;
+  resize(&s, s.cap + 1, a);
+  CHECK(s.data != before && s.data[0] == 98 && s.data[4] == 4);
+}
+
+typedef struct {
+  int32_t runs[8];
+  int32_t round;
+} jobs_check;
+
+static void jobs_check_job(void *user, int32_t worker) {
+  jobs_check *c = user;
+  c->runs[worker] += c->round;
+}
+
+static void check_jobs(void) {
+  job_pool p;
+  CHECK(job_pool_init(&p, 8));
+  CHECK(p.thread_count >= 1 && p.thread_count <= 8);
+
+  // Every worker runs every job once, and the results are in on return
+  jobs_check c = {0};
+  for (c.round = 1; c.round <= 100; c.round++) {
+    job_pool_run(&p, jobs_check_job, &c);
+  }
+  for (int32_t i = 0; i < 8; i++) {
+    CHECK(c.runs[i] == (i < p.thread_count ? 5050 : 0));
+  }
+  job_pool_free(&p);
+  CHECK(!p.workers);
+  job_pool_free(&p);
+}
+
+static void check_depth_raster(arena *a) {
+  // A 4x4 wall across the origin, seen from 5 units away
+  const float wall[] = {-2, -2, 0, 2, -2, 0, 2,  2, 0,
+                        -2, -2, 0, 2, 2,  0, -2, 2, 0};
+  mat4s projection = glms_perspective(glm_rad(60.0f), 1.0f, 0.1f, 100.0f);
+  mat4s view = glms_lookat((vec3s){{0.0f, 0.0f, 5.0f}}, (vec3s){{0}},
+                           (vec3s){{0.0f, 1.0f, 0.0f}});
+  vec3s behind[2] = {{{-0.5f, -0.5f, -3.0f}}, {{0.5f, 0.5f, -2.0f}}};
+  vec3s in_front[2] = {{{-0.5f, -0.5f, 1.0f}}, {{0.5f, 0.5f, 2.0f}}};
+  vec3s beside[2] = {{{3.5f, -0.5f, -3.0f}}, {{4.0f, 0.5f, -2.5f}}};
+  vec3s straddling[2] = {{{1.5f, -0.5f, -2.5f}}, {{4.0f, 0.5f, -2.0f}}};
+  vec3s outside[2] = {{{-0.5f, 20.0f, -3.0f}}, {{0.5f, 21.0f, -2.0f}}};
+
+  // The same answers on any number of bands, and a raster not divided
+  // into whole tiles
+  int32_t thread_counts[] = {1, 3, 16};
+  for (int32_t t = 0; t < 3; t++) {
+    job_pool jobs;
+    CHECK(job_pool_init(&jobs, thread_counts[t]));
+    DepthRaster r;
+    CHECK(depth_raster_init(&r, 100, 75, &jobs));
+    CHECK(r.width == 104 && r.height == 80);
+    CHECK(r.thread_count >= 1 && r.thread_count <= r.tiles_y &&
+          r.thread_count <= jobs.thread_count);
+
+    // With nothing drawn only boxes off screen are culled
+    arena_reset(a);
+    depth_raster_begin(&r, glms_mat4_mul(projection, view), a);
+    depth_raster_render(&r);
+    CHECK(depth_raster_test_box(&r, behind));
+    CHECK(!depth_raster_test_box(&r, outside));
+
+    arena_reset(a);
+    depth_raster_begin(&r, glms_mat4_mul(projection, view), a);
+    depth_raster_add_occluder(&r, wall, 3, 6, glms_mat4_identity());
+    depth_raster_render(&r);
+    CHECK(r.triangle_count == 2);
+    CHECK(!depth_raster_test_box(&r, behind));
+    CHECK(depth_raster_test_box(&r, in_front));
+    CHECK(depth_raster_test_box(&r, beside));
+    CHECK(depth_raster_test_box(&r, straddling));
+    CHECK(!depth_raster_test_box(&r, outside));
+    CHECK(r.tested == 5 && r.culled == 2);
+
+    // Moved aside by the model matrix, the wall no longer hides the box
+    arena_reset(a);
+    depth_raster_begin(&r, glms_mat4_mul(projection, view), a);
+    depth_raster_add_occluder(
+        &r, wall, 3, 6,
+        glms_translate_make((vec3s){{5.0f, 0.0f, 0.0f}}));
+    depth_raster_render(&r);
+    CHECK(depth_raster_test_box(&r, behind));
+    depth_raster_free(&r);
+    job_pool_free(&jobs);
+  }
+}
+
+// A unit UV sphere as a triangle list of position, normal, uv. The seam's
+// vertices share positions with different uvs, the poles are single
+// triangles.
+static float *lod_check_sphere(arena *a, int32_t stacks, int32_t slices,
+                               int32_t *count) {
+  float *v = make(a, float, stacks * slices * 6 * 8);
+  int32_t n = 0;
+  for (int32_t i = 0; i < stacks; i++) {
+    for (int32_t j = 0; j < slices; j++) {
+      int32_t corners[4][2] = {{i, j}, {i + 1, j}, {i + 1, j + 1}, {i, j + 1}};
+      int32_t quad[2][3] = {{0, 2, 1}, {0, 3, 2}};
+      for (int32_t t = 0; t < 2; t++) {
+        if ((t == 1 && i == 0) || (t == 0 && i == stacks - 1)) {
+          continue; // Both top or both bottom corners sit on the pole
+        }
+        for (int32_t c = 0; c < 3; c++) {
+          int32_t *k = corners[quad[t][c]];
+          float theta = GLM_PIf * k[0] / stacks;
+          float phi = 2.0f * GLM_PIf * (k[1] % slices) / slices;
+          float *o = v + n++ * 8;
+          o[0] = o[3] = sinf(theta) * cosf(phi);
+          o[1] = o[4] = cosf(theta);
+          o[2] = o[5] = sinf(theta) * sinf(phi);
+          o[6] = (float)k[1] / slices;
+          o[7] = (float)k[0] / stacks;
+        }
+      }
+    }
+  }
+  *count = n;
+  return v;
+}
+
+static void check_lod_build(arena *a) {
+  // Coarse spheres are where collapses come closest to folding the surface
+  int32_t sizes[2][2] = {{8, 16}, {24, 48}};
+  for (int32_t size = 0; size < 2; size++) {
+    int32_t count;
+    float *sphere = lod_check_sphere(a, sizes[size][0], sizes[size][1],
+                                     &count);
+    lod_levels built;
+    CHECK(lod_build(&built, sphere, count, 8, 3, a));
+    CHECK(built.vertex_count < count);
+    CHECK(built.level_count >= 3);
+    CHECK(built.levels[0].index_count == count);
+
+    // Each level has fewer triangles and no more accuracy than the one
+    // before, and every triangle still faces out of the sphere
+    bool shrinking = true, in_range = true, facing_out = true;
+    for (int32_t l = 0; l < built.level_count; l++) {
+      lod_level *level = &built.levels[l];
+      if (l > 0) {
+        shrinking &= level->index_count < level[-1].index_count &&
+                     level->error >= level[-1].error;
+      }
+      for (int32_t i = 0; i < level->index_count && in_range; i += 3) {
+        const uint32_t *t = built.indices + level->first_index + i;
+        vec3s p[3];
+        for (int32_t c = 0; c < 3; c++) {
+          in_range &= t[c] < (uint32_t)built.vertex_count;
+          p[c] = glms_vec3_make(built.vertices + (in_range ? t[c] : 0) * 8);
+        }
+        vec3s normal = glms_vec3_cross(glms_vec3_sub(p[1], p[0]),
+                                       glms_vec3_sub(p[2], p[0]));
+        vec3s center = glms_vec3_add(glms_vec3_add(p[0], p[1]), p[2]);
+        facing_out &= glms_vec3_dot(normal, center) > 1e-4f;
+      }
+    }
+    CHECK(shrinking);
+    CHECK(in_range);
+    CHECK(facing_out);
+    CHECK(built.levels[built.level_count - 1].error <=
+          LOD_MAX_RELATIVE_ERROR * sqrtf(3.0f));
+
+    // Welding order doesn't depend on qsort's, the same input gives the
+    // same levels
+    lod_levels again;
+    CHECK(lod_build(&again, sphere, count, 8, 3, a));
+    CHECK(again.index_count == built.index_count &&
+          !memcmp(again.indices, built.indices,
+                  built.index_count * sizeof(uint32_t)));
+  }
+
+  float triangle[9] = {0, 0, 0, 1, 0, 0, 0, 1, 0};
+  lod_levels too_few;
+  CHECK(!lod_build(&too_few, triangle, 2, 3, -1, a));
+}
+
+static bool lz_check_round_trip(string src, arena *a) {
+  string frame = lz_compress_frame(src, a);
+  string out;
+  if (!lz_is_frame(frame) || !lz_decompress_frame(frame, a, &out) ||
+      out.len != src.len || out.data[out.len] != 0 ||
+      (src.len && memcmp(out.data, src.data, src.len))) {
+    return false;
+  }
+
+  // The stream hands back the same bytes a block at a time
+  lz_stream stream;
+  if (!lz_stream_begin(&stream, frame)) {
+    return false;
+  }
+  uint8_t *block = make(a, uint8_t, stream.block_size);
+  ptrdiff_t at = 0, n;
+  while ((n = lz_stream_next(&stream, block, stream.block_size)) > 0) {
+    if (at + n > src.len || memcmp(block, src.data + at, n)) {
+      return false;
+    }
+    at += n;
+  }
+  return n == 0 && at == src.len;
+}
+
+static void check_lz(arena *a) {
+  // Text that compresses over several blocks, noise that is stored raw, a
+  // whole number of blocks of one long match, and the short cases
+  ptrdiff_t text_len = 600000;
+  string text = {make(a, uint8_t, text_len), text_len};
+  for (ptrdiff_t at = 0; at < text_len;) {
+    at += snprintf((char *)text.data + at, text_len - at,
+                   "uniform vec3 point_lights[%d].position;\n",
+                   (int)(at % 97));
+  }
+  string noise = {make(a, uint8_t, 300000), 300000};
+  uint32_t state = 1;
+  for (ptrdiff_t i = 0; i < noise.len; i++) {
+    state = state * 1664525 + 1013904223;
+    noise.data[i] = (uint8_t)(state >> 24);
+  }
+  string zeros = {make(a, uint8_t, 2 * LZ_BLOCK_SIZE), 2 * LZ_BLOCK_SIZE};
+
+  CHECK(lz_check_round_trip(text, a));
+  CHECK(lz_check_round_trip(noise, a));
+  CHECK(lz_check_round_trip(zeros, a));
+  CHECK(lz_check_round_trip(S("hello"), a));
+  CHECK(lz_check_round_trip((string){0}, a));
+  CHECK(lz_compress_frame(text, a).len < text.len / 4);
+  CHECK(lz_compress_frame(noise, a).len < noise.len + 64);
+
+  // Corrupt frames are refused, not decoded into garbage
+  string frame = lz_compress_frame(text, a);
+  string out;
+  CHECK(!lz_decompress_frame((string){frame.data, frame.len - 1}, a, &out));
+  CHECK(!lz_decompress_frame((string){frame.data, 16}, a, &out));
+  CHECK(!lz_decompress_frame((string){frame.data, 3}, a, &out));
+  string copy = {make(a, uint8_t, frame.len), frame.len};
+  memcpy(copy.data, frame.data, frame.len);
+  copy.data[0] ^= 1;
+  CHECK(!lz_is_frame(copy) && !lz_decompress_frame(copy, a, &out));
+  memcpy(copy.data, frame.data, frame.len);
+  ((lz_frame_header *)copy.data)->raw_size += 1;
+  CHECK(!lz_decompress_frame(copy, a, &out));
+  memcpy(copy.data, frame.data, frame.len);
+  ((lz_frame_header *)copy.data)->raw_size = (uint64_t)1 << 62;
+  CHECK(!lz_decompress_frame(copy, a, &out));
+  memcpy(copy.data, frame.data, frame.len);
+  copy.data[sizeof(lz_frame_header) + 1] ^= 0x40; // First block's size
+  CHECK(!lz_decompress_frame(copy, a, &out));
+
+  // A match reaching back before the start of the block
+  uint8_t bad_offset[] = {0x10, 'a', 0x05, 0x00, 0x10, 'b'};
+  uint8_t small[32];
+  CHECK(lz_decompress(bad_offset, 6, small, 32) == -1);
+
+  // Flipped bytes inside a block never write past `cap`
+  ptrdiff_t block_len = 0;
+  memcpy(&block_len, frame.data + sizeof(lz_frame_header), 4);
+  const uint8_t *block = frame.data + sizeof(lz_frame_header) + 4;
+  uint8_t *packed = make(a, uint8_t, block_len);
+  uint8_t *dst = make(a, uint8_t, LZ_BLOCK_SIZE + 64);
+  bool in_bounds = true;
+  for (int32_t i = 0; i < 500; i++) {
+    memcpy(packed, block, block_len);
+    state = state * 1664525 + 1013904223;
+    packed[(state >> 8) % block_len] ^= (uint8_t)(state | 1);
+    memset(dst + LZ_BLOCK_SIZE, 0xaa, 64);
+    ptrdiff_t n = lz_decompress(packed, block_len, dst, LZ_BLOCK_SIZE);
+    in_bounds &= n <= LZ_BLOCK_SIZE;
+    for (int32_t j = 0; j < 64; j++) {
+      in_bounds &= dst[LZ_BLOCK_SIZE + j] == 0xaa;
+    }
+  }
+  CHECK(in_bounds);
+
+  // Loose assets are only decompressed when they're named .lz, a plain file
+  // that happens to hold a frame comes back as it is
+  char path[64], lz_path[72];
+  snprintf(path, sizeof(path), "/tmp/lib_check_lz_%d", (int)getpid());
+  snprintf(lz_path, sizeof(lz_path), "%s.lz", path);
+  FILE *f = fopen(lz_path, "wb");
+  CHECK(f && (ptrdiff_t)fwrite(frame.data, 1, frame.len, f) == frame.len);
+  if (f) {
+    fclose(f);
+  }
+  CHECK(read_asset(path, a, &out) == FILE_OK && out.len == text.len &&
+        !memcmp(out.data, text.data, text.len));
+  CHECK(read_asset(lz_path, a, &out) == FILE_OK && out.len == frame.len);
+  rename(lz_path, path);
+  CHECK(read_asset(path, a, &out) == FILE_OK && out.len == frame.len &&
+        !memcmp(out.data, frame.data, frame.len));
+  remove(path);
+  CHECK(read_asset(path, a, &out) == FILE_NOT_FOUND);
+
+  f = fopen(lz_path, "wb");
+  CHECK(f && (ptrdiff_t)fwrite(frame.data, 1, frame.len / 2, f) ==
+                 frame.len / 2);
+  if (f) {
+    fclose(f);
+  }
+  CHECK(read_asset(path, a, &out) == FILE_READ_FAILED);
+  remove(lz_path);
+}
+
+static void aio_check_done(aio_read *read, void *user) {
+  (void)read;
+  atomic_fetch_add((atomic_int *)user, 1);
+}
+
+static void check_aio(arena *a) {
+  // Files of up to five and a half chunks, plus one that isn't there
+  enum { FILES = 12 };
+  char paths[FILES + 1][64];
+  for (int32_t i = 0; i < FILES; i++) {
+    snprintf(paths[i], sizeof(paths[i]), "/tmp/lib_check_aio_%d_%d",
+             (int)getpid(), i);
+    ptrdiff_t size = i * (AIO_CHUNK / 2) + i;
+    uint8_t *bytes = make(a, uint8_t, size + 1);
+    for (ptrdiff_t j = 0; j < size; j++) {
+      bytes[j] = (uint8_t)(j * 31 + i);
+    }
+    FILE *f = fopen(paths[i], "wb");
+    CHECK(f && (ptrdiff_t)fwrite(bytes, 1, size, f) == size);
+    if (f) {
+      fclose(f);
+    }
+  }
+  snprintf(paths[FILES], sizeof(paths[FILES]), "/tmp/lib_check_aio_missing");
+
+  // A four entry ring holds far fewer reads than are queued, so submits
+  // wait on completions and the reaper resubmits around a full ring. The
+  // thread pool runs the same reads.
+  int flags[] = {0, AIO_NO_URING};
+  for (int32_t f = 0; f < 2; f++) {
+    aio io;
+    CHECK(aio_init(&io, 4, 2, flags[f]));
+    for (int32_t round = 0; round < 3; round++) {
+      arena_temp temp = arena_temp_begin(a);
+      atomic_int calls = 0;
+      aio_read reads[FILES + 1] = {0};
+      for (int32_t i = 0; i <= FILES; i++) {
+        reads[i] = (aio_read){.path = paths[i], .done = aio_check_done,
+                              .user = &calls};
+      }
+      aio_submit(&io, reads, FILES + 1, a);
+      aio_wait(&io);
+      CHECK(atomic_load(&calls) == FILES + 1);
+      CHECK(!io.uring || io.inflight == 0);
+
+      for (int32_t i = 0; i < FILES; i++) {
+        ptrdiff_t size = i * (AIO_CHUNK / 2) + i;
+        bool same = !reads[i].error && reads[i].data.len == size &&
+                    reads[i].data.data[size] == 0;
+        for (ptrdiff_t j = 0; same && j < size; j++) {
+          same = reads[i].data.data[j] == (uint8_t)(j * 31 + i);
+        }
+        CHECK(same);
+      }
+      CHECK(reads[FILES].error == ENOENT && !reads[FILES].data.len);
+      arena_temp_end(temp);
+    }
+    aio_free(&io);
+  }
+
+  for (int32_t i = 0; i < FILES; i++) {
+    remove(paths[i]);
+  }
+}
+
+int main(void) {
+  check_arena();
+  arena a = new_arena_virtual((ptrdiff_t)1 << 30);
+  check_pool(&a);
+  check_slotmap(&a);
+  check_hashmap(&a);
+  check_array(&a);
+  check_jobs();
+  check_depth_raster(&a);
+  arena_reset(&a);
+  check_lod_build(&a);
+  arena_reset(&a);
+  check_lz(&a);
+  arena_reset(&a);
+  check_aio(&a);
+  arena_free(&a);
+
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}
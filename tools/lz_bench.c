@@ -0,0 +1,158 @@
+// LZ decode benchmark
+//
+// Usage: lz_bench [file...]
+//
+// Compresses each input into a frame once, then times lz_decompress_frame
+// decoding it into an arena, next to a memcpy of the decoded bytes for scale.
+// Three generated inputs always run: shader-like text, vertex data and noise
+// (stored raw, so that one is the memcpy path). Files given on the command
+// line are joined into one more input. Speeds are decoded bytes per second,
+// the best of ROUNDS passes of at least DECODE_BYTES each.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ARENA_IMPLEMENTATION
+#include "arena.h"
+#define LZ_IMPLEMENTATION
+#include "lz.h"
+
+#define INPUT_SIZE ((ptrdiff_t)32 << 20)
+#define DECODE_BYTES ((ptrdiff_t)256 << 20)
+#define ROUNDS 5
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static uint32_t next_random(uint32_t *state) {
+  *state = *state * 1664525 + 1013904223;
+  return *state >> 8;
+}
+
+// Declarations with varying names and array indices, so matches are short
+// and scattered the way they are in real shader sources
+static string make_text(arena *a) {
+  const char *lines[] = {
+      "uniform vec3 point_lights[%u].position;\n",
+      "  float attenuation = 1.0 / (%u.0 + light.linear * d);\n",
+      "  vec3 diffuse = light.diffuse * diff * texel_%u.rgb;\n",
+      "layout(location = %u) in vec2 tex_coords;\n",
+      "  shadow += texture(shadow_maps[%u], coords).r;\n",
+  };
+  string s = {make_nozero(a, uint8_t, INPUT_SIZE + 128), INPUT_SIZE};
+  uint32_t state = 1;
+  for (ptrdiff_t at = 0; at < s.len;) {
+    uint32_t r = next_random(&state);
+    at += snprintf((char *)s.data + at, 128, lines[r % 5], r % 1000);
+  }
+  return s;
+}
+
+// Interleaved position, normal and uv floats of a smooth surface. Only the
+// high bytes repeat, which is about as hard as real meshes get for LZ.
+static string make_vertices(arena *a) {
+  string s = {make_nozero(a, uint8_t, INPUT_SIZE), INPUT_SIZE};
+  float *v = (float *)s.data;
+  ptrdiff_t count = INPUT_SIZE / (8 * sizeof(float));
+  for (ptrdiff_t i = 0; i < count; i++) {
+    float u = (float)(i % 1024) / 1024.0f, w = (float)(i / 1024) / 1024.0f;
+    float *o = v + i * 8;
+    o[0] = u * 4.0f - 2.0f;
+    o[1] = u * w;
+    o[2] = w * 4.0f - 2.0f;
+    o[3] = 0.0f;
+    o[4] = 1.0f;
+    o[5] = 0.0f;
+    o[6] = u;
+    o[7] = w;
+  }
+  return s;
+}
+
+static string make_noise(arena *a) {
+  string s = {make_nozero(a, uint8_t, INPUT_SIZE), INPUT_SIZE};
+  uint32_t state = 7;
+  for (ptrdiff_t i = 0; i < s.len; i++) {
+    s.data[i] = (uint8_t)next_random(&state);
+  }
+  return s;
+}
+
+// Joins the files into one input. Byte allocations from a virtual arena are
+// contiguous, so each read just extends the string.
+static string read_files(int count, char **paths, arena *a) {
+  string s = {(uint8_t *)a->current, 0};
+  for (int i = 0; i < count; i++) {
+    FILE *f = fopen(paths[i], "rb");
+    if (!f) {
+      perror(paths[i]);
+      continue;
+    }
+    ptrdiff_t n;
+    uint8_t buf[1 << 16];
+    while ((n = (ptrdiff_t)fread(buf, 1, sizeof(buf), f)) > 0) {
+      memcpy(make_nozero(a, uint8_t, n), buf, n);
+      s.len += n;
+    }
+    fclose(f);
+  }
+  return s;
+}
+
+static void bench(const char *name, string src, arena *a) {
+  if (!src.len) {
+    return;
+  }
+  double start = now();
+  string frame = lz_compress_frame(src, a);
+  double compress = src.len / (now() - start) / 1e9;
+
+  ptrdiff_t passes = (DECODE_BYTES + src.len - 1) / src.len;
+  uint8_t *copy = make_nozero(a, uint8_t, src.len);
+  double decode = 0, memcpy_speed = 0;
+  bool ok = true;
+  for (int round = 0; round < ROUNDS; round++) {
+    start = now();
+    for (ptrdiff_t p = 0; p < passes; p++) {
+      arena_temp temp = arena_temp_begin(a);
+      string out;
+      ok &= lz_decompress_frame(frame, a, &out) && out.len == src.len;
+      arena_temp_end(temp);
+    }
+    double t = passes * src.len / (now() - start) / 1e9;
+    decode = t > decode ? t : decode;
+
+    start = now();
+    for (ptrdiff_t p = 0; p < passes; p++) {
+      memcpy(copy, src.data, src.len);
+      __asm__ volatile("" : : "r"(copy) : "memory");
+    }
+    t = passes * src.len / (now() - start) / 1e9;
+    memcpy_speed = t > memcpy_speed ? t : memcpy_speed;
+  }
+
+  printf("%-9s %9.2f MB  ratio %5.2f  compress %5.2f GB/s  "
+         "decode %5.2f GB/s  memcpy %5.2f GB/s%s\n",
+         name, src.len / 1e6, (double)src.len / frame.len, compress, decode,
+         memcpy_speed, ok ? "" : "  DECODE FAILED");
+}
+
+int main(int argc, char **argv) {
+  arena a = new_arena_virtual((ptrdiff_t)1 << 34);
+
+  bench("text", make_text(&a), &a);
+  arena_reset(&a);
+  bench("vertices", make_vertices(&a), &a);
+  arena_reset(&a);
+  bench("noise", make_noise(&a), &a);
+  arena_reset(&a);
+  if (argc > 1) {
+    bench("files", read_files(argc - 1, argv + 1, &a), &a);
+  }
+
+  arena_free(&a);
+  return 0;
+}
@@ -0,0 +1,110 @@
+// Asset packer
+//
+// Usage: packer [-v] [-z] <out.pack> <file or directory>...
+//
+//   -v  store checksums
+//   -z  lz compress blobs that shrink
+//
+// Directories are walked recursively. Paths are stored as given (minus a
+// leading "./"), so run it from the directory the game runs from, e.g.
+//   ./bin/packer assets.pack glsl textures
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define ARENA_IMPLEMENTATION
+#include "arena.h"
+#define PACK_IMPLEMENTATION
+#include "pack.h"
+
+typedef struct {
+  const char **data;
+  ptrdiff_t len;
+  ptrdiff_t cap;
+} path_list;
+
+static void path_push(path_list *list, const char *path, arena *a) {
+  if (list->len == list->cap) {
+    ptrdiff_t cap = list->cap ? list->cap * 2 : 64;
+    const char **data = make(a, const char *, cap);
+    if (list->len) {
+      memcpy(data, list->data, list->len * sizeof(*data));
+    }
+    list->data = data;
+    list->cap = cap;
+  }
+  list->data[list->len++] = path;
+}
+
+static void collect(const char *path, path_list *list, arena *a) {
+  struct stat st;
+  if (stat(path, &st)) {
+    fprintf(stderr, "WARNING: Skipping %s, could not stat it\n", path);
+    return;
+  }
+  if (S_ISREG(st.st_mode)) {
+    path_push(list, path, a);
+    return;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return;
+  }
+
+  DIR *dir = opendir(path);
+  if (!dir) {
+    fprintf(stderr, "WARNING: Skipping %s, could not open it\n", path);
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    ptrdiff_t len = strlen(path) + strlen(entry->d_name) + 2;
+    char *child = make(a, char, len);
+    snprintf(child, len, "%s/%s", path, entry->d_name);
+    collect(child, list, a);
+  }
+  closedir(dir);
+}
+
+static int by_path(const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+int main(int argc, char **argv) {
+  int flags = 0;
+  int first = 1;
+  for (; first < argc && argv[first][0] == '-'; first++) {
+    if (!strcmp(argv[first], "-v")) {
+      flags |= PACK_VERIFY;
+    } else if (!strcmp(argv[first], "-z")) {
+      flags |= PACK_COMPRESS;
+    } else {
+      break;
+    }
+  }
+  if (argc - first < 2) {
+    fprintf(stderr,
+            "Usage: %s [-v] [-z] <out.pack> <file or directory>...\n",
+            argv[0]);
+    return 1;
+  }
+
+  arena a = new_arena_virtual((ptrdiff_t)1 << 32);
+  path_list paths = {0};
+  for (int i = first + 1; i < argc; i++) {
+    collect(argv[i], &paths, &a);
+  }
+  // Same directory means next to each other in the pack
+  qsort(paths.data, paths.len, sizeof(*paths.data), by_path);
+
+  bool ok = pack_write(argv[first], paths.data, paths.len, flags, &a);
+  if (ok) {
+    printf("Packed %td files into %s\n", paths.len, argv[first]);
+  }
+  arena_free(&a);
+  return ok ? 0 : 1;
+}
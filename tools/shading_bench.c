@@ -0,0 +1,114 @@
+// Fragment throughput benchmark
+//
+// Usage: shading_bench [fragment shader...]
+//
+// Fills a 1024x1024 target with one quad per draw, shaded by
+// glsl/cube_vs.glsl and each fragment shader (glsl/cube_fs.glsl by default)
+// under main.c's lights, and prints the best time per frame and per pixel.
+// Every image is compared against the first shader's. To time an older
+// version of a shader, write it next to the current one so its includes
+// still resolve, e.g. git show <rev>:glsl/cube_fs.glsl > glsl/old_fs.glsl.
+#define SHADER_IMPLEMENTATION
+#include "shader.h"
+
+#include "gl_bench.h"
+
+#define SIZE 1024
+#define MAX_SHADERS 8
+#define ROUNDS 8
+#define DRAWS 20
+
+int main(int argc, char **argv) {
+  const char *default_paths[] = {"glsl/cube_fs.glsl"};
+  const char **paths = argc > 1 ? (const char **)argv + 1 : default_paths;
+  int32_t count = argc > 1 ? argc - 1 : 1;
+  if (count > MAX_SHADERS) {
+    fprintf(stderr, "Usage: %s [fragment shader...] (at most %d)\n", argv[0],
+            MAX_SHADERS);
+    return 1;
+  }
+
+  GLFWwindow *window = bench_window();
+  if (!window) {
+    return 1;
+  }
+  bench_target(SIZE, SIZE);
+  GLuint quad = bench_quad();
+  GLuint maps = bench_maps();
+
+  Shader shaders[MAX_SHADERS];
+  mat4s identity = glms_mat4_identity();
+  for (int32_t i = 0; i < count; i++) {
+    shaders[i] = new_shader("glsl/cube_vs.glsl", paths[i]);
+    if (!shaders[i].ID) {
+      glfwTerminate();
+      return 1;
+    }
+    bench_material(&shaders[i], identity, identity);
+    shader_set_mat4(&shaders[i], "model", identity);
+    bench_lights(&shaders[i]);
+    char name[64];
+    for (int32_t l = 0; l < 4; l++) {
+#define POINT_LIGHT(field)                                                     \
+  (snprintf(name, sizeof(name), "point_lights[%d]." field, l), name)
+      shader_set_vec3(&shaders[i], POINT_LIGHT("position"),
+                      bench_point_positions[l]);
+      shader_set_vec3f(&shaders[i], POINT_LIGHT("ambient"), 0.05f, 0.05f,
+                       0.05f);
+      shader_set_vec3f(&shaders[i], POINT_LIGHT("diffuse"), 0.8f, 0.8f, 0.8f);
+      shader_set_vec3f(&shaders[i], POINT_LIGHT("specular"), 1, 1, 1);
+      shader_set_float(&shaders[i], POINT_LIGHT("constant"), 1.0f);
+      shader_set_float(&shaders[i], POINT_LIGHT("linear"), 0.09f);
+      shader_set_float(&shaders[i], POINT_LIGHT("quadratic"), 0.032f);
+#undef POINT_LIGHT
+    }
+  }
+
+  // Rounds alternate between the shaders so drift hits them all alike
+  double best[MAX_SHADERS];
+  for (int32_t i = 0; i < count; i++) {
+    best[i] = 1e9;
+  }
+  glBindVertexArray(quad);
+  for (int32_t round = 0; round < ROUNDS; round++) {
+    for (int32_t i = 0; i < count; i++) {
+      shader_use(&shaders[i]);
+      glDrawArrays(GL_TRIANGLES, 0, 6);
+      glFinish();
+      double start = now();
+      for (int32_t d = 0; d < DRAWS; d++) {
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+      }
+      glFinish();
+      double t = (now() - start) / DRAWS;
+      best[i] = t < best[i] ? t : best[i];
+    }
+  }
+
+  ptrdiff_t image_size = (ptrdiff_t)SIZE * SIZE * 4;
+  uint8_t *first = malloc(image_size);
+  uint8_t *image = malloc(image_size);
+  for (int32_t i = 0; i < count; i++) {
+    shader_use(&shaders[i]);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    glReadPixels(0, 0, SIZE, SIZE, GL_RGBA, GL_UNSIGNED_BYTE,
+                 i ? image : first);
+    printf("%s: %.2f ms/frame, %.2f ns/pixel", paths[i], best[i] * 1e3,
+           best[i] / ((double)SIZE * SIZE) * 1e9);
+    if (i) {
+      printf(", max channel difference %d/255",
+             bench_max_diff(first, image, image_size));
+    }
+    printf("\n");
+  }
+
+  free(first);
+  free(image);
+  for (int32_t i = 0; i < count; i++) {
+    shader_free(&shaders[i]);
+  }
+  glDeleteTextures(1, &maps);
+  glfwDestroyWindow(window);
+  glfwTerminate();
+  return 0;
+}